@@ -0,0 +1,843 @@
+/**
+ * @file blkdev.c
+ *
+ * @author awewsomegamer <awewsomegamer@gmail.com>
+ *
+ * @LICENSE
+ * Arctan-OS/Kernel - Operating System Kernel
+ * Copyright (C) 2023-2025 awewsomegamer
+ *
+ * This file is part of Arctan-OS/Kernel.
+ *
+ * Arctan is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * @DESCRIPTION
+ * Block device registry and request pipeline. Each device has one request
+ * queue per hardware queue, requests are queued on the one belonging to the
+ * submitting processor and handed to the driver while the hardware queue
+ * has room.
+ *
+ * While waiting, requests are kept sorted by block and dispatched in an
+ * upward sweep, a request is merged with those which continue where it ends
+ * into one command of up to the device's maximum transfer. Reads which have
+ * waited past their deadline are dispatched first. Submitters may plug the
+ * queue briefly to let a batch of requests collect before any of them go.
+*/
+#include "arch/smp.h"
+#include "drivers/blkdev.h"
+#include "drivers/cntrl_defs.h"
+#include "drivers/pcache.h"
+#include "drivers/sysdev/clock.h"
+#include "global.h"
+#include "lib/atomics.h"
+#include "lib/util.h"
+#include "mm/allocator.h"
+
+#define BLKDEV_DEFAULT_DEPTH 32
+#define BLKDEV_MAX_MERGE_VECS 256
+#define BLKDEV_READ_EXPIRE_NS (50 * CLOCK_NS_PER_MS)
+
+static ARC_BlockDevice *blkdev_list = NULL;
+static ARC_GenericSpinlock blkdev_lock = { 0 };
+
+// Requests to devices without hooks of their own are turned into control
+// commands, which always finish synchronously
+static int blkdev_control_queue(ARC_BlockDevice *dev, struct blkdev_request *req, int hwq) {
+	(void)hwq;
+
+	int status = 0;
+
+	switch (req->op) {
+		case BLKDEV_OP_READ:
+		case BLKDEV_OP_WRITE: {
+			uint64_t offset = req->lba * dev->block_size;
+			uint32_t command = req->op == BLKDEV_OP_READ ? CNTRL_BLK_READ : CNTRL_BLK_WRITE;
+
+			for (size_t i = 0; i < req->vec_count && status == 0; i++) {
+				struct cntrl_blk_rw rw = {
+				        .offset = offset,
+					.size = req->vecs[i].len,
+					.buffer = req->vecs[i].base,
+					.flags = req->flags,
+			        };
+
+				ARC_ControlPacketResponse resp = blkdev_control(dev->res, command, &rw, sizeof(rw));
+
+				if (resp.type != command || resp.size != rw.size) {
+					status = -1;
+				}
+
+				offset += req->vecs[i].len;
+			}
+
+			break;
+		}
+
+		case BLKDEV_OP_FLUSH: {
+			status = blkdev_control(dev->res, CNTRL_BLK_SYNC, NULL, 0).type == CNTRL_BLK_SYNC ? 0 : -1;
+			break;
+		}
+
+		case BLKDEV_OP_DISCARD: {
+			struct cntrl_blk_range range = { .offset = req->lba * dev->block_size, .size = req->count * dev->block_size };
+			struct cntrl_blk_ranges list = { .count = 1, .ranges = &range };
+
+			status = blkdev_control(dev->res, CNTRL_BLK_DISCARD, &list, sizeof(list)).type == CNTRL_BLK_DISCARD ? 0 : -1;
+			break;
+		}
+
+		default: {
+			status = -1;
+			break;
+		}
+	}
+
+	blkdev_end_request(req, status);
+
+	return 0;
+}
+
+static struct blkdev_ops blkdev_control_ops = {
+        .queue = blkdev_control_queue,
+	.poll = NULL,
+};
+
+ARC_BlockDevice *blkdev_register(char *path, ARC_Resource *res, struct blkdev_info *info) {
+	if (path == NULL || res == NULL) {
+		ARC_DEBUG(ERR, "Improper parameters (%p %p)\n", path, res);
+		return NULL;
+	}
+
+	// Requests and the page cache are timed, calibrate before the first
+	init_clock();
+
+	struct blkdev_info fallback = { 0 };
+
+	if (info == NULL) {
+		struct stat stat = { 0 };
+
+		if (res->driver->stat != NULL) {
+			res->driver->stat(res, NULL, &stat);
+		}
+
+		fallback.block_size = stat.st_blksize == 0 ? 512 : stat.st_blksize;
+		fallback.blocks = stat.st_size / fallback.block_size;
+		fallback.queue_count = 1;
+		fallback.ops = &blkdev_control_ops;
+
+		info = &fallback;
+	}
+
+	if (info->ops == NULL && info->parent == NULL) {
+		ARC_DEBUG(ERR, "Device %s has no hooks and nothing beneath it\n", path);
+		return NULL;
+	}
+
+	ARC_BlockDevice *dev = alloc(sizeof(*dev));
+
+	if (dev == NULL) {
+		ARC_DEBUG(ERR, "Failed to allocate device for %s\n", path);
+		return NULL;
+	}
+
+	memset(dev, 0, sizeof(*dev));
+
+	int queue_count = max(info->queue_count, 1);
+
+	dev->path = strdup(path);
+	dev->queues = alloc(sizeof(*dev->queues) * queue_count);
+
+	if (dev->path == NULL || dev->queues == NULL) {
+		ARC_DEBUG(ERR, "Failed to allocate device for %s\n", path);
+		free(dev->path);
+		free(dev->queues);
+		free(dev);
+		return NULL;
+	}
+
+	memset(dev->queues, 0, sizeof(*dev->queues) * queue_count);
+
+	for (int i = 0; i < queue_count; i++) {
+		init_static_spinlock(&dev->queues[i].lock);
+		dev->queues[i].depth = info->queue_depth == 0 ? BLKDEV_DEFAULT_DEPTH : info->queue_depth;
+	}
+
+	dev->res = res;
+	dev->ops = info->ops;
+	dev->priv = info->priv;
+	dev->parent = info->parent;
+	dev->parent_lba = info->parent_lba;
+	dev->block_size = info->block_size;
+	dev->blocks = info->blocks;
+	dev->max_blocks = info->max_blocks == 0 ? UINT32_MAX : info->max_blocks;
+	dev->queue_count = queue_count;
+	dev->write_back = true;
+	dev->uncached = info->uncached;
+	init_static_spinlock(&dev->dirty.lock);
+
+	if (pcache_init_device(dev) != 0) {
+		ARC_DEBUG(ERR, "Failed to set up caching for %s\n", path);
+		free(dev->path);
+		free(dev->queues);
+		free(dev);
+		return NULL;
+	}
+
+	spinlock_lock(&blkdev_lock);
+	dev->next = blkdev_list;
+	blkdev_list = dev;
+	spinlock_unlock(&blkdev_lock);
+
+	ARC_DEBUG(INFO, "Registered block device %s (resource %lu, %u byte blocks, %d queues)\n", path, res->id, dev->block_size, queue_count);
+
+	return dev;
+}
+
+int blkdev_unregister(ARC_Resource *res) {
+	if (res == NULL) {
+		return -1;
+	}
+
+	spinlock_lock(&blkdev_lock);
+
+	// Windows onto the device would be left remapping onto freed memory,
+	// they have to go first
+	for (ARC_BlockDevice *dev = blkdev_list; dev != NULL; dev = dev->next) {
+		if (dev->res != res && dev->parent != NULL && dev->parent->res == res) {
+			ARC_DEBUG(ERR, "%s is still beneath %s\n", dev->parent->path, dev->path);
+			spinlock_unlock(&blkdev_lock);
+			return -2;
+		}
+	}
+
+	ARC_BlockDevice *removed = NULL;
+	ARC_BlockDevice **link = &blkdev_list;
+
+	while (*link != NULL) {
+		ARC_BlockDevice *dev = *link;
+
+		if (dev->res != res) {
+			link = &dev->next;
+			continue;
+		}
+
+		*link = dev->next;
+		dev->next = removed;
+		removed = dev;
+	}
+
+	spinlock_unlock(&blkdev_lock);
+
+	// Writing back waits on the device, which must not hold up lookups
+	while (removed != NULL) {
+		ARC_BlockDevice *dev = removed;
+		removed = dev->next;
+
+		pcache_invalidate(dev, 0, UINT64_MAX);
+		pcache_uninit_device(dev);
+		free(dev->path);
+		free(dev->queues);
+		free(dev);
+	}
+
+	return 0;
+}
+
+ARC_BlockDevice *blkdev_get(char *path) {
+	if (path == NULL) {
+		return NULL;
+	}
+
+	ARC_BlockDevice *ret = NULL;
+
+	spinlock_lock(&blkdev_lock);
+
+	for (ARC_BlockDevice *dev = blkdev_list; dev != NULL; dev = dev->next) {
+		if (strcmp(dev->path, path) == 0) {
+			ret = dev;
+			break;
+		}
+	}
+
+	spinlock_unlock(&blkdev_lock);
+
+	return ret;
+}
+
+ARC_Resource *blkdev_lookup(char *path) {
+	ARC_BlockDevice *dev = blkdev_get(path);
+
+	return dev == NULL ? NULL : dev->res;
+}
+
+ARC_ControlPacketResponse blkdev_control(ARC_Resource *res, uint32_t command, void *data, size_t size) {
+	if (res == NULL || res->driver == NULL || res->driver->control == NULL) {
+		return (ARC_ControlPacketResponse) { 0 };
+	}
+
+	ARC_ControlPacketInstruction inst = {
+	        .command = command,
+		.size = size,
+		.data = data,
+        };
+
+	return res->driver->control(res, &inst);
+}
+
+// Commands made of several contiguous requests
+struct blkdev_merge {
+	struct blkdev_request req;
+	struct blkdev_request *parts; // In order, chained through next
+	struct blkdev_vec vecs[];
+};
+
+static void blkdev_complete(struct blkdev_request *req, int status);
+
+static void blkdev_merge_end(struct blkdev_request *req) {
+	struct blkdev_merge *merge = req->priv;
+	struct blkdev_request *part = merge->parts;
+
+	while (part != NULL) {
+		struct blkdev_request *next = part->next;
+		part->next = NULL;
+		blkdev_complete(part, req->status);
+		part = next;
+	}
+
+	free(merge);
+}
+
+static bool blkdev_is_barrier(struct blkdev_request *req) {
+	return req->op != BLKDEV_OP_READ && req->op != BLKDEV_OP_WRITE;
+}
+
+// Take the next request to dispatch off the queue along with the requests
+// following it which can be merged into the same command, chained through
+// next. Returns NULL if nothing may be dispatched yet. queue->lock must be
+// held.
+static struct blkdev_request *blkdev_pick(ARC_BlockDevice *dev, struct blkdev_queue *queue) {
+	struct blkdev_request *barrier = NULL;
+
+	for (struct blkdev_request *req = queue->head; req != NULL; req = req->next) {
+		if (blkdev_is_barrier(req) && (barrier == NULL || req->seq < barrier->seq)) {
+			barrier = req;
+		}
+	}
+
+	uint64_t limit = barrier == NULL ? UINT64_MAX : barrier->seq;
+	uint64_t now = clock_ns();
+	struct blkdev_request **pick = NULL;
+
+	// Reads past their deadline go first, oldest first
+	for (struct blkdev_request **link = &queue->head; *link != NULL; link = &(*link)->next) {
+		struct blkdev_request *req = *link;
+
+		if (req->op == BLKDEV_OP_READ && req->seq < limit && req->deadline <= now
+		    && (pick == NULL || req->deadline < (*pick)->deadline)) {
+			pick = link;
+		}
+	}
+
+	if (pick != NULL) {
+		queue->stats.expired++;
+	} else {
+		// Otherwise sweep upwards from the last dispatched block, wrapping around
+		struct blkdev_request **first = NULL;
+
+		for (struct blkdev_request **link = &queue->head; *link != NULL; link = &(*link)->next) {
+			if ((*link)->seq >= limit || blkdev_is_barrier(*link)) {
+				continue;
+			}
+
+			if (first == NULL) {
+				first = link;
+			}
+
+			if ((*link)->lba >= queue->position) {
+				pick = link;
+				break;
+			}
+		}
+
+		pick = pick == NULL ? first : pick;
+	}
+
+	if (pick == NULL) {
+		// Only the barrier is left, it goes once everything before it is done
+		if (barrier == NULL || queue->inflight > 0) {
+			return NULL;
+		}
+
+		for (pick = &queue->head; *pick != barrier; pick = &(*pick)->next);
+	}
+
+	struct blkdev_request *req = *pick;
+	*pick = req->next;
+	req->next = NULL;
+
+	if (blkdev_is_barrier(req)) {
+		return req;
+	}
+
+	// Requests sorted after it which continue where it ends
+	struct blkdev_request *last = req;
+	uint64_t count = req->count;
+	size_t vec_count = req->vec_count;
+
+	while (*pick != NULL) {
+		struct blkdev_request *next = *pick;
+
+		if (next->op != req->op || next->flags != req->flags || next->seq >= limit
+		    || next->lba != last->lba + last->count || count + next->count > dev->max_blocks
+		    || vec_count + next->vec_count > BLKDEV_MAX_MERGE_VECS) {
+			break;
+		}
+
+		*pick = next->next;
+		next->next = NULL;
+		last->next = next;
+		last = next;
+
+		count += next->count;
+		vec_count += next->vec_count;
+		queue->stats.merged++;
+	}
+
+	queue->position = req->lba + count;
+
+	return req;
+}
+
+// Turn a chain of requests into a single command
+static struct blkdev_request *blkdev_merge(struct blkdev_request *parts) {
+	size_t vec_count = 0;
+	uint64_t count = 0;
+
+	for (struct blkdev_request *part = parts; part != NULL; part = part->next) {
+		vec_count += part->vec_count;
+		count += part->count;
+	}
+
+	struct blkdev_merge *merge = alloc(sizeof(*merge) + vec_count * sizeof(struct blkdev_vec));
+
+	if (merge == NULL) {
+		return NULL;
+	}
+
+	memset(merge, 0, sizeof(*merge));
+
+	size_t vec = 0;
+	for (struct blkdev_request *part = parts; part != NULL; part = part->next) {
+		memcpy(&merge->vecs[vec], part->vecs, part->vec_count * sizeof(struct blkdev_vec));
+		vec += part->vec_count;
+	}
+
+	merge->parts = parts;
+	merge->req.dev = parts->dev;
+	merge->req.op = parts->op;
+	merge->req.flags = parts->flags;
+	merge->req.lba = parts->lba;
+	merge->req.count = count;
+	merge->req.vecs = merge->vecs;
+	merge->req.vec_count = vec_count;
+	merge->req.queue = parts->queue;
+	merge->req.seq = parts->seq;
+	merge->req.submitted_at = parts->submitted_at;
+	merge->req.end = blkdev_merge_end;
+	merge->req.priv = merge;
+
+	return &merge->req;
+}
+
+static void blkdev_issue(ARC_BlockDevice *dev, struct blkdev_request *req, int hwq) {
+	req->queue = hwq;
+
+	if (dev->ops->queue(dev, req, hwq) != 0) {
+		blkdev_end_request(req, -1);
+	}
+}
+
+// Hand waiting requests to the driver while the hardware queue has room
+static void blkdev_dispatch(ARC_BlockDevice *dev, int hwq) {
+	struct blkdev_queue *queue = &dev->queues[hwq];
+
+	while (1) {
+		spinlock_lock(&queue->lock);
+
+		if (queue->head == NULL || queue->inflight >= queue->depth || queue->plugged > 0) {
+			spinlock_unlock(&queue->lock);
+			return;
+		}
+
+		struct blkdev_request *req = blkdev_pick(dev, queue);
+
+		if (req == NULL) {
+			spinlock_unlock(&queue->lock);
+			return;
+		}
+
+		queue->inflight++;
+		queue->stats.dispatched++;
+
+		spinlock_unlock(&queue->lock);
+
+		if (req->next == NULL) {
+			blkdev_issue(dev, req, hwq);
+			continue;
+		}
+
+		struct blkdev_request *merged = blkdev_merge(req);
+
+		if (merged != NULL) {
+			blkdev_issue(dev, merged, hwq);
+			continue;
+		}
+
+		// Out of memory, send the parts one by one
+		spinlock_lock(&queue->lock);
+		for (struct blkdev_request *part = req->next; part != NULL; part = part->next) {
+			queue->inflight++;
+			queue->stats.dispatched++;
+			queue->stats.merged--;
+		}
+		spinlock_unlock(&queue->lock);
+
+		while (req != NULL) {
+			struct blkdev_request *next = req->next;
+			req->next = NULL;
+			blkdev_issue(dev, req, hwq);
+			req = next;
+		}
+	}
+}
+
+// Windows without hooks of their own have nothing to queue, their
+// requests go straight to the device beneath them
+static ARC_BlockDevice *blkdev_backing(ARC_BlockDevice *dev) {
+	while (dev->ops == NULL && dev->parent != NULL) {
+		dev = dev->parent;
+	}
+
+	return dev;
+}
+
+int blkdev_submit(struct blkdev_request *req) {
+	if (req == NULL || req->dev == NULL) {
+		ARC_DEBUG(ERR, "Improper request (%p)\n", req);
+		return -1;
+	}
+
+	ARC_BlockDevice *dev = req->dev;
+
+	while (1) {
+		if (req->op != BLKDEV_OP_FLUSH && (req->count == 0 || req->lba + req->count > dev->blocks)) {
+			ARC_DEBUG(ERR, "Request 0x%"PRIx64"+0x%"PRIx64" exceeds %s\n", req->lba, req->count, dev->path);
+			req->done = true;
+			req->status = -1;
+
+			if (req->end != NULL) {
+				req->end(req);
+			}
+
+			return -1;
+		}
+
+		if (dev->ops != NULL || dev->parent == NULL) {
+			break;
+		}
+
+		// Checked against the window, now remapped onto its parent
+		req->lba += dev->parent_lba;
+		dev = dev->parent;
+		req->dev = dev;
+	}
+
+	req->queue = smp_get_processor_id() % dev->queue_count;
+	req->done = false;
+	req->status = 0;
+	req->next = NULL;
+	req->submitted_at = clock_ns();
+	req->deadline = req->submitted_at + BLKDEV_READ_EXPIRE_NS;
+
+	struct blkdev_queue *queue = &dev->queues[req->queue];
+
+	spinlock_lock(&queue->lock);
+
+	req->seq = queue->seq++;
+	queue->stats.submitted++;
+
+	// Sorted by block, after any requests for the same block
+	struct blkdev_request **link = &queue->head;
+	while (*link != NULL && (*link)->lba <= req->lba) {
+		link = &(*link)->next;
+	}
+
+	req->next = *link;
+	*link = req;
+
+	spinlock_unlock(&queue->lock);
+
+	blkdev_dispatch(dev, req->queue);
+
+	return 0;
+}
+
+void blkdev_plug(ARC_BlockDevice *dev) {
+	if (dev == NULL) {
+		return;
+	}
+
+	dev = blkdev_backing(dev);
+
+	ARC_ATOMIC_INC(dev->queues[smp_get_processor_id() % dev->queue_count].plugged);
+}
+
+void blkdev_unplug(ARC_BlockDevice *dev) {
+	if (dev == NULL) {
+		return;
+	}
+
+	dev = blkdev_backing(dev);
+
+	int hwq = smp_get_processor_id() % dev->queue_count;
+
+	if (ARC_ATOMIC_DEC(dev->queues[hwq].plugged) == 0) {
+		blkdev_dispatch(dev, hwq);
+	}
+}
+
+static void blkdev_complete(struct blkdev_request *req, int status) {
+	if (req->end != blkdev_merge_end && (req->op == BLKDEV_OP_READ || req->op == BLKDEV_OP_WRITE)) {
+		struct blkdev_queue *queue = &req->dev->queues[req->queue];
+		uint64_t latency = clock_ns() - req->submitted_at;
+
+		spinlock_lock(&queue->lock);
+		queue->stats.completed[req->op]++;
+		queue->stats.latency_ns[req->op] += latency;
+		queue->stats.max_latency_ns[req->op] = max(queue->stats.max_latency_ns[req->op], latency);
+		spinlock_unlock(&queue->lock);
+	}
+
+	req->status = status;
+	ARC_ATOMIC_STORE(req->done, true);
+
+	if (req->end != NULL) {
+		req->end(req);
+	}
+}
+
+void blkdev_end_request(struct blkdev_request *req, int status) {
+	struct blkdev_queue *queue = &req->dev->queues[req->queue];
+
+	ARC_ATOMIC_DEC(queue->inflight);
+
+	blkdev_complete(req, status);
+}
+
+int blkdev_get_stats(ARC_BlockDevice *dev, struct blkdev_stats *stats) {
+	if (dev == NULL || stats == NULL) {
+		return -1;
+	}
+
+	memset(stats, 0, sizeof(*stats));
+
+	for (int i = 0; i < dev->queue_count; i++) {
+		struct blkdev_queue *queue = &dev->queues[i];
+
+		spinlock_lock(&queue->lock);
+
+		stats->submitted += queue->stats.submitted;
+		stats->dispatched += queue->stats.dispatched;
+		stats->merged += queue->stats.merged;
+		stats->expired += queue->stats.expired;
+
+		for (int op = 0; op < 2; op++) {
+			stats->completed[op] += queue->stats.completed[op];
+			stats->latency_ns[op] += queue->stats.latency_ns[op];
+			stats->max_latency_ns[op] = max(stats->max_latency_ns[op], queue->stats.max_latency_ns[op]);
+		}
+
+		spinlock_unlock(&queue->lock);
+	}
+
+	return 0;
+}
+
+int blkdev_poll(ARC_BlockDevice *dev) {
+	if (dev == NULL) {
+		return -1;
+	}
+
+	dev = blkdev_backing(dev);
+
+	for (int i = 0; i < dev->queue_count; i++) {
+		if (dev->ops->poll != NULL) {
+			dev->ops->poll(dev, i);
+		}
+
+		blkdev_dispatch(dev, i);
+	}
+
+	pcache_writeback(dev);
+
+	return 0;
+}
+
+int blkdev_wait(struct blkdev_request *req) {
+	while (!ARC_ATOMIC_LOAD(req->done)) {
+		blkdev_poll(req->dev);
+	}
+
+	return req->status;
+}
+
+int blkdev_rw(ARC_BlockDevice *dev, uint32_t op, uint64_t lba, uint64_t count, void *buffer, uint32_t flags) {
+	if (dev == NULL || buffer == NULL || count == 0) {
+		return -1;
+	}
+
+	size_t req_count = (count + dev->max_blocks - 1) / dev->max_blocks;
+	struct blkdev_request *reqs = alloc(req_count * (sizeof(*reqs) + sizeof(struct blkdev_vec)));
+
+	if (reqs == NULL) {
+		ARC_DEBUG(ERR, "Failed to allocate %lu requests\n", req_count);
+		return -2;
+	}
+
+	memset(reqs, 0, req_count * (sizeof(*reqs) + sizeof(struct blkdev_vec)));
+
+	struct blkdev_vec *vecs = (struct blkdev_vec *)(reqs + req_count);
+
+	blkdev_plug(dev);
+
+	for (size_t i = 0; i < req_count; i++) {
+		uint64_t part = min(count - i * dev->max_blocks, (uint64_t)dev->max_blocks);
+
+		vecs[i].base = buffer + i * dev->max_blocks * dev->block_size;
+		vecs[i].len = part * dev->block_size;
+
+		reqs[i].dev = dev;
+		reqs[i].op = op;
+		reqs[i].flags = flags;
+		reqs[i].lba = lba + i * dev->max_blocks;
+		reqs[i].count = part;
+		reqs[i].vecs = &vecs[i];
+		reqs[i].vec_count = 1;
+
+		blkdev_submit(&reqs[i]);
+	}
+
+	blkdev_unplug(dev);
+
+	int status = 0;
+
+	for (size_t i = 0; i < req_count; i++) {
+		if (blkdev_wait(&reqs[i]) != 0) {
+			status = -3;
+		}
+	}
+
+	free(reqs);
+
+	return status;
+}
+
+size_t blkdev_io(ARC_BlockDevice *dev, bool write, uint64_t offset, size_t size, void *buffer, uint32_t flags) {
+	if (write) {
+		return pcache_write(dev, offset, size, buffer, flags);
+	}
+
+	return pcache_read(dev, offset, size, buffer, flags);
+}
+
+size_t blkdev_io_direct(ARC_BlockDevice *dev, bool write, uint64_t offset, size_t size, void *buffer, uint32_t flags) {
+	if (dev == NULL || buffer == NULL) {
+		return 0;
+	}
+
+	uint32_t block_size = dev->block_size;
+	uint8_t *bounce = NULL;
+	size_t done = 0;
+
+	while (done < size) {
+		uint64_t lba = (offset + done) / block_size;
+		size_t skew = (offset + done) % block_size;
+		size_t left = size - done;
+
+		if (skew == 0 && left >= block_size) {
+			uint64_t count = left / block_size;
+
+			if (blkdev_rw(dev, write ? BLKDEV_OP_WRITE : BLKDEV_OP_READ, lba, count, buffer + done, flags) != 0) {
+				break;
+			}
+
+			done += count * block_size;
+
+			continue;
+		}
+
+		if (bounce == NULL && (bounce = alloc(block_size)) == NULL) {
+			ARC_DEBUG(ERR, "Failed to allocate bounce buffer\n");
+			break;
+		}
+
+		size_t part = min(block_size - skew, left);
+
+		if (blkdev_rw(dev, BLKDEV_OP_READ, lba, 1, bounce, flags & ~CNTRL_BLK_RW_FUA) != 0) {
+			break;
+		}
+
+		if (write) {
+			memcpy(bounce + skew, buffer + done, part);
+
+			if (blkdev_rw(dev, BLKDEV_OP_WRITE, lba, 1, bounce, flags) != 0) {
+				break;
+			}
+		} else {
+			memcpy(buffer + done, bounce + skew, part);
+		}
+
+		done += part;
+	}
+
+	free(bounce);
+
+	return done;
+}
+
+int blkdev_flush(ARC_BlockDevice *dev) {
+	if (dev == NULL) {
+		return -1;
+	}
+
+	struct blkdev_request req = { .dev = dev, .op = BLKDEV_OP_FLUSH };
+
+	blkdev_submit(&req);
+
+	return blkdev_wait(&req);
+}
+
+int blkdev_discard(ARC_BlockDevice *dev, uint64_t lba, uint64_t count) {
+	if (dev == NULL || count == 0) {
+		return -1;
+	}
+
+	pcache_invalidate(dev, lba * dev->block_size, count * dev->block_size);
+
+	struct blkdev_request req = { .dev = dev, .op = BLKDEV_OP_DISCARD, .lba = lba, .count = count };
+
+	blkdev_submit(&req);
+
+	return blkdev_wait(&req);
+}
@@ -0,0 +1,258 @@
+/**
+ * @file blkdev.h
+ *
+ * @author awewsomegamer <awewsomegamer@gmail.com>
+ *
+ * @LICENSE
+ * Arctan-OS/Kernel - Operating System Kernel
+ * Copyright (C) 2023-2025 awewsomegamer
+ *
+ * This file is part of Arctan-OS/Kernel.
+ *
+ * Arctan is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * @DESCRIPTION
+*/
+#ifndef ARC_DRIVERS_BLKDEV_H
+#define ARC_DRIVERS_BLKDEV_H
+
+#include "drivers/resource.h"
+#include "drivers/twoq.h"
+#include "lib/atomics.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define BLKDEV_OP_READ 0
+#define BLKDEV_OP_WRITE 1
+#define BLKDEV_OP_FLUSH 2
+#define BLKDEV_OP_DISCARD 3
+
+struct ARC_BlockDevice;
+struct pcache_page;
+
+// A directly mapped piece of memory, a multiple of the block size long
+struct blkdev_vec {
+	void *base;
+	size_t len;
+};
+
+struct blkdev_request {
+	struct blkdev_request *next; // Free for whoever holds the request
+	struct ARC_BlockDevice *dev;
+	uint32_t op;
+	uint32_t flags; // CNTRL_BLK_RW_*
+	uint64_t lba; // In blocks of the device
+	uint64_t count; // Blocks, the sum of the vector lengths for reads and writes
+	struct blkdev_vec *vecs;
+	size_t vec_count;
+	int queue; // Set on submission
+	uint64_t seq; // Set on submission, orders requests around barriers
+	uint64_t submitted_at;
+	uint64_t deadline; // Reads are dispatched out of order once past it
+	int status; // Zero on success
+	bool done;
+	void (*end)(struct blkdev_request *req); // Called once done, may be NULL
+	void *priv;
+};
+
+struct blkdev_ops {
+	/**
+	 * Start a request on hardware queue hwq.
+	 *
+	 * blkdev_end_request must be called once the request finishes, which
+	 * may be before returning.
+	 * */
+	int (*queue)(struct ARC_BlockDevice *dev, struct blkdev_request *req, int hwq);
+	/**
+	 * Finish requests which completed on hardware queue hwq, may be NULL if
+	 * requests always finish within queue.
+	 * */
+	int (*poll)(struct ARC_BlockDevice *dev, int hwq);
+};
+
+struct blkdev_stats {
+	uint64_t submitted; // Requests given to blkdev_submit
+	uint64_t dispatched; // Commands given to the driver
+	uint64_t merged; // Requests folded into the command of another
+	uint64_t expired; // Reads dispatched out of order to meet their deadline
+	uint64_t completed[2]; // Indexed by BLKDEV_OP_READ and BLKDEV_OP_WRITE
+	uint64_t latency_ns[2]; // Summed from submission to completion
+	uint64_t max_latency_ns[2];
+};
+
+// Requests wait here, sorted by block, until the hardware queue has room
+// for them. Flushes and discards are sorted in like the rest but act as
+// barriers: by seq, nothing submitted after one is dispatched before it,
+// and it waits for everything submitted before it to finish.
+struct blkdev_queue {
+	ARC_GenericSpinlock lock;
+	struct blkdev_request *head;
+	uint32_t inflight;
+	uint32_t depth;
+	uint32_t plugged;
+	uint64_t position; // Block after the last dispatched request
+	uint64_t seq;
+	struct blkdev_stats stats;
+};
+
+typedef struct ARC_BlockDevice {
+	struct ARC_BlockDevice *next;
+	char *path;
+	ARC_Resource *res;
+	struct blkdev_ops *ops;
+	void *priv;
+	struct ARC_BlockDevice *parent; // Device this one is a window of, NULL if none
+	uint64_t parent_lba; // First block of the window, in blocks of the parent
+	uint32_t block_size;
+	uint64_t blocks;
+	uint32_t max_blocks; // Largest request the device takes
+	int queue_count;
+	struct blkdev_queue *queues; // One per hardware queue
+	bool write_back; // Writes are held in the page cache
+	bool uncached; // Backed by memory, never goes through the page cache
+	struct {
+		ARC_GenericSpinlock lock;
+		struct pcache_page *head; // Oldest first
+		struct pcache_page *tail;
+		uint64_t count;
+		bool flushing; // The flush worker is running on this device
+	} dirty;
+	struct twoq cache; // Replacement policy of the cached pages of this device
+} ARC_BlockDevice;
+
+struct blkdev_info {
+	uint32_t block_size;
+	uint64_t blocks;
+	uint32_t max_blocks; // 0 for no limit
+	int queue_count; // Hardware queues, requests are spread over them by processor
+	uint32_t queue_depth; // Requests in flight per hardware queue
+	struct blkdev_ops *ops; // NULL for windows, whose requests are remapped onto parent
+	void *priv;
+	struct ARC_BlockDevice *parent; // Set by devices which remap onto a range of another
+	uint64_t parent_lba;
+	bool uncached; // Set by memory backed devices, which gain nothing from the page cache
+};
+
+/**
+ * Register a resource as the block device behind path.
+ *
+ * Block devices are created through vfs_create, which leaves no way for other
+ * drivers to get at the resource backing a path. Drivers stacked on top of a
+ * device (partitions, filesystems) use this table to reach the device
+ * beneath them.
+ *
+ * @param char *path - Path the device was created at, copied.
+ * @param ARC_Resource *res - Resource of the device.
+ * @param struct blkdev_info *info - Geometry and request hooks. If NULL, the
+ * device is driven through CNTRL_BLK_* commands in units of its st_blksize.
+ * @return the device, NULL on failure.
+ * */
+ARC_BlockDevice *blkdev_register(char *path, ARC_Resource *res, struct blkdev_info *info);
+
+/**
+ * Remove all devices backed by res, writing back their dirty pages.
+ *
+ * Requests must no longer be in flight.
+ * @return zero on success, non-zero if a window still remaps onto one of
+ * the devices, in which case nothing is removed.
+ * */
+int blkdev_unregister(ARC_Resource *res);
+
+/**
+ * Find the device registered for path.
+ *
+ * @return the device, NULL if none was registered.
+ * */
+ARC_BlockDevice *blkdev_get(char *path);
+
+/**
+ * Find the resource of the device registered for path.
+ *
+ * @return the resource, NULL if none was registered.
+ * */
+ARC_Resource *blkdev_lookup(char *path);
+
+/**
+ * Issue a control command to a block device.
+ *
+ * @return the response of the driver, zeroed if the driver has no control function.
+ * */
+ARC_ControlPacketResponse blkdev_control(ARC_Resource *res, uint32_t command, void *data, size_t size);
+
+/**
+ * Queue a request on the queue of the current processor.
+ *
+ * req->dev, op, lba, count and, for reads and writes, the vectors must be
+ * filled in. The request may finish before this returns. Requests to a
+ * window are checked against it, then req->dev and lba are rewritten to
+ * the device beneath it.
+ * */
+int blkdev_submit(struct blkdev_request *req);
+
+/**
+ * Hold back requests submitted to dev from this processor so they can be
+ * sorted and merged, until the matching blkdev_unplug. Requests must not be
+ * waited on while plugged.
+ * */
+void blkdev_plug(ARC_BlockDevice *dev);
+void blkdev_unplug(ARC_BlockDevice *dev);
+
+/**
+ * Sum the statistics of every queue of dev.
+ * */
+int blkdev_get_stats(ARC_BlockDevice *dev, struct blkdev_stats *stats);
+
+/**
+ * Called by devices when a request finishes.
+ * */
+void blkdev_end_request(struct blkdev_request *req, int status);
+
+/**
+ * Finish completed requests and start waiting ones on every queue of dev.
+ * */
+int blkdev_poll(ARC_BlockDevice *dev);
+
+/**
+ * Wait for a request to finish.
+ *
+ * @return the status of the request.
+ * */
+int blkdev_wait(struct blkdev_request *req);
+
+/**
+ * Synchronously move whole blocks, split into requests the device can take.
+ * */
+int blkdev_rw(ARC_BlockDevice *dev, uint32_t op, uint64_t lba, uint64_t count, void *buffer, uint32_t flags);
+
+/**
+ * Synchronously move bytes through the page cache.
+ *
+ * @return the number of bytes moved.
+ * */
+size_t blkdev_io(ARC_BlockDevice *dev, bool write, uint64_t offset, size_t size, void *buffer, uint32_t flags);
+
+/**
+ * Synchronously move bytes without the page cache, blocks which are only
+ * partly covered are read into a bounce buffer first.
+ *
+ * @return the number of bytes moved.
+ * */
+size_t blkdev_io_direct(ARC_BlockDevice *dev, bool write, uint64_t offset, size_t size, void *buffer, uint32_t flags);
+
+int blkdev_flush(ARC_BlockDevice *dev);
+int blkdev_discard(ARC_BlockDevice *dev, uint64_t lba, uint64_t count);
+
+#endif
@@ -27,6 +27,10 @@
 #ifndef ARC_DRIVERS_CNTRL_DEFS_H
 #define ARC_DRIVERS_CNTRL_DEFS_H
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
 #define CNTRL_CMDSET_DRIVER 0
 #define CNTRL_CMDSET_STANDARD 1
 
@@ -37,4 +41,138 @@
 #define CNTRL_CMDATTRS_OPSIZE 0 // 2 bits (log2(size))
 #define CNTRL_CMDATTRS_RESV0 2 // Rest of attributes
 
+// Standard block device commands (ARC_ControlPacketInstruction.command).
+// On success the response type is set to the command which was issued, on
+// failure a zeroed response is returned.
+#define CNTRL_BLK_SYNC  0x100 // Flush volatile caches to media, data: NULL
+#define CNTRL_BLK_READ  0x101 // Positional read, data: struct cntrl_blk_rw
+#define CNTRL_BLK_WRITE 0x102 // Positional write, data: struct cntrl_blk_rw
+#define CNTRL_BLK_DISCARD 0x103 // Deallocate ranges, data: struct cntrl_blk_ranges
+#define CNTRL_BLK_ZERO_RANGE 0x104 // Zero ranges, data: struct cntrl_blk_ranges
+#define CNTRL_BLK_COPY_RANGE 0x105 // Copy ranges within the device, data: struct cntrl_blk_copy
+#define CNTRL_BLK_ZONE_REPORT 0x106 // Describe zones, data: struct cntrl_blk_zone_report
+#define CNTRL_BLK_ZONE_MGMT 0x107 // Change the state of zones, data: struct cntrl_blk_zone_mgmt
+#define CNTRL_BLK_ZONE_APPEND 0x108 // Append to a zone, data: struct cntrl_blk_zone_append
+#define CNTRL_BLK_SUBMIT_ASYNC 0x109 // Start a command without waiting for it, data: struct cntrl_blk_async
+#define CNTRL_BLK_POLL_ASYNC 0x10A // Complete finished async commands, data: NULL, response size is the number completed
+#define CNTRL_BLK_CACHE_STATS 0x10B // Describe the page cache of the device, data: struct cntrl_blk_cache
+#define CNTRL_BLK_CACHE_TUNE 0x10C // Resize the page cache of the device, data: struct cntrl_blk_cache
+
+// Filesystem commands, sent to the super driver of a mount unless noted
+// otherwise. Commands from 0x200 are left to individual drivers.
+#define CNTRL_FS_CACHE_STATS 0x180 // Describe the inode and name caches, data: struct cntrl_fs_cache
+#define CNTRL_FS_CACHE_TUNE 0x181 // Resize the inode and name caches, data: struct cntrl_fs_cache
+#define CNTRL_FS_TRUNCATE 0x182 // Sent to a file, set its size, data: uint64_t
+
+// Flags for struct cntrl_blk_rw
+#define CNTRL_BLK_RW_FUA (1 << 0) // Force unit access, complete only once on media
+#define CNTRL_BLK_RW_PRIO_SHIFT 1 // 2 bits, priority class (CNTRL_BLK_PRIO_*)
+#define CNTRL_BLK_RW_DIRECT (1 << 3) // Read around the page cache
+
+// Priority classes, devices which cannot tell them apart treat all
+// requests as CNTRL_BLK_PRIO_NORMAL
+#define CNTRL_BLK_PRIO_NORMAL 0
+#define CNTRL_BLK_PRIO_HIGH 1 // Latency sensitive
+#define CNTRL_BLK_PRIO_LOW 2  // Bulk, may be starved under load
+
+struct cntrl_blk_rw {
+	uint64_t offset; // In bytes from the start of the device
+	size_t size; // In bytes, response size is the number of bytes transferred
+	void *buffer;
+	uint32_t flags;
+};
+
+struct cntrl_blk_range {
+	uint64_t offset; // In bytes from the start of the device
+	uint64_t size; // In bytes
+};
+
+struct cntrl_blk_ranges {
+	size_t count;
+	struct cntrl_blk_range *ranges;
+};
+
+// Zone actions for struct cntrl_blk_zone_mgmt
+#define CNTRL_BLK_ZONE_CLOSE 1
+#define CNTRL_BLK_ZONE_FINISH 2
+#define CNTRL_BLK_ZONE_OPEN 3
+#define CNTRL_BLK_ZONE_RESET 4
+
+// Zone states for struct cntrl_blk_zone
+#define CNTRL_BLK_ZONE_EMPTY 0x1
+#define CNTRL_BLK_ZONE_IMPLICITLY_OPEN 0x2
+#define CNTRL_BLK_ZONE_EXPLICITLY_OPEN 0x3
+#define CNTRL_BLK_ZONE_CLOSED 0x4
+#define CNTRL_BLK_ZONE_READ_ONLY 0xD
+#define CNTRL_BLK_ZONE_FULL 0xE
+#define CNTRL_BLK_ZONE_OFFLINE 0xF
+
+// All offsets and sizes are in bytes
+struct cntrl_blk_zone {
+	uint64_t start;
+	uint64_t size;
+	uint64_t capacity; // Writable bytes from start
+	uint64_t write_pointer;
+	uint8_t state;
+};
+
+struct cntrl_blk_zone_report {
+	uint64_t offset; // Report zones from the one containing this offset
+	size_t count; // Number of entries in zones, set to the number filled
+	struct cntrl_blk_zone *zones;
+};
+
+struct cntrl_blk_zone_mgmt {
+	uint64_t zone; // Start of the zone
+	uint32_t action;
+	bool all; // Apply action to every zone, zone is ignored
+};
+
+struct cntrl_blk_zone_append {
+	uint64_t zone; // Start of the zone
+	size_t size; // Multiple of the block size, at most a page
+	void *buffer;
+	uint32_t flags; // CNTRL_BLK_RW_*
+	uint64_t result; // Set to the offset the data was written at
+};
+
+// The sources are written back to back starting at dest
+struct cntrl_blk_copy {
+	uint64_t dest; // In bytes from the start of the device
+	size_t count;
+	struct cntrl_blk_range *sources;
+};
+
+// Only capacity, in_percent and ghost_percent are read by
+// CNTRL_BLK_CACHE_TUNE, a capacity of 0 leaves it as it is
+struct cntrl_blk_cache {
+	size_t capacity; // In pages
+	int in_percent; // Share kept for pages used only once
+	int ghost_percent; // Evicted pages remembered, as a share of the capacity
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	uint64_t promotions;
+	uint64_t ghost_hits;
+	uint64_t resident;
+};
+
+// in_percent and ghost_percent of the inode cache are used for both by
+// CNTRL_FS_CACHE_TUNE
+struct cntrl_fs_cache {
+	struct cntrl_blk_cache inodes;
+	struct cntrl_blk_cache names;
+};
+
+// The command and its data must stay valid until done is called. done may
+// be called before CNTRL_BLK_SUBMIT_ASYNC returns if the device finished
+// the command straight away, otherwise it is called from
+// CNTRL_BLK_POLL_ASYNC.
+struct cntrl_blk_async {
+	uint32_t command; // CNTRL_BLK_READ, WRITE, SYNC or DISCARD
+	void *data; // As for command
+	void (*done)(struct cntrl_blk_async *req, int64_t result); // Bytes transferred, or negative
+	void *priv;
+};
+
 #endif
@@ -0,0 +1,129 @@
+/**
+ * @file ioring.h
+ *
+ * @author awewsomegamer <awewsomegamer@gmail.com>
+ *
+ * @LICENSE
+ * Arctan-OS/Kernel - Operating System Kernel
+ * Copyright (C) 2023-2025 awewsomegamer
+ *
+ * This file is part of Arctan-OS/Kernel.
+ *
+ * Arctan is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * @DESCRIPTION
+*/
+#ifndef ARC_DRIVERS_IORING_H
+#define ARC_DRIVERS_IORING_H
+
+#include "drivers/resource.h"
+#include "lib/atomics.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define IORING_OP_NOP 0
+#define IORING_OP_READ 1
+#define IORING_OP_WRITE 2
+#define IORING_OP_FSYNC 3
+#define IORING_OP_DISCARD 4
+
+struct ioring_sqe {
+	uint8_t opcode;
+	uint32_t flags; // CNTRL_BLK_RW_* for reads and writes
+	ARC_Resource *res;
+	uint64_t offset; // In bytes
+	void *buffer;
+	size_t size; // In bytes
+	uint64_t user_data; // Handed back in the completion
+};
+
+struct ioring_cqe {
+	uint64_t user_data;
+	int64_t result; // Bytes transferred, or negative on failure
+};
+
+/**
+ * Shared between the client and the dispatcher, followed in memory by the
+ * submission and completion entries.
+ *
+ * The client owns sq_tail and cq_head, the dispatcher owns sq_head and
+ * cq_tail. Indices count up freely and are masked with entries - 1.
+ * */
+struct ioring_shared {
+	uint32_t sq_head;
+	uint32_t sq_tail;
+	uint32_t sq_entries;
+	uint32_t cq_head;
+	uint32_t cq_tail;
+	uint32_t cq_entries;
+	uint32_t cq_overflow; // Completions dropped because the ring was full
+};
+
+typedef struct ARC_IORing {
+	struct ioring_shared *shared; // Page aligned, so it may be mapped into a client
+	struct ioring_sqe *sqes;
+	struct ioring_cqe *cqes;
+	size_t size; // Bytes allocated for shared
+	struct ioring_req *reqs; // One per completion entry
+	struct ioring_req *free;
+	uint32_t inflight;
+	ARC_GenericSpinlock lock;
+	// Requests finished by devices, possibly on other processors, which
+	// ioring_enter has yet to post. Only this list is touched by them
+	struct ioring_req *done;
+	ARC_GenericSpinlock done_lock;
+} ARC_IORing;
+
+/**
+ * Create a ring.
+ *
+ * @param uint32_t entries - Submission entries, rounded up to a power of two.
+ * The completion ring is twice the size.
+ * */
+ARC_IORing *init_ioring(uint32_t entries);
+
+/**
+ * Destroy a ring, waiting for everything in flight to finish.
+ * */
+int uninit_ioring(ARC_IORing *ring);
+
+/**
+ * Queue a submission (client side).
+ *
+ * @return zero on success, non-zero if the submission ring is full.
+ * */
+int ioring_push_sqe(ARC_IORing *ring, struct ioring_sqe *sqe);
+
+/**
+ * Take a completion (client side).
+ *
+ * @return zero on success, non-zero if there is no completion.
+ * */
+int ioring_pop_cqe(ARC_IORing *ring, struct ioring_cqe *cqe);
+
+/**
+ * Hand queued submissions to their devices and reap completions.
+ *
+ * Devices which implement CNTRL_BLK_SUBMIT_ASYNC are given commands without
+ * waiting for them, others are driven synchronously through the matching
+ * CNTRL_BLK_* command.
+ *
+ * @param uint32_t min_complete - Keep polling until this many completions
+ * were posted by this call.
+ * @return the number of submissions consumed.
+ * */
+int ioring_enter(ARC_IORing *ring, uint32_t min_complete);
+
+#endif
@@ -0,0 +1,55 @@
+/**
+ * @file lz4.h
+ *
+ * @author awewsomegamer <awewsomegamer@gmail.com>
+ *
+ * @LICENSE
+ * Arctan-OS/Kernel - Operating System Kernel
+ * Copyright (C) 2023-2025 awewsomegamer
+ *
+ * This file is part of Arctan-OS/Kernel.
+ *
+ * Arctan is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * @DESCRIPTION
+*/
+#ifndef ARC_DRIVERS_LZ4_H
+#define ARC_DRIVERS_LZ4_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LZ4_HASH_BITS 12
+#define LZ4_WORK_SIZE ((1 << LZ4_HASH_BITS) * sizeof(uint16_t))
+#define LZ4_MAX_INPUT 0xFFFF // Positions in the match table are 16 bits
+
+/**
+ * Compress into the LZ4 block format.
+ *
+ * @param void *work - LZ4_WORK_SIZE bytes of scratch memory.
+ * @return the compressed size, 0 if it did not fit in capacity or size
+ * exceeds LZ4_MAX_INPUT.
+ * */
+size_t lz4_compress(const void *source, size_t size, void *dest, size_t capacity, void *work);
+
+/**
+ * Decompress an LZ4 block, every offset and length is checked against the
+ * buffers.
+ *
+ * @return the decompressed size, -1 if the block is malformed or does not
+ * fit in capacity.
+ * */
+int64_t lz4_decompress(const void *source, size_t size, void *dest, size_t capacity);
+
+#endif
@@ -0,0 +1,138 @@
+/**
+ * @file pcache.h
+ *
+ * @author awewsomegamer <awewsomegamer@gmail.com>
+ *
+ * @LICENSE
+ * Arctan-OS/Kernel - Operating System Kernel
+ * Copyright (C) 2023-2025 awewsomegamer
+ *
+ * This file is part of Arctan-OS/Kernel.
+ *
+ * Arctan is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * @DESCRIPTION
+*/
+#ifndef ARC_DRIVERS_PCACHE_H
+#define ARC_DRIVERS_PCACHE_H
+
+#include "drivers/blkdev.h"
+#include "drivers/cntrl_defs.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct pcache_stats {
+	uint64_t hits; // Includes processor hits
+	uint64_t processor_hits; // Served without touching the shared index
+	uint64_t misses;
+	uint64_t evictions;
+	uint64_t pages; // Currently cached
+	uint64_t dirty; // Currently waiting to be written back
+	uint64_t written_back;
+};
+
+/**
+ * Read through the page cache.
+ *
+ * Pages are cached once per device at the bottom of a stack, so a partition
+ * and its drive share cached data. Devices with blocks larger than a page
+ * are read directly.
+ *
+ * @return the number of bytes read.
+ * */
+size_t pcache_read(ARC_BlockDevice *dev, uint64_t offset, size_t size, void *buffer, uint32_t flags);
+
+/**
+ * Write through the page cache.
+ *
+ * If the device is in write-back mode the pages are only marked dirty and
+ * written out later, otherwise, or if CNTRL_BLK_RW_FUA or
+ * CNTRL_BLK_RW_DIRECT is given, the data is written to the device straight
+ * away and any cached pages are updated.
+ *
+ * @return the number of bytes written.
+ * */
+size_t pcache_write(ARC_BlockDevice *dev, uint64_t offset, size_t size, void *buffer, uint32_t flags);
+
+/**
+ * Drop cached pages which overlap the range, for drivers which change the
+ * contents of the device without going through the cache. Dirty pages are
+ * written back first.
+ * */
+void pcache_invalidate(ARC_BlockDevice *dev, uint64_t offset, uint64_t size);
+
+/**
+ * Start reading pages of the range which are not cached yet, without
+ * waiting for them. The requests are plugged so runs which are not
+ * contiguous in the cache can still be merged by the device queue.
+ *
+ * @param uint32_t flags - CNTRL_BLK_RW_* flags of the reads, readahead
+ * should use CNTRL_BLK_PRIO_LOW.
+ * */
+void pcache_prefetch(ARC_BlockDevice *dev, uint64_t offset, uint64_t size, uint32_t flags);
+
+/**
+ * Write back the dirty pages which overlap the range, for drivers which
+ * read the device without going through the cache.
+ * */
+void pcache_writeback_range(ARC_BlockDevice *dev, uint64_t offset, uint64_t size);
+
+/**
+ * Write back every dirty page of the device and flush its volatile cache.
+ * */
+int pcache_sync(ARC_BlockDevice *dev);
+
+/**
+ * Switch a device between write-back and write-through, dirty pages are
+ * written back when switching to write-through.
+ * */
+int pcache_set_write_back(ARC_BlockDevice *dev, bool write_back);
+
+/**
+ * Flush worker, writes back pages which have been dirty for too long or
+ * all it can while too much of the cache is dirty. Runs off the I/O paths
+ * of the device, does nothing if it is already running on dev.
+ * */
+void pcache_writeback(ARC_BlockDevice *dev);
+
+/**
+ * Set up and tear down the replacement policy of a device, called by
+ * blkdev_register and blkdev_unregister. The pages of the device must all
+ * have been dropped before it is torn down.
+ * */
+int pcache_init_device(ARC_BlockDevice *dev);
+void pcache_uninit_device(ARC_BlockDevice *dev);
+
+/**
+ * Change how many pages the device may keep cached and how they are split.
+ *
+ * @param size_t capacity - Most pages the device keeps, 0 to leave it.
+ * @param int in_percent - Share of the capacity given to pages which have
+ * only been used once, so a scan cannot push out more than that.
+ * @param int ghost_percent - How many evicted pages are remembered, as a
+ * share of the capacity, a page read again while remembered skips the
+ * probation list.
+ * */
+int pcache_tune(ARC_BlockDevice *dev, size_t capacity, int in_percent, int ghost_percent);
+
+/**
+ * Handle CNTRL_BLK_CACHE_STATS and CNTRL_BLK_CACHE_TUNE for a device.
+ * */
+int pcache_control(ARC_BlockDevice *dev, uint32_t command, struct cntrl_blk_cache *cache);
+
+void pcache_get_stats(struct pcache_stats *stats);
+void pcache_get_device_stats(ARC_BlockDevice *dev, struct twoq_stats *stats);
+
+#endif
@@ -0,0 +1,56 @@
+/**
+ * @file readahead.h
+ *
+ * @author awewsomegamer <awewsomegamer@gmail.com>
+ *
+ * @LICENSE
+ * Arctan-OS/Kernel - Operating System Kernel
+ * Copyright (C) 2023-2025 awewsomegamer
+ *
+ * This file is part of Arctan-OS/Kernel.
+ *
+ * Arctan is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * @DESCRIPTION
+*/
+#ifndef ARC_DRIVERS_READAHEAD_H
+#define ARC_DRIVERS_READAHEAD_H
+
+#include "fs/vfs.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct readahead_window {
+	uint64_t offset; // In bytes, in the same terms as the reads of the file
+	uint64_t size;
+};
+
+/**
+ * Note a read of an open file and decide what to prefetch.
+ *
+ * Reads which continue where the last one on the file ended grow the
+ * window, any other read resets it and stops readahead until the reader is
+ * sequential again. A new window is handed out once the reader gets within
+ * half a window of the end of the previous one.
+ *
+ * @param struct ARC_File *file - The open file, readahead state is kept per file.
+ * @param uint64_t offset - Offset of the read.
+ * @param size_t size - Size of the read.
+ * @param struct readahead_window *window - Filled with the range to prefetch.
+ * @return non-zero if window was filled.
+ * */
+int readahead_advance(struct ARC_File *file, uint64_t offset, size_t size, struct readahead_window *window);
+
+#endif
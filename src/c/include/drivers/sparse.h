@@ -0,0 +1,69 @@
+/**
+ * @file sparse.h
+ *
+ * @author awewsomegamer <awewsomegamer@gmail.com>
+ *
+ * @LICENSE
+ * Arctan-OS/Kernel - Operating System Kernel
+ * Copyright (C) 2023-2025 awewsomegamer
+ *
+ * This file is part of Arctan-OS/Kernel.
+ *
+ * Arctan is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * @DESCRIPTION
+*/
+#ifndef ARC_DRIVERS_SPARSE_H
+#define ARC_DRIVERS_SPARSE_H
+
+#include "lib/atomics.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Memory which is only backed where it has been written.
+ *
+ * Pages are allocated on the first write to them and hang off a radix
+ * tree of page sized nodes, which gains levels as higher pages are
+ * written. Nothing is ever moved, so growing never copies. Reads of pages
+ * which were never written come from a shared zero page.
+ * */
+struct sparse {
+	ARC_GenericSpinlock lock;
+	void *root;
+	int height; // Levels of nodes above the pages, 0 if root is NULL
+	uint64_t pages; // Allocated data pages
+};
+
+int init_sparse(struct sparse *store);
+void uninit_sparse(struct sparse *store);
+
+/**
+ * @return the number of bytes read, always size.
+ * */
+size_t sparse_read(struct sparse *store, uint64_t offset, size_t size, void *buffer);
+
+/**
+ * @return the number of bytes written, less than size if memory ran out.
+ * */
+size_t sparse_write(struct sparse *store, uint64_t offset, size_t size, void *buffer);
+
+/**
+ * Forget the contents of a range, reading it gives zeroes. Pages it
+ * covers entirely are freed.
+ * */
+void sparse_discard(struct sparse *store, uint64_t offset, uint64_t size);
+
+#endif
@@ -0,0 +1,71 @@
+/**
+ * @file clock.h
+ *
+ * @author awewsomegamer <awewsomegamer@gmail.com>
+ *
+ * @LICENSE
+ * Arctan-OS/Kernel - Operating System Kernel
+ * Copyright (C) 2023-2025 awewsomegamer
+ *
+ * This file is part of Arctan-OS/Kernel.
+ *
+ * Arctan is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * @DESCRIPTION
+*/
+#ifndef ARC_DRIVERS_SYSDEV_CLOCK_H
+#define ARC_DRIVERS_SYSDEV_CLOCK_H
+
+#include <stdint.h>
+
+#define CLOCK_NS_PER_MS 1000000ULL
+
+struct clock_wait {
+	uint64_t deadline;
+	uint32_t spins;
+};
+
+/**
+ * Calibrate the TSC against PIT channel 2, busy waiting for 10ms the first
+ * time. Called by the init functions of drivers which time anything, so
+ * that it is done before the clock is read on any hot path. Later calls
+ * return straight away.
+ * */
+int init_clock(void);
+
+/**
+ * Monotonic time in nanoseconds.
+ *
+ * Derived from the TSC. Before init_clock a conservative estimate of the
+ * TSC frequency is used, which can only make waits longer.
+ * */
+uint64_t clock_ns(void);
+
+/**
+ * Start a bounded wait which expires timeout_ns from now.
+ * */
+void clock_wait_init(struct clock_wait *wait, uint64_t timeout_ns);
+
+/**
+ * Back off once while waiting on a condition.
+ *
+ * Each call pauses for twice as long as the previous one, up to a cap, so
+ * that long waits do not hammer the bus with reads of whatever is being
+ * polled.
+ *
+ * @return non-zero once the deadline has passed.
+ * */
+int clock_wait_step(struct clock_wait *wait);
+
+#endif
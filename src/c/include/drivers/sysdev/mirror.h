@@ -0,0 +1,58 @@
+/**
+ * @file mirror.h
+ *
+ * @author awewsomegamer <awewsomegamer@gmail.com>
+ *
+ * @LICENSE
+ * Arctan-OS/Kernel - Operating System Kernel
+ * Copyright (C) 2023-2025 awewsomegamer
+ *
+ * This file is part of Arctan-OS/Kernel.
+ *
+ * Arctan is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * @DESCRIPTION
+*/
+#ifndef ARC_DRIVERS_DEV_MIRROR_H
+#define ARC_DRIVERS_DEV_MIRROR_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define MIRROR_MAX_MEMBERS 8
+
+struct ARC_DriArgs_Mirror {
+	char *path; // The block device is registered under this path
+	char **members; // Paths of registered block devices holding the same data
+	int member_count;
+	size_t region_size; // Bytes tracked by one bit of the dirty region bitmaps, 0 for the default
+};
+
+// Commands accepted by the control function of mirror resources, in
+// addition to the standard CNTRL_BLK_* commands
+enum {
+	MIRROR_CTRL_STATUS = 0x200, // Write the struct mirror_status of the mirror
+	MIRROR_CTRL_RESYNC, // Copy the dirty regions of every member from one which has them, data: NULL
+};
+
+struct mirror_status {
+	int member_count;
+	uint64_t region_size;
+	uint64_t regions;
+	uint64_t dirty_regions[MIRROR_MAX_MEMBERS]; // Regions the member has missed writes to
+	uint64_t reads[MIRROR_MAX_MEMBERS];
+	uint64_t inflight[MIRROR_MAX_MEMBERS];
+};
+
+#endif
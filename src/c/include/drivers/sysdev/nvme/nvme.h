@@ -28,21 +28,53 @@
 #define ARC_DRIVERS_SYSDEV_NVME_NVME_H
 
 #include "lib/ringbuffer.h"
+#include "lib/atomics.h"
 #define NVME_ADMIN_QUEUE -1
 #define NVME_ADMIN_QUEUE_SUB_LEN 64
 #define NVME_ADMIN_QUEUE_COMP_LEN 256
 
+// Command set identifiers
+#define NVME_CSI_NVM 0x0
+#define NVME_CSI_KV 0x1
+#define NVME_CSI_ZNS 0x2
+
 #include "drivers/resource.h"
 
 enum {
         NVME_TRANSPORT_CTRL_IDEN, // Identify the transport layer (write nvme_transport_iden_t structure)
         NVME_TRANSPORT_CTRL_TO_PROPS, // Destination of reads/writes becomes controller properties
+        NVME_TRANSPORT_CTRL_PMR, // Describe the persistent memory region (write nvme_pmr_args_t structure)
+        NVME_TRANSPORT_CTRL_RESET, // Reset the controller, the admin queue is recreated, io queues are lost
 };
 
 enum {
         NVME_TRANSPORT_TYPE_PCI,
 };
 
+// Commands accepted by the control function of the nvme resource
+enum {
+        NVME_CTRL_STATS,              // Write the nvme_ctrl_stats_t of the controller
+        NVME_CTRL_SET_COALESCING,     // Set Interrupt Coalescing (nvme_coalescing_t)
+        NVME_CTRL_SET_VECTOR_CONFIG,  // Set Interrupt Vector Configuration (nvme_vector_config_t)
+        NVME_CTRL_SET_ARBITRATION,    // Set Arbitration (nvme_arbitration_t)
+        NVME_CTRL_QPAIR_STATS,        // Write the telemetry of an io qpair (nvme_qpair_stats_args_t)
+};
+
+// Commands accepted by the control function of namespace resources, in
+// addition to the standard CNTRL_BLK_* commands
+enum {
+        NVME_NS_CTRL_SET_QOS = 0x200, // Replace the QoS limits of the namespace (nvme_qos_config_t)
+};
+
+// Priority classes, indexed by CNTRL_BLK_PRIO_*
+#define NVME_QOS_CLASSES 3
+
+// Feature identifiers
+#define NVME_FID_ARBITRATION 0x01
+#define NVME_FID_NUM_QUEUES 0x07
+#define NVME_FID_COALESCING 0x08
+#define NVME_FID_VECTOR_CONFIG 0x09
+
 typedef struct ctrl_props {
 	uint64_t cap;
 	uint32_t vs;
@@ -119,26 +151,110 @@ typedef struct qc_entry {
 }__attribute__((packed)) qc_entry_t;
 STATIC_ASSERT(sizeof(struct qc_entry) == 16, "Completeion Queue Entry Size mismatch");
 
+typedef struct nvme_cmp_slot {
+        qc_entry_t entry;
+        int done;
+        uint64_t submitted_at; // clock_ns() when the command was submitted
+} nvme_cmp_slot_t;
+
+// Bucket 0 counts completions under 1us, bucket n those within
+// [2^(n-1), 2^n) us, the last bucket everything slower
+#define NVME_LATENCY_BUCKETS 24
+
+// Kept by the transport under the qpair's lock, plain counters which are
+// cheap enough to always keep
+typedef struct nvme_qpair_stats {
+        uint64_t submitted;
+        uint64_t completed;
+        uint64_t doorbells;     // Submission tail and completion head writes
+        uint64_t phase_flips;
+        uint32_t occupancy;     // Commands currently in flight
+        uint32_t max_occupancy;
+        uint64_t occupancy_sum; // Occupancy seen by each submission, over submitted is the average
+        uint64_t latency[NVME_LATENCY_BUCKETS];
+} nvme_qpair_stats_t;
+
 typedef struct nvme_qpair {
         ARC_Ringbuffer *subq;
         ARC_Ringbuffer *cmpq;
+        nvme_cmp_slot_t *slots; // Completions reaped for each submission queue entry
+        ARC_GenericSpinlock lock; // Held by the transport while it changes the rings or slots,
+                                  // processors may share a qpair
         int id;
         int phase; // The expected value of the phase bit for a new entry
+        int prio;  // CDW11.QPRIO the submission queue is created with
+        nvme_qpair_stats_t stats;
 } nvme_qpair_t;
 
+typedef struct nvme_qpair_stats_args {
+        int qpair;              // Index of the io qpair, from 0
+        nvme_qpair_stats_t stats;
+        uint32_t avg_occupancy;
+} nvme_qpair_stats_args_t;
+
+// Submission queue slot a command identifier was given for
+#define NVME_CID_SLOT(_qpair, _cid) ((_qpair)->id ? ((_cid) >> 6) & 0xFF : (_cid) & 0xFF)
+
 typedef struct qs_wrap {
         nvme_qpair_t *qpair;
         qs_entry_t *cmd;
 } qs_wrap_t;
 
+// Returned by nvme_poll_t when a command was not completed in time, even
+// after it was aborted
+#define NVME_STATUS_TIMEOUT -2
+// Returned by nvme_try_poll_t when a command has not completed yet
+#define NVME_STATUS_PENDING -3
+// Returned by nvme_try_poll_t when a command is past its timeout, it is
+// aborted by a call to nvme_poll_t
+#define NVME_STATUS_OVERDUE -4
+
+typedef struct nvme_coalescing {
+        uint8_t threshold; // Completions to aggregate per interrupt, zero based
+        uint8_t time;      // Maximum aggregation time in 100us units
+} nvme_coalescing_t;
+
+typedef struct nvme_vector_config {
+        uint16_t vector;
+        bool disable_coalescing;
+} nvme_vector_config_t;
+
+typedef struct nvme_arbitration {
+        uint8_t burst;  // log2 of the commands fetched from a queue at once, 7 for no limit
+        uint8_t low;    // Weighted round robin weights, zero based
+        uint8_t medium;
+        uint8_t high;
+} nvme_arbitration_t;
+
+// Values of the tunables which are in effect on the controller
+typedef struct nvme_ctrl_stats {
+        nvme_coalescing_t coalescing;
+        nvme_arbitration_t arbitration;
+        uint64_t no_coalescing; // Bit n is set if coalescing is disabled for vector n
+        uint32_t resets;        // Controller resets done by nvme_recover
+        uint32_t recoveries;    // Qpairs recreated by nvme_recover
+} nvme_ctrl_stats_t;
+
+typedef struct nvme_qos_limit {
+        uint64_t iops; // Commands per second, 0 for no limit
+        uint64_t bps;  // Bytes per second, 0 for no limit
+} nvme_qos_limit_t;
+
+typedef struct nvme_qos_config {
+        nvme_qos_limit_t namespace; // Shared by all classes
+        nvme_qos_limit_t classes[NVME_QOS_CLASSES];
+} nvme_qos_config_t;
+
 typedef qs_wrap_t (*nvme_submit_t)(ARC_Resource *, nvme_qpair_t *, qs_entry_t *);
 typedef int (*nvme_poll_t)(ARC_Resource *, qs_wrap_t *, qc_entry_t *);
+typedef int (*nvme_try_poll_t)(ARC_Resource *, qs_wrap_t *, qc_entry_t *);
 
 // Shared between nvme.c and namespace.c
 typedef struct nvme_driver_state {
         ARC_Resource *transport;
         nvme_submit_t submit;
         nvme_poll_t poll;
+        nvme_try_poll_t try_poll;
 
         struct {
                 size_t max_transfer_size;
@@ -146,6 +262,8 @@ typedef struct nvme_driver_state {
                 uint32_t version;
                 uint32_t type;
                 int ctratt;
+                uint16_t oncs; // Optional NVM command support
+                bool vwc;      // Volatile write cache present
         } ctrl_iden;
 
         struct {
@@ -155,18 +273,49 @@ typedef struct nvme_driver_state {
                 size_t init;      // Number of qpairs initialized
                 nvme_qpair_t *qs;
         } qpairs;
+
+        nvme_ctrl_stats_t stats;
+        nvme_qos_config_t qos; // Given to each namespace at init
+        bool recovering;       // nvme_recover is running, admin commands it loses just fail
 } nvme_driver_state_t;
 
 typedef struct nvme_transport_iden {
         uint8_t type;
         nvme_submit_t submit;
         nvme_poll_t poll;
+        nvme_try_poll_t try_poll;
 } nvme_transport_iden_t;
 
+typedef struct nvme_pmr_args {
+        void *base;                // Mapped PMR, NULL if the controller has none
+        size_t size;
+        volatile uint32_t *pmrsts; // Read to flush posted writes if wbm bit 1 is set
+        uint8_t wbm;               // PMRCAP.PMRWBM
+        uint16_t ctrl_id;
+} nvme_pmr_args_t;
+
 typedef struct nvme_namespace_args {
         nvme_driver_state_t *state;
 	int namespace;
 	int command_set;
+        int qpair_base;
+        int qpair_count;   // Per priority class
+        int qpair_classes; // Priority classes with their own qpairs, the rest share
+        nvme_qos_config_t *qos;
+        uint8_t *iden;     // Identify Namespace (CNS 0x0)
+        uint8_t *iden_csi; // I/O command set specific Identify Namespace (CNS 0x5)
 } nvme_namespace_args_t;
 
+/**
+ * Recover from a command which timed out.
+ *
+ * The qpair is deleted and created again. If that fails, or if qpair is
+ * NULL (the admin queue is stuck), the controller is reset and all io
+ * qpairs are registered again. Commands in flight on the recovered queues
+ * are lost.
+ *
+ * @return zero if the controller is usable again.
+ * */
+int nvme_recover(nvme_driver_state_t *state, nvme_qpair_t *qpair);
+
 #endif
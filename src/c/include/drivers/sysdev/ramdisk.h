@@ -0,0 +1,39 @@
+/**
+ * @file ramdisk.h
+ *
+ * @author awewsomegamer <awewsomegamer@gmail.com>
+ *
+ * @LICENSE
+ * Arctan-OS/Kernel - Operating System Kernel
+ * Copyright (C) 2023-2025 awewsomegamer
+ *
+ * This file is part of Arctan-OS/Kernel.
+ *
+ * Arctan is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * @DESCRIPTION
+*/
+#ifndef ARC_DRIVERS_DEV_RAMDISK_H
+#define ARC_DRIVERS_DEV_RAMDISK_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct ARC_DriArgs_Ramdisk {
+	char *path; // The block device is registered under this path
+	size_t size; // In bytes, nothing is allocated until written
+	uint32_t block_size; // 0 for 512
+};
+
+#endif
@@ -0,0 +1,40 @@
+/**
+ * @file stripe.h
+ *
+ * @author awewsomegamer <awewsomegamer@gmail.com>
+ *
+ * @LICENSE
+ * Arctan-OS/Kernel - Operating System Kernel
+ * Copyright (C) 2023-2025 awewsomegamer
+ *
+ * This file is part of Arctan-OS/Kernel.
+ *
+ * Arctan is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * @DESCRIPTION
+*/
+#ifndef ARC_DRIVERS_DEV_STRIPE_H
+#define ARC_DRIVERS_DEV_STRIPE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct ARC_DriArgs_Stripe {
+	char *path; // The block device is registered under this path
+	char **members; // Paths of registered block devices, in stripe order
+	int member_count;
+	size_t chunk_size; // Bytes on one member before the next, 0 for the default
+};
+
+#endif
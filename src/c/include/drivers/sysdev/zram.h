@@ -0,0 +1,58 @@
+/**
+ * @file zram.h
+ *
+ * @author awewsomegamer <awewsomegamer@gmail.com>
+ *
+ * @LICENSE
+ * Arctan-OS/Kernel - Operating System Kernel
+ * Copyright (C) 2023-2025 awewsomegamer
+ *
+ * This file is part of Arctan-OS/Kernel.
+ *
+ * Arctan is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * @DESCRIPTION
+*/
+#ifndef ARC_DRIVERS_DEV_ZRAM_H
+#define ARC_DRIVERS_DEV_ZRAM_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct ARC_DriArgs_Zram {
+	char *path; // The block device is registered under this path
+	size_t size; // In bytes of uncompressed data
+	uint32_t block_size; // 0 for 512
+};
+
+// Commands accepted by the control function of zram resources, in
+// addition to the standard CNTRL_BLK_* commands
+enum {
+	ZRAM_CTRL_STATS = 0x200, // Write the struct zram_stats of the device
+};
+
+struct zram_stats {
+	uint64_t disk_size;
+	uint64_t stored_pages; // Pages holding data, of any kind
+	uint64_t same_pages; // Filled with one repeated word, take no memory
+	uint64_t raw_pages; // Did not compress well enough, kept as they are
+	uint64_t compressed_bytes; // Sum of the sizes kept for compressed pages
+	uint64_t memory_used; // Data and handle table, in bytes
+	uint64_t ratio_percent; // Data stored over memory used
+	uint64_t reads; // Pages
+	uint64_t writes;
+	uint64_t failed;
+};
+
+#endif
@@ -0,0 +1,84 @@
+/**
+ * @file cache.h
+ *
+ * @author awewsomegamer <awewsomegamer@gmail.com>
+ *
+ * @LICENSE
+ * Arctan-OS/Kernel - Operating System Kernel
+ * Copyright (C) 2023-2025 awewsomegamer
+ *
+ * This file is part of Arctan-OS/Kernel.
+ *
+ * Arctan is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * @DESCRIPTION
+ * Inode and directory entry caches of a mounted EXT2 filesystem.
+*/
+#ifndef ARC_DRIVERS_SYSFS_EXT2_CACHE_H
+#define ARC_DRIVERS_SYSFS_EXT2_CACHE_H
+
+#include "drivers/cntrl_defs.h"
+#include "drivers/twoq.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct ext2_inode;
+struct ext2_cache;
+
+struct ext2_cache_stats {
+	struct twoq_stats inodes;
+	struct twoq_stats dentries;
+};
+
+/**
+ * Create the caches of a filesystem.
+ *
+ * Both use the 2Q policy of the page cache, so walking a large directory
+ * tree once does not push out the inodes and names which are looked up
+ * all the time.
+ *
+ * @param size_t inode_size - Size of an on disk inode of the filesystem.
+ * */
+struct ext2_cache *init_ext2_cache(size_t inode_size);
+void uninit_ext2_cache(struct ext2_cache *cache);
+
+/**
+ * @return a copy of the cached inode which the caller frees, NULL if it is
+ * not cached.
+ * */
+struct ext2_inode *ext2_cache_get_inode(struct ext2_cache *cache, uint64_t inode);
+void ext2_cache_put_inode(struct ext2_cache *cache, uint64_t inode, struct ext2_inode *node);
+void ext2_cache_drop_inode(struct ext2_cache *cache, uint64_t inode);
+
+/**
+ * @return the inode number of name in the directory dir, 0 if it is not
+ * cached.
+ * */
+uint64_t ext2_cache_get_dentry(struct ext2_cache *cache, uint64_t dir, char *name);
+void ext2_cache_put_dentry(struct ext2_cache *cache, uint64_t dir, char *name, uint64_t inode);
+void ext2_cache_drop_dentry(struct ext2_cache *cache, uint64_t dir, char *name);
+
+/**
+ * Resize the caches, a capacity of 0 leaves that cache as it is.
+ * */
+int ext2_cache_tune(struct ext2_cache *cache, size_t inodes, size_t dentries, int in_percent, int ghost_percent);
+void ext2_cache_get_stats(struct ext2_cache *cache, struct ext2_cache_stats *stats);
+
+/**
+ * Handle CNTRL_FS_CACHE_STATS and CNTRL_FS_CACHE_TUNE.
+ * */
+int ext2_cache_control(struct ext2_cache *cache, uint32_t command, struct cntrl_fs_cache *data);
+
+#endif
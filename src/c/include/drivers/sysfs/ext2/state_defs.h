@@ -27,6 +27,8 @@
 #ifndef ARC_DRIVERS_SYSFS_EXT2_STATE_DEFS_H
 #define ARC_DRIVERS_SYSFS_EXT2_STATE_DEFS_H
 
+#include "drivers/blkdev.h"
+#include "drivers/sysfs/ext2/cache.h"
 #include "drivers/sysfs/ext2/ext2.h"
 
 #include <stdint.h>
@@ -34,6 +36,8 @@
 
 struct ext2_basic_driver_state {
 	struct ARC_File *partition;
+	ARC_BlockDevice *dev; // NULL if the partition is not a registered block device
+	struct ext2_cache *cache; // Shared by every node of the filesystem, NULL if caching is off
 	struct ext2_inode *node;
 	uint64_t attributes; // Bit | Description
 			     // 0   | 1: Enable caching
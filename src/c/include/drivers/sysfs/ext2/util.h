@@ -29,9 +29,31 @@
 
 #include "drivers/sysfs/ext2/state_defs.h"
 
+/**
+ * Move bytes to or from the partition.
+ *
+ * Block requests are submitted to the partition's block device, the
+ * partition file is only used if it is not a block device.
+ * */
+size_t ext2_dev_read(struct ext2_basic_driver_state *state, void *buffer, uint64_t offset, size_t size);
+size_t ext2_dev_write(struct ext2_basic_driver_state *state, void *buffer, uint64_t offset, size_t size);
+
 size_t ext2_read_inode_data(struct ext2_basic_driver_state *state, uint8_t *buffer, uint64_t offset, size_t size);
+/**
+ * Start reading the blocks which back a range of the inode into the page
+ * cache without waiting for them.
+ * */
+void ext2_prefetch_inode_data(struct ext2_basic_driver_state *state, uint64_t offset, size_t size, uint32_t flags);
+
+/**
+ * Write back the dirty cache pages holding the data of the inode, without
+ * flushing the device.
+ * */
+void ext2_writeback_inode_data(struct ext2_basic_driver_state *state);
+
 size_t ext2_write_inode_data(struct ext2_node_driver_state *state, uint8_t *buffer, uint64_t offset, size_t size); 
 uint64_t ext2_get_inode_in_dir(struct ext2_basic_driver_state *dir, char *filename);
+int ext2_discard_blocks(struct ext2_super_driver_state *super, uint64_t block, size_t count);
 void ext2_list_directory(struct ext2_basic_driver_state *dir, int (*callback)(struct ext2_dir_ent *, void *arg), void *arg);
 
 #endif
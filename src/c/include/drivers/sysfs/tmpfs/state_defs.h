@@ -0,0 +1,83 @@
+/**
+ * @file state_defs.h
+ *
+ * @author awewsomegamer <awewsomegamer@gmail.com>
+ *
+ * @LICENSE
+ * Arctan-OS/Kernel - Operating System Kernel
+ * Copyright (C) 2023-2025 awewsomegamer
+ *
+ * This file is part of Arctan-OS/Kernel.
+ *
+ * Arctan is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * @DESCRIPTION
+*/
+#ifndef ARC_DRIVERS_SYSFS_TMPFS_STATE_DEFS_H
+#define ARC_DRIVERS_SYSFS_TMPFS_STATE_DEFS_H
+
+#include "drivers/sparse.h"
+#include "lib/atomics.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <global.h>
+
+#define TMPFS_INLINE_SIZE 192 // Files up to this size are kept in their node
+
+struct ARC_DriArgs_Tmpfs {
+	size_t size; // Bytes of file data which may be held, 0 for no limit
+};
+
+struct tmpfs_dirent {
+	struct tmpfs_dirent *next;
+	struct tmpfs_node *node; // Referenced by the entry
+	uint64_t hash;
+	size_t length;
+	char name[];
+};
+
+struct tmpfs_node {
+	struct tmpfs_super_driver_state *super;
+	ARC_GenericSpinlock lock;
+	uint64_t ino;
+	uint32_t mode;
+	int refs; // One for each directory entry and each resource
+	size_t size; // Bytes for files, entries for directories
+	union {
+		struct {
+			struct tmpfs_dirent **buckets;
+			size_t bucket_count;
+		} dir;
+		struct {
+			// Small files live in the node, once they outgrow it
+			// they move to a sparse store for good
+			bool spilled;
+			union {
+				uint8_t small[TMPFS_INLINE_SIZE];
+				struct sparse pages;
+			};
+		} file;
+	};
+};
+
+struct tmpfs_super_driver_state {
+	struct tmpfs_node *root;
+	int refs; // One for the mount and one for each node
+	uint64_t next_ino;
+	uint64_t pages; // Data pages held by every file
+	uint64_t max_pages; // 0 for no limit
+};
+
+#endif
@@ -0,0 +1,88 @@
+/**
+ * @file util.h
+ *
+ * @author awewsomegamer <awewsomegamer@gmail.com>
+ *
+ * @LICENSE
+ * Arctan-OS/Kernel - Operating System Kernel
+ * Copyright (C) 2023-2025 awewsomegamer
+ *
+ * This file is part of Arctan-OS/Kernel.
+ *
+ * Arctan is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * @DESCRIPTION
+*/
+#ifndef ARC_DRIVERS_SYSFS_TMPFS_UTIL_H
+#define ARC_DRIVERS_SYSFS_TMPFS_UTIL_H
+
+#include "drivers/sysfs/tmpfs/state_defs.h"
+
+#include <stdint.h>
+#include <global.h>
+#include <sys/stat.h>
+
+/**
+ * Drop a reference to the superblock, the last one frees it. Nodes left
+ * open past an unmount keep it alive until they are closed.
+ * */
+void tmpfs_put_super(struct tmpfs_super_driver_state *super);
+
+/**
+ * Create an unlinked node, holding one reference.
+ *
+ * Directories are made if mode has S_IFDIR, regular files otherwise.
+ * */
+struct tmpfs_node *tmpfs_new_node(struct tmpfs_super_driver_state *super, uint32_t mode);
+void tmpfs_get_node(struct tmpfs_node *node);
+
+/**
+ * Drop a reference, the last one frees the node and everything under it.
+ * */
+void tmpfs_put_node(struct tmpfs_node *node);
+
+/**
+ * Follow a path down from a directory.
+ *
+ * @param leaf - If not NULL, the last component is not followed but given
+ * back here along with its length in leaf_length.
+ * @return a referenced node, NULL if the path does not exist.
+ * */
+struct tmpfs_node *tmpfs_walk(struct tmpfs_node *dir, char *path, char **leaf, size_t *leaf_length);
+
+/**
+ * Create a node at path.
+ *
+ * A directory or file type takes the place of missing S_IFMT bits in
+ * mode, fails if mode names a different kind of node.
+ * */
+int tmpfs_create(struct tmpfs_node *dir, char *path, uint32_t mode, int type);
+
+/**
+ * Unlink path, directories must be empty. The node itself is freed once
+ * no resource refers to it anymore.
+ * */
+int tmpfs_remove(struct tmpfs_node *dir, char *path);
+
+size_t tmpfs_read(struct tmpfs_node *node, uint64_t offset, size_t size, void *buffer);
+
+/**
+ * @return the number of bytes written, less than size if memory or the
+ * size limit of the filesystem ran out.
+ * */
+size_t tmpfs_write(struct tmpfs_node *node, uint64_t offset, size_t size, void *buffer);
+int tmpfs_truncate(struct tmpfs_node *node, uint64_t size);
+void tmpfs_stat(struct tmpfs_node *node, struct stat *stat);
+
+#endif
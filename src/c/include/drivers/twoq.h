@@ -0,0 +1,138 @@
+/**
+ * @file twoq.h
+ *
+ * @author awewsomegamer <awewsomegamer@gmail.com>
+ *
+ * @LICENSE
+ * Arctan-OS/Kernel - Operating System Kernel
+ * Copyright (C) 2023-2025 awewsomegamer
+ *
+ * This file is part of Arctan-OS/Kernel.
+ *
+ * Arctan is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * @DESCRIPTION
+*/
+#ifndef ARC_DRIVERS_TWOQ_H
+#define ARC_DRIVERS_TWOQ_H
+
+#include "lib/atomics.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TWOQ_NONE 0
+#define TWOQ_IN 1 // Seen once, first in first out
+#define TWOQ_MAIN 2 // Seen again, least recently used
+
+// Embedded in whatever is being cached
+struct twoq_entry {
+	struct twoq_entry *prev;
+	struct twoq_entry *next;
+	uint64_t key;
+	uint8_t list;
+	bool referenced;
+};
+
+struct twoq_list {
+	struct twoq_entry *head; // Newest
+	struct twoq_entry *tail;
+	size_t count;
+};
+
+struct twoq_stats {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	uint64_t promotions; // Main list entries used again and kept another round
+	uint64_t ghost_hits; // Inserted straight into the main list
+	uint64_t resident[2]; // Entries in the in and main lists
+};
+
+/**
+ * 2Q replacement policy.
+ *
+ * New entries go on the in list, which is first in first out. Hits there
+ * are ignored, a scan touches its pages several times in a row. Entries
+ * evicted from the in list leave their key in a ghost filter, and only if
+ * the key comes back does it go onto the main list. A scan only ever
+ * cycles through the in list, which is kept to a fraction of the capacity,
+ * so the main list survives it.
+ *
+ * Hits on the main list only set a flag, entries are moved back to its
+ * front once they reach the tail.
+ * */
+struct twoq {
+	ARC_GenericSpinlock lock;
+	struct twoq_list in;
+	struct twoq_list main;
+	size_t capacity;
+	size_t in_target; // The in list is evicted from while larger than this
+	uint64_t *ghost_ring; // Keys in the order they were evicted
+	size_t ghost_size;
+	size_t ghost_idx;
+	uint8_t *ghost_counts; // Counting filter over ghost_ring
+	size_t ghost_slots;
+	struct twoq_stats stats;
+};
+
+/**
+ * @param size_t capacity - Number of resident entries.
+ * @param int in_percent - Share of the capacity given to the in list.
+ * @param int ghost_percent - Keys remembered, relative to the capacity.
+ * */
+int init_twoq(struct twoq *q, size_t capacity, int in_percent, int ghost_percent);
+void uninit_twoq(struct twoq *q);
+
+/**
+ * Change the sizes, resident entries beyond the new capacity are only
+ * evicted as new ones come in.
+ * */
+int twoq_tune(struct twoq *q, size_t capacity, int in_percent, int ghost_percent);
+
+/**
+ * Add a resident entry.
+ * */
+void twoq_insert(struct twoq *q, struct twoq_entry *entry, uint64_t key);
+
+/**
+ * Take an entry out without remembering it, for invalidation.
+ * */
+void twoq_remove(struct twoq *q, struct twoq_entry *entry);
+
+/**
+ * Take the entry which should be evicted next out of the policy.
+ *
+ * @param bool (*evictable)(struct twoq_entry *, void *) - May refuse an
+ * entry which is in use, called with the policy locked.
+ * @return the entry, NULL if there is nothing which can be evicted.
+ * */
+struct twoq_entry *twoq_victim(struct twoq *q, bool (*evictable)(struct twoq_entry *entry, void *arg), void *arg);
+
+/**
+ * Note a use of a resident entry, does not take the lock. Only entries
+ * on the main list are marked.
+ * */
+void twoq_hit(struct twoq *q, struct twoq_entry *entry);
+void twoq_miss(struct twoq *q);
+
+/**
+ * @return true if more entries are resident than the capacity allows.
+ * */
+bool twoq_over(struct twoq *q);
+
+void twoq_get_stats(struct twoq *q, struct twoq_stats *stats);
+
+#endif
@@ -0,0 +1,375 @@
+/**
+ * @file ioring.c
+ *
+ * @author awewsomegamer <awewsomegamer@gmail.com>
+ *
+ * @LICENSE
+ * Arctan-OS/Kernel - Operating System Kernel
+ * Copyright (C) 2023-2025 awewsomegamer
+ *
+ * This file is part of Arctan-OS/Kernel.
+ *
+ * Arctan is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * @DESCRIPTION
+ * Shared submission/completion rings for block I/O, and the dispatcher
+ * which feeds them to devices.
+*/
+#include "drivers/cntrl_defs.h"
+#include "drivers/ioring.h"
+#include "global.h"
+#include "lib/util.h"
+#include "mm/allocator.h"
+#include "mm/pmm.h"
+
+struct ioring_req {
+	struct cntrl_blk_async async; // Must be first
+	struct ioring_req *next;
+	ARC_IORing *ring;
+	ARC_Resource *res;
+	uint64_t user_data;
+	int64_t result;
+	bool pending; // Owned by the ring until it is reaped
+	bool finished; // Set by the device, under done_lock
+	union {
+		struct cntrl_blk_rw rw;
+		struct {
+			struct cntrl_blk_ranges list;
+			struct cntrl_blk_range range;
+		} discard;
+	};
+};
+
+ARC_IORing *init_ioring(uint32_t entries) {
+	if (entries == 0) {
+		ARC_DEBUG(ERR, "Zero entries requested\n");
+		return NULL;
+	}
+
+	uint32_t sq_entries = 1;
+	while (sq_entries < entries) {
+		sq_entries <<= 1;
+	}
+
+	uint32_t cq_entries = sq_entries * 2;
+
+	ARC_IORing *ring = alloc(sizeof(*ring));
+
+	if (ring == NULL) {
+		ARC_DEBUG(ERR, "Failed to allocate ring\n");
+		return NULL;
+	}
+
+	memset(ring, 0, sizeof(*ring));
+
+	size_t size = sizeof(struct ioring_shared) + sq_entries * sizeof(struct ioring_sqe) + cq_entries * sizeof(struct ioring_cqe);
+	size = ALIGN_UP(size, PAGE_SIZE);
+
+	ring->shared = pmm_alloc(size);
+	ring->reqs = alloc(sizeof(*ring->reqs) * cq_entries);
+
+	if (ring->shared == NULL || ring->reqs == NULL) {
+		ARC_DEBUG(ERR, "Failed to allocate ring memory\n");
+		goto fail;
+	}
+
+	memset(ring->shared, 0, size);
+	memset(ring->reqs, 0, sizeof(*ring->reqs) * cq_entries);
+
+	ring->size = size;
+	ring->shared->sq_entries = sq_entries;
+	ring->shared->cq_entries = cq_entries;
+	ring->sqes = (struct ioring_sqe *)(ring->shared + 1);
+	ring->cqes = (struct ioring_cqe *)(ring->sqes + sq_entries);
+
+	for (uint32_t i = 0; i < cq_entries; i++) {
+		ring->reqs[i].next = ring->free;
+		ring->free = &ring->reqs[i];
+	}
+
+	init_static_spinlock(&ring->lock);
+	init_static_spinlock(&ring->done_lock);
+
+	return ring;
+
+ fail:
+	if (ring->shared != NULL) {
+		pmm_free(ring->shared);
+	}
+
+	if (ring->reqs != NULL) {
+		free(ring->reqs);
+	}
+
+	free(ring);
+
+	return NULL;
+}
+
+int ioring_push_sqe(ARC_IORing *ring, struct ioring_sqe *sqe) {
+	struct ioring_shared *shared = ring->shared;
+	uint32_t tail = shared->sq_tail;
+
+	if (tail - ARC_ATOMIC_LOAD(shared->sq_head) >= shared->sq_entries) {
+		return -1;
+	}
+
+	memcpy(&ring->sqes[tail & (shared->sq_entries - 1)], sqe, sizeof(*sqe));
+	ARC_ATOMIC_STORE(shared->sq_tail, tail + 1);
+
+	return 0;
+}
+
+int ioring_pop_cqe(ARC_IORing *ring, struct ioring_cqe *cqe) {
+	struct ioring_shared *shared = ring->shared;
+	uint32_t head = shared->cq_head;
+
+	if (head == ARC_ATOMIC_LOAD(shared->cq_tail)) {
+		return -1;
+	}
+
+	memcpy(cqe, &ring->cqes[head & (shared->cq_entries - 1)], sizeof(*cqe));
+	ARC_ATOMIC_STORE(shared->cq_head, head + 1);
+
+	return 0;
+}
+
+static void ioring_post(ARC_IORing *ring, uint64_t user_data, int64_t result) {
+	struct ioring_shared *shared = ring->shared;
+	uint32_t tail = shared->cq_tail;
+
+	if (tail - ARC_ATOMIC_LOAD(shared->cq_head) >= shared->cq_entries) {
+		// Not reachable while the client keeps up, submissions are held
+		// back when the completion ring could fill
+		shared->cq_overflow++;
+		return;
+	}
+
+	struct ioring_cqe *cqe = &ring->cqes[tail & (shared->cq_entries - 1)];
+	cqe->user_data = user_data;
+	cqe->result = result;
+
+	ARC_ATOMIC_STORE(shared->cq_tail, tail + 1);
+}
+
+// Called by devices as commands finish, possibly before the submission
+// returns and possibly from whoever polls the device. The ring itself is
+// left alone, the request is only queued for ioring_reap
+static void ioring_complete(struct cntrl_blk_async *async, int64_t result) {
+	struct ioring_req *req = (struct ioring_req *)async;
+	ARC_IORing *ring = req->ring;
+
+	spinlock_lock(&ring->done_lock);
+
+	req->result = result;
+	req->finished = true;
+	req->next = ring->done;
+	ring->done = req;
+
+	spinlock_unlock(&ring->done_lock);
+}
+
+// Post the completions of finished requests and recycle them, call with
+// the lock of the ring held
+static void ioring_reap(ARC_IORing *ring) {
+	spinlock_lock(&ring->done_lock);
+
+	struct ioring_req *req = ring->done;
+	ring->done = NULL;
+
+	spinlock_unlock(&ring->done_lock);
+
+	while (req != NULL) {
+		struct ioring_req *next = req->next;
+
+		ioring_post(ring, req->user_data, req->result);
+
+		req->pending = false;
+		req->finished = false;
+		req->next = ring->free;
+		ring->free = req;
+		ring->inflight--;
+
+		req = next;
+	}
+}
+
+static void ioring_dispatch(ARC_IORing *ring, struct ioring_sqe *sqe) {
+	if (sqe->opcode == IORING_OP_NOP) {
+		ioring_post(ring, sqe->user_data, 0);
+		return;
+	}
+
+	if (sqe->res == NULL || sqe->res->driver->control == NULL) {
+		ioring_post(ring, sqe->user_data, -1);
+		return;
+	}
+
+	struct ioring_req *req = ring->free;
+	ring->free = req->next;
+	ring->inflight++;
+
+	req->ring = ring;
+	req->res = sqe->res;
+	req->user_data = sqe->user_data;
+	req->pending = true;
+	req->async.done = ioring_complete;
+	req->async.priv = ring;
+
+	switch (sqe->opcode) {
+	case IORING_OP_READ:
+	case IORING_OP_WRITE: {
+		req->rw.offset = sqe->offset;
+		req->rw.size = sqe->size;
+		req->rw.buffer = sqe->buffer;
+		req->rw.flags = sqe->flags;
+
+		req->async.command = sqe->opcode == IORING_OP_READ ? CNTRL_BLK_READ : CNTRL_BLK_WRITE;
+		req->async.data = &req->rw;
+
+		break;
+	}
+
+	case IORING_OP_FSYNC: {
+		req->async.command = CNTRL_BLK_SYNC;
+		req->async.data = NULL;
+
+		break;
+	}
+
+	case IORING_OP_DISCARD: {
+		req->discard.range.offset = sqe->offset;
+		req->discard.range.size = sqe->size;
+		req->discard.list.count = 1;
+		req->discard.list.ranges = &req->discard.range;
+
+		req->async.command = CNTRL_BLK_DISCARD;
+		req->async.data = &req->discard.list;
+
+		break;
+	}
+
+	default: {
+		ARC_DEBUG(ERR, "Unknown opcode %d\n", sqe->opcode);
+		ioring_complete(&req->async, -1);
+		return;
+	}
+	}
+
+	ARC_ControlPacketInstruction inst = { .command = CNTRL_BLK_SUBMIT_ASYNC, .data = &req->async };
+	ARC_ControlPacketResponse resp = req->res->driver->control(req->res, &inst);
+
+	spinlock_lock(&ring->done_lock);
+	bool finished = req->finished;
+	spinlock_unlock(&ring->done_lock);
+
+	if (resp.type == CNTRL_BLK_SUBMIT_ASYNC || finished) {
+		return;
+	}
+
+	// No async path, do it synchronously
+	inst.command = req->async.command;
+	inst.data = req->async.data;
+	resp = req->res->driver->control(req->res, &inst);
+
+	ioring_complete(&req->async, resp.type == req->async.command ? (int64_t)resp.size : -1);
+}
+
+// Poll each device with commands in flight once
+static void ioring_poll(ARC_IORing *ring) {
+	uint32_t count = ring->shared->cq_entries;
+
+	for (uint32_t i = 0; i < count; i++) {
+		struct ioring_req *req = &ring->reqs[i];
+
+		if (!req->pending) {
+			continue;
+		}
+
+		bool polled = false;
+		for (uint32_t j = 0; j < i && !polled; j++) {
+			polled = ring->reqs[j].pending && ring->reqs[j].res == req->res;
+		}
+
+		if (polled) {
+			continue;
+		}
+
+		ARC_ControlPacketInstruction inst = { .command = CNTRL_BLK_POLL_ASYNC };
+		req->res->driver->control(req->res, &inst);
+	}
+}
+
+int ioring_enter(ARC_IORing *ring, uint32_t min_complete) {
+	if (ring == NULL) {
+		return -1;
+	}
+
+	struct ioring_shared *shared = ring->shared;
+
+	spinlock_lock(&ring->lock);
+
+	uint32_t start = shared->cq_tail;
+	uint32_t tail = ARC_ATOMIC_LOAD(shared->sq_tail);
+	int consumed = 0;
+
+	while (1) {
+		ioring_reap(ring);
+
+		// Only take a submission if its completion is sure to fit
+		while (shared->sq_head != tail && ring->free != NULL
+		       && ring->inflight + (shared->cq_tail - ARC_ATOMIC_LOAD(shared->cq_head)) < shared->cq_entries) {
+			struct ioring_sqe sqe = ring->sqes[shared->sq_head & (shared->sq_entries - 1)];
+			ARC_ATOMIC_STORE(shared->sq_head, shared->sq_head + 1);
+
+			ioring_dispatch(ring, &sqe);
+			consumed++;
+		}
+
+		ioring_reap(ring);
+
+		if (shared->cq_tail - start >= min_complete || ring->inflight == 0) {
+			break;
+		}
+
+		ioring_poll(ring);
+	}
+
+	spinlock_unlock(&ring->lock);
+
+	return consumed;
+}
+
+int uninit_ioring(ARC_IORing *ring) {
+	if (ring == NULL) {
+		return -1;
+	}
+
+	spinlock_lock(&ring->lock);
+
+	ioring_reap(ring);
+
+	while (ring->inflight > 0) {
+		ioring_poll(ring);
+		ioring_reap(ring);
+	}
+
+	spinlock_unlock(&ring->lock);
+
+	pmm_free(ring->shared);
+	free(ring->reqs);
+	free(ring);
+
+	return 0;
+}
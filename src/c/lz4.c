@@ -0,0 +1,252 @@
+/**
+ * @file lz4.c
+ *
+ * @author awewsomegamer <awewsomegamer@gmail.com>
+ *
+ * @LICENSE
+ * Arctan-OS/Kernel - Operating System Kernel
+ * Copyright (C) 2023-2025 awewsomegamer
+ *
+ * This file is part of Arctan-OS/Kernel.
+ *
+ * Arctan is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * @DESCRIPTION
+ * LZ4 block format compressor and decompressor.
+*/
+#include "drivers/lz4.h"
+#include "global.h"
+#include "lib/util.h"
+
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5 // The block ends in at least this many literals
+#define LZ4_MFLIMIT 12 // No match starts in this many bytes before the end
+#define LZ4_MAX_OFFSET 0xFFFF
+
+static uint32_t lz4_read32(const uint8_t *ptr) {
+	uint32_t value;
+	memcpy(&value, ptr, sizeof(value));
+
+	return value;
+}
+
+static uint32_t lz4_hash(uint32_t sequence) {
+	return (sequence * 2654435761U) >> (32 - LZ4_HASH_BITS);
+}
+
+// Lengths which do not fit in the token continue in bytes of 255
+static uint8_t *lz4_write_length(uint8_t *op, uint8_t *end, size_t length) {
+	for (; length >= 255; length -= 255) {
+		if (op >= end) {
+			return NULL;
+		}
+
+		*op++ = 255;
+	}
+
+	if (op >= end) {
+		return NULL;
+	}
+
+	*op++ = (uint8_t)length;
+
+	return op;
+}
+
+static uint8_t *lz4_write_sequence(uint8_t *op, uint8_t *end, const uint8_t *literals, size_t literal_length, size_t offset, size_t match_length) {
+	// Worst case for the token, the literals and the offset
+	if (op == NULL || (size_t)(end - op) < 1 + literal_length + 2) {
+		return NULL;
+	}
+
+	uint8_t *token = op++;
+	*token = min(literal_length, (size_t)15) << 4;
+
+	if (literal_length >= 15 && (op = lz4_write_length(op, end, literal_length - 15)) == NULL) {
+		return NULL;
+	}
+
+	if ((size_t)(end - op) < literal_length) {
+		return NULL;
+	}
+
+	memcpy(op, literals, literal_length);
+	op += literal_length;
+
+	// The last sequence has literals only
+	if (match_length == 0) {
+		return op;
+	}
+
+	if (end - op < 2) {
+		return NULL;
+	}
+
+	*op++ = offset & 0xFF;
+	*op++ = offset >> 8;
+
+	match_length -= LZ4_MIN_MATCH;
+	*token |= min(match_length, (size_t)15);
+
+	if (match_length >= 15) {
+		op = lz4_write_length(op, end, match_length - 15);
+	}
+
+	return op;
+}
+
+size_t lz4_compress(const void *source, size_t size, void *dest, size_t capacity, void *work) {
+	if (source == NULL || dest == NULL || work == NULL || size > LZ4_MAX_INPUT) {
+		return 0;
+	}
+
+	const uint8_t *src = source;
+	uint8_t *op = dest;
+	uint8_t *end = op + capacity;
+	uint16_t *table = work;
+	size_t anchor = 0;
+
+	memset(table, 0, LZ4_WORK_SIZE);
+
+	if (size > LZ4_MFLIMIT) {
+		size_t limit = size - LZ4_MFLIMIT;
+		size_t match_limit = size - LZ4_LAST_LITERALS;
+		size_t ip = 0;
+
+		while (ip < limit) {
+			uint32_t sequence = lz4_read32(src + ip);
+			uint32_t hash = lz4_hash(sequence);
+			size_t ref = table[hash];
+
+			table[hash] = ip;
+
+			if (ref >= ip || ip - ref > LZ4_MAX_OFFSET || lz4_read32(src + ref) != sequence) {
+				ip++;
+				continue;
+			}
+
+			size_t length = LZ4_MIN_MATCH;
+
+			while (ip + length < match_limit && src[ref + length] == src[ip + length]) {
+				length++;
+			}
+
+			while (ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1]) {
+				ip--;
+				ref--;
+				length++;
+			}
+
+			op = lz4_write_sequence(op, end, src + anchor, ip - anchor, ip - ref, length);
+
+			if (op == NULL) {
+				return 0;
+			}
+
+			ip += length;
+			anchor = ip;
+
+			// Let later data match just behind the one found
+			if (ip - 2 < limit) {
+				table[lz4_hash(lz4_read32(src + ip - 2))] = ip - 2;
+			}
+		}
+	}
+
+	op = lz4_write_sequence(op, end, src + anchor, size - anchor, 0, 0);
+
+	return op == NULL ? 0 : (size_t)(op - (uint8_t *)dest);
+}
+
+int64_t lz4_decompress(const void *source, size_t size, void *dest, size_t capacity) {
+	if (source == NULL || dest == NULL) {
+		return -1;
+	}
+
+	const uint8_t *ip = source;
+	const uint8_t *iend = ip + size;
+	uint8_t *op = dest;
+	uint8_t *oend = op + capacity;
+
+	while (ip < iend) {
+		uint8_t token = *ip++;
+		size_t length = token >> 4;
+
+		if (length == 15) {
+			uint8_t byte;
+
+			do {
+				if (ip >= iend) {
+					return -1;
+				}
+
+				byte = *ip++;
+				length += byte;
+			} while (byte == 255);
+		}
+
+		if (length > (size_t)(iend - ip) || length > (size_t)(oend - op)) {
+			return -1;
+		}
+
+		memcpy(op, ip, length);
+		ip += length;
+		op += length;
+
+		if (ip == iend) {
+			break;
+		}
+
+		if (iend - ip < 2) {
+			return -1;
+		}
+
+		size_t offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+
+		if (offset == 0 || offset > (size_t)(op - (uint8_t *)dest)) {
+			return -1;
+		}
+
+		length = token & 15;
+
+		if (length == 15) {
+			uint8_t byte;
+
+			do {
+				if (ip >= iend) {
+					return -1;
+				}
+
+				byte = *ip++;
+				length += byte;
+			} while (byte == 255);
+		}
+
+		length += LZ4_MIN_MATCH;
+
+		if (length > (size_t)(oend - op)) {
+			return -1;
+		}
+
+		// Matches may overlap what they produce
+		for (size_t i = 0; i < length; i++) {
+			op[i] = op[i - offset];
+		}
+
+		op += length;
+	}
+
+	return op - (uint8_t *)dest;
+}
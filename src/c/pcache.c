@@ -0,0 +1,1194 @@
+/**
+ * @file pcache.c
+ *
+ * @author awewsomegamer <awewsomegamer@gmail.com>
+ *
+ * @LICENSE
+ * Arctan-OS/Kernel - Operating System Kernel
+ * Copyright (C) 2023-2025 awewsomegamer
+ *
+ * This file is part of Arctan-OS/Kernel.
+ *
+ * Arctan is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * @DESCRIPTION
+ * Page cache shared by all block devices. Pages are found through a hashed
+ * index keyed by device and page, each processor keeps a few recently used
+ * pages which it can find without touching the shared index. Each device
+ * picks the pages it gives up with its own 2Q policy, so a bulk read of a
+ * device does not push out the metadata read over and over before it.
+ *
+ * Devices in write-back mode keep written pages dirty on a per-device list,
+ * oldest first. The flush worker writes them back once they have been dirty
+ * for too long or too much of the cache is dirty, contiguous pages going out
+ * as one request.
+ *
+ * Prefetched pages are put into the index straight away and marked as
+ * loading, anyone who finds such a page polls the device until the read
+ * completes.
+*/
+#include "arch/smp.h"
+#include "drivers/blkdev.h"
+#include "drivers/cntrl_defs.h"
+#include "drivers/pcache.h"
+#include "drivers/sysdev/clock.h"
+#include "global.h"
+#include "lib/atomics.h"
+#include "lib/util.h"
+#include "mm/allocator.h"
+#include "mm/pmm.h"
+
+#define PCACHE_HASH_BITS 12
+#define PCACHE_MAX_PAGES 4096
+#define PCACHE_IN_PERCENT 25 // Probation share of a device
+#define PCACHE_GHOST_PERCENT 50
+#define PCACHE_PROCESSOR_SLOTS 8
+#define PCACHE_MAX_PROCESSORS 64
+#define PCACHE_FLUSH_BATCH 64
+#define PCACHE_PREFETCH_RUN 32 // Pages in a single prefetch request
+#define PCACHE_DIRTY_EXPIRE_NS (5000 * CLOCK_NS_PER_MS)
+#define PCACHE_DIRTY_BACKGROUND (PCACHE_MAX_PAGES / 10) // Flush worker writes back regardless of age
+#define PCACHE_DIRTY_LIMIT (PCACHE_MAX_PAGES * 2 / 5) // Writers write back before returning
+
+struct pcache_page {
+	struct pcache_page *hash_next;
+	struct twoq_entry policy; // In the policy of dev
+	struct pcache_page *dirty_prev; // Dirty list of dev, under dev->dirty.lock
+	struct pcache_page *dirty_next;
+	uint64_t dirtied_at;
+	bool dirty; // On the dirty list, which holds a reference
+	ARC_BlockDevice *dev;
+	uint64_t index; // In pages from the start of dev
+	uint8_t *data;
+	ARC_GenericSpinlock lock; // Held while data is copied
+	uint32_t refs; // One for the cache, the dirty list, each user and processor slot
+	uint32_t slots; // Processor slots among refs, they do not keep the page from eviction
+	bool valid; // Cleared by whoever takes the page out of the cache
+	bool loading; // Prefetch in flight, data is not yet usable
+};
+
+// Prefetch of a run of contiguous pages
+struct pcache_prefetch {
+	struct blkdev_request req;
+	int count;
+	struct pcache_page **pages;
+	struct blkdev_vec *vecs;
+};
+
+struct pcache_bucket {
+	ARC_GenericSpinlock lock;
+	struct pcache_page *head;
+};
+
+struct pcache_processor {
+	ARC_GenericSpinlock lock;
+	struct pcache_page *slots[PCACHE_PROCESSOR_SLOTS];
+	int next;
+};
+
+static struct pcache_bucket pcache_buckets[1 << PCACHE_HASH_BITS] = { 0 };
+static struct pcache_processor pcache_processors[PCACHE_MAX_PROCESSORS] = { 0 };
+static struct pcache_stats pcache_stats = { 0 };
+
+static struct pcache_bucket *pcache_bucket(ARC_BlockDevice *dev, uint64_t index) {
+	uint64_t key = ((uintptr_t)dev >> 4) ^ (index * 0x9E3779B97F4A7C15ULL);
+	key *= 0x9E3779B97F4A7C15ULL;
+
+	return &pcache_buckets[key >> (64 - PCACHE_HASH_BITS)];
+}
+
+// Walk down to the device at the bottom of a stack, clamping the range to
+// each device on the way
+static int pcache_resolve(ARC_BlockDevice **dev, uint64_t *offset, uint64_t *size) {
+	ARC_BlockDevice *current = *dev;
+
+	while (1) {
+		uint64_t limit = current->blocks * current->block_size;
+
+		if (*offset >= limit) {
+			return -1;
+		}
+
+		*size = min(*size, limit - *offset);
+
+		if (current->parent == NULL) {
+			break;
+		}
+
+		*offset += current->parent_lba * current->parent->block_size;
+		current = current->parent;
+	}
+
+	*dev = current;
+
+	return 0;
+}
+
+static bool pcache_cacheable(ARC_BlockDevice *dev) {
+	return !dev->uncached && dev->block_size != 0 && dev->block_size <= PAGE_SIZE && PAGE_SIZE % dev->block_size == 0;
+}
+
+static void pcache_put(struct pcache_page *page) {
+	if (ARC_ATOMIC_DEC(page->refs) == 0) {
+		pmm_fast_page_free(page->data);
+		free(page);
+	}
+}
+
+// Only the caller which clears valid takes the page out of the index and policy
+static bool pcache_claim(struct pcache_page *page) {
+	spinlock_lock(&page->lock);
+	bool was_valid = page->valid;
+	page->valid = false;
+	spinlock_unlock(&page->lock);
+
+	return was_valid;
+}
+
+static void pcache_unlink_policy(struct pcache_page *page) {
+	twoq_remove(&page->dev->cache, &page->policy);
+}
+
+// Pages held by anyone but the cache and processor slots are in use or
+// dirty. A slot notices an evicted page is no longer valid and drops it.
+static bool pcache_evictable(struct twoq_entry *entry, void *arg) {
+	(void)arg;
+
+	struct pcache_page *page = (struct pcache_page *)((uintptr_t)entry - offsetof(struct pcache_page, policy));
+
+	// Slots are counted after taking their reference and uncounted before
+	// dropping it. With the slot count the same on both sides of reading
+	// the references, a racing slot can only make the page look busy.
+	uint32_t slots = ARC_ATOMIC_LOAD(page->slots);
+	uint32_t refs = ARC_ATOMIC_LOAD(page->refs);
+
+	if (ARC_ATOMIC_LOAD(page->slots) != slots) {
+		return false;
+	}
+
+	return refs - slots == 1 && !page->dirty && pcache_claim(page);
+}
+
+static bool pcache_evict(ARC_BlockDevice *dev) {
+	struct twoq_entry *entry = twoq_victim(&dev->cache, pcache_evictable, NULL);
+
+	if (entry == NULL) {
+		return false;
+	}
+
+	struct pcache_page *victim = (struct pcache_page *)((uintptr_t)entry - offsetof(struct pcache_page, policy));
+	struct pcache_bucket *bucket = pcache_bucket(victim->dev, victim->index);
+
+	spinlock_lock(&bucket->lock);
+
+	struct pcache_page **link = &bucket->head;
+	while (*link != NULL && *link != victim) {
+		link = &(*link)->hash_next;
+	}
+
+	if (*link == victim) {
+		*link = victim->hash_next;
+	}
+
+	spinlock_unlock(&bucket->lock);
+
+	ARC_ATOMIC_DEC(pcache_stats.pages);
+	ARC_ATOMIC_INC(pcache_stats.evictions);
+
+	pcache_put(victim);
+
+	return true;
+}
+
+static ARC_BlockDevice *pcache_root(ARC_BlockDevice *dev) {
+	while (dev->parent != NULL) {
+		dev = dev->parent;
+	}
+
+	return dev;
+}
+
+static void pcache_mark_dirty(struct pcache_page *page) {
+	ARC_BlockDevice *dev = page->dev;
+
+	spinlock_lock(&dev->dirty.lock);
+
+	if (!page->dirty) {
+		ARC_ATOMIC_INC(page->refs);
+		page->dirty = true;
+		page->dirtied_at = clock_ns();
+		page->dirty_next = NULL;
+		page->dirty_prev = dev->dirty.tail;
+
+		if (dev->dirty.tail == NULL) {
+			dev->dirty.head = page;
+		} else {
+			dev->dirty.tail->dirty_next = page;
+		}
+
+		dev->dirty.tail = page;
+		dev->dirty.count++;
+		ARC_ATOMIC_INC(pcache_stats.dirty);
+	}
+
+	spinlock_unlock(&dev->dirty.lock);
+}
+
+// Take page off the dirty list, the reference of the list passes to the
+// caller. dev->dirty.lock must be held.
+static void pcache_unlink_dirty(struct pcache_page *page) {
+	ARC_BlockDevice *dev = page->dev;
+
+	if (page->dirty_prev == NULL) {
+		dev->dirty.head = page->dirty_next;
+	} else {
+		page->dirty_prev->dirty_next = page->dirty_next;
+	}
+
+	if (page->dirty_next == NULL) {
+		dev->dirty.tail = page->dirty_prev;
+	} else {
+		page->dirty_next->dirty_prev = page->dirty_prev;
+	}
+
+	page->dirty_prev = NULL;
+	page->dirty_next = NULL;
+	page->dirty = false;
+	dev->dirty.count--;
+	ARC_ATOMIC_DEC(pcache_stats.dirty);
+}
+
+// Write pages taken off the dirty list of dev, runs of contiguous pages go
+// out as one request. Pages which fail are marked dirty again.
+static int pcache_flush_pages(ARC_BlockDevice *dev, struct pcache_page **pages, int count) {
+	// Sort by page so runs can be found
+	for (int i = 1; i < count; i++) {
+		struct pcache_page *page = pages[i];
+		int j = i - 1;
+
+		for (; j >= 0 && pages[j]->index > page->index; j--) {
+			pages[j + 1] = pages[j];
+		}
+
+		pages[j + 1] = page;
+	}
+
+	uint64_t per_page = PAGE_SIZE / dev->block_size;
+	int run_max = max(dev->max_blocks / per_page, (uint64_t)1);
+	struct blkdev_request *reqs = alloc(count * (sizeof(*reqs) + sizeof(struct blkdev_vec)));
+	int written = 0;
+
+	if (reqs == NULL || per_page > dev->max_blocks) {
+		// Page by page, blkdev_rw splits as needed
+		for (int i = 0; i < count; i++) {
+			uint64_t lba = pages[i]->index * per_page;
+
+			if (blkdev_rw(dev, BLKDEV_OP_WRITE, lba, min(per_page, dev->blocks - lba), pages[i]->data, 0) != 0) {
+				pcache_mark_dirty(pages[i]);
+				continue;
+			}
+
+			written++;
+		}
+
+		free(reqs);
+
+		return written;
+	}
+
+	memset(reqs, 0, count * (sizeof(*reqs) + sizeof(struct blkdev_vec)));
+
+	struct blkdev_vec *vecs = (struct blkdev_vec *)(reqs + count);
+	int req_count = 0;
+
+	blkdev_plug(dev);
+
+	for (int i = 0; i < count;) {
+		int j = i + 1;
+
+		while (j < count && j - i < run_max && pages[j]->index == pages[j - 1]->index + 1) {
+			j++;
+		}
+
+		struct blkdev_request *req = &reqs[req_count++];
+
+		req->dev = dev;
+		req->op = BLKDEV_OP_WRITE;
+		req->lba = pages[i]->index * per_page;
+		req->vecs = &vecs[i];
+		req->vec_count = j - i;
+		req->priv = (void *)(uintptr_t)i;
+
+		for (int k = i; k < j; k++) {
+			// The device may end part way through the last page
+			uint64_t blocks = min(per_page, dev->blocks - pages[k]->index * per_page);
+
+			vecs[k].base = pages[k]->data;
+			vecs[k].len = blocks * dev->block_size;
+			req->count += blocks;
+		}
+
+		blkdev_submit(req);
+
+		i = j;
+	}
+
+	blkdev_unplug(dev);
+
+	for (int i = 0; i < req_count; i++) {
+		int first = (uintptr_t)reqs[i].priv;
+
+		if (blkdev_wait(&reqs[i]) == 0) {
+			written += reqs[i].vec_count;
+			continue;
+		}
+
+		ARC_DEBUG(ERR, "Failed to write back %lu pages at block 0x%"PRIx64" of %s\n", reqs[i].vec_count, reqs[i].lba, dev->path);
+
+		for (size_t k = 0; k < reqs[i].vec_count; k++) {
+			pcache_mark_dirty(pages[first + k]);
+		}
+	}
+
+	free(reqs);
+
+	ARC_ATOMIC_ADD(pcache_stats.written_back, written);
+
+	return written;
+}
+
+// Write back up to a batch of the oldest dirty pages of dev which were
+// dirtied no later than before, returns the number written or -1 if none
+// of them could be
+static int pcache_flush_batch(ARC_BlockDevice *dev, uint64_t before) {
+	struct pcache_page *pages[PCACHE_FLUSH_BATCH];
+	int count = 0;
+
+	spinlock_lock(&dev->dirty.lock);
+
+	while (count < PCACHE_FLUSH_BATCH && dev->dirty.head != NULL && dev->dirty.head->dirtied_at <= before) {
+		struct pcache_page *page = dev->dirty.head;
+		pcache_unlink_dirty(page);
+		pages[count++] = page;
+	}
+
+	spinlock_unlock(&dev->dirty.lock);
+
+	if (count == 0) {
+		return 0;
+	}
+
+	int written = pcache_flush_pages(dev, pages, count);
+
+	for (int i = 0; i < count; i++) {
+		pcache_put(pages[i]);
+	}
+
+	return written == 0 ? -1 : written;
+}
+
+// Write back a single page if it is dirty
+static void pcache_clean(struct pcache_page *page) {
+	ARC_BlockDevice *dev = page->dev;
+
+	spinlock_lock(&dev->dirty.lock);
+
+	if (!page->dirty) {
+		spinlock_unlock(&dev->dirty.lock);
+		return;
+	}
+
+	pcache_unlink_dirty(page);
+
+	spinlock_unlock(&dev->dirty.lock);
+
+	pcache_flush_pages(dev, &page, 1);
+	pcache_put(page);
+}
+
+// Wait for a prefetch of page to complete, returns false if it failed
+static bool pcache_wait(struct pcache_page *page) {
+	while (ARC_ATOMIC_LOAD(page->loading)) {
+		blkdev_poll(page->dev);
+	}
+
+	return ARC_ATOMIC_LOAD(page->valid);
+}
+
+// Keep a reference to page in the slots of the current processor
+static void pcache_remember(struct pcache_page *page) {
+	struct pcache_processor *processor = &pcache_processors[smp_get_processor_id() % PCACHE_MAX_PROCESSORS];
+
+	ARC_ATOMIC_INC(page->refs);
+	ARC_ATOMIC_INC(page->slots);
+
+	spinlock_lock(&processor->lock);
+	struct pcache_page *old = processor->slots[processor->next];
+	processor->slots[processor->next] = page;
+	processor->next = (processor->next + 1) % PCACHE_PROCESSOR_SLOTS;
+	spinlock_unlock(&processor->lock);
+
+	if (old != NULL) {
+		ARC_ATOMIC_DEC(old->slots);
+		pcache_put(old);
+	}
+}
+
+static struct pcache_page *pcache_find_processor(ARC_BlockDevice *dev, uint64_t index) {
+	struct pcache_processor *processor = &pcache_processors[smp_get_processor_id() % PCACHE_MAX_PROCESSORS];
+	struct pcache_page *ret = NULL;
+	struct pcache_page *stale = NULL;
+
+	spinlock_lock(&processor->lock);
+
+	for (int i = 0; i < PCACHE_PROCESSOR_SLOTS; i++) {
+		struct pcache_page *page = processor->slots[i];
+
+		if (page == NULL || page->dev != dev || page->index != index) {
+			continue;
+		}
+
+		if (!ARC_ATOMIC_LOAD(page->valid)) {
+			processor->slots[i] = NULL;
+			stale = page;
+			break;
+		}
+
+		ARC_ATOMIC_INC(page->refs);
+		twoq_hit(&dev->cache, &page->policy);
+		ret = page;
+
+		break;
+	}
+
+	spinlock_unlock(&processor->lock);
+
+	if (stale != NULL) {
+		ARC_ATOMIC_DEC(stale->slots);
+		pcache_put(stale);
+	}
+
+	if (ret != NULL && !pcache_wait(ret)) {
+		pcache_put(ret);
+		ret = NULL;
+	}
+
+	return ret;
+}
+
+static struct pcache_page *pcache_find_bucket(ARC_BlockDevice *dev, uint64_t index) {
+	struct pcache_bucket *bucket = pcache_bucket(dev, index);
+	struct pcache_page *page = NULL;
+
+	spinlock_lock(&bucket->lock);
+
+	for (page = bucket->head; page != NULL; page = page->hash_next) {
+		if (page->dev == dev && page->index == index && ARC_ATOMIC_LOAD(page->valid)) {
+			ARC_ATOMIC_INC(page->refs);
+			twoq_hit(&dev->cache, &page->policy);
+			break;
+		}
+	}
+
+	spinlock_unlock(&bucket->lock);
+
+	if (page != NULL && !pcache_wait(page)) {
+		pcache_put(page);
+		page = NULL;
+	}
+
+	return page;
+}
+
+// Find a page without counting it as used, for the cache's own upkeep.
+// Pages still being read in are skipped, they hold nothing to write back.
+static struct pcache_page *pcache_peek(ARC_BlockDevice *dev, uint64_t index) {
+	struct pcache_bucket *bucket = pcache_bucket(dev, index);
+	struct pcache_page *page = NULL;
+
+	spinlock_lock(&bucket->lock);
+
+	for (page = bucket->head; page != NULL; page = page->hash_next) {
+		if (page->dev == dev && page->index == index && ARC_ATOMIC_LOAD(page->valid) && !ARC_ATOMIC_LOAD(page->loading)) {
+			ARC_ATOMIC_INC(page->refs);
+			break;
+		}
+	}
+
+	spinlock_unlock(&bucket->lock);
+
+	return page;
+}
+
+static bool pcache_cached(ARC_BlockDevice *dev, uint64_t index) {
+	struct pcache_bucket *bucket = pcache_bucket(dev, index);
+	bool ret = false;
+
+	spinlock_lock(&bucket->lock);
+
+	for (struct pcache_page *page = bucket->head; page != NULL && !ret; page = page->hash_next) {
+		ret = page->dev == dev && page->index == index && ARC_ATOMIC_LOAD(page->valid);
+	}
+
+	spinlock_unlock(&bucket->lock);
+
+	return ret;
+}
+
+static struct pcache_page *pcache_find(ARC_BlockDevice *dev, uint64_t index) {
+	struct pcache_page *page = pcache_find_processor(dev, index);
+
+	if (page != NULL) {
+		ARC_ATOMIC_INC(pcache_stats.hits);
+		ARC_ATOMIC_INC(pcache_stats.processor_hits);
+		return page;
+	}
+
+	page = pcache_find_bucket(dev, index);
+
+	if (page != NULL) {
+		ARC_ATOMIC_INC(pcache_stats.hits);
+		pcache_remember(page);
+	}
+
+	return page;
+}
+
+// Add a freshly read page, or one which is being read if loading is set,
+// returns the page already cached if another processor got there first
+static struct pcache_page *pcache_insert(ARC_BlockDevice *dev, uint64_t index, uint8_t *data, bool loading) {
+	struct pcache_page *page = alloc(sizeof(*page));
+
+	if (page == NULL) {
+		ARC_DEBUG(ERR, "Failed to allocate cache page\n");
+		return NULL;
+	}
+
+	memset(page, 0, sizeof(*page));
+	init_static_spinlock(&page->lock);
+	page->dev = dev;
+	page->index = index;
+	page->data = data;
+	page->refs = 2;
+	page->valid = true;
+	page->loading = loading;
+
+	struct pcache_bucket *bucket = pcache_bucket(dev, index);
+
+	retry:;
+
+	spinlock_lock(&bucket->lock);
+
+	for (struct pcache_page *current = bucket->head; current != NULL; current = current->hash_next) {
+		if (current->dev != dev || current->index != index || !ARC_ATOMIC_LOAD(current->valid)) {
+			continue;
+		}
+
+		ARC_ATOMIC_INC(current->refs);
+		spinlock_unlock(&bucket->lock);
+
+		// A failed prefetch is gone from the index by the time it stops loading
+		if (!loading && !pcache_wait(current)) {
+			pcache_put(current);
+			goto retry;
+		}
+
+		free(page);
+
+		return current;
+	}
+
+	page->hash_next = bucket->head;
+	bucket->head = page;
+
+	twoq_insert(&dev->cache, &page->policy, index);
+
+	spinlock_unlock(&bucket->lock);
+
+	// Over the limit of the device or of the whole cache, either way this
+	// device makes room
+	ARC_ATOMIC_INC(pcache_stats.pages);
+
+	while ((twoq_over(&dev->cache) || ARC_ATOMIC_LOAD(pcache_stats.pages) > PCACHE_MAX_PAGES) && pcache_evict(dev));
+
+	if (!loading) {
+		pcache_remember(page);
+	}
+
+	return page;
+}
+
+static struct pcache_page *pcache_load(ARC_BlockDevice *dev, uint64_t index, uint32_t flags) {
+	struct pcache_page *page = pcache_find(dev, index);
+
+	if (page != NULL) {
+		return page;
+	}
+
+	ARC_ATOMIC_INC(pcache_stats.misses);
+	twoq_miss(&dev->cache);
+
+	uint8_t *data = pmm_fast_page_alloc();
+
+	if (data == NULL) {
+		ARC_DEBUG(ERR, "Failed to allocate cache page\n");
+		return NULL;
+	}
+
+	uint64_t per_page = PAGE_SIZE / dev->block_size;
+	uint64_t lba = index * per_page;
+	uint64_t count = min(per_page, dev->blocks - lba);
+
+	if (blkdev_rw(dev, BLKDEV_OP_READ, lba, count, data, flags & ~CNTRL_BLK_RW_FUA) != 0) {
+		pmm_fast_page_free(data);
+		return NULL;
+	}
+
+	// The device may end part way through the page
+	memset(data + count * dev->block_size, 0, PAGE_SIZE - count * dev->block_size);
+
+	page = pcache_insert(dev, index, data, false);
+
+	if (page == NULL || page->data != data) {
+		pmm_fast_page_free(data);
+	}
+
+	return page;
+}
+
+size_t pcache_read(ARC_BlockDevice *dev, uint64_t offset, size_t size, void *buffer, uint32_t flags) {
+	if (dev == NULL || buffer == NULL) {
+		return 0;
+	}
+
+	uint64_t length = size;
+
+	if (pcache_resolve(&dev, &offset, &length) != 0) {
+		return 0;
+	}
+
+	if (!pcache_cacheable(dev)) {
+		return blkdev_io_direct(dev, false, offset, length, buffer, flags);
+	}
+
+	if ((flags & CNTRL_BLK_RW_DIRECT) != 0) {
+		// The device only has what has been written back
+		pcache_writeback_range(dev, offset, length);
+
+		return blkdev_io_direct(dev, false, offset, length, buffer, flags);
+	}
+
+	size_t done = 0;
+
+	while (done < length) {
+		uint64_t index = (offset + done) / PAGE_SIZE;
+		size_t skew = (offset + done) % PAGE_SIZE;
+		size_t part = min(PAGE_SIZE - skew, length - done);
+
+		struct pcache_page *page = pcache_load(dev, index, flags);
+
+		if (page == NULL) {
+			// Out of memory, go around the cache
+			size_t read = blkdev_io_direct(dev, false, offset + done, part, buffer + done, flags);
+			done += read;
+
+			if (read != part) {
+				break;
+			}
+
+			continue;
+		}
+
+		spinlock_lock(&page->lock);
+		memcpy(buffer + done, page->data + skew, part);
+		spinlock_unlock(&page->lock);
+
+		pcache_put(page);
+
+		done += part;
+	}
+
+	return done;
+}
+
+// Cache a page which is about to be entirely overwritten without reading it
+static struct pcache_page *pcache_fill(ARC_BlockDevice *dev, uint64_t index, void *buffer) {
+	struct pcache_page *page = pcache_find(dev, index);
+
+	if (page == NULL) {
+		ARC_ATOMIC_INC(pcache_stats.misses);
+		twoq_miss(&dev->cache);
+
+		uint8_t *data = pmm_fast_page_alloc();
+
+		if (data == NULL) {
+			ARC_DEBUG(ERR, "Failed to allocate cache page\n");
+			return NULL;
+		}
+
+		memcpy(data, buffer, PAGE_SIZE);
+
+		page = pcache_insert(dev, index, data, false);
+
+		if (page == NULL) {
+			pmm_fast_page_free(data);
+			return NULL;
+		}
+
+		if (page->data == data) {
+			return page;
+		}
+
+		pmm_fast_page_free(data);
+	}
+
+	spinlock_lock(&page->lock);
+	memcpy(page->data, buffer, PAGE_SIZE);
+	spinlock_unlock(&page->lock);
+
+	return page;
+}
+
+static size_t pcache_write_through(ARC_BlockDevice *dev, uint64_t offset, uint64_t length, void *buffer, uint32_t flags) {
+	size_t written = blkdev_io_direct(dev, true, offset, length, buffer, flags);
+
+	if (!pcache_cacheable(dev)) {
+		return written;
+	}
+
+	for (size_t done = 0; done < written;) {
+		uint64_t index = (offset + done) / PAGE_SIZE;
+		size_t skew = (offset + done) % PAGE_SIZE;
+		size_t part = min(PAGE_SIZE - skew, written - done);
+
+		struct pcache_page *page = pcache_find_bucket(dev, index);
+
+		if (page != NULL) {
+			spinlock_lock(&page->lock);
+			memcpy(page->data + skew, buffer + done, part);
+			spinlock_unlock(&page->lock);
+
+			pcache_put(page);
+		}
+
+		done += part;
+	}
+
+	return written;
+}
+
+size_t pcache_write(ARC_BlockDevice *dev, uint64_t offset, size_t size, void *buffer, uint32_t flags) {
+	if (dev == NULL || buffer == NULL) {
+		return 0;
+	}
+
+	uint64_t length = size;
+
+	if (pcache_resolve(&dev, &offset, &length) != 0) {
+		return 0;
+	}
+
+	if (!pcache_cacheable(dev) || !dev->write_back || (flags & (CNTRL_BLK_RW_FUA | CNTRL_BLK_RW_DIRECT)) != 0) {
+		return pcache_write_through(dev, offset, length, buffer, flags);
+	}
+
+	size_t done = 0;
+
+	while (done < length) {
+		uint64_t index = (offset + done) / PAGE_SIZE;
+		size_t skew = (offset + done) % PAGE_SIZE;
+		size_t part = min(PAGE_SIZE - skew, length - done);
+
+		struct pcache_page *page = NULL;
+
+		if (part == PAGE_SIZE) {
+			page = pcache_fill(dev, index, buffer + done);
+		} else if ((page = pcache_load(dev, index, flags)) != NULL) {
+			spinlock_lock(&page->lock);
+			memcpy(page->data + skew, buffer + done, part);
+			spinlock_unlock(&page->lock);
+		}
+
+		if (page == NULL) {
+			// Out of memory, go around the cache
+			size_t written = blkdev_io_direct(dev, true, offset + done, part, buffer + done, flags);
+			done += written;
+
+			if (written != part) {
+				break;
+			}
+
+			continue;
+		}
+
+		pcache_mark_dirty(page);
+		pcache_put(page);
+
+		done += part;
+	}
+
+	// Too much is dirty, make the writer pay for it
+	while (ARC_ATOMIC_LOAD(pcache_stats.dirty) > PCACHE_DIRTY_LIMIT && pcache_flush_batch(dev, UINT64_MAX) > 0);
+
+	pcache_writeback(dev);
+
+	return done;
+}
+
+static void pcache_drop_bucket(struct pcache_bucket *bucket, ARC_BlockDevice *dev, uint64_t first, uint64_t last) {
+	struct pcache_page *dropped = NULL;
+
+	spinlock_lock(&bucket->lock);
+
+	struct pcache_page **link = &bucket->head;
+	while (*link != NULL) {
+		struct pcache_page *page = *link;
+
+		if (page->dev != dev || page->index < first || page->index > last || !pcache_claim(page)) {
+			link = &page->hash_next;
+			continue;
+		}
+
+		*link = page->hash_next;
+		page->hash_next = dropped;
+		dropped = page;
+	}
+
+	spinlock_unlock(&bucket->lock);
+
+	while (dropped != NULL) {
+		struct pcache_page *page = dropped;
+		dropped = page->hash_next;
+
+		pcache_clean(page);
+		pcache_unlink_policy(page);
+		ARC_ATOMIC_DEC(pcache_stats.pages);
+		pcache_put(page);
+	}
+}
+
+void pcache_invalidate(ARC_BlockDevice *dev, uint64_t offset, uint64_t size) {
+	if (dev == NULL || size == 0 || pcache_resolve(&dev, &offset, &size) != 0) {
+		return;
+	}
+
+	uint64_t first = offset / PAGE_SIZE;
+	uint64_t last = (offset + size - 1) / PAGE_SIZE;
+
+	// Large ranges are cheaper to find by walking every bucket once
+	if (last - first < (1 << PCACHE_HASH_BITS)) {
+		for (uint64_t i = first; i <= last; i++) {
+			pcache_drop_bucket(pcache_bucket(dev, i), dev, i, i);
+		}
+	} else {
+		for (int i = 0; i < (1 << PCACHE_HASH_BITS); i++) {
+			pcache_drop_bucket(&pcache_buckets[i], dev, first, last);
+		}
+	}
+}
+
+static void pcache_prefetch_end(struct blkdev_request *req) {
+	struct pcache_prefetch *prefetch = req->priv;
+
+	for (int i = 0; i < prefetch->count; i++) {
+		struct pcache_page *page = prefetch->pages[i];
+
+		if (req->status != 0) {
+			pcache_drop_bucket(pcache_bucket(page->dev, page->index), page->dev, page->index, page->index);
+		}
+
+		ARC_ATOMIC_STORE(page->loading, false);
+		pcache_put(page);
+	}
+
+	free(prefetch);
+}
+
+static void pcache_prefetch_submit(ARC_BlockDevice *dev, struct pcache_prefetch *prefetch, uint32_t flags) {
+	if (prefetch->count == 0) {
+		free(prefetch);
+		return;
+	}
+
+	uint64_t per_page = PAGE_SIZE / dev->block_size;
+	struct blkdev_request *req = &prefetch->req;
+
+	req->dev = dev;
+	req->op = BLKDEV_OP_READ;
+	req->flags = flags;
+	req->lba = prefetch->pages[0]->index * per_page;
+	req->vecs = prefetch->vecs;
+	req->vec_count = prefetch->count;
+	req->end = pcache_prefetch_end;
+	req->priv = prefetch;
+
+	for (int i = 0; i < prefetch->count; i++) {
+		struct pcache_page *page = prefetch->pages[i];
+		uint64_t blocks = min(per_page, dev->blocks - page->index * per_page);
+
+		// The device may end part way through the last page
+		memset(page->data + blocks * dev->block_size, 0, PAGE_SIZE - blocks * dev->block_size);
+
+		prefetch->vecs[i].base = page->data;
+		prefetch->vecs[i].len = blocks * dev->block_size;
+		req->count += blocks;
+	}
+
+	blkdev_submit(req);
+}
+
+void pcache_prefetch(ARC_BlockDevice *dev, uint64_t offset, uint64_t size, uint32_t flags) {
+	if (dev == NULL || size == 0 || pcache_resolve(&dev, &offset, &size) != 0 || !pcache_cacheable(dev)) {
+		return;
+	}
+
+	uint64_t per_page = PAGE_SIZE / dev->block_size;
+
+	if (per_page > dev->max_blocks) {
+		return;
+	}
+
+	int run_max = min(dev->max_blocks / per_page, (uint64_t)PCACHE_PREFETCH_RUN);
+	size_t prefetch_size = sizeof(struct pcache_prefetch) + run_max * (sizeof(struct pcache_page *) + sizeof(struct blkdev_vec));
+	struct pcache_prefetch *prefetch = NULL;
+
+	blkdev_plug(dev);
+
+	for (uint64_t i = offset / PAGE_SIZE; i <= (offset + size - 1) / PAGE_SIZE; i++) {
+		if (pcache_cached(dev, i)) {
+			// Ends the run
+			if (prefetch != NULL) {
+				pcache_prefetch_submit(dev, prefetch, flags);
+				prefetch = NULL;
+			}
+
+			continue;
+		}
+
+		if (prefetch == NULL) {
+			if ((prefetch = alloc(prefetch_size)) == NULL) {
+				break;
+			}
+
+			memset(prefetch, 0, prefetch_size);
+			prefetch->pages = (struct pcache_page **)(prefetch + 1);
+			prefetch->vecs = (struct blkdev_vec *)(prefetch->pages + run_max);
+		}
+
+		uint8_t *data = pmm_fast_page_alloc();
+
+		if (data == NULL) {
+			break;
+		}
+
+		struct pcache_page *page = pcache_insert(dev, i, data, true);
+
+		if (page == NULL || page->data != data) {
+			// Lost a race with another reader
+			pmm_fast_page_free(data);
+
+			if (page != NULL) {
+				pcache_put(page);
+			}
+
+			pcache_prefetch_submit(dev, prefetch, flags);
+			prefetch = NULL;
+
+			continue;
+		}
+
+		prefetch->pages[prefetch->count++] = page;
+
+		if (prefetch->count == run_max) {
+			pcache_prefetch_submit(dev, prefetch, flags);
+			prefetch = NULL;
+		}
+	}
+
+	if (prefetch != NULL) {
+		pcache_prefetch_submit(dev, prefetch, flags);
+	}
+
+	blkdev_unplug(dev);
+}
+
+void pcache_writeback_range(ARC_BlockDevice *dev, uint64_t offset, uint64_t size) {
+	if (dev == NULL || size == 0 || pcache_resolve(&dev, &offset, &size) != 0) {
+		return;
+	}
+
+	for (uint64_t i = offset / PAGE_SIZE; ARC_ATOMIC_LOAD(dev->dirty.count) > 0 && i <= (offset + size - 1) / PAGE_SIZE; i++) {
+		struct pcache_page *page = pcache_peek(dev, i);
+
+		if (page != NULL) {
+			pcache_clean(page);
+			pcache_put(page);
+		}
+	}
+}
+
+int pcache_sync(ARC_BlockDevice *dev) {
+	if (dev == NULL) {
+		return -1;
+	}
+
+	dev = pcache_root(dev);
+
+	int r = 0;
+	while ((r = pcache_flush_batch(dev, UINT64_MAX)) > 0);
+
+	if (r < 0) {
+		ARC_DEBUG(ERR, "Failed to write back %s\n", dev->path);
+		return -2;
+	}
+
+	return blkdev_flush(dev);
+}
+
+int pcache_set_write_back(ARC_BlockDevice *dev, bool write_back) {
+	if (dev == NULL) {
+		return -1;
+	}
+
+	dev = pcache_root(dev);
+	dev->write_back = write_back;
+
+	return write_back ? 0 : pcache_sync(dev);
+}
+
+void pcache_writeback(ARC_BlockDevice *dev) {
+	if (dev == NULL) {
+		return;
+	}
+
+	dev = pcache_root(dev);
+
+	if (ARC_ATOMIC_LOAD(dev->dirty.count) == 0) {
+		return;
+	}
+
+	// Writing back polls the device, which lands here again
+	spinlock_lock(&dev->dirty.lock);
+	bool busy = dev->dirty.flushing;
+	dev->dirty.flushing = true;
+	spinlock_unlock(&dev->dirty.lock);
+
+	if (busy) {
+		return;
+	}
+
+	uint64_t now = clock_ns();
+	uint64_t expired = now > PCACHE_DIRTY_EXPIRE_NS ? now - PCACHE_DIRTY_EXPIRE_NS : 0;
+
+	while (1) {
+		uint64_t before = ARC_ATOMIC_LOAD(pcache_stats.dirty) > PCACHE_DIRTY_BACKGROUND ? UINT64_MAX : expired;
+
+		if (pcache_flush_batch(dev, before) <= 0) {
+			break;
+		}
+	}
+
+	spinlock_lock(&dev->dirty.lock);
+	dev->dirty.flushing = false;
+	spinlock_unlock(&dev->dirty.lock);
+}
+
+int pcache_init_device(ARC_BlockDevice *dev) {
+	if (dev == NULL) {
+		return -1;
+	}
+
+	// Windows of another device cache into it
+	if (dev->parent != NULL || dev->uncached) {
+		return 0;
+	}
+
+	return init_twoq(&dev->cache, PCACHE_MAX_PAGES, PCACHE_IN_PERCENT, PCACHE_GHOST_PERCENT);
+}
+
+void pcache_uninit_device(ARC_BlockDevice *dev) {
+	if (dev == NULL) {
+		return;
+	}
+
+	uninit_twoq(&dev->cache);
+}
+
+int pcache_tune(ARC_BlockDevice *dev, size_t capacity, int in_percent, int ghost_percent) {
+	if (dev == NULL) {
+		return -1;
+	}
+
+	dev = pcache_root(dev);
+
+	if (twoq_tune(&dev->cache, capacity == 0 ? dev->cache.capacity : capacity, in_percent, ghost_percent) != 0) {
+		return -1;
+	}
+
+	// Shrinking takes effect straight away
+	while (twoq_over(&dev->cache) && pcache_evict(dev));
+
+	return 0;
+}
+
+void pcache_get_device_stats(ARC_BlockDevice *dev, struct twoq_stats *stats) {
+	if (dev == NULL || stats == NULL) {
+		return;
+	}
+
+	twoq_get_stats(&pcache_root(dev)->cache, stats);
+}
+
+int pcache_control(ARC_BlockDevice *dev, uint32_t command, struct cntrl_blk_cache *cache) {
+	if (dev == NULL || cache == NULL) {
+		return -1;
+	}
+
+	if (command == CNTRL_BLK_CACHE_TUNE && pcache_tune(dev, cache->capacity, cache->in_percent, cache->ghost_percent) != 0) {
+		return -1;
+	} else if (command != CNTRL_BLK_CACHE_TUNE && command != CNTRL_BLK_CACHE_STATS) {
+		return -1;
+	}
+
+	struct twoq *q = &pcache_root(dev)->cache;
+	struct twoq_stats stats = { 0 };
+
+	twoq_get_stats(q, &stats);
+
+	cache->capacity = q->capacity;
+	cache->in_percent = q->capacity == 0 ? 0 : q->in_target * 100 / q->capacity;
+	cache->ghost_percent = q->capacity == 0 ? 0 : q->ghost_size * 100 / q->capacity;
+	cache->hits = stats.hits;
+	cache->misses = stats.misses;
+	cache->evictions = stats.evictions;
+	cache->promotions = stats.promotions;
+	cache->ghost_hits = stats.ghost_hits;
+	cache->resident = stats.resident[0] + stats.resident[1];
+
+	return 0;
+}
+
+void pcache_get_stats(struct pcache_stats *stats) {
+	if (stats == NULL) {
+		return;
+	}
+
+	stats->hits = ARC_ATOMIC_LOAD(pcache_stats.hits);
+	stats->processor_hits = ARC_ATOMIC_LOAD(pcache_stats.processor_hits);
+	stats->misses = ARC_ATOMIC_LOAD(pcache_stats.misses);
+	stats->evictions = ARC_ATOMIC_LOAD(pcache_stats.evictions);
+	stats->pages = ARC_ATOMIC_LOAD(pcache_stats.pages);
+	stats->dirty = ARC_ATOMIC_LOAD(pcache_stats.dirty);
+	stats->written_back = ARC_ATOMIC_LOAD(pcache_stats.written_back);
+}
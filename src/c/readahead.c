@@ -0,0 +1,90 @@
+/**
+ * @file readahead.c
+ *
+ * @author awewsomegamer <awewsomegamer@gmail.com>
+ *
+ * @LICENSE
+ * Arctan-OS/Kernel - Operating System Kernel
+ * Copyright (C) 2023-2025 awewsomegamer
+ *
+ * This file is part of Arctan-OS/Kernel.
+ *
+ * Arctan is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * @DESCRIPTION
+ * Sequential read detection. Drivers have no way to learn when a file is
+ * closed, so the state lives in a fixed table hashed by file and a file
+ * which collides with another simply starts over.
+*/
+#include "drivers/readahead.h"
+#include "global.h"
+#include "lib/atomics.h"
+#include "lib/util.h"
+
+#define READAHEAD_SLOTS 256
+#define READAHEAD_MIN_WINDOW (16 * 1024)
+#define READAHEAD_MAX_WINDOW (512 * 1024)
+
+struct readahead_slot {
+	ARC_GenericSpinlock lock;
+	struct ARC_File *file;
+	uint64_t next; // Offset a sequential read starts at
+	uint64_t ahead; // End of what has been handed out for prefetching
+	uint64_t window; // 0 while access is random
+};
+
+static struct readahead_slot readahead_slots[READAHEAD_SLOTS] = { 0 };
+
+int readahead_advance(struct ARC_File *file, uint64_t offset, size_t size, struct readahead_window *window) {
+	if (file == NULL || window == NULL || size == 0) {
+		return 0;
+	}
+
+	uint64_t hash = ((uintptr_t)file >> 4) * 0x9E3779B97F4A7C15ULL;
+	struct readahead_slot *slot = &readahead_slots[hash >> 56];
+
+	uint64_t end = offset + size;
+	int ret = 0;
+
+	spinlock_lock(&slot->lock);
+
+	if (slot->file != file) {
+		slot->file = file;
+		slot->next = 0;
+		slot->ahead = 0;
+		slot->window = 0;
+	}
+
+	if (offset != slot->next) {
+		// Random access, wait for the reader to settle into a stream again
+		slot->window = 0;
+		slot->ahead = end;
+	} else if (slot->ahead < end || slot->ahead - end < slot->window / 2) {
+		slot->window = slot->window == 0 ? READAHEAD_MIN_WINDOW : min(slot->window * 2, (uint64_t)READAHEAD_MAX_WINDOW);
+
+		uint64_t from = max(slot->ahead, end);
+
+		window->offset = from;
+		window->size = end + slot->window - from;
+		slot->ahead = end + slot->window;
+
+		ret = 1;
+	}
+
+	slot->next = end;
+
+	spinlock_unlock(&slot->lock);
+
+	return ret;
+}
@@ -0,0 +1,238 @@
+/**
+ * @file sparse.c
+ *
+ * @author awewsomegamer <awewsomegamer@gmail.com>
+ *
+ * @LICENSE
+ * Arctan-OS/Kernel - Operating System Kernel
+ * Copyright (C) 2023-2025 awewsomegamer
+ *
+ * This file is part of Arctan-OS/Kernel.
+ *
+ * Arctan is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * @DESCRIPTION
+ * Lazily allocated memory for RAM files and RAM disks.
+*/
+#include "drivers/sparse.h"
+#include "global.h"
+#include "lib/atomics.h"
+#include "lib/util.h"
+#include "mm/allocator.h"
+#include "mm/pmm.h"
+
+#define SPARSE_FANOUT (PAGE_SIZE / sizeof(void *))
+
+static const uint8_t sparse_zero_page[PAGE_SIZE] = { 0 };
+
+static void *sparse_alloc_page() {
+	void *page = pmm_fast_page_alloc();
+
+	if (page != NULL) {
+		memset(page, 0, PAGE_SIZE);
+	}
+
+	return page;
+}
+
+// Number of pages a tree of the given height covers
+static uint64_t sparse_span(int height) {
+	uint64_t span = 1;
+
+	for (int i = 0; i < height && span <= UINT64_MAX / SPARSE_FANOUT; i++) {
+		span *= SPARSE_FANOUT;
+	}
+
+	return span;
+}
+
+// Find the page at index, call with the lock held. With create, missing
+// nodes and the page are allocated, NULL is only returned if memory ran
+// out.
+static uint8_t *sparse_page(struct sparse *store, uint64_t index, bool create) {
+	if (store->root == NULL || index >= sparse_span(store->height)) {
+		if (!create) {
+			return NULL;
+		}
+
+		// Add levels on top, the old tree becomes the first slot
+		while (store->root == NULL || index >= sparse_span(store->height)) {
+			void **node = sparse_alloc_page();
+
+			if (node == NULL) {
+				return NULL;
+			}
+
+			node[0] = store->root;
+			store->root = node;
+			store->height++;
+		}
+	}
+
+	void **slot = &store->root;
+
+	for (int level = store->height; level > 0; level--) {
+		void **node = *slot;
+		uint64_t span = sparse_span(level - 1);
+
+		slot = &node[(index / span) % SPARSE_FANOUT];
+
+		if (*slot == NULL) {
+			if (!create || (*slot = sparse_alloc_page()) == NULL) {
+				return NULL;
+			}
+
+			if (level == 1) {
+				store->pages++;
+			}
+		}
+	}
+
+	return *slot;
+}
+
+static void sparse_free_node(void *node, int height) {
+	if (node == NULL) {
+		return;
+	}
+
+	if (height > 0) {
+		void **slots = node;
+
+		for (size_t i = 0; i < SPARSE_FANOUT; i++) {
+			sparse_free_node(slots[i], height - 1);
+		}
+	}
+
+	pmm_fast_page_free(node);
+}
+
+int init_sparse(struct sparse *store) {
+	if (store == NULL) {
+		return -1;
+	}
+
+	memset(store, 0, sizeof(*store));
+	init_static_spinlock(&store->lock);
+
+	return 0;
+}
+
+void uninit_sparse(struct sparse *store) {
+	if (store == NULL) {
+		return;
+	}
+
+	sparse_free_node(store->root, store->height);
+	store->root = NULL;
+	store->height = 0;
+	store->pages = 0;
+}
+
+size_t sparse_read(struct sparse *store, uint64_t offset, size_t size, void *buffer) {
+	if (store == NULL || buffer == NULL) {
+		return 0;
+	}
+
+	size_t done = 0;
+
+	while (done < size) {
+		size_t skew = (offset + done) % PAGE_SIZE;
+		size_t part = min(PAGE_SIZE - skew, size - done);
+
+		spinlock_lock(&store->lock);
+
+		const uint8_t *page = sparse_page(store, (offset + done) / PAGE_SIZE, false);
+		memcpy(buffer + done, (page == NULL ? sparse_zero_page : page) + skew, part);
+
+		spinlock_unlock(&store->lock);
+
+		done += part;
+	}
+
+	return done;
+}
+
+size_t sparse_write(struct sparse *store, uint64_t offset, size_t size, void *buffer) {
+	if (store == NULL || buffer == NULL) {
+		return 0;
+	}
+
+	size_t done = 0;
+
+	while (done < size) {
+		size_t skew = (offset + done) % PAGE_SIZE;
+		size_t part = min(PAGE_SIZE - skew, size - done);
+
+		spinlock_lock(&store->lock);
+
+		uint8_t *page = sparse_page(store, (offset + done) / PAGE_SIZE, true);
+
+		if (page != NULL) {
+			memcpy(page + skew, buffer + done, part);
+		}
+
+		spinlock_unlock(&store->lock);
+
+		if (page == NULL) {
+			ARC_DEBUG(ERR, "Failed to allocate page\n");
+			break;
+		}
+
+		done += part;
+	}
+
+	return done;
+}
+
+void sparse_discard(struct sparse *store, uint64_t offset, uint64_t size) {
+	if (store == NULL) {
+		return;
+	}
+
+	uint64_t done = 0;
+
+	while (done < size) {
+		uint64_t index = (offset + done) / PAGE_SIZE;
+		size_t skew = (offset + done) % PAGE_SIZE;
+		size_t part = min(PAGE_SIZE - skew, size - done);
+
+		spinlock_lock(&store->lock);
+
+		if (part == PAGE_SIZE) {
+			// Take the page out of its leaf node, the nodes are kept
+			void **slot = store->root == NULL || index >= sparse_span(store->height) ? NULL : &store->root;
+
+			for (int level = store->height; slot != NULL && *slot != NULL && level > 0; level--) {
+				slot = &((void **)*slot)[(index / sparse_span(level - 1)) % SPARSE_FANOUT];
+			}
+
+			if (slot != NULL && *slot != NULL) {
+				pmm_fast_page_free(*slot);
+				*slot = NULL;
+				store->pages--;
+			}
+		} else {
+			uint8_t *page = sparse_page(store, index, false);
+
+			if (page != NULL) {
+				memset(page + skew, 0, part);
+			}
+		}
+
+		spinlock_unlock(&store->lock);
+
+		done += part;
+	}
+}
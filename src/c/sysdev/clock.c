@@ -0,0 +1,115 @@
+/**
+ * @file clock.c
+ *
+ * @author awewsomegamer <awewsomegamer@gmail.com>
+ *
+ * @LICENSE
+ * Arctan-OS/Kernel - Operating System Kernel
+ * Copyright (C) 2023-2025 awewsomegamer
+ *
+ * This file is part of Arctan-OS/Kernel.
+ *
+ * Arctan is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * @DESCRIPTION
+ * TSC based clock and bounded waits for drivers which poll hardware.
+*/
+#include "arch/io/port.h"
+#include "drivers/sysdev/clock.h"
+#include "global.h"
+#include "lib/atomics.h"
+#include "lib/util.h"
+
+#define PIT_FREQUENCY 1193182
+#define PIT_CALIBRATION_MS 10
+#define BACKOFF_MAX_SPINS 0x4000
+// Used until calibration, high so that waits run long rather than short
+#define FALLBACK_TSC_PER_MS 5000000
+
+static uint64_t tsc_per_ms = 0;
+static ARC_GenericSpinlock clock_lock = { 0 };
+
+static void clock_calibrate() {
+	// Gate PIT channel 2 with the speaker disconnected
+	uint8_t gate = inb(0x61);
+	outb(0x61, (gate & ~0x02) | 0x01);
+
+	// Channel 2, lobyte/hibyte, mode 0 (interrupt on terminal count)
+	uint16_t count = (PIT_FREQUENCY * PIT_CALIBRATION_MS) / 1000;
+	outb(0x43, 0xB0);
+	outb(0x42, count & 0xFF);
+	outb(0x42, (count >> 8) & 0xFF);
+
+	// Restart the count
+	uint8_t v = inb(0x61) & ~0x01;
+	outb(0x61, v);
+	outb(0x61, v | 0x01);
+
+	uint64_t start = __builtin_ia32_rdtsc();
+	while ((inb(0x61) & 0x20) == 0) {
+		__builtin_ia32_pause();
+	}
+	uint64_t end = __builtin_ia32_rdtsc();
+
+	outb(0x61, gate);
+
+	ARC_ATOMIC_STORE(tsc_per_ms, max((end - start) / PIT_CALIBRATION_MS, (uint64_t)1));
+
+	ARC_DEBUG(INFO, "Calibrated TSC at %lu ticks/ms\n", tsc_per_ms);
+}
+
+int init_clock() {
+	// PIT channel 2 can only serve one calibration at a time
+	spinlock_lock(&clock_lock);
+
+	if (ARC_ATOMIC_LOAD(tsc_per_ms) == 0) {
+		clock_calibrate();
+	}
+
+	spinlock_unlock(&clock_lock);
+
+	return 0;
+}
+
+uint64_t clock_ns() {
+	uint64_t per_ms = ARC_ATOMIC_LOAD(tsc_per_ms);
+
+	if (per_ms == 0) {
+		per_ms = FALLBACK_TSC_PER_MS;
+	}
+
+	uint64_t tsc = __builtin_ia32_rdtsc();
+
+	// Split to avoid overflowing the multiplication
+	return (tsc / per_ms) * CLOCK_NS_PER_MS + ((tsc % per_ms) * CLOCK_NS_PER_MS) / per_ms;
+}
+
+void clock_wait_init(struct clock_wait *wait, uint64_t timeout_ns) {
+	wait->deadline = clock_ns() + timeout_ns;
+	wait->spins = 1;
+}
+
+int clock_wait_step(struct clock_wait *wait) {
+	if (clock_ns() >= wait->deadline) {
+		return 1;
+	}
+
+	for (uint32_t i = 0; i < wait->spins; i++) {
+		__builtin_ia32_pause();
+	}
+
+	wait->spins = min(wait->spins << 1, (uint32_t)BACKOFF_MAX_SPINS);
+
+	return 0;
+}
@@ -0,0 +1,694 @@
+/**
+ * @file mirror.c
+ *
+ * @author awewsomegamer <awewsomegamer@gmail.com>
+ *
+ * @LICENSE
+ * Arctan-OS/Kernel - Operating System Kernel
+ * Copyright (C) 2023-2025 awewsomegamer
+ *
+ * This file is part of Arctan-OS/Kernel.
+ *
+ * Arctan is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * @DESCRIPTION
+ * Block level mirroring (RAID1) over registered block devices.
+*/
+#include "drivers/blkdev.h"
+#include "drivers/cntrl_defs.h"
+#include "drivers/dri_defs.h"
+#include "drivers/pcache.h"
+#include "drivers/readahead.h"
+#include "drivers/resource.h"
+#include "drivers/sysdev/mirror.h"
+#include "global.h"
+#include "lib/atomics.h"
+#include "lib/util.h"
+#include "mm/allocator.h"
+
+#define MIRROR_DEFAULT_REGION 0x100000
+
+struct mirror_member {
+	ARC_BlockDevice *dev;
+	uint64_t *dirty; // Regions this member has missed writes to
+	uint64_t dirty_count;
+	uint64_t position; // Block after the last read sent here
+	uint32_t inflight;
+	uint64_t reads;
+};
+
+struct driver_state {
+	ARC_BlockDevice *dev;
+	struct mirror_member members[MIRROR_MAX_MEMBERS];
+	int member_count;
+	uint64_t region_blocks;
+	uint64_t regions;
+	ARC_GenericSpinlock lock; // Guards the bitmaps and the resync state
+	uint64_t resync_region; // Being copied, UINT64_MAX if none
+	bool resync_touched; // The region was written while being copied
+	bool resyncing;
+};
+
+struct mirror_io {
+	struct driver_state *state;
+	struct blkdev_request *req;
+	int pending;
+	int succeeded;
+	uint32_t tried; // Members a read has been sent to
+	int member; // Serving a read
+	struct blkdev_request children[]; // One per member for writes, one for reads
+};
+
+// Call with the lock held
+static bool mirror_dirty_in(struct driver_state *state, struct mirror_member *member, uint64_t lba, uint64_t count) {
+	if (member->dirty_count == 0) {
+		return false;
+	}
+
+	uint64_t last = (lba + max(count, (uint64_t)1) - 1) / state->region_blocks;
+
+	for (uint64_t region = lba / state->region_blocks; region <= last; region++) {
+		if (member->dirty[region / 64] & (1ULL << (region % 64))) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// Mark the regions of a range which member failed to read or write as
+// missing from it. A region is only taken from a member if another one
+// still holds it, the last copy is kept readable however many errors it
+// returns, as an error may well be transient
+static void mirror_mark_dirty(struct driver_state *state, struct mirror_member *member, uint64_t lba, uint64_t count) {
+	uint64_t last = (lba + max(count, (uint64_t)1) - 1) / state->region_blocks;
+
+	spinlock_lock(&state->lock);
+
+	for (uint64_t region = lba / state->region_blocks; region <= last; region++) {
+		uint64_t bit = 1ULL << (region % 64);
+
+		if ((member->dirty[region / 64] & bit) != 0) {
+			continue;
+		}
+
+		bool held = false;
+
+		for (int i = 0; i < state->member_count && !held; i++) {
+			held = &state->members[i] != member && (state->members[i].dirty[region / 64] & bit) == 0;
+		}
+
+		if (held) {
+			member->dirty[region / 64] |= bit;
+			member->dirty_count++;
+		}
+	}
+
+	spinlock_unlock(&state->lock);
+}
+
+// Prefer the member a read continues from, then the least busy one, then
+// the one whose last read was closest
+static int mirror_pick(struct driver_state *state, uint64_t lba, uint64_t count, uint32_t tried) {
+	int best = -1;
+	uint32_t best_inflight = UINT32_MAX;
+	uint64_t best_distance = UINT64_MAX;
+
+	spinlock_lock(&state->lock);
+
+	for (int i = 0; i < state->member_count; i++) {
+		struct mirror_member *member = &state->members[i];
+
+		if ((tried & (1 << i)) != 0 || mirror_dirty_in(state, member, lba, count)) {
+			continue;
+		}
+
+		uint64_t position = ARC_ATOMIC_LOAD(member->position);
+
+		if (position == lba) {
+			best = i;
+			break;
+		}
+
+		uint32_t inflight = ARC_ATOMIC_LOAD(member->inflight);
+		uint64_t distance = position > lba ? position - lba : lba - position;
+
+		if (inflight < best_inflight || (inflight == best_inflight && distance < best_distance)) {
+			best = i;
+			best_inflight = inflight;
+			best_distance = distance;
+		}
+	}
+
+	spinlock_unlock(&state->lock);
+
+	return best;
+}
+
+static void mirror_read_end(struct blkdev_request *child);
+
+static int mirror_read_submit(struct mirror_io *io) {
+	struct driver_state *state = io->state;
+	struct blkdev_request *req = io->req;
+	int i = mirror_pick(state, req->lba, req->count, io->tried);
+
+	if (i < 0) {
+		return -1;
+	}
+
+	struct mirror_member *member = &state->members[i];
+	struct blkdev_request *child = &io->children[0];
+
+	io->tried |= 1 << i;
+	io->member = i;
+
+	ARC_ATOMIC_STORE(member->position, req->lba + req->count);
+	ARC_ATOMIC_INC(member->inflight);
+	ARC_ATOMIC_INC(member->reads);
+
+	// Submitting to a window rewrites the device and block
+	memcpy(child, req, sizeof(*child));
+	child->dev = member->dev;
+	child->end = mirror_read_end;
+	child->priv = io;
+
+	blkdev_submit(child);
+
+	return 0;
+}
+
+static void mirror_read_end(struct blkdev_request *child) {
+	struct mirror_io *io = child->priv;
+	struct driver_state *state = io->state;
+	struct mirror_member *member = &state->members[io->member];
+
+	ARC_ATOMIC_DEC(member->inflight);
+
+	if (child->status == 0) {
+		blkdev_end_request(io->req, 0);
+		free(io);
+
+		return;
+	}
+
+	// Have the region rewritten on the next resync unless this is the
+	// only copy, try another member
+	ARC_DEBUG(ERR, "Read of 0x%"PRIx64"+0x%"PRIx64" failed on %s\n", io->req->lba, io->req->count, member->dev->path);
+	mirror_mark_dirty(state, member, io->req->lba, io->req->count);
+
+	if (mirror_read_submit(io) != 0) {
+		blkdev_end_request(io->req, child->status);
+		free(io);
+	}
+}
+
+// Writes which are submitted or land while a region is copied could be
+// overwritten by the copy, the region is left dirty
+static void mirror_touch(struct driver_state *state, struct blkdev_request *req) {
+	if (req->op == BLKDEV_OP_FLUSH) {
+		return;
+	}
+
+	spinlock_lock(&state->lock);
+
+	uint64_t region = state->resync_region;
+
+	if (region != UINT64_MAX && req->lba < (region + 1) * state->region_blocks
+	    && req->lba + req->count > region * state->region_blocks) {
+		state->resync_touched = true;
+	}
+
+	spinlock_unlock(&state->lock);
+}
+
+static void mirror_put(struct mirror_io *io) {
+	if (ARC_ATOMIC_DEC(io->pending) == 0) {
+		// Written once is enough, the other members catch up on resync
+		blkdev_end_request(io->req, ARC_ATOMIC_LOAD(io->succeeded) > 0 ? 0 : -1);
+		free(io);
+	}
+}
+
+static void mirror_write_end(struct blkdev_request *child) {
+	struct mirror_io *io = child->priv;
+	struct mirror_member *member = &io->state->members[child - io->children];
+
+	ARC_ATOMIC_DEC(member->inflight);
+	mirror_touch(io->state, io->req);
+
+	if (child->status == 0) {
+		ARC_ATOMIC_INC(io->succeeded);
+	} else if (io->req->op != BLKDEV_OP_FLUSH) {
+		ARC_DEBUG(ERR, "Write of 0x%"PRIx64"+0x%"PRIx64" failed on %s\n", io->req->lba, io->req->count, member->dev->path);
+		mirror_mark_dirty(io->state, member, io->req->lba, io->req->count);
+	}
+
+	mirror_put(io);
+}
+
+static int mirror_queue(ARC_BlockDevice *dev, struct blkdev_request *req, int hwq) {
+	(void)hwq;
+
+	struct driver_state *state = dev->priv;
+	bool read = req->op == BLKDEV_OP_READ;
+	int children = read ? 1 : state->member_count;
+	struct mirror_io *io = alloc(sizeof(*io) + children * sizeof(struct blkdev_request));
+
+	if (io == NULL) {
+		ARC_DEBUG(ERR, "Failed to allocate request\n");
+		return -1;
+	}
+
+	memset(io, 0, sizeof(*io));
+	io->state = state;
+	io->req = req;
+
+	if (read) {
+		if (mirror_read_submit(io) != 0) {
+			ARC_DEBUG(ERR, "No member holds 0x%"PRIx64"+0x%"PRIx64"\n", req->lba, req->count);
+			free(io);
+			return -1;
+		}
+
+		return 0;
+	}
+
+	mirror_touch(state, req);
+
+	// Held until every child is submitted, children may end straight away
+	io->pending = 1;
+
+	for (int i = 0; i < children; i++) {
+		struct blkdev_request *child = &io->children[i];
+
+		memcpy(child, req, sizeof(*child));
+		child->dev = state->members[i].dev;
+		child->end = mirror_write_end;
+		child->priv = io;
+
+		ARC_ATOMIC_INC(state->members[i].inflight);
+		ARC_ATOMIC_INC(io->pending);
+		blkdev_submit(child);
+	}
+
+	mirror_put(io);
+
+	return 0;
+}
+
+static int mirror_poll(ARC_BlockDevice *dev, int hwq) {
+	(void)hwq;
+
+	struct driver_state *state = dev->priv;
+
+	for (int i = 0; i < state->member_count; i++) {
+		blkdev_poll(state->members[i].dev);
+	}
+
+	return 0;
+}
+
+static struct blkdev_ops mirror_ops = {
+        .queue = mirror_queue,
+	.poll = mirror_poll,
+};
+
+// Copy one dirty region onto member from a member which has it, the
+// region stays dirty if it is written in the meantime
+static int mirror_resync_region(struct driver_state *state, int target, uint64_t region, uint8_t *buffer) {
+	struct mirror_member *member = &state->members[target];
+	uint64_t lba = region * state->region_blocks;
+	uint64_t count = min(state->region_blocks, state->dev->blocks - lba);
+	int source = -1;
+
+	spinlock_lock(&state->lock);
+
+	for (int i = 0; i < state->member_count && source < 0; i++) {
+		if (i != target && !mirror_dirty_in(state, &state->members[i], lba, count)) {
+			source = i;
+		}
+	}
+
+	state->resync_region = region;
+	state->resync_touched = false;
+
+	spinlock_unlock(&state->lock);
+
+	if (source < 0) {
+		ARC_DEBUG(ERR, "No member holds region %lu\n", region);
+		return -1;
+	}
+
+	int r = blkdev_rw(state->members[source].dev, BLKDEV_OP_READ, lba, count, buffer, 0);
+
+	if (r == 0) {
+		r = blkdev_rw(member->dev, BLKDEV_OP_WRITE, lba, count, buffer, 0);
+	}
+
+	spinlock_lock(&state->lock);
+
+	if (r == 0 && !state->resync_touched) {
+		member->dirty[region / 64] &= ~(1ULL << (region % 64));
+		member->dirty_count--;
+	}
+
+	state->resync_region = UINT64_MAX;
+
+	spinlock_unlock(&state->lock);
+
+	return r;
+}
+
+static int mirror_resync(struct driver_state *state) {
+	spinlock_lock(&state->lock);
+	bool busy = state->resyncing;
+	state->resyncing = true;
+	spinlock_unlock(&state->lock);
+
+	if (busy) {
+		return -1;
+	}
+
+	uint8_t *buffer = alloc(state->region_blocks * state->dev->block_size);
+	int r = 0;
+
+	if (buffer == NULL) {
+		ARC_DEBUG(ERR, "Failed to allocate resync buffer\n");
+		r = -1;
+	}
+
+	for (int i = 0; i < state->member_count && buffer != NULL; i++) {
+		struct mirror_member *member = &state->members[i];
+
+		for (uint64_t region = 0; region < state->regions && ARC_ATOMIC_LOAD(member->dirty_count) > 0; region++) {
+			if ((member->dirty[region / 64] & (1ULL << (region % 64))) == 0) {
+				continue;
+			}
+
+			if (mirror_resync_region(state, i, region, buffer) != 0) {
+				r = -1;
+			}
+		}
+	}
+
+	free(buffer);
+
+	spinlock_lock(&state->lock);
+	state->resyncing = false;
+	spinlock_unlock(&state->lock);
+
+	return r;
+}
+
+static void mirror_free(struct driver_state *state) {
+	for (int i = 0; i < state->member_count; i++) {
+		free(state->members[i].dirty);
+	}
+
+	free(state);
+}
+
+static int init_mirror(struct ARC_Resource *res, void *args) {
+	if (res == NULL || args == NULL) {
+		return -1;
+	}
+
+	struct ARC_DriArgs_Mirror *dri_args = (struct ARC_DriArgs_Mirror *)args;
+
+	if (dri_args->path == NULL || dri_args->members == NULL || dri_args->member_count <= 0 || dri_args->member_count > MIRROR_MAX_MEMBERS) {
+		ARC_DEBUG(ERR, "Improper parameters (%p %p %d)\n", dri_args->path, dri_args->members, dri_args->member_count);
+		return -1;
+	}
+
+	struct driver_state *state = (struct driver_state *)alloc(sizeof(*state));
+
+	if (state == NULL) {
+		return -2;
+	}
+
+	memset(state, 0, sizeof(*state));
+	init_static_spinlock(&state->lock);
+	state->resync_region = UINT64_MAX;
+
+	uint32_t block_size = 0;
+	uint64_t blocks = UINT64_MAX;
+	uint32_t max_blocks = UINT32_MAX;
+	int queue_count = 1;
+	uint32_t queue_depth = 0;
+
+	for (int i = 0; i < dri_args->member_count; i++) {
+		ARC_BlockDevice *member = blkdev_get(dri_args->members[i]);
+
+		if (member == NULL || (block_size != 0 && member->block_size != block_size)) {
+			ARC_DEBUG(ERR, "%s is not a block device or its blocks differ from the other members\n", dri_args->members[i]);
+			mirror_free(state);
+			return -3;
+		}
+
+		state->members[i].dev = member;
+		state->member_count++;
+		block_size = member->block_size;
+		blocks = min(blocks, member->blocks);
+		max_blocks = min(max_blocks, member->max_blocks);
+		queue_count = max(queue_count, member->queue_count);
+		queue_depth += member->queues[0].depth;
+	}
+
+	size_t region_size = dri_args->region_size == 0 ? MIRROR_DEFAULT_REGION : dri_args->region_size;
+
+	if (region_size % block_size != 0) {
+		ARC_DEBUG(ERR, "Region size %lu is not a multiple of the block size %u\n", region_size, block_size);
+		mirror_free(state);
+		return -4;
+	}
+
+	state->region_blocks = region_size / block_size;
+	state->regions = (blocks + state->region_blocks - 1) / state->region_blocks;
+
+	for (int i = 0; i < state->member_count; i++) {
+		size_t size = ALIGN_UP(state->regions, 64) / 8;
+
+		state->members[i].dirty = alloc(size);
+
+		if (state->members[i].dirty == NULL) {
+			ARC_DEBUG(ERR, "Failed to allocate dirty region bitmap\n");
+			mirror_free(state);
+			return -2;
+		}
+
+		memset(state->members[i].dirty, 0, size);
+	}
+
+	struct blkdev_info info = {
+	        .block_size = block_size,
+		.blocks = blocks,
+		.max_blocks = max_blocks,
+		.queue_count = queue_count,
+		.queue_depth = queue_depth,
+		.ops = &mirror_ops,
+		.priv = state,
+        };
+
+	res->driver_state = state;
+	state->dev = blkdev_register(dri_args->path, res, &info);
+
+	if (state->dev == NULL) {
+		ARC_DEBUG(ERR, "Failed to register %s\n", dri_args->path);
+		res->driver_state = NULL;
+		mirror_free(state);
+		return -5;
+	}
+
+	ARC_DEBUG(INFO, "Mirrored %d devices into %s (%lu blocks, %lu regions)\n", state->member_count, dri_args->path, blocks, state->regions);
+
+	return 0;
+}
+
+static int uninit_mirror(struct ARC_Resource *res) {
+	if (res == NULL) {
+		return -1;
+	}
+
+	struct driver_state *state = (struct driver_state *)res->driver_state;
+
+	if (state == NULL) {
+		return -1;
+	}
+
+	pcache_sync(state->dev);
+	blkdev_unregister(res);
+	mirror_free(state);
+
+	return 0;
+};
+
+static size_t read_mirror(void *buffer, size_t size, size_t count, struct ARC_File *file, struct ARC_Resource *res) {
+	if (buffer == NULL || size == 0 || count == 0 || file == NULL || res == NULL) {
+		return 0;
+ 	}
+
+	struct driver_state *state = (struct driver_state *)res->driver_state;
+	struct readahead_window window = { 0 };
+
+	if (readahead_advance(file, file->offset, size * count, &window)) {
+		pcache_prefetch(state->dev, window.offset, window.size, CNTRL_BLK_PRIO_LOW << CNTRL_BLK_RW_PRIO_SHIFT);
+	}
+
+	return blkdev_io(state->dev, false, file->offset, size * count, buffer, 0);
+}
+
+static size_t write_mirror(void *buffer, size_t size, size_t count, struct ARC_File *file, struct ARC_Resource *res) {
+	if (buffer == NULL || size == 0 || count == 0 || file == NULL || res == NULL) {
+		return 0;
+ 	}
+
+	struct driver_state *state = (struct driver_state *)res->driver_state;
+
+	return blkdev_io(state->dev, true, file->offset, size * count, buffer, 0);
+}
+
+static int stat_mirror(struct ARC_Resource *res, char *filename, struct stat *stat) {
+	(void)filename;
+
+	if (res == NULL || stat == NULL) {
+		return -1;
+	}
+
+	struct driver_state *state = (struct driver_state *)res->driver_state;
+
+	stat->st_blksize = state->dev->block_size;
+	stat->st_blocks = state->dev->blocks;
+	stat->st_size = state->dev->blocks * state->dev->block_size;
+
+	return 0;
+}
+
+static ARC_ControlPacketResponse control_mirror(struct ARC_Resource *res, ARC_ControlPacketInstruction *inst) {
+	ARC_ControlPacketResponse resp = { 0 };
+
+	if (res == NULL || inst == NULL) {
+		return resp;
+	}
+
+	struct driver_state *state = (struct driver_state *)res->driver_state;
+
+	switch (inst->command) {
+		case CNTRL_BLK_SYNC: {
+			if (pcache_sync(state->dev) != 0) {
+				return resp;
+			}
+
+			resp.type = inst->command;
+
+			return resp;
+		}
+
+		case CNTRL_BLK_READ:
+		case CNTRL_BLK_WRITE: {
+			struct cntrl_blk_rw *rw = inst->data;
+
+			if (rw == NULL || rw->buffer == NULL) {
+				return resp;
+			}
+
+			resp.size = blkdev_io(state->dev, inst->command == CNTRL_BLK_WRITE, rw->offset, rw->size, rw->buffer, rw->flags);
+			resp.type = inst->command;
+
+			return resp;
+		}
+
+		case CNTRL_BLK_DISCARD: {
+			struct cntrl_blk_ranges *list = inst->data;
+			uint32_t block_size = state->dev->block_size;
+
+			if (list == NULL || (list->count > 0 && list->ranges == NULL)) {
+				return resp;
+			}
+
+			for (size_t i = 0; i < list->count; i++) {
+				struct cntrl_blk_range *range = &list->ranges[i];
+
+				if (range->offset % block_size != 0 || range->size % block_size != 0
+				    || blkdev_discard(state->dev, range->offset / block_size, range->size / block_size) != 0) {
+					return resp;
+				}
+			}
+
+			resp.type = inst->command;
+
+			return resp;
+		}
+
+		case CNTRL_BLK_CACHE_STATS:
+		case CNTRL_BLK_CACHE_TUNE: {
+			if (pcache_control(state->dev, inst->command, inst->data) != 0) {
+				return resp;
+			}
+
+			resp.size = sizeof(struct cntrl_blk_cache);
+			resp.type = inst->command;
+
+			return resp;
+		}
+
+		case MIRROR_CTRL_STATUS: {
+			struct mirror_status *status = inst->data;
+
+			if (status == NULL) {
+				return resp;
+			}
+
+			memset(status, 0, sizeof(*status));
+			status->member_count = state->member_count;
+			status->region_size = state->region_blocks * state->dev->block_size;
+			status->regions = state->regions;
+
+			for (int i = 0; i < state->member_count; i++) {
+				status->dirty_regions[i] = ARC_ATOMIC_LOAD(state->members[i].dirty_count);
+				status->reads[i] = ARC_ATOMIC_LOAD(state->members[i].reads);
+				status->inflight[i] = ARC_ATOMIC_LOAD(state->members[i].inflight);
+			}
+
+			resp.size = sizeof(*status);
+			resp.type = inst->command;
+
+			return resp;
+		}
+
+		case MIRROR_CTRL_RESYNC: {
+			if (mirror_resync(state) != 0) {
+				return resp;
+			}
+
+			resp.type = inst->command;
+
+			return resp;
+		}
+	}
+
+	ARC_DEBUG(ERR, "Unhandled command %d\n", inst->command);
+
+	return resp;
+}
+
+ARC_REGISTER_DRIVER(ARC_DRIGRP_DEV, mirror) = {
+        .init = init_mirror,
+	.uninit = uninit_mirror,
+	.read = read_mirror,
+	.write = write_mirror,
+	.seek = dridefs_int_func_empty,
+	.rename = dridefs_int_func_empty,
+	.stat = stat_mirror,
+	.control = control_mirror,
+};
@@ -1,17 +1,91 @@
 #include "arch/smp.h"
 #include "arch/x86-64/config.h"
 #include "config.h"
+#include "drivers/blkdev.h"
+#include "drivers/cntrl_defs.h"
 #include "drivers/resource.h"
 #include "drivers/dri_defs.h"
+#include "drivers/pcache.h"
+#include "drivers/readahead.h"
+#include "drivers/sysdev/clock.h"
 #include "drivers/sysdev/nvme/nvme.h"
+#include "lib/atomics.h"
 #include "mm/allocator.h"
 #include "mm/pmm.h"
 #include "util.h"
 #include "fs/vfs.h"
 #include <stdint.h>
 
+#define NVME_DSM_MAX_RANGES 256
+#define NVME_WRITE_ZEROES_MAX_LBAS 0x10000
+#define NVME_COPY_MAX_NLB 0x10000
+#define NVME_COPY_MAX_RANGES (PAGE_SIZE / sizeof(nvme_copy_range_t))
+#define NVME_ZONE_REPORT_HEADER 64
+#define NVME_ZONE_DESC_SIZE 64
+// Async commands a namespace keeps in flight, leaving room in the
+// qpairs for synchronous commands
+#define NVME_ASYNC_MAX_INFLIGHT 32
+#define NVME_MAX_NLB 0x10000
+
+typedef struct nvme_dsm_range {
+        uint32_t cattr;
+        uint32_t nlb; // Not zero based
+        uint64_t slba;
+} __attribute__((packed)) nvme_dsm_range_t;
+STATIC_ASSERT(sizeof(nvme_dsm_range_t) == 16, "DSM range size mismatch");
+
+// Source Range Entry, descriptor format 0
+typedef struct nvme_copy_range {
+        uint64_t resv0;
+        uint64_t slba;
+        uint16_t nlb; // Zero based
+        uint16_t resv1;
+        uint32_t resv2;
+        uint32_t eilbrt;
+        uint16_t elbat;
+        uint16_t elbatm;
+} __attribute__((packed)) nvme_copy_range_t;
+STATIC_ASSERT(sizeof(nvme_copy_range_t) == 32, "Copy source range size mismatch");
+
+typedef struct nvme_zone_desc {
+        uint8_t zt;
+        uint8_t zs; // Bits 7:4
+        uint8_t za;
+        uint8_t zai;
+        uint32_t resv0;
+        uint64_t zcap;
+        uint64_t zslba;
+        uint64_t wp;
+        uint8_t resv1[32];
+} __attribute__((packed)) nvme_zone_desc_t;
+STATIC_ASSERT(sizeof(nvme_zone_desc_t) == NVME_ZONE_DESC_SIZE, "Zone descriptor size mismatch");
+
+// Index of the namespace wide buckets in driver_state.qos.buckets, after
+// those of the priority classes
+#define NVME_QOS_NAMESPACE NVME_QOS_CLASSES
+
+typedef struct qos_bucket {
+        uint64_t rate;  // Tokens per second, 0 for no limit
+        uint64_t burst;
+        int64_t tokens; // Negative after a request larger than the burst
+        uint64_t last;  // clock_ns() of the last refill
+} qos_bucket_t;
+
+typedef struct namespace_async {
+        struct namespace_async *next;
+        struct cntrl_blk_async *req;
+        qs_entry_t cmd;
+        qs_wrap_t wrap;
+        void *prp_list;
+        void *meta;
+        size_t size;
+        int class;
+        int status;
+} namespace_async_t;
+
 typedef struct driver_state {
         nvme_driver_state_t *nvm_state;
+        ARC_BlockDevice *dev;
 
         size_t block_size; // The size of block which will be read by the
                            // RW functions (default=PAGE_SIZE)
@@ -22,6 +96,19 @@ typedef struct driver_state {
 
         size_t nsze;
         size_t ncap;
+
+        struct {
+                uint32_t mcl;   // Maximum number of LBAs in one copy command
+                uint16_t mssrl; // Maximum number of LBAs in one source range
+                uint16_t msrc;  // Maximum number of source ranges
+        } copy;
+
+        struct {
+                bool enabled;      // Namespace belongs to the zoned command set
+                uint64_t size;     // Zone size in LBAs
+                uint32_t max_open;   // 0 if there is no limit
+                uint32_t max_active; // 0 if there is no limit
+        } zones;
         
         int namespace;
         int nvm_set;
@@ -29,74 +116,35 @@ typedef struct driver_state {
         int command_set;
         int qpair_base;
         int qpair_count;
-} driver_state_t;
-
-static int nvme_register_io_qpair(nvme_driver_state_t *state, nvme_qpair_t *qpair, uint8_t nvm_set, int irq) {
-        if (state == NULL || qpair == NULL || qpair->cmpq == NULL || qpair->subq == NULL) {
-                ARC_DEBUG(ERR, "Improper parameters (qpair=%p, qpair->cmpq=%p, qpair->subq=%p)\n", qpair, qpair == NULL ? NULL : qpair->cmpq, qpair == NULL ? NULL : qpair->subq);
-		return -1;
-	}
-        
-	qs_entry_t cmd = {
-		.cdw0.opcode = 0x5,
-                .prp.entry1 = ARC_HHDM_TO_PHYS(qpair->cmpq->base),
-		.cdw10 = qpair->id | ((qpair->cmpq->objs - 1) << 16),
-		.cdw11 = 1 | ((irq > 31) << 1) | ((irq & 0xFFFF) << 16),
-		.cdw12 = nvm_set
-        };
-        
-        qs_wrap_t wrap = state->submit(state->transport, NULL, &cmd);
+        int qpair_classes;
 
-        int status = state->poll(state->transport, &wrap, NULL);
-        if (status != 0) {
-                return status | (1 << 16);
-        }
-        
-	cmd.cdw0.opcode = 0x1;
-	cmd.prp.entry1 = ARC_HHDM_TO_PHYS(qpair->subq->base);
-	cmd.cdw10 = qpair->id | ((qpair->subq->objs - 1) << 16);
-	cmd.cdw11 = 1 | (qpair->id << 16);
-        
-        wrap = state->submit(state->transport, NULL, &cmd);
-	status = state->poll(state->transport, &wrap, NULL);
-        
-        if (status != 0) {
-                return status | (2 << 16);
-        }
-        
-        return 0;
-}
+        struct {
+                ARC_GenericSpinlock lock;
+                bool enabled; // Any of the buckets has a limit
+                qos_bucket_t buckets[NVME_QOS_CLASSES + 1][2]; // IOPS, bytes per second
+        } qos;
 
+        struct {
+                ARC_GenericSpinlock lock;
+                namespace_async_t *head; // Commands in flight
+                int count;
+                namespace_async_t *held[NVME_QOS_CLASSES]; // Commands waiting on the QoS limits, oldest first
+        } async;
+} driver_state_t;
 
-static int namespace_get_info(driver_state_t *state) {
-        nvme_driver_state_t *nvm_state = state->nvm_state;
-        
-        uint8_t *data = pmm_fast_page_alloc();
+// Parse the Identify Namespace data fetched by init_nvme on our behalf
+static int namespace_get_info(driver_state_t *state, nvme_namespace_args_t *arg) {
+        uint8_t *data = arg->iden;
 
-        if (data == NULL) {
-                ARC_DEBUG(ERR, "Failed to allocate data buffer\n");
+        if (data == NULL || arg->iden_csi == NULL) {
+                ARC_DEBUG(ERR, "No identify data given\n");
                 return -1;
         }
-
-        qs_entry_t cmd = {
-                .cdw0.opcode = 0x6,
-                .prp.entry1 = ARC_HHDM_TO_PHYS(data),
-                .cdw10 = 0,
-                .cdw11 = (state->command_set & 0xFF) << 24,
-                .nsid = state->namespace
-        };
-        
-        qs_wrap_t wrap = nvm_state->submit(nvm_state->transport, NULL, &cmd);
-        int status = nvm_state->poll(nvm_state->transport, &wrap, NULL);
-
-        if (status != 0) {
-                return status | (1 << 16);
-        }
         
         uint8_t format_idx = MASKED_READ(data[26], 0, 0xF) | (MASKED_READ(data[26], 5, 0b11) << 4);
 	state->meta_follows_lba = MASKED_READ(data[26], 4, 1);
 
-	uint32_t lbaf = *(uint32_t *)&data[128 + format_idx];
+	uint32_t lbaf = *(uint32_t *)&data[128 + format_idx * 4];
 	uint8_t lba_exp = MASKED_READ(lbaf, 16, 0xFF);
 
 	state->lba_size = 1 << lba_exp;
@@ -107,32 +155,140 @@ static int namespace_get_info(driver_state_t *state) {
 	state->nsze = *(uint64_t *)data;
 	state->ncap = *(uint64_t *)&data[8];
 
-        cmd.cdw10 = 0x5;
-        wrap = nvm_state->submit(nvm_state->transport, NULL, &cmd);
-        status = nvm_state->poll(nvm_state->transport, &wrap, NULL);
+	// Copy limits, only meaningful if ONCS.Copy is set
+	// 75:74 MSSRL, 79:76 MCL, 80 MSRC (zero based)
+	state->copy.mssrl = *(uint16_t *)&data[74];
+	state->copy.mcl = *(uint32_t *)&data[76];
+	state->copy.msrc = data[80] + 1;
+
+        data = arg->iden_csi;
+
+        if (state->command_set == NVME_CSI_ZNS) {
+                // 7:4   MAR, 11:8 MOR (zero based, 0xFFFFFFFF for no limit)
+                // 2816  LBA format extensions, 16 bytes each, 7:0 ZSZE
+                state->zones.enabled = true;
+                state->zones.max_active = *(uint32_t *)&data[4] + 1;
+                state->zones.max_open = *(uint32_t *)&data[8] + 1;
+                state->zones.size = *(uint64_t *)&data[2816 + format_idx * 16];
 
-        if (status != 0) {
-                return status | (2 << 16);
+                ARC_DEBUG(INFO, "Zoned namespace %d, zone size %lu LBAs\n", state->namespace, state->zones.size);
         }
         
-        cmd.cdw10 = 0x6;
-        wrap = nvm_state->submit(nvm_state->transport, NULL, &cmd);
-        status = nvm_state->poll(nvm_state->transport, &wrap, NULL);
+        return 0;
+}
+
+static void qos_bucket_init(qos_bucket_t *bucket, uint64_t rate, uint64_t min_burst) {
+        bucket->rate = rate;
+        // Allow a tenth of a second worth of requests to go at once
+        bucket->burst = max(rate / 10, min_burst);
+        bucket->tokens = bucket->burst;
+        bucket->last = clock_ns();
+}
 
-        if (status != 0) {
-                return status | (3 << 16);
+// Nanoseconds until the bucket can give out amount tokens
+static uint64_t qos_bucket_wait(qos_bucket_t *bucket, uint64_t now, uint64_t amount) {
+        if (bucket->rate == 0) {
+                return 0;
         }
-        
-        cmd.cdw10 = 0x8;
-        cmd.cdw11 = 0x0;
-        wrap = nvm_state->submit(nvm_state->transport, NULL, &cmd);
-        status = nvm_state->poll(nvm_state->transport, &wrap, NULL);
 
-        if (status != 0) {
-                return status | (4 << 16);
+        uint64_t elapsed = now - bucket->last;
+
+        if (elapsed >= 1000 * CLOCK_NS_PER_MS) {
+                bucket->tokens = bucket->burst;
+                bucket->last = now;
+        } else {
+                uint64_t add = ((unsigned __int128)elapsed * bucket->rate) / (1000 * CLOCK_NS_PER_MS);
+
+                if (add > 0) {
+                        bucket->tokens = min(bucket->tokens + (int64_t)add, (int64_t)bucket->burst);
+                        // Only advance by the time the tokens took to build
+                        // up, so that fractions are not lost
+                        bucket->last += ((unsigned __int128)add * 1000 * CLOCK_NS_PER_MS) / bucket->rate;
+                }
         }
-        
-        return 0;
+
+        // A request larger than the burst goes once the bucket is full,
+        // and leaves it in debt
+        int64_t need = min(amount, bucket->burst);
+
+        if (bucket->tokens >= need) {
+                return 0;
+        }
+
+        return ((unsigned __int128)(need - bucket->tokens) * 1000 * CLOCK_NS_PER_MS) / bucket->rate + 1;
+}
+
+static void namespace_set_qos(driver_state_t *state, nvme_qos_config_t *config) {
+        spinlock_lock(&state->qos.lock);
+
+        state->qos.enabled = false;
+
+        for (int i = 0; i <= NVME_QOS_CLASSES; i++) {
+                nvme_qos_limit_t *limit = i == NVME_QOS_NAMESPACE ? &config->namespace : &config->classes[i];
+
+                qos_bucket_init(&state->qos.buckets[i][0], limit->iops, 1);
+                qos_bucket_init(&state->qos.buckets[i][1], limit->bps, state->block_size);
+
+                state->qos.enabled |= limit->iops != 0 || limit->bps != 0;
+        }
+
+        spinlock_unlock(&state->qos.lock);
+}
+
+/**
+ * Charge a request to the limits of its class and the namespace.
+ *
+ * Nothing waits here. Requests which the limits do not allow yet are not
+ * charged, the caller holds them back and asks again later. If force is
+ * set the request is charged regardless, and the debt it leaves holds back
+ * the requests after it.
+ *
+ * High priority requests are charged to the namespace buckets but never
+ * wait on them, bulk traffic has to make up for them instead.
+ *
+ * @return true if the request may go now.
+ * */
+static bool namespace_throttle(driver_state_t *state, int class, size_t bytes, bool force) {
+        if (!state->qos.enabled) {
+                return true;
+        }
+
+        spinlock_lock(&state->qos.lock);
+
+        uint64_t now = clock_ns();
+        qos_bucket_t *own = state->qos.buckets[class];
+        qos_bucket_t *ns = state->qos.buckets[NVME_QOS_NAMESPACE];
+
+        uint64_t wait = max(qos_bucket_wait(&own[0], now, 1), qos_bucket_wait(&own[1], now, bytes));
+        uint64_t ns_wait = max(qos_bucket_wait(&ns[0], now, 1), qos_bucket_wait(&ns[1], now, bytes));
+
+        if (class != CNTRL_BLK_PRIO_HIGH) {
+                wait = max(wait, ns_wait);
+        }
+
+        if (wait == 0 || force) {
+                own[0].tokens -= 1;
+                own[1].tokens -= bytes;
+                ns[0].tokens -= 1;
+                ns[1].tokens -= bytes;
+        }
+
+        spinlock_unlock(&state->qos.lock);
+
+        return wait == 0;
+}
+
+static struct blkdev_ops namespace_blk_ops;
+
+// Largest read or write which can go to the controller as one command
+static size_t namespace_max_transfer(driver_state_t *state) {
+        size_t max_size = min((size_t)NVME_MAX_NLB * state->lba_size, (1 + PAGE_SIZE / sizeof(uint64_t)) * PAGE_SIZE);
+
+        if (state->nvm_state->ctrl_iden.max_transfer_size != 0) {
+                max_size = min(max_size, (size_t)PAGE_SIZE << state->nvm_state->ctrl_iden.max_transfer_size);
+        }
+
+        return max_size;
 }
 
 static int init_nvme_namespace(ARC_Resource *res, void *_arg) {
@@ -145,56 +301,104 @@ static int init_nvme_namespace(ARC_Resource *res, void *_arg) {
                 return -1;
         }
 
+        memset(state, 0, sizeof(*state));
         state->block_size = PAGE_SIZE;
         
         state->nvm_state = arg->state;        
         state->namespace = arg->namespace;
         state->command_set = arg->command_set;
 
-        state->qpair_base = arg->state->qpairs.init;
-        int q_count = min(Arc_ProcessorCounter, arg->state->qpairs.granted);
-        state->qpair_count = q_count;
-        arg->state->qpairs.init += q_count;
+        // The qpairs were created and registered by init_nvme
+        state->qpair_base = arg->qpair_base;
+        state->qpair_count = arg->qpair_count;
+        state->qpair_classes = arg->qpair_classes;
 
-        int r = namespace_get_info(state);
+        init_static_spinlock(&state->qos.lock);
+        init_static_spinlock(&state->async.lock);
+
+        if (arg->qos != NULL) {
+                namespace_set_qos(state, arg->qos);
+        }
+
+        int r = namespace_get_info(state, arg);
         if (r != 0) {
                 ARC_DEBUG(ERR, "Failed to get information about namespace (r=%04X)\n", r);
+                free(state);
                 return -2;
         }
 
-        for (int i = state->qpair_base; i < state->qpair_base + q_count; i++) {
-                nvme_qpair_t *qpair = &arg->state->qpairs.qs[i];
-                int irq = 0;
-                ARC_DEBUG(INFO, "Registering io qpair %d {%p} (%d, %d)\n", i, qpair, arg->command_set, irq);
-             
-                int r = nvme_register_io_qpair(arg->state, qpair, state->nvm_set, irq);
-                if (r != 0) {
-                        ARC_DEBUG(ERR, "Failed to register io qpair (r=%04X)\n", r);
-                        ARC_DEBUG(WARN, "Figure out what to do\n");
-                }
-        }
-        
         res->driver_state = state;
 
+        struct blkdev_info info = {
+                .block_size = state->lba_size,
+                .blocks = state->nsze,
+                .max_blocks = namespace_max_transfer(state) / state->lba_size,
+                .queue_count = state->qpair_count,
+                .queue_depth = max(NVME_ASYNC_MAX_INFLIGHT / state->qpair_count, 1),
+                .ops = &namespace_blk_ops,
+        };
+
         char path[64] = { 0 };
         sprintf(path, "/dev/nvme%dn%d", state->nvm_state->ctrl_iden.id, state->namespace);
         vfs_create(path, S_IFDIR | ARC_STD_PERM, res);
+        state->dev = blkdev_register(path, res, &info);
         
         return 0;
 }
 
 int uninit_nvme_namespace(ARC_Resource *resource) {
-        (void)resource;
+        blkdev_unregister(resource);
         return 0;
 }
 
-static int namespace_rw_page(bool write, driver_state_t *state, uint64_t bstart, void **data) {
-        if (*data == NULL) {
-                *data = pmm_alloc(state->block_size);
-                memset(*data, 0, PAGE_SIZE);        
+static int namespace_flags_class(uint32_t flags) {
+        int class = MASKED_READ(flags, CNTRL_BLK_RW_PRIO_SHIFT, 0b11);
+
+        if (class >= NVME_QOS_CLASSES) {
+                class = CNTRL_BLK_PRIO_NORMAL;
         }
-        
-        // TODO: Attempt to read/write cache
+
+        return class;
+}
+
+// Classes without qpairs of their own share those of the normal class
+static nvme_qpair_t *namespace_get_qpair(driver_state_t *state, int class) {
+        if (class >= state->qpair_classes) {
+                class = CNTRL_BLK_PRIO_NORMAL;
+        }
+
+        int idx = state->qpair_base + class * state->qpair_count + smp_get_processor_id() % state->qpair_count;
+
+        return &state->nvm_state->qpairs.qs[idx];
+}
+
+static int namespace_submit(driver_state_t *state, qs_entry_t *cmd, qc_entry_t *ret, int class) {
+        nvme_driver_state_t *nvm_state = state->nvm_state;
+        nvme_qpair_t *qpair = namespace_get_qpair(state, class);
+
+        cmd->nsid = state->namespace;
+
+        qs_wrap_t wrap = nvm_state->submit(nvm_state->transport, qpair, cmd);
+        int status = nvm_state->poll(nvm_state->transport, &wrap, ret);
+
+        if (status == NVME_STATUS_TIMEOUT) {
+                // The command is not retried, it may have partially
+                // executed (i.e. a zone append landing twice)
+                nvme_recover(nvm_state, qpair);
+        }
+
+        return status;
+}
+
+static int namespace_io_command(driver_state_t *state, qs_entry_t *cmd, qc_entry_t *ret) {
+        return namespace_submit(state, cmd, ret, CNTRL_BLK_PRIO_NORMAL);
+}
+
+// Move nlb LBAs starting at slba, the data must fit in the single page
+// described by PRP1
+// Reads and writes through the file interface go through the page cache,
+// these functions always go to the controller
+static int namespace_rw_lbas(bool write, driver_state_t *state, uint64_t slba, size_t nlb, void *data, uint32_t flags) {
         
         void *meta = pmm_fast_page_alloc();
 
@@ -202,49 +406,75 @@ static int namespace_rw_page(bool write, driver_state_t *state, uint64_t bstart,
         //       What if we should use a larger data size?
         qs_entry_t cmd = {
                 .cdw0.opcode = write ? 0x1 : 0x2,
-                .prp.entry1 = ARC_HHDM_TO_PHYS(*data),
+                .prp.entry1 = ARC_HHDM_TO_PHYS(data),
                 .mptr = ARC_HHDM_TO_PHYS(meta),
-                .cdw12 = (PAGE_SIZE / state->lba_size) - 1,
-                .cdw10 = bstart & UINT32_MAX,
-                .cdw11 = bstart >> 32,
+                .cdw12 = nlb - 1,
+                .cdw10 = slba & UINT32_MAX,
+                .cdw11 = slba >> 32,
                 .nsid = state->namespace,
         };
 
-        nvme_qpair_t *qpair = &state->nvm_state->qpairs.qs[smp_get_processor_id() + state->qpair_base];
-        
-        nvme_driver_state_t *nvm_state = state->nvm_state;
-        qs_wrap_t wrap = nvm_state->submit(nvm_state->transport, qpair, &cmd);
-        int status = nvm_state->poll(nvm_state->transport, &wrap, NULL);
+        // CDW12.FUA, only meaningful for writes
+        if (write && (flags & CNTRL_BLK_RW_FUA)) {
+                cmd.cdw12 |= 1 << 30;
+        }
+
+        int class = namespace_flags_class(flags);
+
+        // There is nothing to yield to while a synchronous command waits,
+        // it goes straight away and its debt holds back queued commands
+        namespace_throttle(state, class, nlb * state->lba_size, true);
+
+        int status = namespace_submit(state, &cmd, NULL, class);
         
         pmm_fast_page_free(meta);
         
         return status;
 }
 
-static size_t read_nvme_namespace(void *buffer, size_t size, size_t count, ARC_File *file, ARC_Resource *res) {
-        driver_state_t *state = res->driver_state;
-        
+static int namespace_flush(driver_state_t *state) {
+        nvme_driver_state_t *nvm_state = state->nvm_state;
+
+        if (!nvm_state->ctrl_iden.vwc) {
+                // Nothing is held in a volatile cache, every completed
+                // write is already on media
+                return 0;
+        }
+
+        qs_entry_t cmd = {
+                .cdw0.opcode = 0x0,
+        };
+
+        return namespace_io_command(state, &cmd, NULL);
+}
+
+static size_t namespace_read(driver_state_t *state, void *buffer, uint64_t offset, size_t size, uint32_t flags) {
         size_t read = 0;        
-        void *page = NULL;
+        void *page = pmm_alloc(state->block_size);
+
+        if (page == NULL) {
+                ARC_DEBUG(ERR, "Failed to allocate bounce page\n");
+                return 0;
+        }
+
+        size_t max_lbas = state->block_size / state->lba_size;
         
-        while (read < size * count) {
-                size_t read_offset = ALIGN_DOWN(file->offset + read, state->lba_size);
-                size_t page_offset = read + file->offset - read_offset;
-                size_t to_read = min(state->block_size, (size * count) - read);
-                
-                if (page_offset > 0) {
-                        to_read = state->block_size - (file->offset - read_offset);
-                        to_read = min(to_read, size * count);
-                }
-                
-                int lba =  read_offset / state->lba_size;
+        while (read < size) {
+                uint64_t lba = (offset + read) / state->lba_size;
+                size_t lba_offset = (offset + read) % state->lba_size;
+
+                // Only read the LBAs which the request touches
+                size_t nlb = ALIGN_UP(lba_offset + size - read, state->lba_size) / state->lba_size;
+                nlb = min(nlb, max_lbas);
+
+                size_t to_read = min(nlb * state->lba_size - lba_offset, size - read);
                 
-                if (namespace_rw_page(false, state, lba, &page) != 0) {
-                        ARC_DEBUG(ERR, "Failed to read lba=%d for %lu bytes\n", lba, to_read);
+                if (namespace_rw_lbas(false, state, lba, nlb, page, flags) != 0) {
+                        ARC_DEBUG(ERR, "Failed to read lba=%lu for %lu bytes\n", lba, to_read);
                         break;
                 }
                 
-                memcpy(buffer + read, page + page_offset, to_read);
+                memcpy(buffer + read, page + lba_offset, to_read);
 
                 read += to_read;
         }
@@ -254,33 +484,41 @@ static size_t read_nvme_namespace(void *buffer, size_t size, size_t count, ARC_F
         return read;
 }
 
-static size_t write_nvme_namespace(void *buffer, size_t size, size_t count, ARC_File *file, ARC_Resource *res) {
-        driver_state_t *state = res->driver_state;
-        
+// Writes are issued at LBA granularity, only a fragment which covers part
+// of an LBA has to be read back and patched
+static size_t namespace_write(driver_state_t *state, void *buffer, uint64_t offset, size_t size, uint32_t flags) {
         size_t written = 0;
-        void *page = NULL;
+        void *page = pmm_alloc(state->block_size);
 
-        while (written < size * count) {
-                size_t write_offset = ALIGN_DOWN(file->offset + written, state->lba_size);
-                size_t page_offset = written + file->offset - write_offset;
-                size_t to_write = min(state->block_size, (size * count) - written);
-                
-                if (page_offset > 0) {
-                        to_write = state->block_size - (file->offset - write_offset);
-                        to_write = min(to_write, size * count);
-                }
-                
-                int lba =  write_offset / state->lba_size;
+        if (page == NULL) {
+                ARC_DEBUG(ERR, "Failed to allocate bounce page\n");
+                return 0;
+        }
 
-                if (to_write < PAGE_SIZE && namespace_rw_page(false, state, lba, &page) != 0) {
-                        ARC_DEBUG(ERR, "Failed to read lba=%d for %lu bytes\n", lba, to_write);
-                        break;
+        size_t max_lbas = state->block_size / state->lba_size;
+
+        while (written < size) {
+                uint64_t lba = (offset + written) / state->lba_size;
+                size_t lba_offset = (offset + written) % state->lba_size;
+                size_t nlb = 1;
+                size_t to_write = 0;
+
+                if (lba_offset != 0 || size - written < state->lba_size) {
+                        to_write = min(state->lba_size - lba_offset, size - written);
+
+                        if (namespace_rw_lbas(false, state, lba, 1, page, flags & ~CNTRL_BLK_RW_FUA) != 0) {
+                                ARC_DEBUG(ERR, "Failed to read lba=%lu for %lu bytes\n", lba, to_write);
+                                break;
+                        }
+                } else {
+                        nlb = min((size - written) / state->lba_size, max_lbas);
+                        to_write = nlb * state->lba_size;
                 }
                 
-                memcpy(page + page_offset, buffer + written, to_write);
+                memcpy(page + lba_offset, buffer + written, to_write);
                 
-                if (namespace_rw_page(true, state, lba, &page) != 0) {
-                        ARC_DEBUG(ERR, "Failed to write lba=%d for %lu bytes\n", lba, to_write);
+                if (namespace_rw_lbas(true, state, lba, nlb, page, flags) != 0) {
+                        ARC_DEBUG(ERR, "Failed to write lba=%lu for %lu bytes\n", lba, to_write);
                         break;
                 }
                 
@@ -292,23 +530,1050 @@ static size_t write_nvme_namespace(void *buffer, size_t size, size_t count, ARC_
         return written;
 }
 
-static int stat_nvme_namespace(ARC_Resource *res, char *filename, struct stat *stat) {
-	(void)res;
-	(void)filename;
-	(void)stat;
+static int namespace_dsm_deallocate(driver_state_t *state, nvme_dsm_range_t *ranges, int count) {
+        qs_entry_t cmd = {
+                .cdw0.opcode = 0x9,
+                .prp.entry1 = ARC_HHDM_TO_PHYS(ranges),
+                .cdw10 = count - 1,
+                .cdw11 = 1 << 2, // Attribute - Deallocate
+        };
 
-        if (res == NULL || stat == NULL) {
+        return namespace_io_command(state, &cmd, NULL);
+}
+
+static int namespace_discard(driver_state_t *state, struct cntrl_blk_ranges *list) {
+        if (MASKED_READ(state->nvm_state->ctrl_iden.oncs, 2, 1) == 0) {
+                ARC_DEBUG(ERR, "Controller does not support Dataset Management\n");
                 return -1;
         }
 
-        driver_state_t *state = res->driver_state;
+        nvme_dsm_range_t *ranges = pmm_fast_page_alloc();
+
+        if (ranges == NULL) {
+                ARC_DEBUG(ERR, "Failed to allocate range list\n");
+                return -2;
+        }
+
+        memset(ranges, 0, PAGE_SIZE);
+
+        int count = 0;
+        int status = 0;
+
+        for (size_t i = 0; i < list->count && status == 0; i++) {
+                // Deallocation is only a hint, so only the LBAs which lie
+                // entirely within the range are given to the controller
+                uint64_t slba = ALIGN_UP(list->ranges[i].offset, state->lba_size) / state->lba_size;
+                uint64_t elba = ALIGN_DOWN(list->ranges[i].offset + list->ranges[i].size, state->lba_size) / state->lba_size;
+                elba = min(elba, (uint64_t)state->nsze);
+
+                while (slba < elba) {
+                        uint32_t nlb = min(elba - slba, (uint64_t)UINT32_MAX);
+
+                        ranges[count].nlb = nlb;
+                        ranges[count].slba = slba;
+                        count++;
+                        slba += nlb;
+
+                        if (count == NVME_DSM_MAX_RANGES) {
+                                status = namespace_dsm_deallocate(state, ranges, count);
+                                count = 0;
+
+                                if (status != 0) {
+                                        break;
+                                }
+                        }
+                }
+        }
+
+        if (count > 0 && status == 0) {
+                status = namespace_dsm_deallocate(state, ranges, count);
+        }
+
+        pmm_fast_page_free(ranges);
+
+        return status;
+}
+
+static int namespace_write_zeroes_fallback(driver_state_t *state, uint64_t offset, uint64_t size) {
+        void *zero = pmm_fast_page_alloc();
+
+        if (zero == NULL) {
+                return -1;
+        }
+
+        memset(zero, 0, PAGE_SIZE);
+
+        uint64_t written = 0;
+
+        while (written < size) {
+                size_t to_write = min(size - written, (uint64_t)PAGE_SIZE);
+
+                if (namespace_write(state, zero, offset + written, to_write, 0) != to_write) {
+                        break;
+                }
+
+                written += to_write;
+        }
+
+        pmm_fast_page_free(zero);
+
+        return written == size ? 0 : -2;
+}
+
+static int namespace_zero_range(driver_state_t *state, struct cntrl_blk_ranges *list) {
+        bool offload = MASKED_READ(state->nvm_state->ctrl_iden.oncs, 3, 1);
+
+        for (size_t i = 0; i < list->count; i++) {
+                uint64_t start = list->ranges[i].offset;
+                uint64_t end = start + list->ranges[i].size;
+
+                if (!offload) {
+                        if (namespace_write_zeroes_fallback(state, start, end - start) != 0) {
+                                return -1;
+                        }
+
+                        continue;
+                }
+
+                uint64_t aligned_start = ALIGN_UP(start, state->lba_size);
+                uint64_t aligned_end = ALIGN_DOWN(end, state->lba_size);
+
+                if (aligned_start >= aligned_end) {
+                        // Range does not cover a single whole LBA
+                        if (namespace_write_zeroes_fallback(state, start, end - start) != 0) {
+                                return -1;
+                        }
+
+                        continue;
+                }
+
+                if (namespace_write_zeroes_fallback(state, start, aligned_start - start) != 0
+                    || namespace_write_zeroes_fallback(state, aligned_end, end - aligned_end) != 0) {
+                        return -1;
+                }
+
+                uint64_t slba = aligned_start / state->lba_size;
+                uint64_t elba = aligned_end / state->lba_size;
+
+                while (slba < elba) {
+                        uint32_t nlb = min(elba - slba, (uint64_t)NVME_WRITE_ZEROES_MAX_LBAS);
+
+                        qs_entry_t cmd = {
+                                .cdw0.opcode = 0x8,
+                                .cdw10 = slba & UINT32_MAX,
+                                .cdw11 = slba >> 32,
+                                // NLB (zero based) and DEAC, the controller may deallocate
+                                // the blocks as long as they read back as zeroes
+                                .cdw12 = (nlb - 1) | (1 << 25),
+                        };
+
+                        int status = namespace_io_command(state, &cmd, NULL);
+
+                        if (status != 0) {
+                                ARC_DEBUG(ERR, "Failed to write zeroes to slba=%lu (status=%04X)\n", slba, status);
+                                return status;
+                        }
+
+                        slba += nlb;
+                }
+        }
+
+        return 0;
+}
+
+static int namespace_copy_fallback(driver_state_t *state, struct cntrl_blk_copy *copy) {
+        void *bounce = pmm_fast_page_alloc();
+
+        if (bounce == NULL) {
+                return -1;
+        }
+
+        uint64_t dest = copy->dest;
+
+        for (size_t i = 0; i < copy->count; i++) {
+                struct cntrl_blk_range *src = &copy->sources[i];
+
+                for (uint64_t done = 0; done < src->size;) {
+                        size_t size = min(src->size - done, (uint64_t)PAGE_SIZE);
+
+                        if (namespace_read(state, bounce, src->offset + done, size, 0) != size
+                            || namespace_write(state, bounce, dest, size, 0) != size) {
+                                pmm_fast_page_free(bounce);
+                                return -2;
+                        }
+
+                        done += size;
+                        dest += size;
+                }
+        }
+
+        pmm_fast_page_free(bounce);
 
-        stat->st_blksize = state->lba_size;
-        stat->st_size = state->nsze;
-        
         return 0;
 }
 
+static int namespace_copy_submit(driver_state_t *state, nvme_copy_range_t *ranges, int count, uint64_t sdlba) {
+        qs_entry_t cmd = {
+                .cdw0.opcode = 0x19,
+                .prp.entry1 = ARC_HHDM_TO_PHYS(ranges),
+                .cdw10 = sdlba & UINT32_MAX,
+                .cdw11 = sdlba >> 32,
+                .cdw12 = (count - 1) & 0xFF, // NR, descriptor format 0
+        };
+
+        return namespace_io_command(state, &cmd, NULL);
+}
+
+static int namespace_copy(driver_state_t *state, struct cntrl_blk_copy *copy) {
+        bool aligned = (copy->dest % state->lba_size) == 0;
+
+        for (size_t i = 0; i < copy->count && aligned; i++) {
+                aligned = (copy->sources[i].offset % state->lba_size) == 0
+                        && (copy->sources[i].size % state->lba_size) == 0;
+        }
+
+        if (MASKED_READ(state->nvm_state->ctrl_iden.oncs, 8, 1) == 0 || !aligned) {
+                return namespace_copy_fallback(state, copy);
+        }
+
+        nvme_copy_range_t *ranges = pmm_fast_page_alloc();
+
+        if (ranges == NULL) {
+                return -1;
+        }
+
+        memset(ranges, 0, PAGE_SIZE);
+
+        size_t max_ranges = min((size_t)state->copy.msrc, NVME_COPY_MAX_RANGES);
+        uint64_t max_range_nlb = state->copy.mssrl == 0 ? NVME_COPY_MAX_NLB : min((uint64_t)state->copy.mssrl, (uint64_t)NVME_COPY_MAX_NLB);
+        uint64_t max_cmd_nlb = state->copy.mcl == 0 ? UINT32_MAX : state->copy.mcl;
+
+        uint64_t sdlba = copy->dest / state->lba_size;
+        uint64_t cmd_nlb = 0;
+        int count = 0;
+        int status = 0;
+
+        for (size_t i = 0; i < copy->count && status == 0; i++) {
+                uint64_t slba = copy->sources[i].offset / state->lba_size;
+                uint64_t elba = slba + copy->sources[i].size / state->lba_size;
+
+                while (slba < elba) {
+                        uint64_t nlb = min(elba - slba, max_range_nlb);
+                        nlb = min(nlb, max_cmd_nlb - cmd_nlb);
+
+                        ranges[count].slba = slba;
+                        ranges[count].nlb = nlb - 1;
+                        count++;
+                        cmd_nlb += nlb;
+                        slba += nlb;
+
+                        if (count == (int)max_ranges || cmd_nlb == max_cmd_nlb) {
+                                status = namespace_copy_submit(state, ranges, count, sdlba);
+                                memset(ranges, 0, PAGE_SIZE);
+                                sdlba += cmd_nlb;
+                                cmd_nlb = 0;
+                                count = 0;
+
+                                if (status != 0) {
+                                        break;
+                                }
+                        }
+                }
+        }
+
+        if (count > 0 && status == 0) {
+                status = namespace_copy_submit(state, ranges, count, sdlba);
+        }
+
+        pmm_fast_page_free(ranges);
+
+        return status;
+}
+
+static int namespace_zone_report(driver_state_t *state, struct cntrl_blk_zone_report *report) {
+        uint8_t *data = pmm_fast_page_alloc();
+
+        if (data == NULL) {
+                return -1;
+        }
+
+        uint64_t slba = report->offset / state->lba_size;
+        size_t filled = 0;
+        int status = 0;
+
+        while (filled < report->count && slba < state->nsze) {
+                qs_entry_t cmd = {
+                        .cdw0.opcode = 0x7A,
+                        .prp.entry1 = ARC_HHDM_TO_PHYS(data),
+                        .cdw10 = slba & UINT32_MAX,
+                        .cdw11 = slba >> 32,
+                        .cdw12 = (PAGE_SIZE / 4) - 1,
+                        // Report zones, all states, partial report so the
+                        // header counts only the descriptors returned
+                        .cdw13 = 0x0 | (0x0 << 8) | (1 << 16),
+                };
+
+                memset(data, 0, PAGE_SIZE);
+                status = namespace_io_command(state, &cmd, NULL);
+
+                if (status != 0) {
+                        break;
+                }
+
+                uint64_t returned = *(uint64_t *)data;
+
+                if (returned == 0) {
+                        break;
+                }
+
+                nvme_zone_desc_t *descs = (nvme_zone_desc_t *)(data + NVME_ZONE_REPORT_HEADER);
+
+                for (uint64_t i = 0; i < returned && filled < report->count; i++) {
+                        struct cntrl_blk_zone *zone = &report->zones[filled++];
+
+                        zone->start = descs[i].zslba * state->lba_size;
+                        zone->size = state->zones.size * state->lba_size;
+                        zone->capacity = descs[i].zcap * state->lba_size;
+                        zone->write_pointer = descs[i].wp * state->lba_size;
+                        zone->state = MASKED_READ(descs[i].zs, 4, 0xF);
+
+                        slba = descs[i].zslba + state->zones.size;
+                }
+        }
+
+        pmm_fast_page_free(data);
+        report->count = filled;
+
+        return status;
+}
+
+static int namespace_zone_mgmt(driver_state_t *state, struct cntrl_blk_zone_mgmt *mgmt) {
+        if (mgmt->action < CNTRL_BLK_ZONE_CLOSE || mgmt->action > CNTRL_BLK_ZONE_RESET) {
+                return -1;
+        }
+
+        uint64_t slba = mgmt->zone / state->lba_size;
+
+        // The CNTRL_BLK_ZONE_* actions share their values with ZSA
+        qs_entry_t cmd = {
+                .cdw0.opcode = 0x79,
+                .cdw10 = slba & UINT32_MAX,
+                .cdw11 = slba >> 32,
+                .cdw13 = (mgmt->action & 0xFF) | (mgmt->all << 8),
+        };
+
+        return namespace_io_command(state, &cmd, NULL);
+}
+
+static int namespace_zone_append(driver_state_t *state, struct cntrl_blk_zone_append *append) {
+        if (append->size == 0 || append->size > PAGE_SIZE || append->size % state->lba_size != 0) {
+                ARC_DEBUG(ERR, "Zone append of %lu bytes is not a multiple of %lu within a page\n", append->size, state->lba_size);
+                return -1;
+        }
+
+        void *data = pmm_fast_page_alloc();
+
+        if (data == NULL) {
+                return -2;
+        }
+
+        memcpy(data, append->buffer, append->size);
+
+        uint64_t zslba = append->zone / state->lba_size;
+
+        qs_entry_t cmd = {
+                .cdw0.opcode = 0x7D,
+                .prp.entry1 = ARC_HHDM_TO_PHYS(data),
+                .cdw10 = zslba & UINT32_MAX,
+                .cdw11 = zslba >> 32,
+                .cdw12 = (append->size / state->lba_size) - 1,
+        };
+
+        if (append->flags & CNTRL_BLK_RW_FUA) {
+                cmd.cdw12 |= 1 << 30;
+        }
+
+        qc_entry_t ret = { 0 };
+        int status = namespace_io_command(state, &cmd, &ret);
+
+        pmm_fast_page_free(data);
+
+        if (status == 0) {
+                // DW0 and DW1 hold the LBA the data was written to
+                append->result = (((uint64_t)ret.dw1 << 32) | ret.dw0) * state->lba_size;
+        }
+
+        return status;
+}
+
+static ARC_ControlPacketResponse control_nvme_namespace(ARC_Resource *res, ARC_ControlPacketInstruction *inst);
+
+// Put a command on the controller and the in-flight list, async.lock must
+// be held
+static void namespace_async_start(driver_state_t *state, namespace_async_t *async) {
+        nvme_driver_state_t *nvm_state = state->nvm_state;
+
+        async->wrap = nvm_state->submit(nvm_state->transport, namespace_get_qpair(state, async->class), &async->cmd);
+        async->next = state->async.head;
+        state->async.head = async;
+        state->async.count++;
+}
+
+// Start held back commands, oldest first, as far as the QoS limits allow
+static void namespace_async_release(driver_state_t *state) {
+        spinlock_lock(&state->async.lock);
+
+        for (int class = 0; class < NVME_QOS_CLASSES; class++) {
+                namespace_async_t *async = state->async.held[class];
+
+                while (async != NULL && namespace_throttle(state, class, async->size, false)) {
+                        state->async.held[class] = async->next;
+                        namespace_async_start(state, async);
+                        async = state->async.held[class];
+                }
+        }
+
+        spinlock_unlock(&state->async.lock);
+}
+
+// Reap finished async commands and tell their owners. Only checking on
+// the commands is done under the lock, overdue commands are aborted, and
+// lost ones recovered from, after it is dropped.
+static int namespace_async_poll(driver_state_t *state) {
+        nvme_driver_state_t *nvm_state = state->nvm_state;
+        namespace_async_t *finished = NULL;
+
+        namespace_async_release(state);
+
+        spinlock_lock(&state->async.lock);
+
+        namespace_async_t **link = &state->async.head;
+        while (*link != NULL) {
+                namespace_async_t *async = *link;
+                int status = nvm_state->try_poll(nvm_state->transport, &async->wrap, NULL);
+
+                if (status == NVME_STATUS_PENDING) {
+                        link = &async->next;
+                        continue;
+                }
+
+                *link = async->next;
+                async->status = status;
+                async->next = finished;
+                finished = async;
+                state->async.count--;
+        }
+
+        spinlock_unlock(&state->async.lock);
+
+        int count = 0;
+
+        while (finished != NULL) {
+                namespace_async_t *async = finished;
+                finished = async->next;
+
+                if (async->status == NVME_STATUS_OVERDUE) {
+                        async->status = nvm_state->poll(nvm_state->transport, &async->wrap, NULL);
+                }
+
+                if (async->status == NVME_STATUS_TIMEOUT) {
+                        nvme_recover(nvm_state, async->wrap.qpair);
+                }
+
+                if (async->prp_list != NULL) {
+                        pmm_fast_page_free(async->prp_list);
+                }
+
+                if (async->meta != NULL) {
+                        pmm_fast_page_free(async->meta);
+                }
+
+                async->req->done(async->req, async->status == 0 ? (int64_t)async->size : -1);
+                free(async);
+                count++;
+        }
+
+        return count;
+}
+
+// How many of vecs can be carried by one command with a PRP list: each
+// must start on a page, all but the last must end on one, and together
+// they must fit in a transfer
+static size_t namespace_vec_run(driver_state_t *state, struct blkdev_vec *vecs, size_t count) {
+        size_t max_size = namespace_max_transfer(state);
+        size_t size = 0;
+        size_t n = 0;
+
+        while (n < count) {
+                struct blkdev_vec *vec = &vecs[n];
+
+                if ((uintptr_t)vec->base % PAGE_SIZE != 0 || vec->len == 0 || vec->len % state->lba_size != 0
+                    || size + vec->len > max_size || (n > 0 && vecs[n - 1].len % PAGE_SIZE != 0)) {
+                        break;
+                }
+
+                size += vec->len;
+                n++;
+        }
+
+        return n;
+}
+
+// Send a read or write of a run of vecs, as found by namespace_vec_run,
+// to the controller as a single command
+static int namespace_async_issue(driver_state_t *state, struct cntrl_blk_async *req, bool write, uint64_t offset,
+                                 uint32_t flags, struct blkdev_vec *vecs, size_t count) {
+        while (state->async.count >= NVME_ASYNC_MAX_INFLIGHT) {
+                namespace_async_poll(state);
+        }
+
+        namespace_async_t *async = alloc(sizeof(*async));
+
+        if (async == NULL) {
+                ARC_DEBUG(ERR, "Failed to allocate async command\n");
+                return -1;
+        }
+
+        memset(async, 0, sizeof(*async));
+        async->req = req;
+
+        size_t pages = 0;
+
+        for (size_t i = 0; i < count; i++) {
+                async->size += vecs[i].len;
+                pages += ALIGN_UP(vecs[i].len, PAGE_SIZE) / PAGE_SIZE;
+        }
+
+        uint64_t prp2 = 0;
+
+        if (pages == 2) {
+                prp2 = ARC_HHDM_TO_PHYS(count == 1 ? vecs[0].base + PAGE_SIZE : vecs[1].base);
+        } else if (pages > 2) {
+                uint64_t *list = pmm_fast_page_alloc();
+
+                if (list == NULL) {
+                        ARC_DEBUG(ERR, "Failed to allocate PRP list\n");
+                        free(async);
+                        return -2;
+                }
+
+                // Every page but the first, which goes in PRP1
+                size_t entry = 0;
+
+                for (size_t i = 0; i < count; i++) {
+                        for (size_t page = 0; page < vecs[i].len; page += PAGE_SIZE) {
+                                if (i != 0 || page != 0) {
+                                        list[entry++] = ARC_HHDM_TO_PHYS(vecs[i].base + page);
+                                }
+                        }
+                }
+
+                async->prp_list = list;
+                prp2 = ARC_HHDM_TO_PHYS(list);
+        }
+
+        if (state->meta_size != 0 && !state->meta_follows_lba) {
+                async->meta = pmm_fast_page_alloc();
+        }
+
+        uint64_t slba = offset / state->lba_size;
+
+        async->cmd = (qs_entry_t){
+                .cdw0.opcode = write ? 0x1 : 0x2,
+                .nsid = state->namespace,
+                .prp.entry1 = ARC_HHDM_TO_PHYS(vecs[0].base),
+                .prp.entry2 = prp2,
+                .mptr = async->meta == NULL ? 0 : ARC_HHDM_TO_PHYS(async->meta),
+                .cdw10 = slba & UINT32_MAX,
+                .cdw11 = slba >> 32,
+                .cdw12 = async->size / state->lba_size - 1,
+        };
+
+        if (write && (flags & CNTRL_BLK_RW_FUA)) {
+                async->cmd.cdw12 |= 1 << 30;
+        }
+
+        async->class = namespace_flags_class(flags);
+
+        spinlock_lock(&state->async.lock);
+
+        // Over the QoS limits the command waits its turn behind those of
+        // its class already held back, it is started by a later poll
+        namespace_async_t **held = &state->async.held[async->class];
+
+        if (*held == NULL && namespace_throttle(state, async->class, async->size, false)) {
+                namespace_async_start(state, async);
+        } else {
+                while (*held != NULL) {
+                        held = &(*held)->next;
+                }
+
+                *held = async;
+        }
+
+        spinlock_unlock(&state->async.lock);
+
+        return 0;
+}
+
+/**
+ * Start a command without waiting for it.
+ *
+ * Reads and writes of whole LBAs to a page aligned, directly mapped buffer
+ * go to the controller as a single command with a PRP list. Everything
+ * else is carried out synchronously and completed straight away.
+ * */
+static int namespace_async_submit(ARC_Resource *res, struct cntrl_blk_async *req) {
+        driver_state_t *state = res->driver_state;
+        struct cntrl_blk_rw *rw = req->data;
+        bool write = req->command == CNTRL_BLK_WRITE;
+        struct blkdev_vec vec = { 0 };
+
+        if (rw != NULL) {
+                vec = (struct blkdev_vec){ .base = rw->buffer, .len = rw->size };
+        }
+
+        if ((req->command != CNTRL_BLK_READ && !write) || rw == NULL || rw->offset % state->lba_size != 0
+            || namespace_vec_run(state, &vec, 1) != 1) {
+                // Straight to the namespace, the block layer submits here on
+                // behalf of the page cache
+                if ((req->command == CNTRL_BLK_READ || write) && rw != NULL && rw->buffer != NULL) {
+                        size_t size = write ? namespace_write(state, rw->buffer, rw->offset, rw->size, rw->flags)
+                                : namespace_read(state, rw->buffer, rw->offset, rw->size, rw->flags);
+
+                        req->done(req, size);
+
+                        return 0;
+                }
+
+                ARC_ControlPacketInstruction inst = { .command = req->command, .data = req->data };
+                ARC_ControlPacketResponse resp = control_nvme_namespace(res, &inst);
+
+                req->done(req, resp.type == req->command ? (int64_t)resp.size : -1);
+
+                return 0;
+        }
+
+        return namespace_async_issue(state, req, write, rw->offset, rw->flags, &vec, 1);
+}
+
+// A block request split into as few commands as its vectors allow
+struct namespace_blk_req {
+        struct blkdev_request *req;
+        int remaining;
+        int status;
+        struct {
+                struct cntrl_blk_async async;
+                struct cntrl_blk_rw rw;
+        } parts[];
+};
+
+static void namespace_blk_put(struct namespace_blk_req *blk) {
+        if (ARC_ATOMIC_DEC(blk->remaining) == 0) {
+                blkdev_end_request(blk->req, blk->status);
+                free(blk);
+        }
+}
+
+static void namespace_blk_done(struct cntrl_blk_async *async, int64_t result) {
+        struct namespace_blk_req *blk = async->priv;
+        struct cntrl_blk_rw *rw = async->data;
+
+        if (result != (int64_t)rw->size) {
+                blk->status = -1;
+        }
+
+        namespace_blk_put(blk);
+}
+
+static int namespace_blk_queue(ARC_BlockDevice *dev, struct blkdev_request *req, int hwq) {
+        (void)hwq;
+
+        ARC_Resource *res = dev->res;
+        driver_state_t *state = res->driver_state;
+
+        switch (req->op) {
+        case BLKDEV_OP_READ:
+        case BLKDEV_OP_WRITE: {
+                // At most one part per vector
+                struct namespace_blk_req *blk = alloc(sizeof(*blk) + req->vec_count * sizeof(blk->parts[0]));
+
+                if (blk == NULL) {
+                        ARC_DEBUG(ERR, "Failed to allocate block request\n");
+                        return -1;
+                }
+
+                bool write = req->op == BLKDEV_OP_WRITE;
+
+                blk->req = req;
+                blk->status = 0;
+                // Held until every part was submitted
+                blk->remaining = 1;
+
+                uint64_t offset = req->lba * state->lba_size;
+                size_t part = 0;
+
+                for (size_t i = 0; i < req->vec_count; part++) {
+                        // Merged requests are runs of cache pages, which
+                        // go out as one command. Only a vector which does
+                        // not start or end on a page splits it
+                        size_t run = offset % state->lba_size == 0 ? namespace_vec_run(state, &req->vecs[i], req->vec_count - i) : 0;
+                        size_t size = 0;
+
+                        for (size_t j = 0; j < max(run, (size_t)1); j++) {
+                                size += req->vecs[i + j].len;
+                        }
+
+                        blk->parts[part].rw = (struct cntrl_blk_rw){
+                                .offset = offset,
+                                .size = size,
+                                .buffer = req->vecs[i].base,
+                                .flags = req->flags,
+                        };
+
+                        blk->parts[part].async = (struct cntrl_blk_async){
+                                .command = write ? CNTRL_BLK_WRITE : CNTRL_BLK_READ,
+                                .data = &blk->parts[part].rw,
+                                .done = namespace_blk_done,
+                                .priv = blk,
+                        };
+
+                        ARC_ATOMIC_INC(blk->remaining);
+
+                        int r = run == 0 ? namespace_async_submit(res, &blk->parts[part].async)
+                                : namespace_async_issue(state, &blk->parts[part].async, write, offset, req->flags, &req->vecs[i], run);
+
+                        if (r != 0) {
+                                namespace_blk_done(&blk->parts[part].async, -1);
+                        }
+
+                        offset += size;
+                        i += max(run, (size_t)1);
+                }
+
+                namespace_blk_put(blk);
+
+                return 0;
+        }
+
+        case BLKDEV_OP_FLUSH: {
+                blkdev_end_request(req, namespace_flush(state));
+
+                return 0;
+        }
+
+        case BLKDEV_OP_DISCARD: {
+                struct cntrl_blk_range range = { .offset = req->lba * state->lba_size, .size = req->count * state->lba_size };
+                struct cntrl_blk_ranges list = { .count = 1, .ranges = &range };
+
+                blkdev_end_request(req, namespace_discard(state, &list));
+
+                return 0;
+        }
+        }
+
+        return -1;
+}
+
+static int namespace_blk_poll(ARC_BlockDevice *dev, int hwq) {
+        (void)hwq;
+
+        return namespace_async_poll(dev->res->driver_state);
+}
+
+static struct blkdev_ops namespace_blk_ops = {
+        .queue = namespace_blk_queue,
+        .poll = namespace_blk_poll,
+};
+
+static size_t read_nvme_namespace(void *buffer, size_t size, size_t count, ARC_File *file, ARC_Resource *res) {
+        driver_state_t *state = res->driver_state;
+
+        if (state->dev != NULL) {
+                struct readahead_window window = { 0 };
+
+                if (readahead_advance(file, file->offset, size * count, &window)) {
+                        pcache_prefetch(state->dev, window.offset, window.size, CNTRL_BLK_PRIO_LOW << CNTRL_BLK_RW_PRIO_SHIFT);
+                }
+
+                return blkdev_io(state->dev, false, file->offset, size * count, buffer, 0);
+        }
+        
+        return namespace_read(state, buffer, file->offset, size * count, 0);
+}
+
+static size_t write_nvme_namespace(void *buffer, size_t size, size_t count, ARC_File *file, ARC_Resource *res) {
+        driver_state_t *state = res->driver_state;
+
+        if (state->dev != NULL) {
+                return blkdev_io(state->dev, true, file->offset, size * count, buffer, 0);
+        }
+        
+        return namespace_write(state, buffer, file->offset, size * count, 0);
+}
+
+// Control commands go around the page cache, reads need what it has not
+// written back yet and changes to the namespace make cached pages stale
+static void namespace_bypass_cache(driver_state_t *state, ARC_ControlPacketInstruction *inst) {
+        switch (inst->command) {
+        case CNTRL_BLK_READ: {
+                struct cntrl_blk_rw *rw = inst->data;
+                pcache_writeback_range(state->dev, rw->offset, rw->size);
+                break;
+        }
+
+        case CNTRL_BLK_WRITE: {
+                struct cntrl_blk_rw *rw = inst->data;
+                pcache_invalidate(state->dev, rw->offset, rw->size);
+                break;
+        }
+
+        case CNTRL_BLK_DISCARD:
+        case CNTRL_BLK_ZERO_RANGE: {
+                struct cntrl_blk_ranges *list = inst->data;
+
+                for (size_t i = 0; list->ranges != NULL && i < list->count; i++) {
+                        pcache_invalidate(state->dev, list->ranges[i].offset, list->ranges[i].size);
+                }
+
+                break;
+        }
+
+        case CNTRL_BLK_COPY_RANGE: {
+                struct cntrl_blk_copy *copy = inst->data;
+                uint64_t size = 0;
+
+                for (size_t i = 0; copy->sources != NULL && i < copy->count; i++) {
+                        size += copy->sources[i].size;
+                }
+
+                pcache_invalidate(state->dev, copy->dest, size);
+                break;
+        }
+
+        case CNTRL_BLK_ZONE_MGMT:
+        case CNTRL_BLK_ZONE_APPEND: {
+                pcache_invalidate(state->dev, 0, UINT64_MAX);
+                break;
+        }
+
+        case CNTRL_BLK_SUBMIT_ASYNC: {
+                struct cntrl_blk_async *req = inst->data;
+                ARC_ControlPacketInstruction sub = { .command = req->command, .data = req->data };
+
+                if (req->data != NULL && req->command != CNTRL_BLK_SUBMIT_ASYNC) {
+                        namespace_bypass_cache(state, &sub);
+                }
+
+                break;
+        }
+        }
+}
+
+static int stat_nvme_namespace(ARC_Resource *res, char *filename, struct stat *stat) {
+	(void)res;
+	(void)filename;
+	(void)stat;
+
+        if (res == NULL || stat == NULL) {
+                return -1;
+        }
+
+        driver_state_t *state = res->driver_state;
+
+        stat->st_blksize = state->lba_size;
+        stat->st_size = state->nsze;
+        
+        return 0;
+}
+
+static ARC_ControlPacketResponse control_nvme_namespace(ARC_Resource *res, ARC_ControlPacketInstruction *inst) {
+        ARC_ControlPacketResponse resp = { 0 };
+
+        if (res == NULL || inst == NULL) {
+                return resp;
+        }
+
+        driver_state_t *state = res->driver_state;
+
+        if (state->dev != NULL && inst->data != NULL) {
+                namespace_bypass_cache(state, inst);
+        }
+
+        switch (inst->command) {
+        case CNTRL_BLK_SYNC: {
+                int status = state->dev != NULL ? pcache_sync(state->dev) : namespace_flush(state);
+
+                if (status != 0) {
+                        ARC_DEBUG(ERR, "Failed to flush namespace %d (status=%04X)\n", state->namespace, status);
+                        return resp;
+                }
+
+                resp.type = inst->command;
+
+                return resp;
+        }
+
+        case CNTRL_BLK_READ:
+        case CNTRL_BLK_WRITE: {
+                struct cntrl_blk_rw *rw = inst->data;
+
+                if (rw == NULL || rw->buffer == NULL) {
+                        goto err;
+                }
+
+                if (inst->command == CNTRL_BLK_READ) {
+                        resp.size = namespace_read(state, rw->buffer, rw->offset, rw->size, rw->flags);
+                } else {
+                        resp.size = namespace_write(state, rw->buffer, rw->offset, rw->size, rw->flags);
+                }
+
+                resp.type = inst->command;
+                resp.data = rw;
+
+                return resp;
+        }
+
+        case CNTRL_BLK_DISCARD:
+        case CNTRL_BLK_ZERO_RANGE: {
+                struct cntrl_blk_ranges *list = inst->data;
+
+                if (list == NULL || (list->count > 0 && list->ranges == NULL)) {
+                        goto err;
+                }
+
+                int r = 0;
+
+                if (inst->command == CNTRL_BLK_DISCARD) {
+                        r = namespace_discard(state, list);
+                } else {
+                        r = namespace_zero_range(state, list);
+                }
+
+                if (r != 0) {
+                        ARC_DEBUG(ERR, "Failed to %s %lu ranges (r=%04X)\n", inst->command == CNTRL_BLK_DISCARD ? "discard" : "zero", list->count, r);
+                        return resp;
+                }
+
+                resp.type = inst->command;
+
+                return resp;
+        }
+
+        case CNTRL_BLK_ZONE_REPORT:
+        case CNTRL_BLK_ZONE_MGMT:
+        case CNTRL_BLK_ZONE_APPEND: {
+                if (!state->zones.enabled) {
+                        ARC_DEBUG(ERR, "Namespace %d is not zoned\n", state->namespace);
+                        return resp;
+                }
+
+                if (inst->data == NULL) {
+                        goto err;
+                }
+
+                int r = 0;
+
+                switch (inst->command) {
+                case CNTRL_BLK_ZONE_REPORT: {
+                        struct cntrl_blk_zone_report *report = inst->data;
+                        r = report->zones == NULL ? -1 : namespace_zone_report(state, report);
+                        break;
+                }
+
+                case CNTRL_BLK_ZONE_MGMT: {
+                        r = namespace_zone_mgmt(state, inst->data);
+                        break;
+                }
+
+                case CNTRL_BLK_ZONE_APPEND: {
+                        r = namespace_zone_append(state, inst->data);
+                        break;
+                }
+                }
+
+                if (r != 0) {
+                        ARC_DEBUG(ERR, "Zone command %d failed (r=%04X)\n", inst->command, r);
+                        return resp;
+                }
+
+                resp.type = inst->command;
+                resp.data = inst->data;
+
+                return resp;
+        }
+
+        case CNTRL_BLK_COPY_RANGE: {
+                struct cntrl_blk_copy *copy = inst->data;
+
+                if (copy == NULL || (copy->count > 0 && copy->sources == NULL)) {
+                        goto err;
+                }
+
+                int r = namespace_copy(state, copy);
+
+                if (r != 0) {
+                        ARC_DEBUG(ERR, "Failed to copy %lu ranges (r=%04X)\n", copy->count, r);
+                        return resp;
+                }
+
+                resp.type = inst->command;
+
+                return resp;
+        }
+
+        case CNTRL_BLK_SUBMIT_ASYNC: {
+                struct cntrl_blk_async *req = inst->data;
+
+                if (req == NULL || req->done == NULL) {
+                        goto err;
+                }
+
+                if (namespace_async_submit(res, req) != 0) {
+                        return resp;
+                }
+
+                resp.type = inst->command;
+
+                return resp;
+        }
+
+        case CNTRL_BLK_POLL_ASYNC: {
+                resp.size = namespace_async_poll(state);
+                resp.type = inst->command;
+
+                return resp;
+        }
+
+        case CNTRL_BLK_CACHE_STATS:
+        case CNTRL_BLK_CACHE_TUNE: {
+                if (pcache_control(state->dev, inst->command, inst->data) != 0) {
+                        goto err;
+                }
+
+                resp.size = sizeof(struct cntrl_blk_cache);
+                resp.type = inst->command;
+
+                return resp;
+        }
+
+        case NVME_NS_CTRL_SET_QOS: {
+                if (inst->data == NULL) {
+                        goto err;
+                }
+
+                namespace_set_qos(state, inst->data);
+                resp.type = inst->command;
+
+                return resp;
+        }
+        }
+
+ err:
+        ARC_DEBUG(ERR, "Unhandled command %d\n", inst->command);
+        return (ARC_ControlPacketResponse) { 0 };
+}
+
 ARC_REGISTER_DRIVER(ARC_DRIGRP_DEV, nvme_namespace) = {
         .init = init_nvme_namespace,
 	.uninit = uninit_nvme_namespace,
@@ -317,5 +1582,6 @@ ARC_REGISTER_DRIVER(ARC_DRIGRP_DEV, nvme_namespace) = {
 	.seek = dridefs_int_func_empty,
 	.rename = dridefs_int_func_empty,
 	.stat = stat_nvme_namespace,
+        .control = control_nvme_namespace,
 	.codes = NULL
 };
@@ -1,17 +1,121 @@
 #include "drivers/sysdev/nvme/nvme.h"
 #include "arch/smp.h"
 #include "drivers/resource.h"
+#include "drivers/cntrl_defs.h"
 #include "drivers/dri_defs.h"
 #include "lib/ringbuffer.h"
 #include "mm/allocator.h"
 #include "mm/pmm.h"
 #include <stddef.h>
 
+// Leave one submission queue entry free, a completely full queue
+// is indistinguishable from an empty one
+#define NVME_ADMIN_BATCH (NVME_ADMIN_QUEUE_SUB_LEN - 1)
+
+// CDW11.QPRIO for the submission queues of each CNTRL_BLK_PRIO_* class,
+// only honoured when the controller arbitrates by weighted round robin
+static const int nvme_class_qprio[NVME_QOS_CLASSES] = { 0b10, 0b01, 0b11 };
+
 typedef struct nvme_namespace {
         struct nvme_namespace *next;
         nvme_namespace_args_t arg;
 } nvme_namespace_t;
 
+// An admin command was lost even after it was aborted. The admin queue
+// cannot be recreated on its own, the controller is reset, which also
+// gives back the submission slots of the lost commands.
+static void nvme_admin_lost(nvme_driver_state_t *state) {
+        if (state->recovering) {
+                return;
+        }
+
+        ARC_DEBUG(WARN, "Admin command lost, recovering controller\n");
+        nvme_recover(state, NULL);
+}
+
+static int nvme_admin_poll(nvme_driver_state_t *state, qs_wrap_t *wrap, qc_entry_t *ret) {
+        int status = state->poll(state->transport, wrap, ret);
+
+        if (status == NVME_STATUS_TIMEOUT) {
+                nvme_admin_lost(state);
+        }
+
+        return status;
+}
+
+/**
+ * Pipeline admin commands.
+ *
+ * Up to NVME_ADMIN_BATCH commands are kept in flight on the admin queue,
+ * rather than waiting for each command to complete before submitting
+ * the next.
+ *
+ * @param qs_entry_t *cmds - Commands to submit, must stay valid until return.
+ * @param int count - Number of commands.
+ * @param int *status - If non-NULL, receives the status of each command.
+ * @return the number of commands which failed.
+ *
+ * Once a command is lost the rest of the batch is failed with
+ * NVME_STATUS_TIMEOUT without being polled, and the controller is
+ * recovered.
+ * */
+static int nvme_admin_batch(nvme_driver_state_t *state, qs_entry_t *cmds, int count, int *status) {
+        qs_wrap_t *wraps = alloc(sizeof(*wraps) * count);
+
+        if (wraps == NULL) {
+                ARC_DEBUG(ERR, "Failed to allocate wraps for %d commands\n", count);
+                return count;
+        }
+
+        int failed = 0;
+        int polled = 0;
+        int submitted = 0;
+        bool lost = false;
+
+        for (; submitted < count; submitted++) {
+                if (submitted - polled >= NVME_ADMIN_BATCH) {
+                        int r = state->poll(state->transport, &wraps[polled], NULL);
+                        failed += r != 0;
+                        lost = r == NVME_STATUS_TIMEOUT;
+
+                        if (status != NULL) {
+                                status[polled] = r;
+                        }
+
+                        polled++;
+
+                        if (lost) {
+                                break;
+                        }
+                }
+
+                wraps[submitted] = state->submit(state->transport, NULL, &cmds[submitted]);
+        }
+
+        for (; polled < count; polled++) {
+                int r = NVME_STATUS_TIMEOUT;
+
+                if (!lost && polled < submitted) {
+                        r = state->poll(state->transport, &wraps[polled], NULL);
+                        lost = r == NVME_STATUS_TIMEOUT;
+                }
+
+                failed += r != 0;
+
+                if (status != NULL) {
+                        status[polled] = r;
+                }
+        }
+
+        free(wraps);
+
+        if (lost) {
+                nvme_admin_lost(state);
+        }
+
+        return failed;
+}
+
 static int nvme_identify_controller(nvme_driver_state_t *state) {
 	uint8_t *data = (uint8_t *)pmm_fast_page_alloc();
 
@@ -22,7 +126,7 @@ static int nvme_identify_controller(nvme_driver_state_t *state) {
         };
 
 	qs_wrap_t wrap = state->submit(state->transport, NULL, &cmd);
-	state->poll(state->transport, &wrap, NULL);
+	nvme_admin_poll(state, &wrap, NULL);
 
 	// 77    Maximum Data Transfer Size in 2 << cap.mpsmin
 	//       CTRATT mem bit cleared, includes the size of the interleaved metadata
@@ -45,39 +149,178 @@ static int nvme_identify_controller(nvme_driver_state_t *state) {
 
 	// TODO: CRDTs
 
-	cmd.cdw10 = 0x2;
-	wrap = state->submit(state->transport, NULL, &cmd);
-	state->poll(state->transport, &wrap, NULL);
+	// 521:520 ONCS
+	state->ctrl_iden.oncs = *(uint16_t *)(&data[520]);
+
+	// 525   VWC bit 0 is volatile write cache present, flushes are
+	//       only needed if it is set
+	state->ctrl_iden.vwc = MASKED_READ(data[525], 0, 1);
 
 	pmm_fast_page_free(data);
 
 	return 0;
 }
 
+static int nvme_set_feature(nvme_driver_state_t *state, uint8_t fid, uint32_t value) {
+        qs_entry_t cmd = {
+                .cdw0.opcode = 0x9,
+                .cdw10 = fid,
+                .cdw11 = value,
+        };
+
+        return nvme_admin_batch(state, &cmd, 1, NULL);
+}
+
+// Read the current value of a feature, arg is passed in CDW11 for the
+// features which need it
+static int nvme_get_feature(nvme_driver_state_t *state, uint8_t fid, uint32_t arg, uint32_t *value) {
+        qs_entry_t cmd = {
+                .cdw0.opcode = 0xA,
+                .cdw10 = fid,
+                .cdw11 = arg,
+        };
+
+        qs_wrap_t wrap = state->submit(state->transport, NULL, &cmd);
+        qc_entry_t ret = { 0 };
+        int status = nvme_admin_poll(state, &wrap, &ret);
+
+        if (status == 0) {
+                *value = ret.dw0;
+        }
+
+        return status;
+}
+
+static int nvme_set_coalescing(nvme_driver_state_t *state, nvme_coalescing_t *coalescing) {
+        int status = nvme_set_feature(state, NVME_FID_COALESCING, coalescing->threshold | (coalescing->time << 8));
+
+        if (status == 0) {
+                state->stats.coalescing = *coalescing;
+        }
+
+        return status;
+}
+
+static int nvme_set_vector_config(nvme_driver_state_t *state, nvme_vector_config_t *config) {
+        int status = nvme_set_feature(state, NVME_FID_VECTOR_CONFIG, config->vector | (config->disable_coalescing << 16));
+
+        if (status == 0 && config->vector < 64) {
+                if (config->disable_coalescing) {
+                        state->stats.no_coalescing |= 1ULL << config->vector;
+                } else {
+                        state->stats.no_coalescing &= ~(1ULL << config->vector);
+                }
+        }
+
+        return status;
+}
+
+static int nvme_set_arbitration(nvme_driver_state_t *state, nvme_arbitration_t *arb) {
+        uint32_t value = (arb->burst & 0b111) | (arb->low << 8) | (arb->medium << 16) | (arb->high << 24);
+        int status = nvme_set_feature(state, NVME_FID_ARBITRATION, value);
+
+        if (status == 0) {
+                state->stats.arbitration = *arb;
+                state->stats.arbitration.burst &= 0b111;
+        }
+
+        return status;
+}
+
+// Fill in the stats with what the controller currently has in effect
+static void nvme_read_tunables(nvme_driver_state_t *state) {
+        uint32_t value = 0;
+
+        if (nvme_get_feature(state, NVME_FID_COALESCING, 0, &value) == 0) {
+                state->stats.coalescing.threshold = MASKED_READ(value, 0, 0xFF);
+                state->stats.coalescing.time = MASKED_READ(value, 8, 0xFF);
+        }
+
+        if (nvme_get_feature(state, NVME_FID_ARBITRATION, 0, &value) == 0) {
+                state->stats.arbitration.burst = MASKED_READ(value, 0, 0b111);
+                state->stats.arbitration.low = MASKED_READ(value, 8, 0xFF);
+                state->stats.arbitration.medium = MASKED_READ(value, 16, 0xFF);
+                state->stats.arbitration.high = MASKED_READ(value, 24, 0xFF);
+        }
+}
+
+// Put the tunables back after a controller reset returned them to their
+// defaults
+static void nvme_restore_tunables(nvme_driver_state_t *state) {
+        nvme_set_coalescing(state, &state->stats.coalescing);
+        nvme_set_arbitration(state, &state->stats.arbitration);
+
+        for (int i = 0; i < 64; i++) {
+                if (state->stats.no_coalescing & (1ULL << i)) {
+                        nvme_vector_config_t config = { .vector = i, .disable_coalescing = true };
+                        nvme_set_vector_config(state, &config);
+                }
+        }
+}
+
 static uint16_t nvme_request_io_queues(nvme_driver_state_t *state, uint16_t qcount) {
+        if (qcount == 0) {
+                // The field is zero based, there is no way to ask for none
+                return 0;
+        }
+
         // Request qcount qpairs
 	struct qs_entry cmd = {
 	        .cdw0.opcode = 0x9,
-		.cdw10 = 0x7,
+		.cdw10 = NVME_FID_NUM_QUEUES,
 		.cdw11 = (qcount - 1) | ((qcount - 1) << 16)
         };
 
 	qs_wrap_t wrap = state->submit(state->transport, NULL, &cmd);
         qc_entry_t ret = { 0 };
-	state->poll(state->transport, &wrap, &ret);
+	nvme_admin_poll(state, &wrap, &ret);
 
 	return min(MASKED_READ(ret.dw0, 0, 0xFFFF), MASKED_READ(ret.dw0, 16, 0xFFFF)) + 1;
 }
 
+static int nvme_expose_pmr(nvme_driver_state_t *state) {
+        nvme_pmr_args_t pmr = { 0 };
+        ARC_ControlPacketInstruction cmd = { .command = NVME_TRANSPORT_CTRL_PMR,
+                                             .data    = &pmr };
+
+        ARC_ControlPacketResponse resp = state->transport->driver->control(state->transport, &cmd);
+
+        if (resp.data == NULL) {
+                // No PMR, or the transport has no way to reach it
+                return 0;
+        }
+
+        pmr.ctrl_id = state->ctrl_iden.id;
+
+        if (init_resource(ARC_DRIGRP_DEV, ARC_DRIDEF_DEV_NVME_PMR, &pmr) == NULL) {
+                ARC_DEBUG(ERR, "Failed to create PMR resource\n");
+                return -1;
+        }
+
+        return 0;
+}
+
+static void nvme_free_io_qpairs(nvme_qpair_t *qpairs, int count) {
+        for (int i = count - 1; i >= 0; i--) {
+                pmm_free(qpairs[i].subq->base);
+                uninit_ringbuffer(qpairs[i].subq);
+                uninit_ringbuffer(qpairs[i].cmpq);
+                free(qpairs[i].slots);
+        }
+
+        free(qpairs);
+}
+
 static int nvme_create_io_qpairs(nvme_driver_state_t *state, uint16_t count, size_t qsize) {                
         nvme_qpair_t *io_qpairs = alloc(sizeof(*io_qpairs) * count);
         
         if (io_qpairs == NULL) {
                 ARC_DEBUG(ERR, "Failed to allocate io qpairs\n");
-                free(state);
                 return -1;
         }
 
+        memset(io_qpairs, 0, sizeof(*io_qpairs) * count);
+
         uint16_t i = 0;
         for (; i < count; i++) {
                 void *base = pmm_alloc(qsize * 2);
@@ -101,20 +344,28 @@ static int nvme_create_io_qpairs(nvme_driver_state_t *state, uint16_t count, siz
                         ARC_DEBUG(ERR, "Failed to create ringbuffer structure for io qpair %d (completion)\n", i);
                         break;
                 }
+
+                nvme_cmp_slot_t *slots = alloc(sizeof(*slots) * sub->objs);
+
+                if (slots == NULL) {
+                        ARC_DEBUG(ERR, "Failed to allocate completion slots for io qpair %d\n", i);
+                        break;
+                }
+
+                memset(slots, 0, sizeof(*slots) * sub->objs);
                 
                 io_qpairs[i].phase = 1;
                 io_qpairs[i].id = i + 1;
                 io_qpairs[i].subq = sub;
                 io_qpairs[i].cmpq = cmp;
+                io_qpairs[i].slots = slots;
+                init_static_spinlock(&io_qpairs[i].lock);
 
                 ARC_DEBUG(INFO, "Create qpair %d with base %p\n", i, base);
         }
 
         if (i != count) {
-                for (int _i = i; _i >= 0; _i--) {
-                        pmm_free(io_qpairs[_i].subq->base);
-                }
-                free(io_qpairs);
+                nvme_free_io_qpairs(io_qpairs, i);
                 
                 return -1;
         }
@@ -135,7 +386,8 @@ static uint64_t nvme_set_command_sets(nvme_driver_state_t *state) {
                 return -1;
         }
 
-        transport->driver->read(props, sizeof(*props), 1, NULL, transport);
+        ARC_File file = { 0 };
+        transport->driver->read(props, sizeof(*props), 1, &file, transport);
 
 	uint64_t cap = props->cap;
 	uint64_t cc =  props->cc;
@@ -153,7 +405,7 @@ static uint64_t nvme_set_command_sets(nvme_driver_state_t *state) {
                 };
 
                 qs_wrap_t wrap = state->submit(state->transport, NULL, &iocs_struct_cmd);
-                state->poll(state->transport, &wrap, NULL);
+                nvme_admin_poll(state, &wrap, NULL);
                 
 		uint32_t i = 0;
 		uint64_t enabled_cmd_sets = 0;
@@ -178,7 +430,7 @@ static uint64_t nvme_set_command_sets(nvme_driver_state_t *state) {
 
                 wrap = state->submit(state->transport, NULL, &set_cmd);
                 qc_entry_t ret = { 0 };
-		state->poll(state->transport, &wrap, &ret);
+		nvme_admin_poll(state, &wrap, &ret);
 
 		if ((ret.dw0 & 0xFF) != i) {
 			ARC_DEBUG(ERR, "Command set not set to desired command set (TODO)\n");
@@ -195,68 +447,385 @@ static uint64_t nvme_set_command_sets(nvme_driver_state_t *state) {
 
 static int nvme_list_namespaces(nvme_driver_state_t *state, nvme_namespace_t **ret, uint64_t sets) {
         int ns_count = 0;
-        
+
+        // The active namespace list of each command set is paged through
+        // independently, the next page of every set is requested together
+        struct {
+                uint32_t *namespaces;
+                qs_entry_t cmd;
+                qs_wrap_t wrap;
+                int idx;
+        } lists[64] = { 0 };
+        int list_count = 0;
+
         while (sets != 0) {
 		int idx = __builtin_ffs(sets) - 1;
+		sets &= ~(1ULL << idx);
 
 		uint32_t *namespaces = (uint32_t *)pmm_fast_page_alloc();
 
-		struct qs_entry get_ns_cmd = {
+                if (namespaces == NULL) {
+                        ARC_DEBUG(ERR, "Failed to allocate namespace list for idx=%d\n", idx);
+                        continue;
+                }
+
+                lists[list_count].namespaces = namespaces;
+                lists[list_count].idx = idx;
+                lists[list_count].cmd = (qs_entry_t){
 	                .cdw0.opcode = 0x6,
 			.prp.entry1 = ARC_HHDM_TO_PHYS(namespaces),
 	                .cdw10 = 0x7 | (state->ctrl_iden.id << 16),
 			.cdw11 = (idx & 0xFF) << 24,
 			.nsid = 0x0,
                 };
+                list_count++;
+        }
 
-                uint32_t _t = 0;
-                
-                do {
-                        get_ns_cmd.nsid = _t;
-                        memset(namespaces, 0, PAGE_SIZE);
-                        
-                        qs_wrap_t wrap = state->submit(state->transport, NULL, &get_ns_cmd);
-                        qc_entry_t cmp = { 0 };
-                        state->poll(state->transport, &wrap, &cmp);
+        int pending = list_count;
+        bool lost = false;
 
-                        if (cmp.status != 0) {
-                                ARC_DEBUG(ERR, "Failed to get list of 1024 active namespaces from namespace %d (idx=%d)\n", _t, idx);
-                                break;
+        while (pending > 0 && !lost) {
+                for (int l = 0; l < list_count; l++) {
+                        if (lists[l].namespaces == NULL) {
+                                continue;
                         }
-                        
-                        for (int i = 0; i < 1024; i++) {
-                                _t = namespaces[i];
+
+                        memset(lists[l].namespaces, 0, PAGE_SIZE);
+                        lists[l].wrap = state->submit(state->transport, NULL, &lists[l].cmd);
+                }
+
+                for (int l = 0; l < list_count; l++) {
+                        uint32_t *namespaces = lists[l].namespaces;
+                        int idx = lists[l].idx;
+
+                        if (namespaces == NULL) {
+                                continue;
+                        }
+
+                        // Once a command is lost the others in flight are
+                        // given up on, the controller is reset below
+                        qc_entry_t cmp = { 0 };
+                        int status = lost ? NVME_STATUS_TIMEOUT : state->poll(state->transport, &lists[l].wrap, &cmp);
+                        lost |= status == NVME_STATUS_TIMEOUT;
+
+                        uint32_t _t = 0;
+
+                        if (status != 0) {
+                                ARC_DEBUG(ERR, "Failed to get list of 1024 active namespaces from namespace %d (idx=%d)\n", lists[l].cmd.nsid, idx);
+                        } else {
+                                for (int i = 0; i < 1024; i++) {
+                                        _t = namespaces[i];
                                 
-                                if (namespaces[i] == 0) {
-                                        break;
-                                }
+                                        if (namespaces[i] == 0) {
+                                                break;
+                                        }
 
-                                ARC_DEBUG(INFO, "Found active namespace %d in command set idx=%d\n", _t, idx);
+                                        ARC_DEBUG(INFO, "Found active namespace %d in command set idx=%d\n", _t, idx);
                                 
-                                nvme_namespace_t *ns = alloc(sizeof(*ns));
+                                        nvme_namespace_t *ns = alloc(sizeof(*ns));
                                 
-                                if (ns == NULL) {
-                                        ARC_DEBUG(ERR, "Failed to allocate space for namespace arguments (%\n");
-                                        break;
+                                        if (ns == NULL) {
+                                                ARC_DEBUG(ERR, "Failed to allocate space for namespace arguments\n");
+                                                _t = 0;
+                                                break;
+                                        }
+
+                                        memset(ns, 0, sizeof(*ns));
+                                        ns->next = *ret;
+                                        ns->arg.command_set = idx;
+                                        ns->arg.namespace = namespaces[i];
+                                        ns->arg.state = state;
+                                        *ret = ns;
+                                        ns_count++;
                                 }
-                                
-                                ns->next = *ret;
-                                ns->arg.command_set = idx;
-                                ns->arg.namespace = namespaces[i];
-                                ns->arg.state = state;
-                                *ret = ns;
-                                ns_count++;
                         }
-                } while(_t != 0);
-                
-		pmm_fast_page_free(namespaces);
 
-		sets &= ~(1 << (idx));
+                        if (_t == 0) {
+                                // List exhausted
+                                pmm_fast_page_free(namespaces);
+                                lists[l].namespaces = NULL;
+                                pending--;
+                                continue;
+                        }
+
+                        lists[l].cmd.nsid = _t;
+                }
 	}
+
+        if (lost) {
+                for (int l = 0; l < list_count; l++) {
+                        if (lists[l].namespaces != NULL) {
+                                pmm_fast_page_free(lists[l].namespaces);
+                        }
+                }
+
+                nvme_admin_lost(state);
+        }
  
 	return ns_count;
 }
 
+static void nvme_free_namespaces(nvme_namespace_t *namespaces) {
+        while (namespaces != NULL) {
+                nvme_namespace_t *next = namespaces->next;
+
+                if (namespaces->arg.iden != NULL) {
+                        pmm_fast_page_free(namespaces->arg.iden);
+                        pmm_fast_page_free(namespaces->arg.iden_csi);
+                }
+
+                free(namespaces);
+                namespaces = next;
+        }
+}
+
+static int nvme_identify_namespaces(nvme_driver_state_t *state, nvme_namespace_t *namespaces, int ns_count) {
+        if (ns_count == 0) {
+                return 0;
+        }
+
+        qs_entry_t *cmds = alloc(sizeof(*cmds) * ns_count * 2);
+        int *status = alloc(sizeof(*status) * ns_count * 2);
+
+        if (cmds == NULL || status == NULL) {
+                ARC_DEBUG(ERR, "Failed to allocate identify commands\n");
+                free(cmds);
+                free(status);
+                return -1;
+        }
+
+        memset(cmds, 0, sizeof(*cmds) * ns_count * 2);
+
+        int i = 0;
+        for (nvme_namespace_t *ns = namespaces; ns != NULL; ns = ns->next, i += 2) {
+                ns->arg.iden = pmm_fast_page_alloc();
+                ns->arg.iden_csi = pmm_fast_page_alloc();
+
+                cmds[i].cdw0.opcode = 0x6;
+                cmds[i].prp.entry1 = ARC_HHDM_TO_PHYS(ns->arg.iden);
+                cmds[i].cdw10 = 0x0;
+                cmds[i].nsid = ns->arg.namespace;
+
+                cmds[i + 1].cdw0.opcode = 0x6;
+                cmds[i + 1].prp.entry1 = ARC_HHDM_TO_PHYS(ns->arg.iden_csi);
+                cmds[i + 1].cdw10 = 0x5;
+                cmds[i + 1].cdw11 = (ns->arg.command_set & 0xFF) << 24;
+                cmds[i + 1].nsid = ns->arg.namespace;
+        }
+
+        nvme_admin_batch(state, cmds, ns_count * 2, status);
+
+        i = 0;
+        for (nvme_namespace_t *ns = namespaces; ns != NULL; ns = ns->next, i += 2) {
+                if (status[i] == 0 && status[i + 1] == 0) {
+                        continue;
+                }
+
+                ARC_DEBUG(ERR, "Failed to identify namespace %d (%04X, %04X)\n", ns->arg.namespace, status[i], status[i + 1]);
+
+                pmm_fast_page_free(ns->arg.iden);
+                pmm_fast_page_free(ns->arg.iden_csi);
+                ns->arg.iden = NULL;
+                ns->arg.iden_csi = NULL;
+        }
+
+        free(cmds);
+        free(status);
+
+        return 0;
+}
+
+static int nvme_register_io_qpairs(nvme_driver_state_t *state, int count) {
+        qs_entry_t *cmds = alloc(sizeof(*cmds) * count);
+
+        if (cmds == NULL) {
+                ARC_DEBUG(ERR, "Failed to allocate queue creation commands\n");
+                return -1;
+        }
+
+        // All completion queues must exist before the submission
+        // queues which post to them are created
+        memset(cmds, 0, sizeof(*cmds) * count);
+        for (int i = 0; i < count; i++) {
+                nvme_qpair_t *qpair = &state->qpairs.qs[i];
+                int irq = 0;
+
+                cmds[i].cdw0.opcode = 0x5;
+                cmds[i].prp.entry1 = ARC_HHDM_TO_PHYS(qpair->cmpq->base);
+                cmds[i].cdw10 = qpair->id | ((qpair->cmpq->objs - 1) << 16);
+                cmds[i].cdw11 = 1 | ((irq > 31) << 1) | ((irq & 0xFFFF) << 16);
+        }
+
+        int failed = nvme_admin_batch(state, cmds, count, NULL);
+
+        if (failed != 0) {
+                ARC_DEBUG(ERR, "Failed to create %d io completion queues\n", failed);
+                free(cmds);
+                return -2;
+        }
+
+        memset(cmds, 0, sizeof(*cmds) * count);
+        for (int i = 0; i < count; i++) {
+                nvme_qpair_t *qpair = &state->qpairs.qs[i];
+
+                cmds[i].cdw0.opcode = 0x1;
+                cmds[i].prp.entry1 = ARC_HHDM_TO_PHYS(qpair->subq->base);
+                cmds[i].cdw10 = qpair->id | ((qpair->subq->objs - 1) << 16);
+                cmds[i].cdw11 = 1 | (qpair->prio << 1) | (qpair->id << 16);
+        }
+
+        failed = nvme_admin_batch(state, cmds, count, NULL);
+        free(cmds);
+
+        if (failed != 0) {
+                ARC_DEBUG(ERR, "Failed to create %d io submission queues\n", failed);
+                return -3;
+        }
+
+        state->qpairs.init = count;
+
+        return 0;
+}
+
+// Return the rings of a qpair to the state of a freshly created queue
+static int nvme_clear_qpair(nvme_qpair_t *qpair) {
+        spinlock_lock(&qpair->lock);
+
+        ARC_Ringbuffer *sub = qpair->subq;
+        ARC_Ringbuffer *cmp = qpair->cmpq;
+
+        ARC_Ringbuffer *new_sub = init_ringbuffer(sub->base, sub->objs, sizeof(qs_entry_t));
+        ARC_Ringbuffer *new_cmp = init_ringbuffer(cmp->base, cmp->objs, sizeof(qc_entry_t));
+
+        if (new_sub == NULL || new_cmp == NULL) {
+                ARC_DEBUG(ERR, "Failed to create ringbuffers for qpair %d\n", qpair->id);
+
+                if (new_sub != NULL) {
+                        uninit_ringbuffer(new_sub);
+                }
+
+                if (new_cmp != NULL) {
+                        uninit_ringbuffer(new_cmp);
+                }
+
+                spinlock_unlock(&qpair->lock);
+
+                return -1;
+        }
+
+        memset(sub->base, 0, sub->objs * sizeof(qs_entry_t));
+        memset(cmp->base, 0, cmp->objs * sizeof(qc_entry_t));
+        memset(qpair->slots, 0, sizeof(*qpair->slots) * sub->objs);
+        qpair->stats.occupancy = 0;
+
+        qpair->subq = new_sub;
+        qpair->cmpq = new_cmp;
+        qpair->phase = 1;
+
+        uninit_ringbuffer(sub);
+        uninit_ringbuffer(cmp);
+
+        spinlock_unlock(&qpair->lock);
+
+        return 0;
+}
+
+static int nvme_recreate_qpair(nvme_driver_state_t *state, nvme_qpair_t *qpair) {
+        // Delete I/O Submission Queue, then Delete I/O Completion Queue
+        qs_entry_t del[2] = {
+                { .cdw0.opcode = 0x0, .cdw10 = qpair->id },
+                { .cdw0.opcode = 0x4, .cdw10 = qpair->id },
+        };
+
+        for (int i = 0; i < 2; i++) {
+                if (nvme_admin_batch(state, &del[i], 1, NULL) != 0) {
+                        return -1;
+                }
+        }
+
+        if (nvme_clear_qpair(qpair) != 0) {
+                return -2;
+        }
+
+        qs_entry_t create[2] = {
+                { .cdw0.opcode = 0x5,
+                  .prp.entry1 = ARC_HHDM_TO_PHYS(qpair->cmpq->base),
+                  .cdw10 = qpair->id | ((qpair->cmpq->objs - 1) << 16),
+                  .cdw11 = 1 },
+                { .cdw0.opcode = 0x1,
+                  .prp.entry1 = ARC_HHDM_TO_PHYS(qpair->subq->base),
+                  .cdw10 = qpair->id | ((qpair->subq->objs - 1) << 16),
+                  .cdw11 = 1 | (qpair->prio << 1) | (qpair->id << 16) },
+        };
+
+        for (int i = 0; i < 2; i++) {
+                if (nvme_admin_batch(state, &create[i], 1, NULL) != 0) {
+                        return -3;
+                }
+        }
+
+        return 0;
+}
+
+static int nvme_try_recover(nvme_driver_state_t *state, nvme_qpair_t *qpair) {
+        if (qpair != NULL) {
+                if (nvme_recreate_qpair(state, qpair) == 0) {
+                        ARC_DEBUG(INFO, "Recovered qpair %d\n", qpair->id);
+                        state->stats.recoveries++;
+                        return 0;
+                }
+
+                ARC_DEBUG(WARN, "Failed to recover qpair %d, resetting controller\n", qpair->id);
+        }
+
+        ARC_ControlPacketInstruction cmd = { .command = NVME_TRANSPORT_CTRL_RESET };
+        ARC_ControlPacketResponse resp = state->transport->driver->control(state->transport, &cmd);
+
+        if (resp.type != NVME_TRANSPORT_CTRL_RESET) {
+                ARC_DEBUG(ERR, "Failed to reset controller\n");
+                return -2;
+        }
+
+        // The queue count is forgotten across a reset, and has to be set
+        // before any io queue is created
+        if (nvme_request_io_queues(state, state->qpairs.requested) < state->qpairs.init) {
+                ARC_DEBUG(ERR, "Controller granted fewer queues after reset\n");
+                return -3;
+        }
+
+        for (size_t i = 0; i < state->qpairs.init; i++) {
+                if (nvme_clear_qpair(&state->qpairs.qs[i]) != 0) {
+                        return -4;
+                }
+        }
+
+        // No io qpairs yet while the controller is being brought up
+        if (state->qpairs.init > 0 && nvme_register_io_qpairs(state, state->qpairs.init) != 0) {
+                return -5;
+        }
+
+        nvme_restore_tunables(state);
+        state->stats.resets++;
+
+        ARC_DEBUG(INFO, "Reset controller\n");
+
+        return 0;
+}
+
+int nvme_recover(nvme_driver_state_t *state, nvme_qpair_t *qpair) {
+        if (state == NULL) {
+                return -1;
+        }
+
+        // Admin commands lost from here on fail the recovery, rather than
+        // starting another one
+        state->recovering = true;
+        int r = nvme_try_recover(state, qpair);
+        state->recovering = false;
+
+        return r;
+}
+
 int init_nvme(ARC_Resource *res, void *arg) {
         if (arg == NULL) {
                 ARC_DEBUG(ERR, "NULL pointer given for transport resource\n");
@@ -296,27 +865,50 @@ int init_nvme(ARC_Resource *res, void *arg) {
         }
         
         state->poll = ident.poll;
+        state->try_poll = ident.try_poll;
         state->submit = ident.submit;
         
         nvme_identify_controller(state);
+        nvme_read_tunables(state);
+        nvme_expose_pmr(state);
         int sets = nvme_set_command_sets(state);
         
         nvme_namespace_t *namespaces = NULL;
         uint16_t ns_count = nvme_list_namespaces(state, &namespaces, sets);
-        uint16_t requested = ns_count * Arc_ProcessorCounter;
+
+        if (ns_count == 0) {
+                // Nothing to do I/O to, the admin queue is all that is needed
+                ARC_DEBUG(INFO, "No active namespaces, skipping io qpairs\n");
+                res->driver_state = state;
+                return 0;
+        }
+
+        // One qpair per processor for each priority class of each namespace
+        uint16_t requested = min((size_t)ns_count * Arc_ProcessorCounter * NVME_QOS_CLASSES, (size_t)UINT16_MAX);
         uint16_t granted = nvme_request_io_queues(state, requested);
 
         ARC_DEBUG(INFO, "ns_count: %d, requested: %d, granted: %d\n", ns_count, requested, granted);
         
         if (granted == 0) {
                 ARC_DEBUG(ERR, "No queues were granted\n");
+                nvme_free_namespaces(namespaces);
                 free(state);
                 return -6;
         }
         
         size_t qsize = 0x1000;
-        if (nvme_create_io_qpairs(state, min(requested, granted), qsize) != 0) {
+        uint16_t qcount = min(requested, granted);
+
+        if (qcount < 1) {
+                ARC_DEBUG(ERR, "No io qpairs to create\n");
+                nvme_free_namespaces(namespaces);
+                free(state);
+                return -6;
+        }
+
+        if (nvme_create_io_qpairs(state, qcount, qsize) != 0) {
                 ARC_DEBUG(ERR, "Failed to create all io qpairs\n");
+                nvme_free_namespaces(namespaces);
                 free(state);
                 return -7;
         }
@@ -324,10 +916,56 @@ int init_nvme(ARC_Resource *res, void *arg) {
         state->qpairs.requested = requested;
         state->qpairs.granted = granted;
 
+        // Everything the namespaces need from the controller is fetched
+        // here for all of them at once, so that the commands can be
+        // pipelined rather than issued one namespace at a time
+        nvme_identify_namespaces(state, namespaces, ns_count);
+
+        // Each namespace gets one qpair per processor for every priority
+        // class where possible. Classes are given up before processors, and
+        // once the qpairs run out namespaces start sharing them. Each
+        // namespace's qpairs are laid out class by class:
+        //     [ class 0 x per_class ][ class 1 x per_class ] ...
+        int classes = max(1, min(NVME_QOS_CLASSES, (int)qcount));
+        int per_class = max(1, min((int)Arc_ProcessorCounter, (int)qcount / classes));
+        int per_ns = per_class * classes;
+
+        for (int i = 0; i < qcount; i++) {
+                int class = (i % per_ns) / per_class;
+
+                if (i >= (qcount / per_ns) * per_ns) {
+                        // Left over, never handed to a namespace
+                        class = CNTRL_BLK_PRIO_NORMAL;
+                }
+
+                state->qpairs.qs[i].prio = nvme_class_qprio[class];
+        }
+
+        if (nvme_register_io_qpairs(state, qcount) != 0) {
+                ARC_DEBUG(ERR, "Failed to register io qpairs\n");
+                nvme_free_namespaces(namespaces);
+                nvme_free_io_qpairs(state->qpairs.qs, qcount);
+                free(state);
+                return -8;
+        }
+
+        int ns_idx = 0;
+
         nvme_namespace_t *namespace = namespaces;
         while (namespace != NULL) {
-                init_resource(ARC_DRIGRP_DEV, ARC_DRIDEF_DEV_NVME_NAMESPACE, &namespace->arg);
+                namespace->arg.qpair_base = (ns_idx % (qcount / per_ns)) * per_ns;
+                namespace->arg.qpair_count = per_class;
+                namespace->arg.qpair_classes = classes;
+                namespace->arg.qos = &state->qos;
+
+                if (namespace->arg.iden != NULL) {
+                        init_resource(ARC_DRIGRP_DEV, ARC_DRIDEF_DEV_NVME_NAMESPACE, &namespace->arg);
+                        pmm_fast_page_free(namespace->arg.iden);
+                        pmm_fast_page_free(namespace->arg.iden_csi);
+                }
+
                 namespace = namespace->next;
+                ns_idx++;
         }
         
         res->driver_state = state;
@@ -363,6 +1001,80 @@ static int stat_nvme_pci(ARC_Resource *res, char *filename, struct stat *stat) {
         return 0;
 }
 
+static ARC_ControlPacketResponse control_nvme(ARC_Resource *res, ARC_ControlPacketInstruction *inst) {
+        ARC_ControlPacketResponse resp = { 0 };
+
+        if (res == NULL || inst == NULL || inst->data == NULL) {
+                return resp;
+        }
+
+        nvme_driver_state_t *state = res->driver_state;
+        int status = 0;
+
+        switch (inst->command) {
+        case NVME_CTRL_STATS: {
+                memcpy(inst->data, &state->stats, sizeof(state->stats));
+
+                resp.type = inst->command;
+                resp.data = inst->data;
+                resp.size = sizeof(state->stats);
+
+                return resp;
+        }
+
+        case NVME_CTRL_SET_COALESCING: {
+                status = nvme_set_coalescing(state, inst->data);
+                break;
+        }
+
+        case NVME_CTRL_SET_VECTOR_CONFIG: {
+                status = nvme_set_vector_config(state, inst->data);
+                break;
+        }
+
+        case NVME_CTRL_SET_ARBITRATION: {
+                status = nvme_set_arbitration(state, inst->data);
+                break;
+        }
+
+        case NVME_CTRL_QPAIR_STATS: {
+                nvme_qpair_stats_args_t *args = inst->data;
+
+                if (args->qpair < 0 || (size_t)args->qpair >= state->qpairs.init) {
+                        goto err;
+                }
+
+                nvme_qpair_stats_t *stats = &state->qpairs.qs[args->qpair].stats;
+
+                memcpy(&args->stats, stats, sizeof(*stats));
+                args->avg_occupancy = args->stats.submitted == 0 ? 0 : args->stats.occupancy_sum / args->stats.submitted;
+
+                resp.type = inst->command;
+                resp.data = args;
+                resp.size = sizeof(*args);
+
+                return resp;
+        }
+
+        default: {
+                goto err;
+        }
+        }
+
+        if (status != 0) {
+                ARC_DEBUG(ERR, "Failed to set feature for command %d (status=%04X)\n", inst->command, status);
+                return resp;
+        }
+
+        resp.type = inst->command;
+
+        return resp;
+
+ err:
+        ARC_DEBUG(ERR, "Unhandled command %d\n", inst->command);
+        return (ARC_ControlPacketResponse) { 0 };
+}
+
 ARC_REGISTER_DRIVER(ARC_DRIGRP_DEV, nvme) = {
         .init = init_nvme,
 	.uninit = uninit_nvme,
@@ -371,5 +1083,6 @@ ARC_REGISTER_DRIVER(ARC_DRIGRP_DEV, nvme) = {
 	.seek = dridefs_int_func_empty,
 	.rename = dridefs_int_func_empty,
 	.stat = stat_nvme_pci,
+        .control = control_nvme,
 	.codes = NULL
 };
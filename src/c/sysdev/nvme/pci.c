@@ -10,14 +10,26 @@
 #include "arch/pager.h"
 #include "lib/ringbuffer.h"
 #include "lib/util.h"
+#include "drivers/sysdev/clock.h"
+#include <stddef.h>
 
 #define SQnTDBL(_properties, _n) ((uintptr_t)_properties->data + ((2 * (_n)) * (4 << MASKED_READ(_properties->cap, 32, 0b1111))))
 #define CQnHDBL(_properties, _n) ((uintptr_t)_properties->data + ((2 * (_n) + 1) * (4 << MASKED_READ(_properties->cap, 32, 0b1111))))
 
+// How long a command may be outstanding before it is considered lost
+#define NVME_ADMIN_TIMEOUT_MS 60000
+#define NVME_IO_TIMEOUT_MS 30000
+// How long to wait for an aborted command to be completed
+#define NVME_ABORT_GRACE_MS 1000
+
 typedef struct driver_state {
         ctrl_props_t *props;
         int exposed;
         nvme_qpair_t adminq;
+        struct {
+                void *base;
+                size_t size;
+        } pmr;
 } driver_state_t;
 
 // TODO: Atomic analysis
@@ -37,6 +49,8 @@ static qs_wrap_t nvme_pci_submit_command(ARC_Resource *transport, nvme_qpair_t *
                 admin = true;
         }
 
+        spinlock_lock(&qpair->lock);
+
 	size_t ptr = ringbuffer_allocate(qpair->subq, 1);
 
 	if (admin) {
@@ -46,9 +60,19 @@ static qs_wrap_t nvme_pci_submit_command(ARC_Resource *transport, nvme_qpair_t *
 	}
 
 	ringbuffer_write(qpair->subq, ptr, cmd);
+
+        nvme_qpair_stats_t *stats = &qpair->stats;
+        qpair->slots[ptr & 0xFF].submitted_at = clock_ns();
+        stats->submitted++;
+        stats->occupancy++;
+        stats->occupancy_sum += stats->occupancy;
+        stats->max_occupancy = max(stats->max_occupancy, stats->occupancy);
         
 	uint32_t *doorbell = (uint32_t *)SQnTDBL(state->props, qpair->id);
 	*doorbell = ((uint32_t)ptr + 1) % qpair->subq->objs;
+        stats->doorbells++;
+
+        spinlock_unlock(&qpair->lock);
         
         if (I) {
                 ARC_ENABLE_INTERRUPT;
@@ -57,53 +81,168 @@ static qs_wrap_t nvme_pci_submit_command(ARC_Resource *transport, nvme_qpair_t *
 	return (qs_wrap_t){ .cmd = cmd, .qpair = qpair };
 }
 
+// Completions are not necessarily posted in the order commands were
+// submitted. Any completion found at the head of the queue is stashed in
+// the slot of the command it belongs to, so that several commands may be
+// in flight at once and polled for in any order.
+static void nvme_pci_reap_completion(driver_state_t *state, nvme_qpair_t *qpair) {
+        spinlock_lock(&qpair->lock);
+
+	volatile qc_entry_t *qc = (struct qc_entry *)qpair->cmpq->base;
+	size_t i = qpair->cmpq->idx;
+
+	if (qc[i].phase != qpair->phase) {
+                spinlock_unlock(&qpair->lock);
+		return;
+	}
+
+	int slot = NVME_CID_SLOT(qpair, qc[i].cid);
+	memcpy(&qpair->slots[slot].entry, (void *)&qc[i], sizeof(qc_entry_t));
+	qpair->slots[slot].done = 1;
+
+        nvme_qpair_stats_t *stats = &qpair->stats;
+        uint64_t us = (clock_ns() - qpair->slots[slot].submitted_at) / 1000;
+        int bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+        stats->latency[min(bucket, NVME_LATENCY_BUCKETS - 1)]++;
+        stats->completed++;
+        stats->occupancy -= stats->occupancy > 0;
+
+	size_t idx = ringbuffer_allocate(qpair->cmpq, 1);
+
+	if (idx + 1 >= qpair->cmpq->objs) {
+		qpair->phase = !qpair->phase;
+                stats->phase_flips++;
+	}
+
+	uint32_t *doorbell = (uint32_t *)CQnHDBL(state->props, qpair->id);
+	*doorbell = ((uint32_t)idx + 1) % qpair->cmpq->objs;
+        stats->doorbells++;
+
+        spinlock_unlock(&qpair->lock);
+}
+
+static int nvme_pci_wait_slot(driver_state_t *state, nvme_qpair_t *qpair, int slot, uint64_t timeout_ns) {
+        struct clock_wait wait;
+        clock_wait_init(&wait, timeout_ns);
+
+        nvme_pci_reap_completion(state, qpair);
+
+        while (!qpair->slots[slot].done) {
+                if (clock_wait_step(&wait)) {
+                        return -1;
+                }
+
+                nvme_pci_reap_completion(state, qpair);
+        }
+
+        return 0;
+}
+
+static int nvme_pci_poll_completion(ARC_Resource *, qs_wrap_t *, qc_entry_t *);
+
+// Hand a reaped completion to the caller and free its submission slot
+static int nvme_pci_take_completion(nvme_qpair_t *qpair, int slot, qc_entry_t *ret) {
+        spinlock_lock(&qpair->lock);
+
+	int status = qpair->slots[slot].entry.status;
+
+	if (ret != NULL) {
+		memcpy(ret, &qpair->slots[slot].entry, sizeof(*ret));
+	}
+
+        qpair->slots[slot].done = 0;
+	ringbuffer_free(qpair->subq, slot);
+
+        spinlock_unlock(&qpair->lock);
+        
+	return status;
+}
+
+// Ask the controller to abort a command which has not completed in time,
+// then give it a moment to post the completion for the aborted command
+static int nvme_pci_abort(ARC_Resource *transport, nvme_qpair_t *qpair, uint16_t cid, int slot) {
+        driver_state_t *state = transport->driver_state;
+
+        qs_entry_t cmd = {
+                .cdw0.opcode = 0x8,
+                .cdw10 = qpair->id | ((uint32_t)cid << 16),
+        };
+
+        qs_wrap_t wrap = nvme_pci_submit_command(transport, NULL, &cmd);
+
+        if (nvme_pci_poll_completion(transport, &wrap, NULL) != 0) {
+                return -1;
+        }
+
+        return nvme_pci_wait_slot(state, qpair, slot, NVME_ABORT_GRACE_MS * CLOCK_NS_PER_MS);
+}
+
 // TODO: Atomic analysis
 static int nvme_pci_poll_completion(ARC_Resource *transport, qs_wrap_t *wrap, qc_entry_t *ret) {
 	if (transport == NULL || wrap->cmd == NULL) {
 		return -1;
 	}
         
+        driver_state_t *state = transport->driver_state;
         nvme_qpair_t *qpair = wrap->qpair;
-        qs_entry_t *cmd = wrap->cmd;
-	volatile qc_entry_t *qc = (struct qc_entry *)qpair->cmpq->base;
+        uint16_t cid = wrap->cmd->cdw0.cid;
+        int slot = NVME_CID_SLOT(qpair, cid);
+        bool admin = qpair == &state->adminq;
         
         bool I = arch_interrupts_enabled();
         //ARC_ENABLE_INTERRUPT; // Causes a double fault
 
-        size_t i = 0;
+        // The timeout runs from submission, not from when polling began
+        uint64_t deadline = qpair->slots[slot].submitted_at + (admin ? NVME_ADMIN_TIMEOUT_MS : NVME_IO_TIMEOUT_MS) * CLOCK_NS_PER_MS;
+        uint64_t now = clock_ns();
+        int timed_out = nvme_pci_wait_slot(state, qpair, slot, deadline > now ? deadline - now : 0);
 
-        do {
-		i = qpair->cmpq->idx;
-        } while (qc[i].phase != qpair->phase || qc[i].cid != cmd->cdw0.cid);
+        // An Abort which is lost itself is not aborted in turn
+        if (timed_out && !(admin && wrap->cmd->cdw0.opcode == 0x8)) {
+                ARC_DEBUG(WARN, "Command %d on qpair %d timed out, aborting\n", cid, qpair->id);
+                timed_out = nvme_pci_abort(transport, qpair, cid, slot);
+        }
         
         if (!I) {
                 ARC_DISABLE_INTERRUPT;
         }
-        
-	int status = qc[i].status;
 
-	if (ret != NULL) {
-		memcpy(ret, &qc[i], sizeof(*ret));
-	}
+        if (timed_out) {
+                // The slot stays allocated, it is reclaimed when the queue
+                // is recovered, or for the admin queue when the controller
+                // is reset
+                ARC_DEBUG(ERR, "Command %d on qpair %d was lost\n", cid, qpair->id);
+                return NVME_STATUS_TIMEOUT;
+        }
 
-	size_t idx = ringbuffer_allocate(qpair->cmpq, 1);
+        return nvme_pci_take_completion(qpair, slot, ret);
+}
 
-	if (idx == qpair->cmpq->objs - 1) {
-		qpair->phase = !qpair->phase;
+// Check on a command without waiting for it. Commands which are overdue
+// are only reported, the caller takes them through the timeout handling
+// of nvme_pci_poll_completion once it holds no locks of its own
+static int nvme_pci_try_poll_completion(ARC_Resource *transport, qs_wrap_t *wrap, qc_entry_t *ret) {
+	if (transport == NULL || wrap->cmd == NULL) {
+		return -1;
 	}
 
         driver_state_t *state = transport->driver_state;
-	uint32_t *doorbell = (uint32_t *)CQnHDBL(state->props, qpair->id);
-	*doorbell = ((uint32_t)idx + 1) % qpair->cmpq->objs;
+        nvme_qpair_t *qpair = wrap->qpair;
+        int slot = NVME_CID_SLOT(qpair, wrap->cmd->cdw0.cid);
 
-        if (idx + 1 >= qpair->cmpq->objs) {
-                qpair->phase = !qpair->phase;
+        if (!qpair->slots[slot].done) {
+                nvme_pci_reap_completion(state, qpair);
         }
-        
-        int cmd_idx = qpair->id ? (cmd->cdw0.cid >> 6) & 0xFF : (cmd->cdw0.cid);
-	ringbuffer_free(qpair->subq, cmd_idx);
-        
-	return status;
+
+        if (qpair->slots[slot].done) {
+                return nvme_pci_take_completion(qpair, slot, ret);
+        }
+
+        if (clock_ns() - qpair->slots[slot].submitted_at < NVME_IO_TIMEOUT_MS * CLOCK_NS_PER_MS) {
+                return NVME_STATUS_PENDING;
+        }
+
+        return NVME_STATUS_OVERDUE;
 }
 
 static int create_admin_qpair(driver_state_t *state, size_t qsize) {
@@ -120,6 +259,7 @@ static int create_admin_qpair(driver_state_t *state, size_t qsize) {
 
         if (sub == NULL) {
                 ARC_DEBUG(ERR, "Failed to create ringbuffer for submission queue\n");
+                pmm_free(queues);
                 return -2;
         }
         
@@ -127,12 +267,27 @@ static int create_admin_qpair(driver_state_t *state, size_t qsize) {
 
         if (comp == NULL) {
                 ARC_DEBUG(ERR, "Failed to create ringbuffer for completion queue\n");
-                // TODO: Delete ringbuffer
+                uninit_ringbuffer(sub);
+                pmm_free(queues);
                 return -3;
         }
 
+        nvme_cmp_slot_t *slots = alloc(sizeof(*slots) * NVME_ADMIN_QUEUE_SUB_LEN);
+
+        if (slots == NULL) {
+                ARC_DEBUG(ERR, "Failed to allocate completion slots\n");
+                uninit_ringbuffer(sub);
+                uninit_ringbuffer(comp);
+                pmm_free(queues);
+                return -4;
+        }
+
+        memset(slots, 0, sizeof(*slots) * NVME_ADMIN_QUEUE_SUB_LEN);
+
+        init_static_spinlock(&state->adminq.lock);
         state->adminq.id = 0;
         state->adminq.phase = 1;
+        state->adminq.slots = slots;
         state->adminq.cmpq = comp;
         state->adminq.subq = sub;
 
@@ -147,6 +302,29 @@ static int create_admin_qpair(driver_state_t *state, size_t qsize) {
         return 0;
 }
 
+// Wait for CSTS.RDY to reach the given value, for at most CAP.TO
+static int wait_controller_ready(ctrl_props_t *props, uint32_t ready) {
+        uint64_t timeout_ms = max(MASKED_READ(props->cap, 24, 0xFF), 1) * 500;
+
+        struct clock_wait wait;
+        clock_wait_init(&wait, timeout_ms * CLOCK_NS_PER_MS);
+
+        while (MASKED_READ(props->csts, 0, 1) != ready) {
+                // CSTS.CFS
+                if (MASKED_READ(props->csts, 1, 1)) {
+                        ARC_DEBUG(ERR, "Controller fatal status\n");
+                        return -1;
+                }
+
+                if (clock_wait_step(&wait)) {
+                        ARC_DEBUG(ERR, "Controller did not become %s within %lu ms\n", ready ? "ready" : "disabled", timeout_ms);
+                        return -2;
+                }
+        }
+
+        return 0;
+}
+
 static int reset_controller(driver_state_t *state) {
         if (state == NULL) {
 		ARC_DEBUG(ERR, "Failed to reset controller, state or properties NULL\n");
@@ -158,9 +336,19 @@ static int reset_controller(driver_state_t *state) {
 	// Disable
 	MASKED_WRITE(props->cc, 0, 0, 1);
 
-        // TODO: Portability?
-        // TODO: A timeout?
-	while (MASKED_READ(props->csts, 0, 1)) __builtin_ia32_pause();
+        if (wait_controller_ready(props, 0) != 0) {
+                return -3;
+        }
+
+        if (state->adminq.slots != NULL) {
+                // Resetting a running controller, throw out the old admin queue
+                // along with any command slots still held by lost commands
+                pmm_free(state->adminq.subq->base);
+                uninit_ringbuffer(state->adminq.subq);
+                uninit_ringbuffer(state->adminq.cmpq);
+                free(state->adminq.slots);
+                state->adminq.slots = NULL;
+        }
         
         if (create_admin_qpair(state, PAGE_SIZE) != 0) {
                 return -2;
@@ -181,28 +369,146 @@ static int reset_controller(driver_state_t *state) {
 		MASKED_WRITE(props->cc, 0b000, 4, 0b111);
 	}
 
-	// Set MPS and AMS
+	// Set MPS and AMS, weighted round robin if CAP.AMS allows it so
+	// that submission queue priorities are honoured
 	MASKED_WRITE(props->cc, 0, 7, 0b1111);
-	MASKED_WRITE(props->cc, 0, 11, 0b111);
+	MASKED_WRITE(props->cc, MASKED_READ(props->cap, 17, 1), 11, 0b111);
+
+        // Set IOSQES and IOCQES
+        MASKED_WRITE(props->cc, 6, 16, 0xF);
+	MASKED_WRITE(props->cc, 4, 20, 0xF);
         
 	// Enable
 	MASKED_WRITE(props->cc, 1, 0, 1);
 
-        // TODO: Portability?
-        // TODO: A timeout?
-	while (!MASKED_READ(props->csts, 0, 1)) __builtin_ia32_pause();
+        if (wait_controller_ready(props, 1) != 0) {
+                return -4;
+        }
 
 	return 0;
 }
 
+static volatile uint32_t *pci_get_bar(ARC_PCIHeaderMeta *meta, int bar) {
+        volatile ARC_PCIHdrDevice *device = &meta->header->s.device;
+
+        switch (bar) {
+        case 0: return &device->bar0;
+        case 1: return &device->bar1;
+        case 2: return &device->bar2;
+        case 3: return &device->bar3;
+        case 4: return &device->bar4;
+        case 5: return &device->bar5;
+        }
+
+        return NULL;
+}
+
+// Size a memory BAR by writing all ones and reading back the mask, high
+// is NULL for 32-bit BARs
+static size_t pci_size_bar(volatile uint32_t *low, volatile uint32_t *high) {
+        uint32_t orig_low = *low;
+        uint32_t orig_high = high == NULL ? 0 : *high;
+
+        *low = UINT32_MAX;
+        uint64_t mask = UINT64_MAX << 32;
+
+        if (high != NULL) {
+                *high = UINT32_MAX;
+                mask = (uint64_t)*high << 32;
+        }
+
+        mask |= *low & ~0xF;
+
+        *low = orig_low;
+
+        if (high != NULL) {
+                *high = orig_high;
+        }
+
+        return (size_t)(~mask + 1);
+}
+
+static int enable_pmr(driver_state_t *state, ARC_PCIHeaderMeta *meta) {
+        ctrl_props_t *props = state->props;
+
+        // CAP.PMRS
+        if (MASKED_READ(props->cap, 56, 1) == 0) {
+                return 0;
+        }
+
+        int bir = MASKED_READ(props->pmrcap, 5, 0b111);
+        volatile uint32_t *low = pci_get_bar(meta, bir);
+
+        if (low == NULL || ARC_BAR_IS_IOSPACE(*low)) {
+                ARC_DEBUG(ERR, "PMR is in unusable BAR %d\n", bir);
+                return -1;
+        }
+
+        // Memory BAR type, 0 for 32-bit and 2 for 64-bit, where the next
+        // BAR holds the upper half
+        int type = MASKED_READ(*low, 1, 0b11);
+        volatile uint32_t *high = NULL;
+
+        if (type == 2) {
+                high = pci_get_bar(meta, bir + 1);
+
+                if (high == NULL) {
+                        ARC_DEBUG(ERR, "PMR is in unusable BAR %d\n", bir);
+                        return -1;
+                }
+        } else if (type != 0) {
+                ARC_DEBUG(ERR, "PMR BAR %d is of unknown type %d\n", bir, type);
+                return -1;
+        }
+
+        uint64_t base = (*low & ~0xF) | (high == NULL ? 0 : (uint64_t)*high << 32);
+        size_t size = pci_size_bar(low, high);
+
+        uint32_t attrs = 1 << ARC_PAGER_4K | 1 << ARC_PAGER_NX | 1 << ARC_PAGER_RW | ARC_PAGER_PAT_UC;
+        if (pager_map(NULL, base, base, size, attrs) != 0) {
+                ARC_DEBUG(ERR, "Failed to map PMR\n");
+                return -2;
+        }
+
+        MASKED_WRITE(props->pmrctl, 1, 0, 1);
+
+        // PMRCAP.PMRTO in units of PMRCAP.PMRTU (500ms or minutes)
+        uint64_t timeout_ms = max(MASKED_READ(props->pmrcap, 16, 0xFF), 1);
+        timeout_ms *= MASKED_READ(props->pmrcap, 8, 0b11) == 0 ? 500 : 60000;
+
+        struct clock_wait wait;
+        clock_wait_init(&wait, timeout_ms * CLOCK_NS_PER_MS);
+
+        // PMRSTS.NRDY
+        while (MASKED_READ(props->pmrsts, 8, 1)) {
+                if (clock_wait_step(&wait)) {
+                        ARC_DEBUG(ERR, "PMR did not become ready\n");
+                        MASKED_WRITE(props->pmrctl, 0, 0, 1);
+                        return -3;
+                }
+        }
+
+        state->pmr.base = (void *)base;
+        state->pmr.size = size;
+
+        ARC_DEBUG(INFO, "PMR of 0x%lx bytes enabled at %p (BAR %d)\n", size, state->pmr.base, bir);
+
+        return 0;
+}
+
 static int uninit_nvme_pci(ARC_Resource *);
 int init_nvme_pci(ARC_Resource *res, void *arg) {
+        // Every command from the controller reset on is timed
+        init_clock();
+
         driver_state_t *state = alloc(sizeof(*state));
 
         if (state == NULL) {
                 ARC_DEBUG(ERR, "Failed to allocate state\n");
                 return -1;
         }
+
+        memset(state, 0, sizeof(*state));
         
         uint64_t mem_registers_base = 0;
 	uint64_t idx_data_pair_base = 0;
@@ -247,8 +553,9 @@ int init_nvme_pci(ARC_Resource *res, void *arg) {
                 return -4;
         }
 
-        MASKED_WRITE(state->props->cc, 6, 16, 0xF);
-	MASKED_WRITE(state->props->cc, 4, 20, 0xF);
+        if (enable_pmr(state, meta) != 0) {
+                ARC_DEBUG(WARN, "Continuing without PMR\n");
+        }
         
         res->driver_state = state;
         
@@ -331,6 +638,7 @@ static ARC_ControlPacketResponse control_nvme_pci(ARC_Resource *res, ARC_Control
                 
                 iden->submit = nvme_pci_submit_command;
                 iden->poll = nvme_pci_poll_completion;
+                iden->try_poll = nvme_pci_try_poll_completion;
                 iden->type = NVME_TRANSPORT_TYPE_PCI;
 
                 resp.type = inst->command;
@@ -344,6 +652,37 @@ static ARC_ControlPacketResponse control_nvme_pci(ARC_Resource *res, ARC_Control
                 state->exposed = NVME_TRANSPORT_CTRL_TO_PROPS;
                 return resp;
         }
+
+        case NVME_TRANSPORT_CTRL_PMR: {
+                nvme_pmr_args_t *pmr = inst->data;
+
+                if (pmr == NULL) {
+                        goto err;
+                }
+
+                pmr->base = state->pmr.base;
+                pmr->size = state->pmr.size;
+                // Computed from the register base, the member of the packed
+                // properties structure is not a pointer that may be kept
+                pmr->pmrsts = (volatile uint32_t *)((uintptr_t)state->props + offsetof(ctrl_props_t, pmrsts));
+                pmr->wbm = MASKED_READ(state->props->pmrcap, 10, 0xF);
+
+                resp.type = inst->command;
+                resp.data = pmr->base == NULL ? NULL : pmr;
+                resp.size = sizeof(*pmr);
+
+                return resp;
+        }
+
+        case NVME_TRANSPORT_CTRL_RESET: {
+                if (reset_controller(state) != 0) {
+                        goto err;
+                }
+
+                resp.type = inst->command;
+
+                return resp;
+        }
         }
 
  err:
@@ -0,0 +1,183 @@
+#include "drivers/sysdev/nvme/nvme.h"
+#include "drivers/cntrl_defs.h"
+#include "drivers/dri_defs.h"
+#include "drivers/resource.h"
+#include "fs/vfs.h"
+#include "lib/util.h"
+#include "mm/allocator.h"
+
+// Persistent memory region of an NVMe controller, exposed as a byte
+// addressable device. Writes land in the controller's PMR directly and
+// are made persistent by pmr_barrier (CNTRL_BLK_SYNC).
+
+typedef struct driver_state {
+        uint8_t *base;
+        size_t size;
+        volatile uint32_t *pmrsts;
+        uint8_t wbm;
+} driver_state_t;
+
+static void pmr_barrier(driver_state_t *state) {
+        __asm__ volatile("sfence" ::: "memory");
+
+        // PMRWBM bit 1: a read of PMRSTS completes only once prior writes
+        //               to the PMR are persistent
+        // PMRWBM bit 0: a read from the PMR completes only once prior
+        //               writes to the PMR have completed
+        if (MASKED_READ(state->wbm, 1, 1)) {
+                (void)*state->pmrsts;
+        } else if (MASKED_READ(state->wbm, 0, 1)) {
+                (void)*(volatile uint8_t *)state->base;
+        }
+}
+
+static int init_nvme_pmr(ARC_Resource *res, void *_arg) {
+        nvme_pmr_args_t *arg = _arg;
+
+        if (res == NULL || arg == NULL || arg->base == NULL) {
+                ARC_DEBUG(ERR, "Improper parameters\n");
+                return -1;
+        }
+
+        driver_state_t *state = alloc(sizeof(*state));
+
+        if (state == NULL) {
+                ARC_DEBUG(ERR, "Failed to allocate state\n");
+                return -2;
+        }
+
+        state->base = arg->base;
+        state->size = arg->size;
+        state->pmrsts = arg->pmrsts;
+        state->wbm = arg->wbm;
+
+        res->driver_state = state;
+
+        char path[64] = { 0 };
+        sprintf(path, "/dev/nvme%dpmr", arg->ctrl_id);
+        vfs_create(path, S_IFDIR | ARC_STD_PERM, res);
+
+        return 0;
+}
+
+static int uninit_nvme_pmr(ARC_Resource *res) {
+        if (res == NULL) {
+                return -1;
+        }
+
+        pmr_barrier(res->driver_state);
+        free(res->driver_state);
+
+        return 0;
+}
+
+static size_t pmr_clamp(driver_state_t *state, uint64_t offset, size_t size) {
+        if (offset >= state->size) {
+                return 0;
+        }
+
+        return min(size, state->size - offset);
+}
+
+static size_t read_nvme_pmr(void *buffer, size_t size, size_t count, ARC_File *file, ARC_Resource *res) {
+	if (buffer == NULL || size == 0 || count == 0 || file == NULL || res == NULL) {
+		return 0;
+	}
+
+        driver_state_t *state = res->driver_state;
+        size_t given = pmr_clamp(state, file->offset, size * count);
+
+        memcpy(buffer, state->base + file->offset, given);
+
+        return given;
+}
+
+static size_t write_nvme_pmr(void *buffer, size_t size, size_t count, ARC_File *file, ARC_Resource *res) {
+	if (buffer == NULL || size == 0 || count == 0 || file == NULL || res == NULL) {
+		return 0;
+	}
+
+        driver_state_t *state = res->driver_state;
+        size_t given = pmr_clamp(state, file->offset, size * count);
+
+        memcpy(state->base + file->offset, buffer, given);
+
+        return given;
+}
+
+static int stat_nvme_pmr(ARC_Resource *res, char *filename, struct stat *stat) {
+        (void)filename;
+
+        if (res == NULL || stat == NULL) {
+                return -1;
+        }
+
+        driver_state_t *state = res->driver_state;
+
+        stat->st_blksize = 1;
+        stat->st_size = state->size;
+
+        return 0;
+}
+
+static ARC_ControlPacketResponse control_nvme_pmr(ARC_Resource *res, ARC_ControlPacketInstruction *inst) {
+        ARC_ControlPacketResponse resp = { 0 };
+
+        if (res == NULL || inst == NULL) {
+                return resp;
+        }
+
+        driver_state_t *state = res->driver_state;
+
+        switch (inst->command) {
+        case CNTRL_BLK_SYNC: {
+                pmr_barrier(state);
+                resp.type = inst->command;
+
+                return resp;
+        }
+
+        case CNTRL_BLK_READ:
+        case CNTRL_BLK_WRITE: {
+                struct cntrl_blk_rw *rw = inst->data;
+
+                if (rw == NULL || rw->buffer == NULL) {
+                        goto err;
+                }
+
+                size_t given = pmr_clamp(state, rw->offset, rw->size);
+
+                if (inst->command == CNTRL_BLK_READ) {
+                        memcpy(rw->buffer, state->base + rw->offset, given);
+                } else {
+                        memcpy(state->base + rw->offset, rw->buffer, given);
+
+                        if (rw->flags & CNTRL_BLK_RW_FUA) {
+                                pmr_barrier(state);
+                        }
+                }
+
+                resp.type = inst->command;
+                resp.size = given;
+                resp.data = rw;
+
+                return resp;
+        }
+        }
+
+ err:
+        ARC_DEBUG(ERR, "Unhandled command %d\n", inst->command);
+        return (ARC_ControlPacketResponse) { 0 };
+}
+
+ARC_REGISTER_DRIVER(ARC_DRIGRP_DEV, nvme_pmr) = {
+        .init = init_nvme_pmr,
+	.uninit = uninit_nvme_pmr,
+	.read = read_nvme_pmr,
+	.write = write_nvme_pmr,
+	.seek = dridefs_int_func_empty,
+	.rename = dridefs_int_func_empty,
+	.stat = stat_nvme_pmr,
+        .control = control_nvme_pmr,
+	.codes = NULL
+};
@@ -24,11 +24,13 @@
  *
  * @DESCRIPTION
 */
-#include "abi-bits/seek-whence.h"
+#include "drivers/blkdev.h"
+#include "drivers/cntrl_defs.h"
 #include "drivers/dri_defs.h"
+#include "drivers/pcache.h"
+#include "drivers/readahead.h"
 #include "drivers/resource.h"
 #include "drivers/sysdev/partition_dummy.h"
-#include "fs/vfs.h"
 #include "global.h"
 #include "lib/util.h"
 #include "mm/allocator.h"
@@ -36,7 +38,9 @@
 #define NAME_FORMAT "%sp%d"
 
 struct driver_state {
-	struct ARC_File *drive;
+	struct ARC_Resource *drive_res;
+	ARC_BlockDevice *drive_dev; // NULL if the drive is not a registered block device
+	ARC_BlockDevice *dev;
 	uint64_t attrs;
 	uint64_t start_lba;
 	size_t size_in_lbas;
@@ -44,6 +48,18 @@ struct driver_state {
 	uint32_t partition_number;
 };
 
+// Asynchronous commands forwarded to the drive, remapped copies of their
+// data live here until the drive finishes them
+struct partition_async {
+	struct cntrl_blk_async async;
+	struct cntrl_blk_async *caller;
+	union {
+		struct cntrl_blk_rw rw;
+		struct cntrl_blk_ranges ranges;
+	} data;
+	struct cntrl_blk_range *remapped;
+};
+
 static int init_partition_dummy(struct ARC_Resource *res, void *args) {
 	if (res == NULL || args == NULL) {
 		return -1;
@@ -65,12 +81,49 @@ static int init_partition_dummy(struct ARC_Resource *res, void *args) {
 	state->size_in_lbas = dri_args->size_in_lbas;
 	state->partition_number = dri_args->partition_number;
 
-	vfs_open(dri_args->drive_path, 0, ARC_STD_PERM, &state->drive);
+	// Everything is forwarded to the drive directly, never through its path
+	state->drive_dev = blkdev_get(dri_args->drive_path);
+	state->drive_res = blkdev_lookup(dri_args->drive_path);
+
+	if (state->drive_res == NULL) {
+		ARC_DEBUG(ERR, "No block device registered for %s, cannot add partition %u\n", dri_args->drive_path, state->partition_number);
+		free(state);
+		return -3;
+	}
+
 	res->driver_state = state;
 
 	char *path = (char *)alloc(strlen(dri_args->drive_path) + 32);
 	sprintf(path, NAME_FORMAT, dri_args->drive_path, dri_args->partition_number);
 
+	if (state->drive_dev != NULL) {
+		ARC_BlockDevice *drive = state->drive_dev;
+		uint64_t start = state->start_lba * state->lba_size;
+
+		if (start % drive->block_size != 0) {
+			ARC_DEBUG(ERR, "Partition %u is not aligned to the blocks of its drive\n", state->partition_number);
+			state->drive_dev = NULL;
+		} else {
+			struct blkdev_info info = {
+			        .block_size = drive->block_size,
+				.blocks = (state->size_in_lbas * state->lba_size) / drive->block_size,
+				.max_blocks = drive->max_blocks,
+				.queue_count = 1,
+				.ops = NULL, // Requests are remapped onto the drive when submitted
+				.priv = state,
+				.parent = drive,
+				.parent_lba = start / drive->block_size,
+		        };
+
+			state->dev = blkdev_register(path, res, &info);
+		}
+	}
+
+	if (state->dev == NULL) {
+		// Reached through positional commands to the drive
+		blkdev_register(path, res, NULL);
+	}
+
 	/*
 	struct ARC_VFSNodeInfo info = {
 	        .type = ARC_VFS_N_DEV,
@@ -85,10 +138,144 @@ static int init_partition_dummy(struct ARC_Resource *res, void *args) {
 	return 0;
 }
 
-static int uninit_partition_dummy() {
+static int uninit_partition_dummy(struct ARC_Resource *res) {
+	blkdev_unregister(res);
+
 	return 0;
 };
 
+// Translate a byte range on the partition into one on the drive, returns
+// non-zero if the range does not lie within the partition
+static int partition_remap(struct driver_state *state, uint64_t *offset, uint64_t size) {
+	uint64_t limit = state->size_in_lbas * state->lba_size;
+
+	if (*offset > limit || size > limit - *offset) {
+		ARC_DEBUG(ERR, "Range 0x%"PRIx64"+0x%"PRIx64" exceeds partition %u\n", *offset, size, state->partition_number);
+		return -1;
+	}
+
+	*offset += state->start_lba * state->lba_size;
+
+	return 0;
+}
+
+// Positional transfer through the drive, cut short at the end of the
+// partition
+static size_t partition_rw(struct driver_state *state, uint32_t command, void *buffer, uint64_t offset, size_t size, uint32_t flags) {
+	uint64_t limit = state->size_in_lbas * state->lba_size;
+
+	if (offset >= limit) {
+		return 0;
+	}
+
+	struct cntrl_blk_rw rw = {
+	        .offset = offset + state->start_lba * state->lba_size,
+		.size = min(size, limit - offset),
+		.buffer = buffer,
+		.flags = flags,
+        };
+
+	ARC_ControlPacketResponse resp = blkdev_control(state->drive_res, command, &rw, sizeof(rw));
+
+	return resp.type == command ? resp.size : 0;
+}
+
+static void partition_async_done(struct cntrl_blk_async *req, int64_t result) {
+	struct partition_async *async = req->priv;
+
+	async->caller->done(async->caller, result);
+
+	free(async->remapped);
+	free(async);
+}
+
+static int partition_async_submit(struct driver_state *state, struct cntrl_blk_async *req) {
+	if (req == NULL || req->done == NULL) {
+		return -1;
+	}
+
+	struct partition_async *async = alloc(sizeof(*async));
+
+	if (async == NULL) {
+		ARC_DEBUG(ERR, "Failed to allocate async command\n");
+		return -1;
+	}
+
+	memset(async, 0, sizeof(*async));
+	async->caller = req;
+	async->async.command = req->command;
+	async->async.done = partition_async_done;
+	async->async.priv = async;
+
+	switch (req->command) {
+		case CNTRL_BLK_READ:
+		case CNTRL_BLK_WRITE: {
+			struct cntrl_blk_rw *rw = req->data;
+
+			if (rw == NULL) {
+				goto fail;
+			}
+
+			async->data.rw = *rw;
+
+			if (partition_remap(state, &async->data.rw.offset, rw->size) != 0) {
+				goto fail;
+			}
+
+			async->async.data = &async->data.rw;
+
+			break;
+		}
+
+		case CNTRL_BLK_DISCARD: {
+			struct cntrl_blk_ranges *list = req->data;
+
+			if (list == NULL || (list->count > 0 && list->ranges == NULL)) {
+				goto fail;
+			}
+
+			async->remapped = alloc(list->count * sizeof(*async->remapped));
+
+			if (async->remapped == NULL && list->count > 0) {
+				goto fail;
+			}
+
+			for (size_t i = 0; i < list->count; i++) {
+				async->remapped[i] = list->ranges[i];
+
+				if (partition_remap(state, &async->remapped[i].offset, async->remapped[i].size) != 0) {
+					goto fail;
+				}
+			}
+
+			async->data.ranges.count = list->count;
+			async->data.ranges.ranges = async->remapped;
+			async->async.data = &async->data.ranges;
+
+			break;
+		}
+
+		case CNTRL_BLK_SYNC: {
+			break;
+		}
+
+		default: {
+			goto fail;
+		}
+	}
+
+	// done may already have run, and freed async, by the time this returns
+	if (blkdev_control(state->drive_res, CNTRL_BLK_SUBMIT_ASYNC, &async->async, sizeof(async->async)).type == CNTRL_BLK_SUBMIT_ASYNC) {
+		return 0;
+	}
+
+	fail:
+	free(async->remapped);
+	free(async);
+
+	return -1;
+}
+
 static size_t read_partition_dummy(void *buffer, size_t size, size_t count, struct ARC_File *file, struct ARC_Resource *res) {
 	if (buffer == NULL || size == 0 || count == 0 || file == NULL || res == NULL) {
 		return 0;
@@ -96,9 +283,17 @@ static size_t read_partition_dummy(void *buffer, size_t size, size_t count, stru
 
 	struct driver_state *state = (struct driver_state *)res->driver_state;
 
-	vfs_seek(state->drive, file->offset + (state->start_lba * state->lba_size), SEEK_SET);
+	if (state->dev != NULL) {
+		struct readahead_window window = { 0 };
+
+		if (readahead_advance(file, file->offset, size * count, &window)) {
+			pcache_prefetch(state->dev, window.offset, window.size, CNTRL_BLK_PRIO_LOW << CNTRL_BLK_RW_PRIO_SHIFT);
+		}
 
-	return vfs_read(buffer, size, count, state->drive);
+		return blkdev_io(state->dev, false, file->offset, size * count, buffer, 0);
+	}
+
+	return partition_rw(state, CNTRL_BLK_READ, buffer, file->offset, size * count, 0);
 }
 
 static size_t write_partition_dummy(void *buffer, size_t size, size_t count, struct ARC_File *file, struct ARC_Resource *res) {
@@ -108,9 +303,11 @@ static size_t write_partition_dummy(void *buffer, size_t size, size_t count, str
 
 	struct driver_state *state = (struct driver_state *)res->driver_state;
 
-	vfs_seek(state->drive, file->offset + (state->start_lba * state->lba_size), SEEK_SET);
+	if (state->dev != NULL) {
+		return blkdev_io(state->dev, true, file->offset, size * count, buffer, 0);
+	}
 
-	return vfs_write(buffer, size, count, state->drive);
+	return partition_rw(state, CNTRL_BLK_WRITE, buffer, file->offset, size * count, 0);
 }
 
 static int stat_partition_dummy(struct ARC_Resource *res, char *filename, struct stat *stat) {
@@ -129,6 +326,133 @@ static int stat_partition_dummy(struct ARC_Resource *res, char *filename, struct
 	return 0;
 }
 
+static ARC_ControlPacketResponse control_partition_dummy(struct ARC_Resource *res, ARC_ControlPacketInstruction *inst) {
+	ARC_ControlPacketResponse resp = { 0 };
+
+	if (res == NULL || inst == NULL) {
+		return resp;
+	}
+
+	struct driver_state *state = (struct driver_state *)res->driver_state;
+
+	switch (inst->command) {
+		case CNTRL_BLK_SYNC: {
+			return blkdev_control(state->drive_res, inst->command, NULL, 0);
+		}
+
+		case CNTRL_BLK_CACHE_STATS:
+		case CNTRL_BLK_CACHE_TUNE: {
+			// The partition caches into the drive
+			return blkdev_control(state->drive_res, inst->command, inst->data, inst->size);
+		}
+
+		case CNTRL_BLK_SUBMIT_ASYNC: {
+			if (partition_async_submit(state, inst->data) != 0) {
+				return resp;
+			}
+
+			resp.type = inst->command;
+
+			return resp;
+		}
+
+		case CNTRL_BLK_POLL_ASYNC: {
+			// Completions of forwarded commands are reaped by the drive
+			return blkdev_control(state->drive_res, inst->command, NULL, 0);
+		}
+
+		case CNTRL_BLK_READ:
+		case CNTRL_BLK_WRITE: {
+			struct cntrl_blk_rw *rw = inst->data;
+
+			if (rw == NULL) {
+				return resp;
+			}
+
+			struct cntrl_blk_rw remapped = *rw;
+
+			if (partition_remap(state, &remapped.offset, remapped.size) != 0) {
+				return resp;
+			}
+
+			resp = blkdev_control(state->drive_res, inst->command, &remapped, sizeof(remapped));
+			resp.data = resp.data == NULL ? NULL : rw;
+
+			return resp;
+		}
+
+		case CNTRL_BLK_DISCARD:
+		case CNTRL_BLK_ZERO_RANGE: {
+			struct cntrl_blk_ranges *list = inst->data;
+
+			if (list == NULL || (list->count > 0 && list->ranges == NULL)) {
+				return resp;
+			}
+
+			struct cntrl_blk_range *ranges = alloc(list->count * sizeof(*ranges));
+
+			if (ranges == NULL) {
+				return resp;
+			}
+
+			for (size_t i = 0; i < list->count; i++) {
+				ranges[i] = list->ranges[i];
+
+				if (partition_remap(state, &ranges[i].offset, ranges[i].size) != 0) {
+					free(ranges);
+					return resp;
+				}
+			}
+
+			struct cntrl_blk_ranges remapped = { .count = list->count, .ranges = ranges };
+			resp = blkdev_control(state->drive_res, inst->command, &remapped, sizeof(remapped));
+
+			free(ranges);
+
+			return resp;
+		}
+
+		case CNTRL_BLK_COPY_RANGE: {
+			struct cntrl_blk_copy *copy = inst->data;
+
+			if (copy == NULL || (copy->count > 0 && copy->sources == NULL)) {
+				return resp;
+			}
+
+			struct cntrl_blk_range *sources = alloc(copy->count * sizeof(*sources));
+
+			if (sources == NULL) {
+				return resp;
+			}
+
+			uint64_t total = 0;
+			for (size_t i = 0; i < copy->count; i++) {
+				sources[i] = copy->sources[i];
+				total += sources[i].size;
+
+				if (partition_remap(state, &sources[i].offset, sources[i].size) != 0) {
+					free(sources);
+					return resp;
+				}
+			}
+
+			struct cntrl_blk_copy remapped = { .dest = copy->dest, .count = copy->count, .sources = sources };
+
+			if (partition_remap(state, &remapped.dest, total) == 0) {
+				resp = blkdev_control(state->drive_res, inst->command, &remapped, sizeof(remapped));
+			}
+
+			free(sources);
+
+			return resp;
+		}
+	}
+
+	ARC_DEBUG(ERR, "Unhandled command %d\n", inst->command);
+
+	return resp;
+}
+
 ARC_REGISTER_DRIVER(ARC_DRIGRP_DEV, partition_dummy) = {
         .init = init_partition_dummy,
 	.uninit = uninit_partition_dummy,
@@ -137,6 +461,7 @@ ARC_REGISTER_DRIVER(ARC_DRIGRP_DEV, partition_dummy) = {
 	.seek = dridefs_int_func_empty,
 	.rename = dridefs_int_func_empty,
 	.stat = stat_partition_dummy,
+	.control = control_partition_dummy,
 };
 
 #undef NAME_FORMAT
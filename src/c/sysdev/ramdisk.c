@@ -0,0 +1,273 @@
+/**
+ * @file ramdisk.c
+ *
+ * @author awewsomegamer <awewsomegamer@gmail.com>
+ *
+ * @LICENSE
+ * Arctan-OS/Kernel - Operating System Kernel
+ * Copyright (C) 2023-2025 awewsomegamer
+ *
+ * This file is part of Arctan-OS/Kernel.
+ *
+ * Arctan is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * @DESCRIPTION
+ * Sparse RAM block device, memory is only allocated for written pages.
+*/
+#include "drivers/blkdev.h"
+#include "drivers/cntrl_defs.h"
+#include "drivers/dri_defs.h"
+#include "drivers/resource.h"
+#include "drivers/sparse.h"
+#include "drivers/sysdev/ramdisk.h"
+#include "global.h"
+#include "lib/util.h"
+#include "mm/allocator.h"
+
+#define RAMDISK_DEFAULT_BLOCK 512
+
+struct driver_state {
+	ARC_BlockDevice *dev;
+	struct sparse data;
+	size_t size;
+	uint32_t block_size;
+};
+
+// Copies straight to or from the pages, every request finishes here
+static int ramdisk_queue(ARC_BlockDevice *dev, struct blkdev_request *req, int hwq) {
+	(void)hwq;
+
+	struct driver_state *state = dev->priv;
+	uint64_t offset = req->lba * state->block_size;
+	int status = 0;
+
+	switch (req->op) {
+		case BLKDEV_OP_READ:
+		case BLKDEV_OP_WRITE: {
+			for (size_t i = 0; i < req->vec_count && status == 0; i++) {
+				struct blkdev_vec *vec = &req->vecs[i];
+				size_t moved = req->op == BLKDEV_OP_READ ? sparse_read(&state->data, offset, vec->len, vec->base)
+					: sparse_write(&state->data, offset, vec->len, vec->base);
+
+				status = moved == vec->len ? 0 : -1;
+				offset += vec->len;
+			}
+
+			break;
+		}
+
+		case BLKDEV_OP_DISCARD: {
+			sparse_discard(&state->data, offset, req->count * state->block_size);
+			break;
+		}
+
+		case BLKDEV_OP_FLUSH: {
+			break;
+		}
+
+		default: {
+			status = -1;
+			break;
+		}
+	}
+
+	blkdev_end_request(req, status);
+
+	return 0;
+}
+
+static struct blkdev_ops ramdisk_ops = {
+        .queue = ramdisk_queue,
+	.poll = NULL,
+};
+
+// Clamp a byte range to the disk, returns the bytes of it which lie within
+static size_t ramdisk_clamp(struct driver_state *state, uint64_t offset, size_t size) {
+	if (offset >= state->size) {
+		return 0;
+	}
+
+	return min(size, state->size - offset);
+}
+
+static int init_ramdisk(struct ARC_Resource *res, void *args) {
+	if (res == NULL || args == NULL) {
+		return -1;
+	}
+
+	struct ARC_DriArgs_Ramdisk *dri_args = (struct ARC_DriArgs_Ramdisk *)args;
+	uint32_t block_size = dri_args->block_size == 0 ? RAMDISK_DEFAULT_BLOCK : dri_args->block_size;
+
+	if (dri_args->path == NULL || dri_args->size < block_size) {
+		ARC_DEBUG(ERR, "Improper parameters (%p %lu)\n", dri_args->path, dri_args->size);
+		return -1;
+	}
+
+	struct driver_state *state = (struct driver_state *)alloc(sizeof(*state));
+
+	if (state == NULL) {
+		return -2;
+	}
+
+	memset(state, 0, sizeof(*state));
+	init_sparse(&state->data);
+	state->block_size = block_size;
+	state->size = ALIGN_DOWN(dri_args->size, block_size);
+
+	struct blkdev_info info = {
+	        .block_size = block_size,
+		.blocks = state->size / block_size,
+		.max_blocks = 0,
+		.queue_count = 1,
+		.ops = &ramdisk_ops,
+		.priv = state,
+		.uncached = true,
+        };
+
+	res->driver_state = state;
+	state->dev = blkdev_register(dri_args->path, res, &info);
+
+	if (state->dev == NULL) {
+		ARC_DEBUG(ERR, "Failed to register %s\n", dri_args->path);
+		res->driver_state = NULL;
+		free(state);
+		return -3;
+	}
+
+	return 0;
+}
+
+static int uninit_ramdisk(struct ARC_Resource *res) {
+	if (res == NULL) {
+		return -1;
+	}
+
+	struct driver_state *state = (struct driver_state *)res->driver_state;
+
+	if (state == NULL) {
+		return -1;
+	}
+
+	blkdev_unregister(res);
+	uninit_sparse(&state->data);
+	free(state);
+
+	return 0;
+};
+
+static size_t read_ramdisk(void *buffer, size_t size, size_t count, struct ARC_File *file, struct ARC_Resource *res) {
+	if (buffer == NULL || size == 0 || count == 0 || file == NULL || res == NULL) {
+		return 0;
+ 	}
+
+	struct driver_state *state = (struct driver_state *)res->driver_state;
+
+	return sparse_read(&state->data, file->offset, ramdisk_clamp(state, file->offset, size * count), buffer);
+}
+
+static size_t write_ramdisk(void *buffer, size_t size, size_t count, struct ARC_File *file, struct ARC_Resource *res) {
+	if (buffer == NULL || size == 0 || count == 0 || file == NULL || res == NULL) {
+		return 0;
+ 	}
+
+	struct driver_state *state = (struct driver_state *)res->driver_state;
+
+	return sparse_write(&state->data, file->offset, ramdisk_clamp(state, file->offset, size * count), buffer);
+}
+
+static int stat_ramdisk(struct ARC_Resource *res, char *filename, struct stat *stat) {
+	(void)filename;
+
+	if (res == NULL || stat == NULL) {
+		return -1;
+	}
+
+	struct driver_state *state = (struct driver_state *)res->driver_state;
+
+	stat->st_blksize = state->block_size;
+	stat->st_blocks = state->size / state->block_size;
+	stat->st_size = state->size;
+
+	return 0;
+}
+
+static ARC_ControlPacketResponse control_ramdisk(struct ARC_Resource *res, ARC_ControlPacketInstruction *inst) {
+	ARC_ControlPacketResponse resp = { 0 };
+
+	if (res == NULL || inst == NULL) {
+		return resp;
+	}
+
+	struct driver_state *state = (struct driver_state *)res->driver_state;
+
+	switch (inst->command) {
+		case CNTRL_BLK_SYNC: {
+			// Nothing is volatile beyond what is already in memory
+			resp.type = inst->command;
+
+			return resp;
+		}
+
+		case CNTRL_BLK_READ:
+		case CNTRL_BLK_WRITE: {
+			struct cntrl_blk_rw *rw = inst->data;
+
+			if (rw == NULL || rw->buffer == NULL) {
+				return resp;
+			}
+
+			size_t size = ramdisk_clamp(state, rw->offset, rw->size);
+
+			resp.size = inst->command == CNTRL_BLK_READ ? sparse_read(&state->data, rw->offset, size, rw->buffer)
+				: sparse_write(&state->data, rw->offset, size, rw->buffer);
+			resp.type = inst->command;
+
+			return resp;
+		}
+
+		case CNTRL_BLK_DISCARD:
+		case CNTRL_BLK_ZERO_RANGE: {
+			// Discarded pages read back as zeroes, so both free memory
+			struct cntrl_blk_ranges *list = inst->data;
+
+			if (list == NULL || (list->count > 0 && list->ranges == NULL)) {
+				return resp;
+			}
+
+			for (size_t i = 0; i < list->count; i++) {
+				struct cntrl_blk_range *range = &list->ranges[i];
+				sparse_discard(&state->data, range->offset, ramdisk_clamp(state, range->offset, range->size));
+			}
+
+			resp.type = inst->command;
+
+			return resp;
+		}
+	}
+
+	ARC_DEBUG(ERR, "Unhandled command %d\n", inst->command);
+
+	return resp;
+}
+
+ARC_REGISTER_DRIVER(ARC_DRIGRP_DEV, ramdisk) = {
+        .init = init_ramdisk,
+	.uninit = uninit_ramdisk,
+	.read = read_ramdisk,
+	.write = write_ramdisk,
+	.seek = dridefs_int_func_empty,
+	.rename = dridefs_int_func_empty,
+	.stat = stat_ramdisk,
+	.control = control_ramdisk,
+};
@@ -0,0 +1,458 @@
+/**
+ * @file stripe.c
+ *
+ * @author awewsomegamer <awewsomegamer@gmail.com>
+ *
+ * @LICENSE
+ * Arctan-OS/Kernel - Operating System Kernel
+ * Copyright (C) 2023-2025 awewsomegamer
+ *
+ * This file is part of Arctan-OS/Kernel.
+ *
+ * Arctan is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * @DESCRIPTION
+ * Block level striping (RAID0) over registered block devices.
+*/
+#include "drivers/blkdev.h"
+#include "drivers/cntrl_defs.h"
+#include "drivers/dri_defs.h"
+#include "drivers/pcache.h"
+#include "drivers/readahead.h"
+#include "drivers/resource.h"
+#include "drivers/sysdev/stripe.h"
+#include "global.h"
+#include "lib/atomics.h"
+#include "lib/util.h"
+#include "mm/allocator.h"
+
+#define STRIPE_DEFAULT_CHUNK 0x10000
+
+struct driver_state {
+	ARC_BlockDevice *dev;
+	ARC_BlockDevice **members;
+	int member_count;
+	uint64_t chunk_blocks;
+};
+
+// A request split over the members, it ends once every child has
+struct stripe_io {
+	struct blkdev_request *req;
+	int pending;
+	int status;
+	struct blkdev_request children[]; // One per member, followed by their vectors
+};
+
+static void stripe_put(struct stripe_io *io) {
+	if (ARC_ATOMIC_DEC(io->pending) == 0) {
+		blkdev_end_request(io->req, io->status);
+		free(io);
+	}
+}
+
+static void stripe_end(struct blkdev_request *child) {
+	struct stripe_io *io = child->priv;
+
+	if (child->status != 0) {
+		ARC_ATOMIC_STORE(io->status, child->status);
+	}
+
+	stripe_put(io);
+}
+
+// Walk the request chunk by chunk. The chunks of a request which land on
+// the same member are contiguous on it, so each member gets one child.
+// Without children only the number of vectors of each member is counted.
+static void stripe_split(struct driver_state *state, struct blkdev_request *req, struct blkdev_request *children, size_t *vec_counts) {
+	uint32_t block_size = state->dev->block_size;
+	uint64_t lba = req->lba;
+	uint64_t left = req->count;
+	size_t vec = 0;
+	size_t skew = 0;
+
+	while (left > 0) {
+		uint64_t chunk = lba / state->chunk_blocks;
+		uint64_t offset = lba % state->chunk_blocks;
+		int member = chunk % state->member_count;
+		uint64_t blocks = min(state->chunk_blocks - offset, left);
+
+		if (children != NULL) {
+			struct blkdev_request *child = &children[member];
+
+			if (child->count == 0) {
+				child->lba = (chunk / state->member_count) * state->chunk_blocks + offset;
+			}
+
+			child->count += blocks;
+		}
+
+		if (req->op == BLKDEV_OP_READ || req->op == BLKDEV_OP_WRITE) {
+			size_t bytes = blocks * block_size;
+
+			while (bytes > 0 && vec < req->vec_count) {
+				size_t part = min(bytes, req->vecs[vec].len - skew);
+
+				if (children != NULL) {
+					struct blkdev_request *child = &children[member];
+					child->vecs[child->vec_count].base = req->vecs[vec].base + skew;
+					child->vecs[child->vec_count].len = part;
+					child->vec_count++;
+				} else {
+					vec_counts[member]++;
+				}
+
+				bytes -= part;
+				skew += part;
+
+				if (skew == req->vecs[vec].len) {
+					vec++;
+					skew = 0;
+				}
+			}
+		}
+
+		lba += blocks;
+		left -= blocks;
+	}
+}
+
+static int stripe_queue(ARC_BlockDevice *dev, struct blkdev_request *req, int hwq) {
+	(void)hwq;
+
+	struct driver_state *state = dev->priv;
+	int count = state->member_count;
+	size_t *vec_counts = alloc(count * sizeof(*vec_counts));
+
+	if (vec_counts == NULL) {
+		ARC_DEBUG(ERR, "Failed to allocate request\n");
+		return -1;
+	}
+
+	memset(vec_counts, 0, count * sizeof(*vec_counts));
+
+	size_t vec_total = 0;
+
+	if (req->op != BLKDEV_OP_FLUSH) {
+		stripe_split(state, req, NULL, vec_counts);
+
+		for (int i = 0; i < count; i++) {
+			vec_total += vec_counts[i];
+		}
+	}
+
+	struct stripe_io *io = alloc(sizeof(*io) + count * sizeof(struct blkdev_request) + vec_total * sizeof(struct blkdev_vec));
+
+	if (io == NULL) {
+		ARC_DEBUG(ERR, "Failed to allocate request\n");
+		free(vec_counts);
+		return -1;
+	}
+
+	memset(io, 0, sizeof(*io) + count * sizeof(struct blkdev_request));
+
+	struct blkdev_vec *vecs = (struct blkdev_vec *)&io->children[count];
+
+	for (int i = 0; i < count; i++) {
+		struct blkdev_request *child = &io->children[i];
+
+		child->dev = state->members[i];
+		child->op = req->op;
+		child->flags = req->flags;
+		child->vecs = vecs;
+		child->end = stripe_end;
+		child->priv = io;
+
+		vecs += vec_counts[i];
+	}
+
+	free(vec_counts);
+
+	if (req->op != BLKDEV_OP_FLUSH) {
+		stripe_split(state, req, io->children, NULL);
+	}
+
+	io->req = req;
+	// Held until every child is submitted, children may end straight away
+	io->pending = 1;
+
+	for (int i = 0; i < count; i++) {
+		struct blkdev_request *child = &io->children[i];
+
+		if (child->count == 0 && req->op != BLKDEV_OP_FLUSH) {
+			continue;
+		}
+
+		ARC_ATOMIC_INC(io->pending);
+		blkdev_submit(child);
+	}
+
+	stripe_put(io);
+
+	return 0;
+}
+
+static int stripe_poll(ARC_BlockDevice *dev, int hwq) {
+	(void)hwq;
+
+	struct driver_state *state = dev->priv;
+
+	for (int i = 0; i < state->member_count; i++) {
+		blkdev_poll(state->members[i]);
+	}
+
+	return 0;
+}
+
+static struct blkdev_ops stripe_ops = {
+        .queue = stripe_queue,
+	.poll = stripe_poll,
+};
+
+static int init_stripe(struct ARC_Resource *res, void *args) {
+	if (res == NULL || args == NULL) {
+		return -1;
+	}
+
+	struct ARC_DriArgs_Stripe *dri_args = (struct ARC_DriArgs_Stripe *)args;
+
+	if (dri_args->path == NULL || dri_args->members == NULL || dri_args->member_count <= 0) {
+		ARC_DEBUG(ERR, "Improper parameters (%p %p %d)\n", dri_args->path, dri_args->members, dri_args->member_count);
+		return -1;
+	}
+
+	struct driver_state *state = (struct driver_state *)alloc(sizeof(*state));
+
+	if (state == NULL) {
+		return -2;
+	}
+
+	memset(state, 0, sizeof(*state));
+
+	state->member_count = dri_args->member_count;
+	state->members = alloc(state->member_count * sizeof(*state->members));
+
+	if (state->members == NULL) {
+		free(state);
+		return -2;
+	}
+
+	uint32_t block_size = 0;
+	uint64_t member_blocks = UINT64_MAX;
+	uint32_t max_blocks = UINT32_MAX;
+	int queue_count = 1;
+	uint32_t queue_depth = 0;
+
+	for (int i = 0; i < state->member_count; i++) {
+		ARC_BlockDevice *member = blkdev_get(dri_args->members[i]);
+
+		if (member == NULL || (block_size != 0 && member->block_size != block_size)) {
+			ARC_DEBUG(ERR, "%s is not a block device or its blocks differ from the other members\n", dri_args->members[i]);
+			free(state->members);
+			free(state);
+			return -3;
+		}
+
+		state->members[i] = member;
+		block_size = member->block_size;
+		member_blocks = min(member_blocks, member->blocks);
+		max_blocks = min(max_blocks, member->max_blocks);
+		queue_count = max(queue_count, member->queue_count);
+		queue_depth += member->queues[0].depth;
+	}
+
+	size_t chunk_size = dri_args->chunk_size == 0 ? STRIPE_DEFAULT_CHUNK : dri_args->chunk_size;
+
+	if (chunk_size % block_size != 0) {
+		ARC_DEBUG(ERR, "Chunk size %lu is not a multiple of the block size %u\n", chunk_size, block_size);
+		free(state->members);
+		free(state);
+		return -4;
+	}
+
+	state->chunk_blocks = chunk_size / block_size;
+
+	// Only whole rows of chunks are used
+	uint64_t rows = member_blocks / state->chunk_blocks;
+
+	struct blkdev_info info = {
+	        .block_size = block_size,
+		.blocks = rows * state->chunk_blocks * state->member_count,
+		.max_blocks = max_blocks,
+		.queue_count = queue_count,
+		.queue_depth = queue_depth,
+		.ops = &stripe_ops,
+		.priv = state,
+        };
+
+	res->driver_state = state;
+	state->dev = blkdev_register(dri_args->path, res, &info);
+
+	if (state->dev == NULL) {
+		ARC_DEBUG(ERR, "Failed to register %s\n", dri_args->path);
+		res->driver_state = NULL;
+		free(state->members);
+		free(state);
+		return -5;
+	}
+
+	ARC_DEBUG(INFO, "Striped %d devices into %s (%lu byte chunks, %lu blocks)\n", state->member_count, dri_args->path, chunk_size, info.blocks);
+
+	return 0;
+}
+
+static int uninit_stripe(struct ARC_Resource *res) {
+	if (res == NULL) {
+		return -1;
+	}
+
+	struct driver_state *state = (struct driver_state *)res->driver_state;
+
+	if (state == NULL) {
+		return -1;
+	}
+
+	pcache_sync(state->dev);
+	blkdev_unregister(res);
+
+	free(state->members);
+	free(state);
+
+	return 0;
+};
+
+static size_t read_stripe(void *buffer, size_t size, size_t count, struct ARC_File *file, struct ARC_Resource *res) {
+	if (buffer == NULL || size == 0 || count == 0 || file == NULL || res == NULL) {
+		return 0;
+ 	}
+
+	struct driver_state *state = (struct driver_state *)res->driver_state;
+	struct readahead_window window = { 0 };
+
+	if (readahead_advance(file, file->offset, size * count, &window)) {
+		pcache_prefetch(state->dev, window.offset, window.size, CNTRL_BLK_PRIO_LOW << CNTRL_BLK_RW_PRIO_SHIFT);
+	}
+
+	return blkdev_io(state->dev, false, file->offset, size * count, buffer, 0);
+}
+
+static size_t write_stripe(void *buffer, size_t size, size_t count, struct ARC_File *file, struct ARC_Resource *res) {
+	if (buffer == NULL || size == 0 || count == 0 || file == NULL || res == NULL) {
+		return 0;
+ 	}
+
+	struct driver_state *state = (struct driver_state *)res->driver_state;
+
+	return blkdev_io(state->dev, true, file->offset, size * count, buffer, 0);
+}
+
+static int stat_stripe(struct ARC_Resource *res, char *filename, struct stat *stat) {
+	(void)filename;
+
+	if (res == NULL || stat == NULL) {
+		return -1;
+	}
+
+	struct driver_state *state = (struct driver_state *)res->driver_state;
+
+	stat->st_blksize = state->dev->block_size;
+	stat->st_blocks = state->dev->blocks;
+	stat->st_size = state->dev->blocks * state->dev->block_size;
+
+	return 0;
+}
+
+static ARC_ControlPacketResponse control_stripe(struct ARC_Resource *res, ARC_ControlPacketInstruction *inst) {
+	ARC_ControlPacketResponse resp = { 0 };
+
+	if (res == NULL || inst == NULL) {
+		return resp;
+	}
+
+	struct driver_state *state = (struct driver_state *)res->driver_state;
+
+	switch (inst->command) {
+		case CNTRL_BLK_SYNC: {
+			if (pcache_sync(state->dev) != 0) {
+				return resp;
+			}
+
+			resp.type = inst->command;
+
+			return resp;
+		}
+
+		case CNTRL_BLK_READ:
+		case CNTRL_BLK_WRITE: {
+			struct cntrl_blk_rw *rw = inst->data;
+
+			if (rw == NULL || rw->buffer == NULL) {
+				return resp;
+			}
+
+			resp.size = blkdev_io(state->dev, inst->command == CNTRL_BLK_WRITE, rw->offset, rw->size, rw->buffer, rw->flags);
+			resp.type = inst->command;
+
+			return resp;
+		}
+
+		case CNTRL_BLK_DISCARD: {
+			struct cntrl_blk_ranges *list = inst->data;
+			uint32_t block_size = state->dev->block_size;
+
+			if (list == NULL || (list->count > 0 && list->ranges == NULL)) {
+				return resp;
+			}
+
+			for (size_t i = 0; i < list->count; i++) {
+				struct cntrl_blk_range *range = &list->ranges[i];
+
+				if (range->offset % block_size != 0 || range->size % block_size != 0
+				    || blkdev_discard(state->dev, range->offset / block_size, range->size / block_size) != 0) {
+					return resp;
+				}
+			}
+
+			resp.type = inst->command;
+
+			return resp;
+		}
+
+		case CNTRL_BLK_CACHE_STATS:
+		case CNTRL_BLK_CACHE_TUNE: {
+			if (pcache_control(state->dev, inst->command, inst->data) != 0) {
+				return resp;
+			}
+
+			resp.size = sizeof(struct cntrl_blk_cache);
+			resp.type = inst->command;
+
+			return resp;
+		}
+	}
+
+	ARC_DEBUG(ERR, "Unhandled command %d\n", inst->command);
+
+	return resp;
+}
+
+ARC_REGISTER_DRIVER(ARC_DRIGRP_DEV, stripe) = {
+        .init = init_stripe,
+	.uninit = uninit_stripe,
+	.read = read_stripe,
+	.write = write_stripe,
+	.seek = dridefs_int_func_empty,
+	.rename = dridefs_int_func_empty,
+	.stat = stat_stripe,
+	.control = control_stripe,
+};
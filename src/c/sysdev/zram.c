@@ -0,0 +1,666 @@
+/**
+ * @file zram.c
+ *
+ * @author awewsomegamer <awewsomegamer@gmail.com>
+ *
+ * @LICENSE
+ * Arctan-OS/Kernel - Operating System Kernel
+ * Copyright (C) 2023-2025 awewsomegamer
+ *
+ * This file is part of Arctan-OS/Kernel.
+ *
+ * Arctan is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * @DESCRIPTION
+ * Compressed RAM block device, every page is kept LZ4 compressed.
+*/
+#include "arch/smp.h"
+#include "drivers/blkdev.h"
+#include "drivers/cntrl_defs.h"
+#include "drivers/dri_defs.h"
+#include "drivers/lz4.h"
+#include "drivers/resource.h"
+#include "drivers/sysdev/zram.h"
+#include "global.h"
+#include "lib/atomics.h"
+#include "lib/util.h"
+#include "mm/allocator.h"
+#include "mm/pmm.h"
+
+#define ZRAM_DEFAULT_BLOCK 512
+#define ZRAM_MAX_COMPRESSED (PAGE_SIZE * 3 / 4) // Larger pages are kept raw
+#define ZRAM_LOCKS 64
+#define ZRAM_MAX_PROCESSORS 64
+
+#define ZRAM_EMPTY 0
+#define ZRAM_SAME 1 // handle is the repeated word
+#define ZRAM_RAW 2 // handle is a page
+#define ZRAM_COMPRESSED 3 // handle is size bytes of LZ4
+
+struct zram_slot {
+	uintptr_t handle;
+	uint16_t size;
+	uint8_t type;
+	bool busy; // Claimed by a writer from reading the old page to storing the new one
+};
+
+struct driver_state {
+	ARC_BlockDevice *dev;
+	struct zram_slot *slots; // One per page of the device
+	uint64_t page_count;
+	ARC_GenericSpinlock locks[ZRAM_LOCKS]; // Striped over the slots
+	size_t size;
+	uint32_t block_size;
+	struct zram_stats stats;
+};
+
+// Scratch memory of a processor, a page to compress into, a page to
+// merge partial writes in and the match table of the compressor
+struct zram_workspace {
+	ARC_GenericSpinlock lock;
+	uint8_t *buffer;
+};
+
+static struct zram_workspace zram_workspaces[ZRAM_MAX_PROCESSORS] = { 0 };
+
+static struct zram_workspace *zram_get_workspace() {
+	struct zram_workspace *work = &zram_workspaces[smp_get_processor_id() % ZRAM_MAX_PROCESSORS];
+
+	spinlock_lock(&work->lock);
+
+	if (work->buffer == NULL && (work->buffer = alloc(PAGE_SIZE * 2 + LZ4_WORK_SIZE)) == NULL) {
+		ARC_DEBUG(ERR, "Failed to allocate workspace\n");
+		spinlock_unlock(&work->lock);
+		return NULL;
+	}
+
+	return work;
+}
+
+static void zram_put_workspace(struct zram_workspace *work) {
+	spinlock_unlock(&work->lock);
+}
+
+static ARC_GenericSpinlock *zram_lock(struct driver_state *state, uint64_t index) {
+	return &state->locks[index % ZRAM_LOCKS];
+}
+
+// Become the only writer of a page, so that merging a partial write with
+// what the page held cannot lose a write made in between
+static void zram_claim(struct driver_state *state, uint64_t index) {
+	ARC_GenericSpinlock *lock = zram_lock(state, index);
+
+	while (1) {
+		spinlock_lock(lock);
+
+		if (!state->slots[index].busy) {
+			state->slots[index].busy = true;
+			spinlock_unlock(lock);
+			return;
+		}
+
+		spinlock_unlock(lock);
+	}
+}
+
+static void zram_release(struct driver_state *state, uint64_t index) {
+	ARC_GenericSpinlock *lock = zram_lock(state, index);
+
+	spinlock_lock(lock);
+	state->slots[index].busy = false;
+	spinlock_unlock(lock);
+}
+
+// Call with the lock of the slot held
+static void zram_free_slot(struct driver_state *state, struct zram_slot *slot) {
+	switch (slot->type) {
+		case ZRAM_SAME: {
+			ARC_ATOMIC_DEC(state->stats.same_pages);
+			break;
+		}
+
+		case ZRAM_RAW: {
+			pmm_fast_page_free((void *)slot->handle);
+			ARC_ATOMIC_DEC(state->stats.raw_pages);
+			ARC_ATOMIC_ADD(state->stats.memory_used, -(uint64_t)PAGE_SIZE);
+			break;
+		}
+
+		case ZRAM_COMPRESSED: {
+			free((void *)slot->handle);
+			ARC_ATOMIC_ADD(state->stats.compressed_bytes, -(uint64_t)slot->size);
+			ARC_ATOMIC_ADD(state->stats.memory_used, -(uint64_t)slot->size);
+			break;
+		}
+	}
+
+	if (slot->type != ZRAM_EMPTY) {
+		ARC_ATOMIC_DEC(state->stats.stored_pages);
+	}
+
+	slot->handle = 0;
+	slot->size = 0;
+	slot->type = ZRAM_EMPTY;
+}
+
+// Call with the lock of the slot held
+static int zram_load(struct driver_state *state, uint64_t index, uint8_t *page) {
+	struct zram_slot *slot = &state->slots[index];
+
+	switch (slot->type) {
+		case ZRAM_EMPTY: {
+			memset(page, 0, PAGE_SIZE);
+			return 0;
+		}
+
+		case ZRAM_SAME: {
+			uint64_t *words = (uint64_t *)page;
+
+			for (size_t i = 0; i < PAGE_SIZE / sizeof(uint64_t); i++) {
+				words[i] = slot->handle;
+			}
+
+			return 0;
+		}
+
+		case ZRAM_RAW: {
+			memcpy(page, (void *)slot->handle, PAGE_SIZE);
+			return 0;
+		}
+
+		case ZRAM_COMPRESSED: {
+			if (lz4_decompress((void *)slot->handle, slot->size, page, PAGE_SIZE) != PAGE_SIZE) {
+				ARC_DEBUG(ERR, "Page %lu is corrupt\n", index);
+				return -1;
+			}
+
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+static bool zram_same_filled(uint8_t *page, uint64_t *word) {
+	uint64_t *words = (uint64_t *)page;
+
+	for (size_t i = 1; i < PAGE_SIZE / sizeof(uint64_t); i++) {
+		if (words[i] != words[0]) {
+			return false;
+		}
+	}
+
+	*word = words[0];
+
+	return true;
+}
+
+// Replace the contents of a page, compressing outside of its lock. Call
+// with the page claimed
+static int zram_store(struct driver_state *state, uint64_t index, uint8_t *page, struct zram_workspace *work) {
+	struct zram_slot slot = { 0 };
+	uint64_t word = 0;
+
+	if (zram_same_filled(page, &word)) {
+		slot.type = ZRAM_SAME;
+		slot.handle = word;
+	} else {
+		size_t size = lz4_compress(page, PAGE_SIZE, work->buffer, ZRAM_MAX_COMPRESSED, work->buffer + PAGE_SIZE * 2);
+		void *data = NULL;
+
+		if (size == 0) {
+			// Would gain too little to be worth decompressing
+			if ((data = pmm_fast_page_alloc()) != NULL) {
+				memcpy(data, page, PAGE_SIZE);
+			}
+
+			slot.type = ZRAM_RAW;
+			slot.size = 0;
+		} else {
+			if ((data = alloc(size)) != NULL) {
+				memcpy(data, work->buffer, size);
+			}
+
+			slot.type = ZRAM_COMPRESSED;
+			slot.size = size;
+		}
+
+		if (data == NULL) {
+			ARC_DEBUG(ERR, "Failed to allocate page %lu\n", index);
+			return -1;
+		}
+
+		slot.handle = (uintptr_t)data;
+	}
+
+	ARC_GenericSpinlock *lock = zram_lock(state, index);
+
+	spinlock_lock(lock);
+
+	zram_free_slot(state, &state->slots[index]);
+	state->slots[index].handle = slot.handle;
+	state->slots[index].size = slot.size;
+	state->slots[index].type = slot.type;
+
+	spinlock_unlock(lock);
+
+	ARC_ATOMIC_INC(state->stats.stored_pages);
+
+	switch (slot.type) {
+		case ZRAM_SAME: {
+			ARC_ATOMIC_INC(state->stats.same_pages);
+			break;
+		}
+
+		case ZRAM_RAW: {
+			ARC_ATOMIC_INC(state->stats.raw_pages);
+			ARC_ATOMIC_ADD(state->stats.memory_used, PAGE_SIZE);
+			break;
+		}
+
+		case ZRAM_COMPRESSED: {
+			ARC_ATOMIC_ADD(state->stats.compressed_bytes, slot.size);
+			ARC_ATOMIC_ADD(state->stats.memory_used, slot.size);
+			break;
+		}
+	}
+
+	return 0;
+}
+
+static void zram_drop(struct driver_state *state, uint64_t index) {
+	ARC_GenericSpinlock *lock = zram_lock(state, index);
+
+	zram_claim(state, index);
+
+	spinlock_lock(lock);
+	zram_free_slot(state, &state->slots[index]);
+	spinlock_unlock(lock);
+
+	zram_release(state, index);
+}
+
+// Move bytes within the device, pages which are only partly written are
+// merged with what they held
+static size_t zram_rw(struct driver_state *state, bool write, uint64_t offset, size_t size, uint8_t *buffer) {
+	if (offset >= state->size) {
+		return 0;
+	}
+
+	size = min(size, state->size - offset);
+
+	struct zram_workspace *work = zram_get_workspace();
+
+	if (work == NULL) {
+		return 0;
+	}
+
+	uint8_t *merge = work->buffer + PAGE_SIZE;
+	size_t done = 0;
+
+	while (done < size) {
+		uint64_t index = (offset + done) / PAGE_SIZE;
+		size_t skew = (offset + done) % PAGE_SIZE;
+		size_t part = min(PAGE_SIZE - skew, size - done);
+		bool whole = part == PAGE_SIZE;
+		ARC_GenericSpinlock *lock = zram_lock(state, index);
+		int r = 0;
+
+		if (write) {
+			zram_claim(state, index);
+		}
+
+		if (!write || !whole) {
+			spinlock_lock(lock);
+			r = zram_load(state, index, (whole && !write) ? buffer + done : merge);
+			spinlock_unlock(lock);
+		}
+
+		if (r == 0 && !write && !whole) {
+			memcpy(buffer + done, merge + skew, part);
+		} else if (r == 0 && write) {
+			uint8_t *page = buffer + done;
+
+			if (!whole) {
+				memcpy(merge + skew, buffer + done, part);
+				page = merge;
+			}
+
+			r = zram_store(state, index, page, work);
+		}
+
+		if (write) {
+			zram_release(state, index);
+		}
+
+		if (r != 0) {
+			ARC_ATOMIC_INC(state->stats.failed);
+			break;
+		}
+
+		ARC_ATOMIC_INC(*(write ? &state->stats.writes : &state->stats.reads));
+		done += part;
+	}
+
+	zram_put_workspace(work);
+
+	return done;
+}
+
+// Pages covered entirely are freed, with zero the rest of the range is
+// overwritten too
+static int zram_discard(struct driver_state *state, uint64_t offset, uint64_t size, bool zero) {
+	if (offset >= state->size) {
+		return 0;
+	}
+
+	size = min(size, state->size - offset);
+
+	uint64_t first = ALIGN_UP(offset, PAGE_SIZE);
+	uint64_t last = ALIGN_DOWN(offset + size, PAGE_SIZE);
+
+	for (uint64_t page = first; page < last; page += PAGE_SIZE) {
+		zram_drop(state, page / PAGE_SIZE);
+	}
+
+	if (!zero) {
+		return 0;
+	}
+
+	uint8_t *zeroes = alloc(PAGE_SIZE);
+
+	if (zeroes == NULL) {
+		return -1;
+	}
+
+	memset(zeroes, 0, PAGE_SIZE);
+
+	int r = 0;
+
+	if (first > last) {
+		// Within a single page
+		r = zram_rw(state, true, offset, size, zeroes) == size ? 0 : -1;
+	} else {
+		if (offset < first && zram_rw(state, true, offset, first - offset, zeroes) != first - offset) {
+			r = -1;
+		}
+
+		if (last < offset + size && zram_rw(state, true, last, offset + size - last, zeroes) != offset + size - last) {
+			r = -1;
+		}
+	}
+
+	free(zeroes);
+
+	return r;
+}
+
+static int zram_queue(ARC_BlockDevice *dev, struct blkdev_request *req, int hwq) {
+	(void)hwq;
+
+	struct driver_state *state = dev->priv;
+	uint64_t offset = req->lba * state->block_size;
+	int status = 0;
+
+	switch (req->op) {
+		case BLKDEV_OP_READ:
+		case BLKDEV_OP_WRITE: {
+			for (size_t i = 0; i < req->vec_count && status == 0; i++) {
+				struct blkdev_vec *vec = &req->vecs[i];
+
+				status = zram_rw(state, req->op == BLKDEV_OP_WRITE, offset, vec->len, vec->base) == vec->len ? 0 : -1;
+				offset += vec->len;
+			}
+
+			break;
+		}
+
+		case BLKDEV_OP_DISCARD: {
+			status = zram_discard(state, offset, req->count * state->block_size, false);
+			break;
+		}
+
+		case BLKDEV_OP_FLUSH: {
+			break;
+		}
+
+		default: {
+			status = -1;
+			break;
+		}
+	}
+
+	blkdev_end_request(req, status);
+
+	return 0;
+}
+
+static struct blkdev_ops zram_ops = {
+        .queue = zram_queue,
+	.poll = NULL,
+};
+
+static void zram_get_stats(struct driver_state *state, struct zram_stats *stats) {
+	stats->disk_size = state->size;
+	stats->stored_pages = ARC_ATOMIC_LOAD(state->stats.stored_pages);
+	stats->same_pages = ARC_ATOMIC_LOAD(state->stats.same_pages);
+	stats->raw_pages = ARC_ATOMIC_LOAD(state->stats.raw_pages);
+	stats->compressed_bytes = ARC_ATOMIC_LOAD(state->stats.compressed_bytes);
+	stats->memory_used = ARC_ATOMIC_LOAD(state->stats.memory_used) + state->page_count * sizeof(struct zram_slot);
+	stats->ratio_percent = (stats->stored_pages * PAGE_SIZE * 100) / stats->memory_used;
+	stats->reads = ARC_ATOMIC_LOAD(state->stats.reads);
+	stats->writes = ARC_ATOMIC_LOAD(state->stats.writes);
+	stats->failed = ARC_ATOMIC_LOAD(state->stats.failed);
+}
+
+static int init_zram(struct ARC_Resource *res, void *args) {
+	if (res == NULL || args == NULL) {
+		return -1;
+	}
+
+	struct ARC_DriArgs_Zram *dri_args = (struct ARC_DriArgs_Zram *)args;
+	uint32_t block_size = dri_args->block_size == 0 ? ZRAM_DEFAULT_BLOCK : dri_args->block_size;
+
+	if (dri_args->path == NULL || dri_args->size < PAGE_SIZE || block_size > PAGE_SIZE || PAGE_SIZE % block_size != 0) {
+		ARC_DEBUG(ERR, "Improper parameters (%p %lu %u)\n", dri_args->path, dri_args->size, block_size);
+		return -1;
+	}
+
+	struct driver_state *state = (struct driver_state *)alloc(sizeof(*state));
+
+	if (state == NULL) {
+		return -2;
+	}
+
+	memset(state, 0, sizeof(*state));
+
+	state->block_size = block_size;
+	state->size = ALIGN_DOWN(dri_args->size, PAGE_SIZE);
+	state->page_count = state->size / PAGE_SIZE;
+	state->slots = alloc(state->page_count * sizeof(*state->slots));
+
+	if (state->slots == NULL) {
+		ARC_DEBUG(ERR, "Failed to allocate handle table\n");
+		free(state);
+		return -2;
+	}
+
+	memset(state->slots, 0, state->page_count * sizeof(*state->slots));
+
+	for (int i = 0; i < ZRAM_LOCKS; i++) {
+		init_static_spinlock(&state->locks[i]);
+	}
+
+	struct blkdev_info info = {
+	        .block_size = block_size,
+		.blocks = state->size / block_size,
+		.max_blocks = 0,
+		.queue_count = 1,
+		.ops = &zram_ops,
+		.priv = state,
+		.uncached = true,
+        };
+
+	res->driver_state = state;
+	state->dev = blkdev_register(dri_args->path, res, &info);
+
+	if (state->dev == NULL) {
+		ARC_DEBUG(ERR, "Failed to register %s\n", dri_args->path);
+		res->driver_state = NULL;
+		free(state->slots);
+		free(state);
+		return -3;
+	}
+
+	return 0;
+}
+
+static int uninit_zram(struct ARC_Resource *res) {
+	if (res == NULL) {
+		return -1;
+	}
+
+	struct driver_state *state = (struct driver_state *)res->driver_state;
+
+	if (state == NULL) {
+		return -1;
+	}
+
+	blkdev_unregister(res);
+
+	for (uint64_t i = 0; i < state->page_count; i++) {
+		zram_free_slot(state, &state->slots[i]);
+	}
+
+	free(state->slots);
+	free(state);
+
+	return 0;
+};
+
+static size_t read_zram(void *buffer, size_t size, size_t count, struct ARC_File *file, struct ARC_Resource *res) {
+	if (buffer == NULL || size == 0 || count == 0 || file == NULL || res == NULL) {
+		return 0;
+ 	}
+
+	return zram_rw(res->driver_state, false, file->offset, size * count, buffer);
+}
+
+static size_t write_zram(void *buffer, size_t size, size_t count, struct ARC_File *file, struct ARC_Resource *res) {
+	if (buffer == NULL || size == 0 || count == 0 || file == NULL || res == NULL) {
+		return 0;
+ 	}
+
+	return zram_rw(res->driver_state, true, file->offset, size * count, buffer);
+}
+
+static int stat_zram(struct ARC_Resource *res, char *filename, struct stat *stat) {
+	(void)filename;
+
+	if (res == NULL || stat == NULL) {
+		return -1;
+	}
+
+	struct driver_state *state = (struct driver_state *)res->driver_state;
+	struct zram_stats stats = { 0 };
+
+	zram_get_stats(state, &stats);
+
+	// Like a sparse file, the size is what can be stored and the blocks
+	// are the memory it takes
+	stat->st_blksize = state->block_size;
+	stat->st_size = state->size;
+	stat->st_blocks = ALIGN_UP(stats.memory_used, 512) / 512;
+
+	return 0;
+}
+
+static ARC_ControlPacketResponse control_zram(struct ARC_Resource *res, ARC_ControlPacketInstruction *inst) {
+	ARC_ControlPacketResponse resp = { 0 };
+
+	if (res == NULL || inst == NULL) {
+		return resp;
+	}
+
+	struct driver_state *state = (struct driver_state *)res->driver_state;
+
+	switch (inst->command) {
+		case CNTRL_BLK_SYNC: {
+			resp.type = inst->command;
+
+			return resp;
+		}
+
+		case CNTRL_BLK_READ:
+		case CNTRL_BLK_WRITE: {
+			struct cntrl_blk_rw *rw = inst->data;
+
+			if (rw == NULL || rw->buffer == NULL) {
+				return resp;
+			}
+
+			resp.size = zram_rw(state, inst->command == CNTRL_BLK_WRITE, rw->offset, rw->size, rw->buffer);
+			resp.type = inst->command;
+
+			return resp;
+		}
+
+		case CNTRL_BLK_DISCARD:
+		case CNTRL_BLK_ZERO_RANGE: {
+			struct cntrl_blk_ranges *list = inst->data;
+
+			if (list == NULL || (list->count > 0 && list->ranges == NULL)) {
+				return resp;
+			}
+
+			for (size_t i = 0; i < list->count; i++) {
+				if (zram_discard(state, list->ranges[i].offset, list->ranges[i].size, inst->command == CNTRL_BLK_ZERO_RANGE) != 0) {
+					return resp;
+				}
+			}
+
+			resp.type = inst->command;
+
+			return resp;
+		}
+
+		case ZRAM_CTRL_STATS: {
+			if (inst->data == NULL) {
+				return resp;
+			}
+
+			zram_get_stats(state, inst->data);
+
+			resp.size = sizeof(struct zram_stats);
+			resp.type = inst->command;
+
+			return resp;
+		}
+	}
+
+	ARC_DEBUG(ERR, "Unhandled command %d\n", inst->command);
+
+	return resp;
+}
+
+ARC_REGISTER_DRIVER(ARC_DRIGRP_DEV, zram) = {
+        .init = init_zram,
+	.uninit = uninit_zram,
+	.read = read_zram,
+	.write = write_zram,
+	.seek = dridefs_int_func_empty,
+	.rename = dridefs_int_func_empty,
+	.stat = stat_zram,
+	.control = control_zram,
+};
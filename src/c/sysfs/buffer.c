@@ -26,17 +26,22 @@
  * Driver for RAM files or buffers which are accesible by the VFS.
 */
 #include "abi-bits/seek-whence.h"
+#include "drivers/cntrl_defs.h"
 #include "drivers/dri_defs.h"
 #include "drivers/resource.h"
+#include "drivers/sparse.h"
 #include "global.h"
 #include "lib/util.h"
 #include "mm/allocator.h"
 
-// NOTE: Should buffers be made such that they are dynamic in size? So one can just append data?
+// Buffers grow to fit whatever is written past their end. The pages hang
+// off a sparse store, so growing only allocates the new pages and never
+// moves the old ones, and truncating frees the pages past the new end.
 
 struct buffer_dri_state {
+	ARC_GenericSpinlock lock; // Held while the size, and the pages it covers, change or are read
 	size_t size;
-	void *buffer;
+	struct sparse data; // Pages are only allocated once written
 };
 
 static int buffer_init(struct ARC_Resource *res, void *arg) {
@@ -52,11 +57,10 @@ static int buffer_init(struct ARC_Resource *res, void *arg) {
 		return -1;
 	}
 
-	state->buffer = (void *)alloc(size);
+	init_static_spinlock(&state->lock);
+	init_sparse(&state->data);
 	state->size = size;
 
-	memset(state->buffer, 0, state->size);
-
 	res->driver_state = state;
 
 	return 0;
@@ -69,7 +73,7 @@ static int buffer_uninit(struct ARC_Resource *res) {
 		return 1;
 	}
 
-	free(state->buffer);
+	uninit_sparse(&state->data);
 	free(state);
 
 	return 0;
@@ -82,19 +86,21 @@ static size_t buffer_read(void *buffer, size_t size, size_t count, struct ARC_Fi
 
 	struct buffer_dri_state *state = (struct buffer_dri_state *)res->driver_state;
 
-	size_t wanted = size * count;
-	size_t accessible = state->size - file->offset;
+	uint64_t offset = file->offset;
+
+	spinlock_lock(&state->lock);
 
-	if (accessible == 0) {
+	if (offset >= state->size) {
+		spinlock_unlock(&state->lock);
 		return 0;
 	}
 
-	int64_t delta = wanted - accessible;
-	size_t given = delta > 0 ? wanted - delta : wanted;
-	given = given > 0 ? given : 0;
+	size_t given = min(size * count, state->size - offset);
 
 	// Do the actual giving
-	memcpy(buffer, state->buffer + file->offset, given);
+	given = sparse_read(&state->data, offset, given, buffer);
+
+	spinlock_unlock(&state->lock);
 
 	return given;
 }
@@ -106,19 +112,15 @@ static size_t buffer_write(void *buffer, size_t size, size_t count, struct ARC_F
 
 	struct buffer_dri_state *state = (struct buffer_dri_state *)res->driver_state;
 
-	size_t wanted = size * count;
-	size_t accessible = state->size - file->offset;
-
-	if (accessible == 0) {
-		return 0;
-	}
-
-	int64_t delta = wanted - accessible;
-	size_t given = delta > 0 ? wanted - delta : wanted;
-	given = given > 0 ? given : 0;
+	// A truncate must not discard the pages in between writing them and
+	// growing the size over them
+	spinlock_lock(&state->lock);
 
 	// Do the actual receiving
-	memcpy(state->buffer + file->offset, buffer, given);
+	size_t given = sparse_write(&state->data, file->offset, size * count, buffer);
+	state->size = max(state->size, file->offset + given);
+
+	spinlock_unlock(&state->lock);
 
 	return given;
 }
@@ -139,10 +141,54 @@ static int buffer_stat(struct ARC_Resource *res, char *filename, struct stat *st
 
 	struct buffer_dri_state *state = res->driver_state;
 	stat->st_size = state->size;
+	stat->st_blocks = state->data.pages * (PAGE_SIZE / 512);
 
 	return 0;
 }
 
+static int buffer_truncate(struct buffer_dri_state *state, uint64_t size) {
+	spinlock_lock(&state->lock);
+
+	uint64_t old = state->size;
+	state->size = size;
+
+	if (size < old) {
+		// Reads past the end are cut off anyway, but growing again must
+		// show zeroes
+		sparse_discard(&state->data, size, ALIGN_UP(old, PAGE_SIZE) - size);
+	}
+
+	spinlock_unlock(&state->lock);
+
+	return 0;
+}
+
+static ARC_ControlPacketResponse buffer_control(struct ARC_Resource *res, ARC_ControlPacketInstruction *inst) {
+	ARC_ControlPacketResponse resp = { 0 };
+
+	if (res == NULL || inst == NULL || res->driver_state == NULL) {
+		return resp;
+	}
+
+	struct buffer_dri_state *state = (struct buffer_dri_state *)res->driver_state;
+
+	switch (inst->command) {
+		case CNTRL_FS_TRUNCATE: {
+			if (inst->data == NULL || buffer_truncate(state, *(uint64_t *)inst->data) != 0) {
+				return resp;
+			}
+
+			resp.type = inst->command;
+
+			return resp;
+		}
+	}
+
+	ARC_DEBUG(ERR, "Unhandled command %d\n", inst->command);
+
+	return resp;
+}
+
 ARC_REGISTER_DRIVER(ARC_DRIGRP_FS_FILE, buffer) = {
 	.init = buffer_init,
 	.uninit = buffer_uninit,
@@ -151,5 +197,6 @@ ARC_REGISTER_DRIVER(ARC_DRIGRP_FS_FILE, buffer) = {
 	.seek = buffer_seek,
 	.rename = dridefs_int_func_empty,
 	.stat = buffer_stat,
+	.control = buffer_control,
 	.codes = NULL
 };
@@ -0,0 +1,441 @@
+/**
+ * @file cache.c
+ *
+ * @author awewsomegamer <awewsomegamer@gmail.com>
+ *
+ * @LICENSE
+ * Arctan-OS/Kernel - Operating System Kernel
+ * Copyright (C) 2023-2025 awewsomegamer
+ *
+ * This file is part of Arctan-OS/Kernel.
+ *
+ * Arctan is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * @DESCRIPTION
+ * Inode and directory entry caches of a mounted EXT2 filesystem.
+*/
+#include "drivers/sysfs/ext2/cache.h"
+#include "drivers/twoq.h"
+#include "global.h"
+#include "lib/atomics.h"
+#include "lib/util.h"
+#include "mm/allocator.h"
+
+#define EXT2_CACHE_HASH_BITS 8
+#define EXT2_CACHE_INODES 512
+#define EXT2_CACHE_DENTRIES 1024
+#define EXT2_CACHE_IN_PERCENT 25
+#define EXT2_CACHE_GHOST_PERCENT 50
+
+struct ext2_cache_inode {
+	struct ext2_cache_inode *next;
+	struct twoq_entry policy;
+	uint64_t number;
+	uint8_t data[];
+};
+
+struct ext2_cache_dentry {
+	struct ext2_cache_dentry *next;
+	struct twoq_entry policy;
+	uint64_t key;
+	uint64_t dir;
+	uint64_t inode;
+	size_t length;
+	char name[];
+};
+
+struct ext2_cache {
+	size_t inode_size;
+	ARC_GenericSpinlock inode_lock;
+	struct ext2_cache_inode *inodes[1 << EXT2_CACHE_HASH_BITS];
+	struct twoq inode_policy;
+	ARC_GenericSpinlock dentry_lock;
+	struct ext2_cache_dentry *dentries[1 << EXT2_CACHE_HASH_BITS];
+	struct twoq dentry_policy;
+};
+
+static size_t ext2_cache_bucket(uint64_t key) {
+	return (key * 0x9E3779B97F4A7C15ULL) >> (64 - EXT2_CACHE_HASH_BITS);
+}
+
+// FNV-1a over the name, mixed with the directory
+static uint64_t ext2_cache_dentry_key(uint64_t dir, char *name, size_t length) {
+	uint64_t hash = 0xCBF29CE484222325ULL ^ dir;
+
+	for (size_t i = 0; i < length; i++) {
+		hash ^= (uint8_t)name[i];
+		hash *= 0x100000001B3ULL;
+	}
+
+	return hash;
+}
+
+struct ext2_cache *init_ext2_cache(size_t inode_size) {
+	if (inode_size == 0) {
+		ARC_DEBUG(ERR, "Improper inode size\n");
+		return NULL;
+	}
+
+	struct ext2_cache *cache = alloc(sizeof(*cache));
+
+	if (cache == NULL) {
+		ARC_DEBUG(ERR, "Failed to allocate cache\n");
+		return NULL;
+	}
+
+	memset(cache, 0, sizeof(*cache));
+
+	cache->inode_size = inode_size;
+	init_static_spinlock(&cache->inode_lock);
+	init_static_spinlock(&cache->dentry_lock);
+
+	if (init_twoq(&cache->inode_policy, EXT2_CACHE_INODES, EXT2_CACHE_IN_PERCENT, EXT2_CACHE_GHOST_PERCENT) != 0
+	    || init_twoq(&cache->dentry_policy, EXT2_CACHE_DENTRIES, EXT2_CACHE_IN_PERCENT, EXT2_CACHE_GHOST_PERCENT) != 0) {
+		ARC_DEBUG(ERR, "Failed to initialize cache policies\n");
+		uninit_twoq(&cache->inode_policy);
+		uninit_twoq(&cache->dentry_policy);
+		free(cache);
+		return NULL;
+	}
+
+	return cache;
+}
+
+void uninit_ext2_cache(struct ext2_cache *cache) {
+	if (cache == NULL) {
+		return;
+	}
+
+	for (int i = 0; i < (1 << EXT2_CACHE_HASH_BITS); i++) {
+		while (cache->inodes[i] != NULL) {
+			struct ext2_cache_inode *next = cache->inodes[i]->next;
+			free(cache->inodes[i]);
+			cache->inodes[i] = next;
+		}
+
+		while (cache->dentries[i] != NULL) {
+			struct ext2_cache_dentry *next = cache->dentries[i]->next;
+			free(cache->dentries[i]);
+			cache->dentries[i] = next;
+		}
+	}
+
+	uninit_twoq(&cache->inode_policy);
+	uninit_twoq(&cache->dentry_policy);
+	free(cache);
+}
+
+// Both called with the lock of the cache held
+static void ext2_cache_unlink_inode(struct ext2_cache *cache, struct ext2_cache_inode *entry) {
+	struct ext2_cache_inode **link = &cache->inodes[ext2_cache_bucket(entry->number)];
+
+	while (*link != NULL && *link != entry) {
+		link = &(*link)->next;
+	}
+
+	if (*link == entry) {
+		*link = entry->next;
+	}
+}
+
+static void ext2_cache_unlink_dentry(struct ext2_cache *cache, struct ext2_cache_dentry *entry) {
+	struct ext2_cache_dentry **link = &cache->dentries[ext2_cache_bucket(entry->key)];
+
+	while (*link != NULL && *link != entry) {
+		link = &(*link)->next;
+	}
+
+	if (*link == entry) {
+		*link = entry->next;
+	}
+}
+
+static void ext2_cache_shrink_inodes(struct ext2_cache *cache) {
+	while (twoq_over(&cache->inode_policy)) {
+		struct twoq_entry *victim = twoq_victim(&cache->inode_policy, NULL, NULL);
+
+		if (victim == NULL) {
+			break;
+		}
+
+		struct ext2_cache_inode *entry = (struct ext2_cache_inode *)((uintptr_t)victim - offsetof(struct ext2_cache_inode, policy));
+		ext2_cache_unlink_inode(cache, entry);
+		free(entry);
+	}
+}
+
+static void ext2_cache_shrink_dentries(struct ext2_cache *cache) {
+	while (twoq_over(&cache->dentry_policy)) {
+		struct twoq_entry *victim = twoq_victim(&cache->dentry_policy, NULL, NULL);
+
+		if (victim == NULL) {
+			break;
+		}
+
+		struct ext2_cache_dentry *entry = (struct ext2_cache_dentry *)((uintptr_t)victim - offsetof(struct ext2_cache_dentry, policy));
+		ext2_cache_unlink_dentry(cache, entry);
+		free(entry);
+	}
+}
+
+static struct ext2_cache_inode *ext2_cache_find_inode(struct ext2_cache *cache, uint64_t inode) {
+	struct ext2_cache_inode *entry = cache->inodes[ext2_cache_bucket(inode)];
+
+	while (entry != NULL && entry->number != inode) {
+		entry = entry->next;
+	}
+
+	return entry;
+}
+
+static struct ext2_cache_dentry *ext2_cache_find_dentry(struct ext2_cache *cache, uint64_t key, uint64_t dir, char *name, size_t length) {
+	struct ext2_cache_dentry *entry = cache->dentries[ext2_cache_bucket(key)];
+
+	while (entry != NULL && (entry->key != key || entry->dir != dir || entry->length != length || memcmp(entry->name, name, length) != 0)) {
+		entry = entry->next;
+	}
+
+	return entry;
+}
+
+struct ext2_inode *ext2_cache_get_inode(struct ext2_cache *cache, uint64_t inode) {
+	if (cache == NULL || inode == 0) {
+		return NULL;
+	}
+
+	struct ext2_inode *ret = NULL;
+
+	spinlock_lock(&cache->inode_lock);
+
+	struct ext2_cache_inode *entry = ext2_cache_find_inode(cache, inode);
+
+	if (entry == NULL) {
+		twoq_miss(&cache->inode_policy);
+	} else if ((ret = alloc(cache->inode_size)) != NULL) {
+		twoq_hit(&cache->inode_policy, &entry->policy);
+		memcpy(ret, entry->data, cache->inode_size);
+	}
+
+	spinlock_unlock(&cache->inode_lock);
+
+	return ret;
+}
+
+void ext2_cache_put_inode(struct ext2_cache *cache, uint64_t inode, struct ext2_inode *node) {
+	if (cache == NULL || inode == 0 || node == NULL) {
+		return;
+	}
+
+	struct ext2_cache_inode *entry = alloc(sizeof(*entry) + cache->inode_size);
+
+	if (entry == NULL) {
+		return;
+	}
+
+	memset(entry, 0, sizeof(*entry));
+	entry->number = inode;
+	memcpy(entry->data, node, cache->inode_size);
+
+	spinlock_lock(&cache->inode_lock);
+
+	struct ext2_cache_inode *current = ext2_cache_find_inode(cache, inode);
+
+	if (current != NULL) {
+		// Refresh the copy in place, it keeps its place in the policy
+		memcpy(current->data, node, cache->inode_size);
+		spinlock_unlock(&cache->inode_lock);
+		free(entry);
+
+		return;
+	}
+
+	size_t bucket = ext2_cache_bucket(inode);
+	entry->next = cache->inodes[bucket];
+	cache->inodes[bucket] = entry;
+
+	twoq_insert(&cache->inode_policy, &entry->policy, inode);
+	ext2_cache_shrink_inodes(cache);
+
+	spinlock_unlock(&cache->inode_lock);
+}
+
+void ext2_cache_drop_inode(struct ext2_cache *cache, uint64_t inode) {
+	if (cache == NULL) {
+		return;
+	}
+
+	spinlock_lock(&cache->inode_lock);
+
+	struct ext2_cache_inode *entry = ext2_cache_find_inode(cache, inode);
+
+	if (entry != NULL) {
+		ext2_cache_unlink_inode(cache, entry);
+		twoq_remove(&cache->inode_policy, &entry->policy);
+	}
+
+	spinlock_unlock(&cache->inode_lock);
+
+	free(entry);
+}
+
+uint64_t ext2_cache_get_dentry(struct ext2_cache *cache, uint64_t dir, char *name) {
+	if (cache == NULL || name == NULL) {
+		return 0;
+	}
+
+	size_t length = strlen(name);
+	uint64_t key = ext2_cache_dentry_key(dir, name, length);
+	uint64_t ret = 0;
+
+	spinlock_lock(&cache->dentry_lock);
+
+	struct ext2_cache_dentry *entry = ext2_cache_find_dentry(cache, key, dir, name, length);
+
+	if (entry == NULL) {
+		twoq_miss(&cache->dentry_policy);
+	} else {
+		twoq_hit(&cache->dentry_policy, &entry->policy);
+		ret = entry->inode;
+	}
+
+	spinlock_unlock(&cache->dentry_lock);
+
+	return ret;
+}
+
+void ext2_cache_put_dentry(struct ext2_cache *cache, uint64_t dir, char *name, uint64_t inode) {
+	if (cache == NULL || name == NULL || inode == 0) {
+		return;
+	}
+
+	size_t length = strlen(name);
+	uint64_t key = ext2_cache_dentry_key(dir, name, length);
+	struct ext2_cache_dentry *entry = alloc(sizeof(*entry) + length);
+
+	if (entry == NULL) {
+		return;
+	}
+
+	memset(entry, 0, sizeof(*entry));
+	entry->key = key;
+	entry->dir = dir;
+	entry->inode = inode;
+	entry->length = length;
+	memcpy(entry->name, name, length);
+
+	spinlock_lock(&cache->dentry_lock);
+
+	struct ext2_cache_dentry *current = ext2_cache_find_dentry(cache, key, dir, name, length);
+
+	if (current != NULL) {
+		current->inode = inode;
+		spinlock_unlock(&cache->dentry_lock);
+		free(entry);
+
+		return;
+	}
+
+	size_t bucket = ext2_cache_bucket(key);
+	entry->next = cache->dentries[bucket];
+	cache->dentries[bucket] = entry;
+
+	twoq_insert(&cache->dentry_policy, &entry->policy, key);
+	ext2_cache_shrink_dentries(cache);
+
+	spinlock_unlock(&cache->dentry_lock);
+}
+
+void ext2_cache_drop_dentry(struct ext2_cache *cache, uint64_t dir, char *name) {
+	if (cache == NULL || name == NULL) {
+		return;
+	}
+
+	size_t length = strlen(name);
+	uint64_t key = ext2_cache_dentry_key(dir, name, length);
+
+	spinlock_lock(&cache->dentry_lock);
+
+	struct ext2_cache_dentry *entry = ext2_cache_find_dentry(cache, key, dir, name, length);
+
+	if (entry != NULL) {
+		ext2_cache_unlink_dentry(cache, entry);
+		twoq_remove(&cache->dentry_policy, &entry->policy);
+	}
+
+	spinlock_unlock(&cache->dentry_lock);
+
+	free(entry);
+}
+
+int ext2_cache_tune(struct ext2_cache *cache, size_t inodes, size_t dentries, int in_percent, int ghost_percent) {
+	if (cache == NULL) {
+		return -1;
+	}
+
+	int r = 0;
+
+	spinlock_lock(&cache->inode_lock);
+	r |= twoq_tune(&cache->inode_policy, inodes == 0 ? cache->inode_policy.capacity : inodes, in_percent, ghost_percent);
+	ext2_cache_shrink_inodes(cache);
+	spinlock_unlock(&cache->inode_lock);
+
+	spinlock_lock(&cache->dentry_lock);
+	r |= twoq_tune(&cache->dentry_policy, dentries == 0 ? cache->dentry_policy.capacity : dentries, in_percent, ghost_percent);
+	ext2_cache_shrink_dentries(cache);
+	spinlock_unlock(&cache->dentry_lock);
+
+	return r == 0 ? 0 : -1;
+}
+
+void ext2_cache_get_stats(struct ext2_cache *cache, struct ext2_cache_stats *stats) {
+	if (cache == NULL || stats == NULL) {
+		return;
+	}
+
+	twoq_get_stats(&cache->inode_policy, &stats->inodes);
+	twoq_get_stats(&cache->dentry_policy, &stats->dentries);
+}
+
+static void ext2_cache_describe(struct twoq *q, struct cntrl_blk_cache *out) {
+	struct twoq_stats stats = { 0 };
+
+	twoq_get_stats(q, &stats);
+
+	out->capacity = q->capacity;
+	out->in_percent = q->capacity == 0 ? 0 : q->in_target * 100 / q->capacity;
+	out->ghost_percent = q->capacity == 0 ? 0 : q->ghost_size * 100 / q->capacity;
+	out->hits = stats.hits;
+	out->misses = stats.misses;
+	out->evictions = stats.evictions;
+	out->promotions = stats.promotions;
+	out->ghost_hits = stats.ghost_hits;
+	out->resident = stats.resident[0] + stats.resident[1];
+}
+
+int ext2_cache_control(struct ext2_cache *cache, uint32_t command, struct cntrl_fs_cache *data) {
+	if (cache == NULL || data == NULL) {
+		return -1;
+	}
+
+	if (command == CNTRL_FS_CACHE_TUNE && ext2_cache_tune(cache, data->inodes.capacity, data->names.capacity, data->inodes.in_percent, data->inodes.ghost_percent) != 0) {
+		return -1;
+	} else if (command != CNTRL_FS_CACHE_TUNE && command != CNTRL_FS_CACHE_STATS) {
+		return -1;
+	}
+
+	ext2_cache_describe(&cache->inode_policy, &data->inodes);
+	ext2_cache_describe(&cache->dentry_policy, &data->names);
+
+	return 0;
+}
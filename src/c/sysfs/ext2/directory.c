@@ -60,6 +60,8 @@ static int init_ext2_directory(struct ARC_Resource *res, void *args) {
 	state->basic.node = cast_args->node;
 	state->basic.inode = cast_args->inode;
 	state->basic.block_size = cast_args->super->basic.block_size;
+	state->basic.dev = cast_args->super->basic.dev;
+	state->basic.cache = cast_args->super->basic.cache;
 
 	res->driver_state = state;
 
@@ -73,7 +75,12 @@ static int uninit_ext2_directory(struct ARC_Resource *res) {
 		return -1;
 	}
 
-	// TODO: Sync
+	struct ext2_node_driver_state *state = res->driver_state;
+
+	// Only what belongs to this node, syncing the whole partition is left
+	// to unmounting and explicit syncs
+	ext2_writeback_inode_data(&state->basic);
+
 	free(res->driver_state);
 
 	return 0;
@@ -120,6 +127,7 @@ static int stat_ext2_directory(struct ARC_Resource *res, char *filename, struct
 	}
 
 	stat->st_mode = inode->type_perms;
+	free(inode);
 
 	return 0;
 }
@@ -26,7 +26,9 @@
  * File driver for the EXT2 filesystem.
 */
 #include "abi-bits/seek-whence.h"
+#include "drivers/cntrl_defs.h"
 #include "drivers/dri_defs.h"
+#include "drivers/readahead.h"
 #include "drivers/resource.h"
 #include "drivers/sysfs/ext2/ext2.h"
 #include "drivers/sysfs/ext2/super.h"
@@ -63,6 +65,8 @@ static int init_ext2_file(struct ARC_Resource *res, void *args) {
 	state->basic.node = cast_args->node;
 	state->basic.inode = cast_args->inode;
 	state->basic.block_size = cast_args->super->basic.block_size;
+	state->basic.dev = cast_args->super->basic.dev;
+	state->basic.cache = cast_args->super->basic.cache;
 
 	res->driver_state = state;
 
@@ -76,7 +80,12 @@ static int uninit_ext2_file(struct ARC_Resource *res) {
 		return -1;
 	}
 
-	// TODO: Sync
+	struct ext2_node_driver_state *state = res->driver_state;
+
+	// Only what belongs to this node, syncing the whole partition is left
+	// to unmounting and explicit syncs
+	ext2_writeback_inode_data(&state->basic);
+
 	free(res->driver_state);
 
 	return 0;
@@ -89,6 +98,11 @@ static size_t read_ext2_file(void *buffer, size_t size, size_t count, struct ARC
  	}
 
 	struct ext2_node_driver_state *state = res->driver_state;
+	struct readahead_window window = { 0 };
+
+	if (readahead_advance(file, file->offset, size * count, &window)) {
+		ext2_prefetch_inode_data(&state->basic, window.offset, window.size, CNTRL_BLK_PRIO_LOW << CNTRL_BLK_RW_PRIO_SHIFT);
+	}
 
 	return ext2_read_inode_data(&state->basic, buffer, file->offset, size * count);
 }
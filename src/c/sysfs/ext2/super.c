@@ -26,8 +26,10 @@
  * Superblock dirvers for the EXT2 filesystem.
 */
 #include "abi-bits/seek-whence.h"
+#include "drivers/blkdev.h"
 #include "drivers/cntrl_defs.h"
 #include "drivers/dri_defs.h"
+#include "drivers/pcache.h"
 #include "drivers/sysfs/ext2/super.h"
 #include "drivers/resource.h"
 #include "drivers/sysfs/ext2/util.h"
@@ -123,8 +125,9 @@ static int init_ext2_super(struct ARC_Resource *res, void *args) {
 		return -3;
 	}
 
-	vfs_seek(state->basic.partition, 1024, SEEK_SET);
-	if (vfs_read(&state->super, 1, sizeof(state->super), state->basic.partition) != sizeof(state->super)) {
+	state->basic.dev = blkdev_get(args);
+
+	if (ext2_dev_read(&state->basic, &state->super, 1024, sizeof(state->super)) != sizeof(state->super)) {
 		ARC_DEBUG(ERR, "Failed to read in super block\n");
 		vfs_close(state->basic.partition);
 		free(state);
@@ -170,9 +173,8 @@ static int init_ext2_super(struct ARC_Resource *res, void *args) {
 		return -7;
 	}
 
-	vfs_seek(state->basic.partition, (1 + state->super.superblock) * state->basic.block_size, SEEK_SET);
-	if (vfs_read(descriptor_table, 1, block_groups * sizeof(struct ext2_block_group_desc), state->basic.partition)
-	    != block_groups * sizeof(struct ext2_block_group_desc)) {
+	if (ext2_dev_read(&state->basic, descriptor_table, (1 + state->super.superblock) * state->basic.block_size,
+			  block_groups * sizeof(struct ext2_block_group_desc)) != block_groups * sizeof(struct ext2_block_group_desc)) {
 		ARC_DEBUG(ERR, "Failed to read in descriptor table\n");
 		vfs_close(state->basic.partition);
 		free(descriptor_table);
@@ -181,6 +183,12 @@ static int init_ext2_super(struct ARC_Resource *res, void *args) {
 	}
 
 	state->descriptor_table = descriptor_table;
+	state->basic.cache = init_ext2_cache(state->super.inode_size);
+
+	if (state->basic.cache == NULL) {
+		ARC_DEBUG(WARN, "Failed to create inode and directory caches, continuing without\n");
+	}
+
 	state->parition_path = strdup(args);
 	state->basic.node = ext2_read_inode(state, 2);
 	state->basic.inode = 2;
@@ -194,6 +202,17 @@ static int uninit_ext2_super(struct ARC_Resource *res) {
 		return -1;
 	}
 
+	struct ext2_super_driver_state *state = res->driver_state;
+
+	if (state != NULL) {
+		if (state->basic.dev != NULL && pcache_sync(state->basic.dev) != 0) {
+			ARC_DEBUG(ERR, "Failed to sync partition\n");
+		}
+
+		uninit_ext2_cache(state->basic.cache);
+		state->basic.cache = NULL;
+	}
+
 	return 0;
 };
 
@@ -238,6 +257,7 @@ static int stat_ext2_super(struct ARC_Resource *res, char *filename, struct stat
 	}
 
 	stat->st_mode = inode->type_perms;
+	free(inode);
 
 	return 0;
 }
@@ -302,8 +322,7 @@ static uint64_t *ext2_allocate_blocks(struct ext2_super_driver_state *state, uin
 		return NULL;
 	}
 
-	vfs_seek(state->basic.partition, state->descriptor_table[use_group].usage_bmp_block * state->basic.block_size, SEEK_SET);
-	vfs_read(block_bmp, 1, state->basic.block_size, state->basic.partition);
+	ext2_dev_read(&state->basic, block_bmp, (uint64_t)state->descriptor_table[use_group].usage_bmp_block * state->basic.block_size, state->basic.block_size);
 
 	int next_ret_idx = 0;
 	uint64_t offset;
@@ -358,6 +377,39 @@ static int remove_ext2_super(struct ARC_Resource *res, char *name) {
 }
 
 static ARC_ControlPacketResponse control_ext2_super(struct ARC_Resource *res, ARC_ControlPacketInstruction *inst) {
+	ARC_ControlPacketResponse resp = { 0 };
+
+	if (res == NULL || inst == NULL) {
+		return resp;
+	}
+
+	struct ext2_super_driver_state *state = res->driver_state;
+
+	switch (inst->command) {
+		case CNTRL_BLK_SYNC: {
+			// Everything written to the filesystem, onto the media
+			if (state->basic.dev != NULL && pcache_sync(state->basic.dev) != 0) {
+				break;
+			}
+
+			resp.type = inst->command;
+
+			return resp;
+		}
+
+		case CNTRL_FS_CACHE_STATS:
+		case CNTRL_FS_CACHE_TUNE: {
+			if (ext2_cache_control(state->basic.cache, inst->command, inst->data) != 0) {
+				break;
+			}
+
+			resp.size = sizeof(struct cntrl_fs_cache);
+			resp.type = inst->command;
+
+			return resp;
+		}
+	}
+
         /*
 	if (res == NULL || command == NULL || len == 0) {
 		return NULL;
@@ -422,7 +474,8 @@ static ARC_ControlPacketResponse control_ext2_super(struct ARC_Resource *res, AR
 		}
 	}
         */
-        
+
+	ARC_DEBUG(ERR, "Unhandled command %d\n", inst->command);
 	return (ARC_ControlPacketResponse) { 0 };
 }
 
@@ -432,7 +485,13 @@ struct ext2_inode *ext2_read_inode(struct ext2_super_driver_state *state, uint64
 		return NULL;
 	}
 
-	struct ext2_inode *buffer = alloc(state->super.inode_size);
+	struct ext2_inode *buffer = ext2_cache_get_inode(state->basic.cache, inode);
+
+	if (buffer != NULL) {
+		return buffer;
+	}
+
+	buffer = alloc(state->super.inode_size);
 
 	if (buffer == NULL) {
 		ARC_DEBUG(ERR, "Failed to allocate inode\n");
@@ -444,8 +503,9 @@ struct ext2_inode *ext2_read_inode(struct ext2_super_driver_state *state, uint64
 	uint64_t inode_table_address = (state->descriptor_table[block_group].inode_table_start) * state->basic.block_size;
 	uint64_t inode_offset = state->super.inode_size * index_in_table;
 
-	vfs_seek(state->basic.partition, inode_table_address + inode_offset, SEEK_SET);
-	vfs_read(buffer, 1, state->super.inode_size, state->basic.partition);
+	if (ext2_dev_read(&state->basic, buffer, inode_table_address + inode_offset, state->super.inode_size) == state->super.inode_size) {
+		ext2_cache_put_inode(state->basic.cache, inode, buffer);
+	}
 
 	return buffer;
 }
@@ -25,12 +25,35 @@
  * @DESCRIPTION
 */
 #include "abi-bits/seek-whence.h"
+#include "drivers/blkdev.h"
+#include "drivers/cntrl_defs.h"
+#include "drivers/pcache.h"
 #include "drivers/sysfs/ext2/util.h"
 #include "fs/vfs.h"
 #include "lib/util.h"
 #include "mm/allocator.h"
 
 
+size_t ext2_dev_read(struct ext2_basic_driver_state *state, void *buffer, uint64_t offset, size_t size) {
+	if (state->dev != NULL) {
+		return blkdev_io(state->dev, false, offset, size, buffer, 0);
+	}
+
+	vfs_seek(state->partition, offset, SEEK_SET);
+
+	return vfs_read(buffer, 1, size, state->partition);
+}
+
+size_t ext2_dev_write(struct ext2_basic_driver_state *state, void *buffer, uint64_t offset, size_t size) {
+	if (state->dev != NULL) {
+		return blkdev_io(state->dev, true, offset, size, buffer, 0);
+	}
+
+	vfs_seek(state->partition, offset, SEEK_SET);
+
+	return vfs_write(buffer, 1, size, state->partition);
+}
+
 // TODO: For the below three functions revise naming
 static uint32_t ext2_load_block(uint32_t *block,
 				uint32_t (*create_callback)(void *, uint32_t inode), uint32_t inode, void *create_arg) {
@@ -58,8 +81,7 @@ static int ext2_load_read_block(struct ext2_basic_driver_state *state, uint32_t
 	uint32_t _block = ext2_load_block(block, create_callback, inode, create_arg);
 
 	if (_block != 0) {
-		vfs_seek(state->partition, _block * state->block_size, SEEK_SET);
-		vfs_read(*out, 1, state->block_size, state->partition);
+		ext2_dev_read(state, *out, (uint64_t)_block * state->block_size, state->block_size);
 		return 0;
 	}
 
@@ -80,6 +102,8 @@ static size_t ext2_traverse_blocks(struct ext2_basic_driver_state *state, uint64
 
 	uint64_t traversed = 0;
 	uint64_t ptr_count = state->block_size / 4;
+	// Indirect blocks only change if blocks may be created
+	bool dirty = create_callback != NULL;
 
 	uint32_t *sibp = NULL;
 	uint64_t last_doubly = 0;
@@ -126,9 +150,8 @@ static size_t ext2_traverse_blocks(struct ext2_basic_driver_state *state, uint64
 					goto exit;
 				}
 
-				if (last_triply != 0 && block != last_triply) {
-					vfs_seek(state->partition, last_triply * state->block_size, SEEK_SET);
-					vfs_write(dibp, 1, state->block_size, state->partition);
+				if (dirty && last_triply != 0 && block != last_triply) {
+					ext2_dev_write(state, dibp, last_triply * state->block_size, state->block_size);
 				} else if (block == last_triply) {
 					goto do_dibp;
 				}
@@ -153,9 +176,8 @@ static size_t ext2_traverse_blocks(struct ext2_basic_driver_state *state, uint64
 				goto exit;
 			}
 
-			if (last_doubly != 0 && block != last_doubly) {
-				vfs_seek(state->partition, last_doubly * state->block_size, SEEK_SET);
-				vfs_write(sibp, 1, state->block_size, state->partition);
+			if (dirty && last_doubly != 0 && block != last_doubly) {
+				ext2_dev_write(state, sibp, last_doubly * state->block_size, state->block_size);
 			} else if (block == last_doubly) {
 				goto skip_dibp;
 			}
@@ -179,31 +201,29 @@ static size_t ext2_traverse_blocks(struct ext2_basic_driver_state *state, uint64
 
 	exit:;
 	if (tibp != NULL) {
-		vfs_seek(state->partition, state->node->tibp * state->block_size, SEEK_SET);
-		vfs_write(tibp, 1, state->block_size, state->partition);
+		if (dirty) {
+			ext2_dev_write(state, tibp, (uint64_t)state->node->tibp * state->block_size, state->block_size);
+		}
+
 		free(tibp);
 	}
 
 	if (dibp != NULL) {
-		if (last_triply == 0) {
-			vfs_seek(state->partition, state->node->dibp * state->block_size, SEEK_SET);
-		} else {
-			vfs_seek(state->partition, last_triply * state->block_size, SEEK_SET);
-		}
+		uint64_t block = last_triply == 0 ? state->node->dibp : last_triply;
 
-		vfs_write(dibp, 1, state->block_size, state->partition);
+		if (dirty) {
+			ext2_dev_write(state, dibp, block * state->block_size, state->block_size);
+		}
 
 		free(dibp);
 	}
 
 	if (sibp != NULL) {
-		if (last_doubly == 0) {
-			vfs_seek(state->partition, state->node->sibp * state->block_size, SEEK_SET);
-		} else {
-			vfs_seek(state->partition, last_doubly * state->block_size, SEEK_SET);
-		}
+		uint64_t block = last_doubly == 0 ? state->node->sibp : last_doubly;
 
-		vfs_write(sibp, 1, state->block_size, state->partition);
+		if (dirty) {
+			ext2_dev_write(state, sibp, block * state->block_size, state->block_size);
+		}
 
 		free(sibp);
 	}
@@ -224,10 +244,9 @@ static size_t ext2_read_callback(struct ext2_basic_driver_state *state, uint32_t
 
 	struct internal_callback_args *cast_args = args;
 
-	vfs_seek(state->partition, block * state->block_size + jank, SEEK_SET);
 	size_t copy_size = min(state->block_size - jank, cast_args->size - traversed);
 
-	return vfs_read(cast_args->buffer + traversed, 1, copy_size, state->partition);
+	return ext2_dev_read(state, cast_args->buffer + traversed, (uint64_t)block * state->block_size + jank, copy_size);
 }
 
 size_t ext2_read_inode_data(struct ext2_basic_driver_state *state, uint8_t *buffer, uint64_t offset, size_t size) {
@@ -241,9 +260,83 @@ size_t ext2_read_inode_data(struct ext2_basic_driver_state *state, uint8_t *buff
 		.size = size,
         };
 
+	// Start every block at once so adjacent ones are merged, the reads
+	// below then wait on them in the cache
+	if (size > state->block_size) {
+		ext2_prefetch_inode_data(state, offset, size, 0);
+	}
+
 	return ext2_traverse_blocks(state, offset, size, ext2_read_callback, &args, NULL, NULL);
 }
 
+struct internal_prefetch_args {
+	size_t size;
+	uint32_t flags;
+	bool writeback; // Write the runs back instead of prefetching them
+	uint64_t run_offset; // Contiguous range of the partition not yet handled
+	uint64_t run_size;
+};
+
+static void ext2_prefetch_run(struct ext2_basic_driver_state *state, struct internal_prefetch_args *args) {
+	if (args->run_size == 0) {
+		return;
+	}
+
+	if (args->writeback) {
+		pcache_writeback_range(state->dev, args->run_offset, args->run_size);
+	} else {
+		pcache_prefetch(state->dev, args->run_offset, args->run_size, args->flags);
+	}
+}
+
+static size_t ext2_prefetch_callback(struct ext2_basic_driver_state *state, uint32_t block, uint64_t traversed, uint64_t jank, void *args) {
+	struct internal_prefetch_args *cast_args = args;
+
+	uint64_t offset = (uint64_t)block * state->block_size + jank;
+	size_t size = min(state->block_size - jank, cast_args->size - traversed);
+
+	if (cast_args->run_size != 0 && cast_args->run_offset + cast_args->run_size == offset) {
+		cast_args->run_size += size;
+		return size;
+	}
+
+	ext2_prefetch_run(state, cast_args);
+
+	cast_args->run_offset = offset;
+	cast_args->run_size = size;
+
+	return size;
+}
+
+void ext2_prefetch_inode_data(struct ext2_basic_driver_state *state, uint64_t offset, size_t size, uint32_t flags) {
+	if (state == NULL || state->dev == NULL || offset >= state->node->size_low) {
+		return;
+	}
+
+	struct internal_prefetch_args args = {
+	        .size = min(size, state->node->size_low - offset),
+		.flags = flags,
+        };
+
+	// Maps the blocks, reading the indirect blocks which lead to them
+	ext2_traverse_blocks(state, offset, args.size, ext2_prefetch_callback, &args, NULL, NULL);
+	ext2_prefetch_run(state, &args);
+}
+
+void ext2_writeback_inode_data(struct ext2_basic_driver_state *state) {
+	if (state == NULL || state->dev == NULL || state->node == NULL || state->node->size_low == 0) {
+		return;
+	}
+
+	struct internal_prefetch_args args = {
+	        .size = state->node->size_low,
+		.writeback = true,
+        };
+
+	ext2_traverse_blocks(state, 0, args.size, ext2_prefetch_callback, &args, NULL, NULL);
+	ext2_prefetch_run(state, &args);
+}
+
 static size_t ext2_write_callback(struct ext2_basic_driver_state *state, uint32_t block, uint64_t traversed, uint64_t jank, void *args) {
 	if (args == NULL) {
 		ARC_DEBUG(ERR, "Write callback failed, improper parameters (%p)\n", args);
@@ -252,9 +345,8 @@ static size_t ext2_write_callback(struct ext2_basic_driver_state *state, uint32_
 
 	struct internal_callback_args *cast_args = args;
 
-	vfs_seek(state->partition, block * state->block_size + jank, SEEK_SET);
 	size_t copy_size = min(state->block_size - jank, cast_args->size - traversed);
-	return vfs_write(cast_args->buffer + traversed, 1, copy_size, state->partition);
+	return ext2_dev_write(state, cast_args->buffer + traversed, (uint64_t)block * state->block_size + jank, copy_size);
 }
 
 static uint32_t ext2_create_callback(void *args, uint32_t inode) {
@@ -287,6 +379,31 @@ size_t ext2_write_inode_data(struct ext2_node_driver_state *state, uint8_t *buff
 	return ext2_traverse_blocks(&state->basic, offset, size, ext2_write_callback, &args, ext2_create_callback, state->super);
 }
 
+int ext2_discard_blocks(struct ext2_super_driver_state *super, uint64_t block, size_t count) {
+	if (super == NULL || count == 0) {
+		ARC_DEBUG(ERR, "Failed to discard blocks, improper parameters (%p %lu)\n", super, count);
+		return -1;
+	}
+
+	// Discarding is only a hint to the device, freeing the blocks
+	// does not depend on it succeeding
+	ARC_BlockDevice *dev = super->basic.dev;
+
+	if (dev == NULL) {
+		return 0;
+	}
+
+	// Only device blocks which are entirely covered may go
+	uint64_t start = ALIGN_UP(block * super->basic.block_size, dev->block_size) / dev->block_size;
+	uint64_t end = ALIGN_DOWN((block + count) * super->basic.block_size, dev->block_size) / dev->block_size;
+
+	if (end <= start) {
+		return 0;
+	}
+
+	return blkdev_discard(dev, start, end - start) == 0 ? 0 : -2;
+}
+
 struct internal_get_inode_in_dir_arg {
 	char *target;
 	uint64_t inode_number;
@@ -315,11 +432,18 @@ uint64_t ext2_get_inode_in_dir(struct ext2_basic_driver_state *dir, char *filena
 		return 0;
 	}
 
+	uint64_t cached = ext2_cache_get_dentry(dir->cache, dir->inode, filename);
+
+	if (cached != 0) {
+		return cached;
+	}
+
 	struct internal_get_inode_in_dir_arg arg = {
 	        .target = filename
         };
 
 	ext2_list_directory(dir, callback_get_inode_in_dir, &arg);
+	ext2_cache_put_dentry(dir->cache, dir->inode, filename, arg.inode_number);
 
 	return arg.inode_number;
 }
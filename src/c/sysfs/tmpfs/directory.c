@@ -0,0 +1,136 @@
+/**
+ * @file directory.c
+ *
+ * @author awewsomegamer <awewsomegamer@gmail.com>
+ *
+ * @LICENSE
+ * Arctan-OS/Kernel - Operating System Kernel
+ * Copyright (C) 2023-2025 awewsomegamer
+ *
+ * This file is part of Arctan-OS/Kernel.
+ *
+ * Arctan is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * @DESCRIPTION
+ * Directory driver for tmpfs.
+*/
+#include "drivers/dri_defs.h"
+#include "drivers/resource.h"
+#include "drivers/sysfs/tmpfs/util.h"
+#include "global.h"
+#include "mm/allocator.h"
+#include "sys/stat.h"
+
+static int init_tmpfs_directory(struct ARC_Resource *res, void *args) {
+	if (res == NULL || args == NULL) {
+		ARC_DEBUG(ERR, "Failed to initialize directory driver, improper parameters (%p %p)\n", res, args);
+		return -1;
+	}
+
+	struct tmpfs_node *node = args;
+
+	if (!S_ISDIR(node->mode)) {
+		ARC_DEBUG(ERR, "Not a directory\n");
+		tmpfs_put_node(node);
+		return -2;
+	}
+
+	// NOTE: The reference was taken by the locate function, we own it now
+	res->driver_state = node;
+
+	return 0;
+}
+
+static int uninit_tmpfs_directory(struct ARC_Resource *res) {
+	if (res == NULL) {
+		return -1;
+	}
+
+	tmpfs_put_node(res->driver_state);
+
+	return 0;
+};
+
+static size_t read_tmpfs_directory(void *buffer, size_t size, size_t count, struct ARC_File *file, struct ARC_Resource *res) {
+	if (buffer == NULL || size == 0 || count == 0 || file == NULL || res == NULL) {
+		return 0;
+ 	}
+
+	return 0;
+}
+
+static size_t write_tmpfs_directory(void *buffer, size_t size, size_t count, struct ARC_File *file, struct ARC_Resource *res) {
+	if (buffer == NULL || size == 0 || count == 0 || file == NULL || res == NULL) {
+		return 0;
+ 	}
+
+	return 0;
+}
+
+static int stat_tmpfs_directory(struct ARC_Resource *res, char *filename, struct stat *stat) {
+	if (res == NULL || stat == NULL) {
+		ARC_DEBUG(ERR, "Failed to stat, improper parameters (%p %p)\n", res, stat);
+		return -1;
+	}
+
+	struct tmpfs_node *node = tmpfs_walk(res->driver_state, filename == NULL ? "" : filename, NULL, NULL);
+
+	if (node == NULL) {
+		return -1;
+	}
+
+	tmpfs_stat(node, stat);
+	tmpfs_put_node(node);
+
+	return 0;
+}
+
+static void *locate_tmpfs_directory(struct ARC_Resource *res, char *filename) {
+	if (res == NULL || filename == NULL) {
+		ARC_DEBUG(ERR, "Failed to locate, improper parameters (%p %p)\n", res, filename);
+		return NULL;
+	}
+
+	return tmpfs_walk(res->driver_state, filename, NULL, NULL);
+}
+
+static int create_tmpfs_directory(struct ARC_Resource *res, char *name, uint32_t mode, int type) {
+	if (res == NULL || name == NULL) {
+		return -1;
+	}
+
+	return tmpfs_create(res->driver_state, name, mode, type);
+}
+
+static int remove_tmpfs_directory(struct ARC_Resource *res, char *name) {
+	if (res == NULL || name == NULL) {
+		return -1;
+	}
+
+	return tmpfs_remove(res->driver_state, name);
+}
+
+ARC_REGISTER_DRIVER(ARC_DRIGRP_FS_DIR, tmpfs) = {
+        .init = init_tmpfs_directory,
+	.uninit = uninit_tmpfs_directory,
+	.write = write_tmpfs_directory,
+	.read = read_tmpfs_directory,
+	.seek = dridefs_int_func_empty,
+	.rename = dridefs_int_func_empty,
+	.stat = stat_tmpfs_directory,
+	.control = NULL,
+	.create = create_tmpfs_directory,
+	.remove = remove_tmpfs_directory,
+	.locate = locate_tmpfs_directory,
+};
@@ -0,0 +1,131 @@
+/**
+ * @file file.c
+ *
+ * @author awewsomegamer <awewsomegamer@gmail.com>
+ *
+ * @LICENSE
+ * Arctan-OS/Kernel - Operating System Kernel
+ * Copyright (C) 2023-2025 awewsomegamer
+ *
+ * This file is part of Arctan-OS/Kernel.
+ *
+ * Arctan is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * @DESCRIPTION
+ * File driver for tmpfs.
+*/
+#include "drivers/cntrl_defs.h"
+#include "drivers/dri_defs.h"
+#include "drivers/resource.h"
+#include "drivers/sysfs/tmpfs/util.h"
+#include "global.h"
+#include "mm/allocator.h"
+#include "sys/stat.h"
+
+static int init_tmpfs_file(struct ARC_Resource *res, void *args) {
+	if (res == NULL || args == NULL) {
+		ARC_DEBUG(ERR, "Failed to initialize file driver, improper parameters (%p %p)\n", res, args);
+		return -1;
+	}
+
+	struct tmpfs_node *node = args;
+
+	if (S_ISDIR(node->mode)) {
+		ARC_DEBUG(ERR, "Is a directory\n");
+		tmpfs_put_node(node);
+		return -2;
+	}
+
+	// NOTE: The reference was taken by the locate function, we own it now
+	res->driver_state = node;
+
+	return 0;
+}
+
+static int uninit_tmpfs_file(struct ARC_Resource *res) {
+	if (res == NULL) {
+		return -1;
+	}
+
+	tmpfs_put_node(res->driver_state);
+
+	return 0;
+};
+
+static size_t read_tmpfs_file(void *buffer, size_t size, size_t count, struct ARC_File *file, struct ARC_Resource *res) {
+	if (buffer == NULL || size == 0 || count == 0 || file == NULL || res == NULL) {
+		return 0;
+ 	}
+
+	return tmpfs_read(res->driver_state, file->offset, size * count, buffer);
+}
+
+static size_t write_tmpfs_file(void *buffer, size_t size, size_t count, struct ARC_File *file, struct ARC_Resource *res) {
+	if (buffer == NULL || size == 0 || count == 0 || file == NULL || res == NULL) {
+		return 0;
+ 	}
+
+	return tmpfs_write(res->driver_state, file->offset, size * count, buffer);
+}
+
+static int stat_tmpfs_file(struct ARC_Resource *res, char *filename, struct stat *stat) {
+	(void)filename;
+
+	if (res == NULL || stat == NULL) {
+		ARC_DEBUG(ERR, "Failed to stat file, improper parameters (%p %p)\n", res, stat);
+		return -1;
+	}
+
+	tmpfs_stat(res->driver_state, stat);
+
+	return 0;
+}
+
+static ARC_ControlPacketResponse control_tmpfs_file(struct ARC_Resource *res, ARC_ControlPacketInstruction *inst) {
+	ARC_ControlPacketResponse resp = { 0 };
+
+	if (res == NULL || inst == NULL) {
+		return resp;
+	}
+
+	switch (inst->command) {
+		case CNTRL_FS_TRUNCATE: {
+			if (inst->data == NULL || tmpfs_truncate(res->driver_state, *(uint64_t *)inst->data) != 0) {
+				return resp;
+			}
+
+			resp.type = inst->command;
+
+			return resp;
+		}
+	}
+
+	ARC_DEBUG(ERR, "Unhandled command %d\n", inst->command);
+
+	return resp;
+}
+
+ARC_REGISTER_DRIVER(ARC_DRIGRP_FS_FILE, tmpfs) = {
+        .init = init_tmpfs_file,
+	.uninit = uninit_tmpfs_file,
+	.write = write_tmpfs_file,
+	.read = read_tmpfs_file,
+	.seek = dridefs_int_func_empty,
+	.rename = dridefs_int_func_empty,
+	.stat = stat_tmpfs_file,
+	.control = control_tmpfs_file,
+	.create = dridefs_int_func_empty,
+	.remove = dridefs_int_func_empty,
+	.locate = dridefs_void_func_empty,
+};
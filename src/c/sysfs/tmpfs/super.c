@@ -0,0 +1,169 @@
+/**
+ * @file super.c
+ *
+ * @author awewsomegamer <awewsomegamer@gmail.com>
+ *
+ * @LICENSE
+ * Arctan-OS/Kernel - Operating System Kernel
+ * Copyright (C) 2023-2025 awewsomegamer
+ *
+ * This file is part of Arctan-OS/Kernel.
+ *
+ * Arctan is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * @DESCRIPTION
+ * Superblock driver for tmpfs, a filesystem held entirely in memory.
+*/
+#include "drivers/dri_defs.h"
+#include "drivers/resource.h"
+#include "drivers/sysfs/tmpfs/util.h"
+#include "global.h"
+#include "lib/util.h"
+#include "mm/allocator.h"
+#include "sys/stat.h"
+
+static int init_tmpfs_super(struct ARC_Resource *res, void *args) {
+	if (res == NULL) {
+		ARC_DEBUG(ERR, "Failed to initialize superblock driver, improper parameters (%p)\n", res);
+		return -1;
+	}
+
+	struct tmpfs_super_driver_state *state = alloc(sizeof(*state));
+
+	if (state == NULL) {
+		ARC_DEBUG(ERR, "Failed to allocate state\n");
+		return -2;
+	}
+
+	memset(state, 0, sizeof(*state));
+	state->refs = 1;
+
+	if (args != NULL) {
+		struct ARC_DriArgs_Tmpfs *dri_args = args;
+		state->max_pages = ALIGN_UP(dri_args->size, PAGE_SIZE) / PAGE_SIZE;
+	}
+
+	state->root = tmpfs_new_node(state, S_IFDIR | ARC_STD_PERM);
+
+	if (state->root == NULL) {
+		ARC_DEBUG(ERR, "Failed to create root directory\n");
+		tmpfs_put_super(state);
+		return -3;
+	}
+
+	res->driver_state = state;
+
+	return 0;
+}
+
+static int uninit_tmpfs_super(struct ARC_Resource *res) {
+	if (res == NULL) {
+		return -1;
+	}
+
+	struct tmpfs_super_driver_state *state = res->driver_state;
+
+	if (state == NULL) {
+		return -1;
+	}
+
+	// Nodes still open keep themselves and the superblock alive, the rest
+	// of the tree goes
+	tmpfs_put_node(state->root);
+	tmpfs_put_super(state);
+	res->driver_state = NULL;
+
+	return 0;
+};
+
+static size_t read_tmpfs_super(void *buffer, size_t size, size_t count, struct ARC_File *file, struct ARC_Resource *res) {
+	if (buffer == NULL || size == 0 || count == 0 || file == NULL || res == NULL) {
+		return 0;
+ 	}
+
+	return 0;
+}
+
+static size_t write_tmpfs_super(void *buffer, size_t size, size_t count, struct ARC_File *file, struct ARC_Resource *res) {
+	if (buffer == NULL || size == 0 || count == 0 || file == NULL || res == NULL) {
+		return 0;
+ 	}
+
+	return 0;
+}
+
+static int stat_tmpfs_super(struct ARC_Resource *res, char *filename, struct stat *stat) {
+	if (res == NULL || stat == NULL) {
+		ARC_DEBUG(ERR, "Failed to stat, improper parameters (%p %p)\n", res, stat);
+		return -1;
+	}
+
+	struct tmpfs_super_driver_state *state = res->driver_state;
+	struct tmpfs_node *node = tmpfs_walk(state->root, filename == NULL ? "" : filename, NULL, NULL);
+
+	if (node == NULL) {
+		return -1;
+	}
+
+	tmpfs_stat(node, stat);
+	tmpfs_put_node(node);
+
+	return 0;
+}
+
+static void *locate_tmpfs_super(struct ARC_Resource *res, char *filename) {
+	if (res == NULL || filename == NULL) {
+		ARC_DEBUG(ERR, "Failed to locate, improper parameters (%p %p)\n", res, filename);
+		return NULL;
+	}
+
+	struct tmpfs_super_driver_state *state = res->driver_state;
+
+	// NOTE: The reference is handed to the directory or file driver
+	return tmpfs_walk(state->root, filename, NULL, NULL);
+}
+
+static int create_tmpfs_super(struct ARC_Resource *res, char *name, uint32_t mode, int type) {
+	if (res == NULL || name == NULL) {
+		return -1;
+	}
+
+	struct tmpfs_super_driver_state *state = res->driver_state;
+
+	return tmpfs_create(state->root, name, mode, type);
+}
+
+static int remove_tmpfs_super(struct ARC_Resource *res, char *name) {
+	if (res == NULL || name == NULL) {
+		return -1;
+	}
+
+	struct tmpfs_super_driver_state *state = res->driver_state;
+
+	return tmpfs_remove(state->root, name);
+}
+
+ARC_REGISTER_DRIVER(ARC_DRIGRP_FS_SUPER, tmpfs) = {
+        .init = init_tmpfs_super,
+	.uninit = uninit_tmpfs_super,
+	.write = write_tmpfs_super,
+	.read = read_tmpfs_super,
+	.seek = dridefs_int_func_empty,
+	.rename = dridefs_int_func_empty,
+	.stat = stat_tmpfs_super,
+	.control = NULL,
+	.create = create_tmpfs_super,
+	.remove = remove_tmpfs_super,
+	.locate = locate_tmpfs_super,
+};
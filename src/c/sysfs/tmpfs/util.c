@@ -0,0 +1,565 @@
+/**
+ * @file util.c
+ *
+ * @author awewsomegamer <awewsomegamer@gmail.com>
+ *
+ * @LICENSE
+ * Arctan-OS/Kernel - Operating System Kernel
+ * Copyright (C) 2023-2025 awewsomegamer
+ *
+ * This file is part of Arctan-OS/Kernel.
+ *
+ * Arctan is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * @DESCRIPTION
+ * Nodes, hashed directories and file data shared by the tmpfs drivers.
+*/
+#include "drivers/sparse.h"
+#include "drivers/sysfs/tmpfs/util.h"
+#include "fs/vfs.h"
+#include "global.h"
+#include "lib/atomics.h"
+#include "lib/util.h"
+#include "mm/allocator.h"
+#include "sys/stat.h"
+
+#define TMPFS_MIN_BUCKETS 16
+
+static uint64_t tmpfs_hash(char *name, size_t length) {
+	uint64_t hash = 0xCBF29CE484222325ULL;
+
+	for (size_t i = 0; i < length; i++) {
+		hash ^= (uint8_t)name[i];
+		hash *= 0x100000001B3ULL;
+	}
+
+	return hash;
+}
+
+void tmpfs_put_super(struct tmpfs_super_driver_state *super) {
+	if (super != NULL && ARC_ATOMIC_DEC(super->refs) == 0) {
+		free(super);
+	}
+}
+
+struct tmpfs_node *tmpfs_new_node(struct tmpfs_super_driver_state *super, uint32_t mode) {
+	if (super == NULL) {
+		ARC_DEBUG(ERR, "No superblock given\n");
+		return NULL;
+	}
+
+	struct tmpfs_node *node = alloc(sizeof(*node));
+
+	if (node == NULL) {
+		ARC_DEBUG(ERR, "Failed to allocate node\n");
+		return NULL;
+	}
+
+	memset(node, 0, sizeof(*node));
+
+	if ((mode & S_IFMT) == 0) {
+		mode |= S_IFREG;
+	}
+
+	if (S_ISDIR(mode)) {
+		node->dir.bucket_count = TMPFS_MIN_BUCKETS;
+		node->dir.buckets = alloc(TMPFS_MIN_BUCKETS * sizeof(*node->dir.buckets));
+
+		if (node->dir.buckets == NULL) {
+			ARC_DEBUG(ERR, "Failed to allocate directory\n");
+			free(node);
+			return NULL;
+		}
+
+		memset(node->dir.buckets, 0, TMPFS_MIN_BUCKETS * sizeof(*node->dir.buckets));
+	}
+
+	init_static_spinlock(&node->lock);
+	ARC_ATOMIC_INC(super->refs);
+	node->super = super;
+	node->ino = ARC_ATOMIC_INC(super->next_ino);
+	node->mode = mode;
+	node->refs = 1;
+
+	return node;
+}
+
+void tmpfs_get_node(struct tmpfs_node *node) {
+	if (node != NULL) {
+		ARC_ATOMIC_INC(node->refs);
+	}
+}
+
+void tmpfs_put_node(struct tmpfs_node *node) {
+	if (node == NULL || ARC_ATOMIC_DEC(node->refs) > 0) {
+		return;
+	}
+
+	if (S_ISDIR(node->mode)) {
+		// Only reached with entries when the whole tree goes away
+		for (size_t i = 0; i < node->dir.bucket_count; i++) {
+			struct tmpfs_dirent *ent = node->dir.buckets[i];
+
+			while (ent != NULL) {
+				struct tmpfs_dirent *next = ent->next;
+
+				tmpfs_put_node(ent->node);
+				free(ent);
+
+				ent = next;
+			}
+		}
+
+		free(node->dir.buckets);
+	} else if (node->file.spilled) {
+		ARC_ATOMIC_ADD(node->super->pages, -(uint64_t)node->file.pages.pages);
+		uninit_sparse(&node->file.pages);
+	}
+
+	tmpfs_put_super(node->super);
+	free(node);
+}
+
+// Call with the lock of dir held, gives the link to the entry or to where
+// it would go
+static struct tmpfs_dirent **tmpfs_find(struct tmpfs_node *dir, char *name, size_t length, uint64_t hash) {
+	struct tmpfs_dirent **slot = &dir->dir.buckets[hash % dir->dir.bucket_count];
+
+	while (*slot != NULL) {
+		struct tmpfs_dirent *ent = *slot;
+
+		if (ent->hash == hash && ent->length == length && memcmp(ent->name, name, length) == 0) {
+			break;
+		}
+
+		slot = &ent->next;
+	}
+
+	return slot;
+}
+
+// Call with the lock of dir held. Keeps the chains about one entry long,
+// the entries themselves are only relinked
+static void tmpfs_grow(struct tmpfs_node *dir) {
+	size_t count = dir->dir.bucket_count * 2;
+	struct tmpfs_dirent **buckets = alloc(count * sizeof(*buckets));
+
+	if (buckets == NULL) {
+		// Lookups only get slower
+		return;
+	}
+
+	memset(buckets, 0, count * sizeof(*buckets));
+
+	for (size_t i = 0; i < dir->dir.bucket_count; i++) {
+		struct tmpfs_dirent *ent = dir->dir.buckets[i];
+
+		while (ent != NULL) {
+			struct tmpfs_dirent *next = ent->next;
+
+			ent->next = buckets[ent->hash % count];
+			buckets[ent->hash % count] = ent;
+
+			ent = next;
+		}
+	}
+
+	free(dir->dir.buckets);
+	dir->dir.buckets = buckets;
+	dir->dir.bucket_count = count;
+}
+
+static struct tmpfs_node *tmpfs_lookup(struct tmpfs_node *dir, char *name, size_t length) {
+	if (!S_ISDIR(dir->mode)) {
+		return NULL;
+	}
+
+	uint64_t hash = tmpfs_hash(name, length);
+
+	spinlock_lock(&dir->lock);
+
+	struct tmpfs_dirent *ent = *tmpfs_find(dir, name, length, hash);
+	struct tmpfs_node *node = ent == NULL ? NULL : ent->node;
+
+	tmpfs_get_node(node);
+
+	spinlock_unlock(&dir->lock);
+
+	return node;
+}
+
+static int tmpfs_link(struct tmpfs_node *dir, char *name, size_t length, struct tmpfs_node *node) {
+	if (!S_ISDIR(dir->mode)) {
+		ARC_DEBUG(ERR, "Not a directory\n");
+		return -1;
+	}
+
+	struct tmpfs_dirent *ent = alloc(sizeof(*ent) + length + 1);
+
+	if (ent == NULL) {
+		ARC_DEBUG(ERR, "Failed to allocate entry\n");
+		return -2;
+	}
+
+	ent->node = node;
+	ent->hash = tmpfs_hash(name, length);
+	ent->length = length;
+	memcpy(ent->name, name, length);
+	ent->name[length] = 0;
+
+	spinlock_lock(&dir->lock);
+
+	if (*tmpfs_find(dir, name, length, ent->hash) != NULL) {
+		spinlock_unlock(&dir->lock);
+		free(ent);
+		return -3;
+	}
+
+	if (dir->size >= dir->dir.bucket_count) {
+		tmpfs_grow(dir);
+	}
+
+	struct tmpfs_dirent **bucket = &dir->dir.buckets[ent->hash % dir->dir.bucket_count];
+
+	ent->next = *bucket;
+	*bucket = ent;
+	dir->size++;
+	tmpfs_get_node(node);
+
+	spinlock_unlock(&dir->lock);
+
+	return 0;
+}
+
+static int tmpfs_unlink(struct tmpfs_node *dir, char *name, size_t length) {
+	if (!S_ISDIR(dir->mode)) {
+		ARC_DEBUG(ERR, "Not a directory\n");
+		return -1;
+	}
+
+	spinlock_lock(&dir->lock);
+
+	struct tmpfs_dirent **slot = tmpfs_find(dir, name, length, tmpfs_hash(name, length));
+	struct tmpfs_dirent *ent = *slot;
+
+	if (ent == NULL) {
+		spinlock_unlock(&dir->lock);
+		return -2;
+	}
+
+	// Locks are always taken parent before child
+	if (S_ISDIR(ent->node->mode)) {
+		spinlock_lock(&ent->node->lock);
+		size_t entries = ent->node->size;
+		spinlock_unlock(&ent->node->lock);
+
+		if (entries != 0) {
+			spinlock_unlock(&dir->lock);
+			ARC_DEBUG(ERR, "Directory is not empty\n");
+			return -3;
+		}
+	}
+
+	*slot = ent->next;
+	dir->size--;
+
+	spinlock_unlock(&dir->lock);
+
+	tmpfs_put_node(ent->node);
+	free(ent);
+
+	return 0;
+}
+
+struct tmpfs_node *tmpfs_walk(struct tmpfs_node *dir, char *path, char **leaf, size_t *leaf_length) {
+	if (dir == NULL || path == NULL) {
+		return NULL;
+	}
+
+	struct tmpfs_node *node = dir;
+	tmpfs_get_node(node);
+
+	while (true) {
+		while (*path == '/') {
+			path++;
+		}
+
+		size_t length = 0;
+
+		while (path[length] != 0 && path[length] != '/') {
+			length++;
+		}
+
+		if (length == 0) {
+			if (leaf == NULL) {
+				return node;
+			}
+
+			// Nothing left to give as the leaf
+			tmpfs_put_node(node);
+			return NULL;
+		}
+
+		char *rest = path + length;
+
+		while (*rest == '/') {
+			rest++;
+		}
+
+		if (leaf != NULL && *rest == 0) {
+			*leaf = path;
+			*leaf_length = length;
+
+			return node;
+		}
+
+		if (length == 1 && *path == '.') {
+			path = rest;
+			continue;
+		}
+
+		struct tmpfs_node *next = tmpfs_lookup(node, path, length);
+
+		tmpfs_put_node(node);
+
+		if (next == NULL) {
+			return NULL;
+		}
+
+		node = next;
+		path = rest;
+	}
+}
+
+// Settle the kind of node from the VFS type and the S_IFMT bits of mode,
+// 0 if the two disagree
+static uint32_t tmpfs_create_mode(uint32_t mode, int type) {
+	uint32_t fmt = 0;
+
+	switch (type) {
+		case ARC_VFS_N_DIR: {
+			fmt = S_IFDIR;
+			break;
+		}
+
+		case ARC_VFS_N_FILE: {
+			fmt = S_IFREG;
+			break;
+		}
+
+		default: {
+			return mode;
+		}
+	}
+
+	if ((mode & S_IFMT) == 0) {
+		return mode | fmt;
+	}
+
+	return (mode & S_IFMT) == fmt ? mode : 0;
+}
+
+int tmpfs_create(struct tmpfs_node *dir, char *path, uint32_t mode, int type) {
+	uint32_t node_mode = tmpfs_create_mode(mode, type);
+
+	if (node_mode == 0) {
+		ARC_DEBUG(ERR, "Mode %o contradicts type %d of %s\n", mode, type, path);
+		return -3;
+	}
+
+	char *leaf = NULL;
+	size_t length = 0;
+	struct tmpfs_node *parent = tmpfs_walk(dir, path, &leaf, &length);
+
+	if (parent == NULL) {
+		ARC_DEBUG(ERR, "Parent of %s does not exist\n", path);
+		return -1;
+	}
+
+	struct tmpfs_node *node = tmpfs_new_node(parent->super, node_mode);
+
+	if (node == NULL) {
+		tmpfs_put_node(parent);
+		return -2;
+	}
+
+	int r = tmpfs_link(parent, leaf, length, node);
+
+	// The entry holds the node now
+	tmpfs_put_node(node);
+	tmpfs_put_node(parent);
+
+	return r;
+}
+
+int tmpfs_remove(struct tmpfs_node *dir, char *path) {
+	char *leaf = NULL;
+	size_t length = 0;
+	struct tmpfs_node *parent = tmpfs_walk(dir, path, &leaf, &length);
+
+	if (parent == NULL) {
+		return -1;
+	}
+
+	int r = tmpfs_unlink(parent, leaf, length);
+
+	tmpfs_put_node(parent);
+
+	return r;
+}
+
+// Call with the lock of node held
+static int tmpfs_spill(struct tmpfs_node *node) {
+	uint8_t small[TMPFS_INLINE_SIZE];
+
+	// The store overlaps the inline data
+	memcpy(small, node->file.small, sizeof(small));
+	init_sparse(&node->file.pages);
+
+	if (node->size > 0 && sparse_write(&node->file.pages, 0, node->size, small) != node->size) {
+		uninit_sparse(&node->file.pages);
+		memcpy(node->file.small, small, sizeof(small));
+		ARC_DEBUG(ERR, "Failed to move file out of its node\n");
+		return -1;
+	}
+
+	node->file.spilled = true;
+	ARC_ATOMIC_ADD(node->super->pages, node->file.pages.pages);
+
+	return 0;
+}
+
+size_t tmpfs_read(struct tmpfs_node *node, uint64_t offset, size_t size, void *buffer) {
+	if (node == NULL || buffer == NULL || S_ISDIR(node->mode)) {
+		return 0;
+	}
+
+	spinlock_lock(&node->lock);
+
+	if (offset >= node->size) {
+		spinlock_unlock(&node->lock);
+		return 0;
+	}
+
+	size = min(size, node->size - offset);
+
+	if (!node->file.spilled) {
+		memcpy(buffer, node->file.small + offset, size);
+		spinlock_unlock(&node->lock);
+
+		return size;
+	}
+
+	spinlock_unlock(&node->lock);
+
+	// Spilled files never move back, the store locks itself
+	return sparse_read(&node->file.pages, offset, size, buffer);
+}
+
+size_t tmpfs_write(struct tmpfs_node *node, uint64_t offset, size_t size, void *buffer) {
+	if (node == NULL || buffer == NULL || size == 0 || S_ISDIR(node->mode)) {
+		return 0;
+	}
+
+	struct tmpfs_super_driver_state *super = node->super;
+
+	// Writers of a file are serialized so the pages they add can be
+	// counted against the filesystem
+	spinlock_lock(&node->lock);
+
+	if (!node->file.spilled && offset + size <= TMPFS_INLINE_SIZE) {
+		memcpy(node->file.small + offset, buffer, size);
+		node->size = max(node->size, offset + size);
+		spinlock_unlock(&node->lock);
+
+		return size;
+	}
+
+	if (!node->file.spilled && tmpfs_spill(node) != 0) {
+		spinlock_unlock(&node->lock);
+		return 0;
+	}
+
+	uint64_t limit = super->max_pages;
+	size_t given = size;
+
+	if (limit != 0) {
+		// Counted in whole pages, so a write may go over by one page
+		uint64_t used = ARC_ATOMIC_LOAD(super->pages);
+		uint64_t room = used >= limit ? 0 : (limit - used) * PAGE_SIZE;
+
+		given = min(given, room);
+	}
+
+	uint64_t before = node->file.pages.pages;
+
+	given = given == 0 ? 0 : sparse_write(&node->file.pages, offset, given, buffer);
+
+	ARC_ATOMIC_ADD(super->pages, node->file.pages.pages - before);
+	node->size = max(node->size, offset + given);
+
+	spinlock_unlock(&node->lock);
+
+	if (given < size) {
+		ARC_DEBUG(ERR, "Filesystem is full\n");
+	}
+
+	return given;
+}
+
+int tmpfs_truncate(struct tmpfs_node *node, uint64_t size) {
+	if (node == NULL || S_ISDIR(node->mode)) {
+		return -1;
+	}
+
+	spinlock_lock(&node->lock);
+
+	if (!node->file.spilled && size > TMPFS_INLINE_SIZE && tmpfs_spill(node) != 0) {
+		spinlock_unlock(&node->lock);
+		return -2;
+	}
+
+	if (!node->file.spilled && size < node->size) {
+		// Growing again must show zeroes
+		memset(node->file.small + size, 0, node->size - size);
+	} else if (node->file.spilled && size < node->size) {
+		uint64_t before = node->file.pages.pages;
+
+		// Nothing past the size matters, so the last page goes too
+		sparse_discard(&node->file.pages, size, ALIGN_UP(node->size, PAGE_SIZE) - size);
+		ARC_ATOMIC_ADD(node->super->pages, -(uint64_t)(before - node->file.pages.pages));
+	}
+
+	node->size = size;
+
+	spinlock_unlock(&node->lock);
+
+	return 0;
+}
+
+void tmpfs_stat(struct tmpfs_node *node, struct stat *stat) {
+	if (node == NULL || stat == NULL) {
+		return;
+	}
+
+	spinlock_lock(&node->lock);
+
+	stat->st_mode = node->mode;
+	stat->st_ino = node->ino;
+	stat->st_size = node->size;
+	stat->st_blksize = PAGE_SIZE;
+	stat->st_blocks = (!S_ISDIR(node->mode) && node->file.spilled) ? node->file.pages.pages * (PAGE_SIZE / 512) : 0;
+
+	spinlock_unlock(&node->lock);
+}
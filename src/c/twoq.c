@@ -0,0 +1,291 @@
+/**
+ * @file twoq.c
+ *
+ * @author awewsomegamer <awewsomegamer@gmail.com>
+ *
+ * @LICENSE
+ * Arctan-OS/Kernel - Operating System Kernel
+ * Copyright (C) 2023-2025 awewsomegamer
+ *
+ * This file is part of Arctan-OS/Kernel.
+ *
+ * Arctan is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * @DESCRIPTION
+*/
+#include "drivers/twoq.h"
+#include "global.h"
+#include "lib/atomics.h"
+#include "lib/util.h"
+#include "mm/allocator.h"
+
+static void twoq_push(struct twoq_list *list, struct twoq_entry *entry) {
+	entry->prev = NULL;
+	entry->next = list->head;
+
+	if (list->head == NULL) {
+		list->tail = entry;
+	} else {
+		list->head->prev = entry;
+	}
+
+	list->head = entry;
+	list->count++;
+}
+
+static void twoq_unlink(struct twoq *q, struct twoq_entry *entry) {
+	struct twoq_list *list = entry->list == TWOQ_IN ? &q->in : &q->main;
+
+	if (entry->prev == NULL) {
+		list->head = entry->next;
+	} else {
+		entry->prev->next = entry->next;
+	}
+
+	if (entry->next == NULL) {
+		list->tail = entry->prev;
+	} else {
+		entry->next->prev = entry->prev;
+	}
+
+	entry->prev = NULL;
+	entry->next = NULL;
+	entry->list = TWOQ_NONE;
+	list->count--;
+}
+
+static size_t twoq_ghost_slot(struct twoq *q, uint64_t key) {
+	return (key * 0x9E3779B97F4A7C15ULL) % q->ghost_slots;
+}
+
+static void twoq_ghost_add(struct twoq *q, uint64_t key) {
+	if (q->ghost_size == 0) {
+		return;
+	}
+
+	uint64_t *slot = &q->ghost_ring[q->ghost_idx];
+
+	// The oldest ghost makes room
+	if (*slot != UINT64_MAX) {
+		q->ghost_counts[twoq_ghost_slot(q, *slot)]--;
+	}
+
+	*slot = key;
+	q->ghost_idx = (q->ghost_idx + 1) % q->ghost_size;
+
+	uint8_t *count = &q->ghost_counts[twoq_ghost_slot(q, key)];
+
+	if (*count < UINT8_MAX) {
+		(*count)++;
+	}
+}
+
+static bool twoq_ghost_has(struct twoq *q, uint64_t key) {
+	return q->ghost_size != 0 && q->ghost_counts[twoq_ghost_slot(q, key)] != 0;
+}
+
+static int twoq_alloc_ghosts(struct twoq *q, size_t capacity, int ghost_percent) {
+	size_t size = capacity * ghost_percent / 100;
+	uint64_t *ring = NULL;
+	uint8_t *counts = NULL;
+
+	if (size != 0) {
+		ring = alloc(size * sizeof(*ring));
+		// Four slots per ghost keeps false positives rare
+		counts = alloc(size * 4);
+
+		if (ring == NULL || counts == NULL) {
+			ARC_DEBUG(ERR, "Failed to allocate %lu ghosts\n", size);
+			free(ring);
+			free(counts);
+			return -1;
+		}
+
+		memset(ring, 0xFF, size * sizeof(*ring));
+		memset(counts, 0, size * 4);
+	}
+
+	free(q->ghost_ring);
+	free(q->ghost_counts);
+
+	q->ghost_ring = ring;
+	q->ghost_counts = counts;
+	q->ghost_size = size;
+	q->ghost_slots = size * 4;
+	q->ghost_idx = 0;
+
+	return 0;
+}
+
+int init_twoq(struct twoq *q, size_t capacity, int in_percent, int ghost_percent) {
+	if (q == NULL) {
+		return -1;
+	}
+
+	memset(q, 0, sizeof(*q));
+	init_static_spinlock(&q->lock);
+
+	return twoq_tune(q, capacity, in_percent, ghost_percent);
+}
+
+void uninit_twoq(struct twoq *q) {
+	if (q == NULL) {
+		return;
+	}
+
+	free(q->ghost_ring);
+	free(q->ghost_counts);
+	q->ghost_ring = NULL;
+	q->ghost_counts = NULL;
+	q->ghost_size = 0;
+}
+
+int twoq_tune(struct twoq *q, size_t capacity, int in_percent, int ghost_percent) {
+	if (q == NULL || capacity == 0 || in_percent <= 0 || in_percent > 100 || ghost_percent < 0) {
+		ARC_DEBUG(ERR, "Improper parameters (%p %lu %d %d)\n", q, capacity, in_percent, ghost_percent);
+		return -1;
+	}
+
+	spinlock_lock(&q->lock);
+
+	int r = 0;
+
+	if (q->ghost_size != capacity * ghost_percent / 100) {
+		r = twoq_alloc_ghosts(q, capacity, ghost_percent);
+	}
+
+	if (r == 0) {
+		q->capacity = capacity;
+		q->in_target = max(capacity * in_percent / 100, (size_t)1);
+	}
+
+	spinlock_unlock(&q->lock);
+
+	return r;
+}
+
+void twoq_insert(struct twoq *q, struct twoq_entry *entry, uint64_t key) {
+	spinlock_lock(&q->lock);
+
+	entry->key = key;
+	entry->referenced = false;
+
+	if (twoq_ghost_has(q, key)) {
+		// Evicted before it could be used again, it is worth keeping
+		entry->list = TWOQ_MAIN;
+		twoq_push(&q->main, entry);
+		q->stats.ghost_hits++;
+	} else {
+		entry->list = TWOQ_IN;
+		twoq_push(&q->in, entry);
+	}
+
+	spinlock_unlock(&q->lock);
+}
+
+void twoq_remove(struct twoq *q, struct twoq_entry *entry) {
+	spinlock_lock(&q->lock);
+
+	if (entry->list != TWOQ_NONE) {
+		twoq_unlink(q, entry);
+	}
+
+	spinlock_unlock(&q->lock);
+}
+
+struct twoq_entry *twoq_victim(struct twoq *q, bool (*evictable)(struct twoq_entry *entry, void *arg), void *arg) {
+	struct twoq_entry *victim = NULL;
+
+	spinlock_lock(&q->lock);
+
+	// Every entry may be looked at twice, once to clear its flag
+	size_t budget = 2 * (q->in.count + q->main.count);
+
+	for (size_t i = 0; i < budget; i++) {
+		bool from_in = q->in.count > q->in_target || q->main.count == 0;
+		struct twoq_list *list = from_in ? &q->in : &q->main;
+		struct twoq_entry *entry = list->tail;
+
+		if (entry == NULL) {
+			break;
+		}
+
+		twoq_unlink(q, entry);
+
+		if (!from_in && entry->referenced) {
+			// Used again, back to the front
+			entry->referenced = false;
+			entry->list = TWOQ_MAIN;
+			twoq_push(&q->main, entry);
+			q->stats.promotions++;
+
+			continue;
+		}
+
+		entry->referenced = false;
+
+		if (evictable != NULL && !evictable(entry, arg)) {
+			entry->list = from_in ? TWOQ_IN : TWOQ_MAIN;
+			twoq_push(list, entry);
+			continue;
+		}
+
+		if (from_in) {
+			twoq_ghost_add(q, entry->key);
+		}
+
+		q->stats.evictions++;
+		victim = entry;
+
+		break;
+	}
+
+	spinlock_unlock(&q->lock);
+
+	return victim;
+}
+
+void twoq_hit(struct twoq *q, struct twoq_entry *entry) {
+	// Uses while on the in list belong to the same burst of accesses, a
+	// prefetch and the read after it or a page read block by block
+	if (ARC_ATOMIC_LOAD(entry->list) == TWOQ_MAIN) {
+		ARC_ATOMIC_STORE(entry->referenced, true);
+	}
+
+	ARC_ATOMIC_INC(q->stats.hits);
+}
+
+void twoq_miss(struct twoq *q) {
+	ARC_ATOMIC_INC(q->stats.misses);
+}
+
+bool twoq_over(struct twoq *q) {
+	return ARC_ATOMIC_LOAD(q->in.count) + ARC_ATOMIC_LOAD(q->main.count) > q->capacity;
+}
+
+void twoq_get_stats(struct twoq *q, struct twoq_stats *stats) {
+	if (q == NULL || stats == NULL) {
+		return;
+	}
+
+	spinlock_lock(&q->lock);
+
+	memcpy(stats, &q->stats, sizeof(*stats));
+	stats->hits = ARC_ATOMIC_LOAD(q->stats.hits);
+	stats->misses = ARC_ATOMIC_LOAD(q->stats.misses);
+	stats->resident[0] = q->in.count;
+	stats->resident[1] = q->main.count;
+
+	spinlock_unlock(&q->lock);
+}